@@ -11,8 +11,15 @@
 
 // Required includes
 #include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 #pragma once
 #ifndef __HSM_H__
@@ -54,6 +61,7 @@
 #include <cassert>  // for HSM_ASSERT
 #include <cstdio>   // for SNPRINTF
 #include <cstring>  // for STRNCPY
+#include <iterator> // for std::reverse_iterator
 
 // Define HSM_DEBUG to 0 or 1 explicitly, otherwise it will be 1 if _DEBUG is defined
 #if !defined(HSM_DEBUG)
@@ -65,19 +73,144 @@
 #endif
 
 // If set and C++ RTTI is enabled, will use C++ RTTI instead of the custom HSM RTTI system to
-// identify state types and return state names. Using C++ RTTI may yield better performance
-// when comparing StateTypeIds, but the state names returned are usually less human readable.
+// identify state types and return state names, in which case DEFINE_HSM_STATE is not required.
+// State names are demangled when possible, but usually include enclosing namespaces and classes.
 #if !defined(HSM_USE_CPP_RTTI_IF_ENABLED)
 #define HSM_USE_CPP_RTTI_IF_ENABLED 1
 #endif
 
+// Each module (executable, DLL, or shared object built with hidden symbols) otherwise assigns its own StateTypeId
+// indices, so the same state type may get different indices, and different types the same index, in different
+// modules. If set, state types are instead registered by name in a single StateTypeRegistry, which exactly one
+// module must define with HSM_DEFINE_STATE_TYPE_REGISTRY() and export by defining HSM_STATE_TYPE_REGISTRY_API
+// (e.g. to __declspec(dllexport), and to __declspec(dllimport) in the other modules). Without C++ RTTI, the
+// names passed to DEFINE_HSM_STATE must then be unique across modules.
+#if !defined(HSM_USE_SHARED_STATE_TYPE_REGISTRY)
+#define HSM_USE_SHARED_STATE_TYPE_REGISTRY 0
+#endif
+
+#if !defined(HSM_STATE_TYPE_REGISTRY_API)
+#define HSM_STATE_TYPE_REGISTRY_API
+#endif
+
+// If set, states are allocated from per-type free-list pools (see StatePoolSet) instead of via HSM_NEW and
+// HSM_DELETE. Once the pools are warm, transitions no longer allocate or free heap memory.
+#if !defined(HSM_USE_STATE_POOLS)
+#define HSM_USE_STATE_POOLS 0
+#endif
+
+// If set, StatePoolSet guards its pools with a spin lock, so that state machines sharing a StatePoolSet may be
+// processed on different threads (e.g. by hsm_parallel.h, where machines may migrate between worker threads).
+#if !defined(HSM_STATE_POOLS_THREAD_SAFE)
+#define HSM_STATE_POOLS_THREAD_SAFE 0
+#endif
+
+// If HSM_STATE_POOLS_THREAD_SAFE is set, the number of StatePoolSets that StatePoolSet::GetDefault spreads
+// threads over, so that threads processing state machines in parallel rarely contend for the same lock
+#if !defined(HSM_STATE_POOLS_NUM_PARTITIONS)
+#define HSM_STATE_POOLS_NUM_PARTITIONS 16
+#endif
+
+// If set, each StateMachine owns a fixed-size arena in which its states are constructed in stack (LIFO) order,
+// and the state stack itself is stored inline in the StateMachine rather than in a vector. The stack can hold
+// at most HSM_STATE_ARENA_MAX_DEPTH states, and the arena is sized to fit that many states of up to
+// HSM_STATE_ARENA_MAX_STATE_SIZE bytes each. States that don't fit in the remaining arena space are allocated
+// as usual (from pools or the heap).
+#if !defined(HSM_USE_STATE_ARENA)
+#define HSM_USE_STATE_ARENA 0
+#endif
+
+#if !defined(HSM_STATE_ARENA_MAX_DEPTH)
+#define HSM_STATE_ARENA_MAX_DEPTH 16
+#endif
+
+#if !defined(HSM_STATE_ARENA_MAX_STATE_SIZE)
+#define HSM_STATE_ARENA_MAX_STATE_SIZE 128
+#endif
+
+// If set, each StateMachine keeps a bitset of the state types on its stack, along with the depth of each one,
+// which makes IsInState, GetState, GetInnerState and GetOuterState constant-time. Costs a few bytes per
+// registered state type per StateMachine.
+#if !defined(HSM_USE_ACTIVE_STATE_TABLE)
+#define HSM_USE_ACTIVE_STATE_TABLE 1
+#endif
+
+// If set, state args that can't be stored inline in a Transition (see HSM_STATE_ARGS_MAX_SIZE) are stored in a
+// reference-counted heap block. If not set, such args fail to compile, and Transition is trivially copyable and
+// never touches the heap.
+#if !defined(HSM_STATE_ARGS_HEAP_FALLBACK)
+#define HSM_STATE_ARGS_HEAP_FALLBACK 0
+#endif
+
+// If set, StateMachine::SaveSnapshot and LoadSnapshot save and restore a machine's state stack to and from a
+// compact binary blob (see SnapshotWriter). State types are then registered at startup, so that snapshots can
+// refer to them by a hash of their name, which must be unique.
+#if !defined(HSM_USE_SNAPSHOTS)
+#define HSM_USE_SNAPSHOTS 0
+#endif
+
+// If set, StateMachine::SetProfiler can be used to time the GetTransition, Update, OnEnter and OnExit calls
+// made to states, per state type (see Profiler), and StateMachine::SetTransitionGraph to count the transitions
+// taken (see TransitionGraph). If not set, profiling compiles to nothing.
+#if !defined(HSM_USE_PROFILER)
+#define HSM_USE_PROFILER 0
+#endif
+
+// If set, a TraceSink set with TraceLevel::Calls also receives each GetTransition and Update call, with its
+// duration. If not set, these hooks compile to nothing, so that the per-frame calls to states don't pay for
+// checking the sink; transitions are still written to the sink.
+#if !defined(HSM_USE_TRACE_CALLS)
+#define HSM_USE_TRACE_CALLS 0
+#endif
+
+// If set, USDT static probes are placed at state pushes and pops, transitions, settling and Update calls, for
+// tracing live processes with perf, bpftrace or SystemTap (see HSM_PROBE and tools/hsmTimeInState.bt). Requires
+// sys/sdt.h at compile time (e.g. from systemtap-sdt-dev) but no runtime library. Probes are single nops while
+// no tracer is attached.
+#if !defined(HSM_USE_USDT_PROBES)
+#define HSM_USE_USDT_PROBES 0
+#endif
+
 #define HSM_STD_VECTOR std::vector
 #define HSM_STD_MAP std::map
 #define HSM_ASSERT assert
 #define HSM_ASSERT_MSG(cond, msg) assert((cond) && msg)
 #define HSM_NEW new
 #define HSM_DELETE delete
+#define HSM_ALLOC(size) ::operator new(size)
+#define HSM_FREE(ptr) ::operator delete(ptr)
+#if defined(HSM_COMPILER_CLANG_OR_GCC)
+#define HSM_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define HSM_PREFETCH(addr) ((void)(addr))
+#endif
+
+// USDT probes of provider "hsm", all taking the StateMachine* as first argument:
+//   state_push(machine, depth, stateTypeIndex, stateName)
+//   state_pop(machine, depth, stateTypeIndex, stateName)
+//   transition(machine, depth, transitionType, targetStateTypeIndex, targetStateName): a state at depth returned
+//     a transition that is about to be made (see Transition::Type)
+//   settle(machine, numIterations, stackSize): transitions were processed until none was returned
+//   update_enter(machine, depth, stateTypeIndex, stateName), update_exit(same arguments)
+// State type indices are StateTypeId::mIndex, and state names are only readable as strings if hsm_char is char.
+#if HSM_USE_USDT_PROBES
+#include <sys/sdt.h>
+#define HSM_PROBE3(name, arg1, arg2, arg3) DTRACE_PROBE3(hsm, name, arg1, arg2, arg3)
+#define HSM_PROBE4(name, arg1, arg2, arg3, arg4) DTRACE_PROBE4(hsm, name, arg1, arg2, arg3, arg4)
+#define HSM_PROBE5(name, arg1, arg2, arg3, arg4, arg5) DTRACE_PROBE5(hsm, name, arg1, arg2, arg3, arg4, arg5)
+#else
+#define HSM_PROBE3(name, arg1, arg2, arg3)
+#define HSM_PROBE4(name, arg1, arg2, arg3, arg4)
+#define HSM_PROBE5(name, arg1, arg2, arg3, arg4, arg5)
+#endif
 #define HSM_DEBUG_NAME_MAXLEN 128
+#if !defined(HSM_STATE_ARGS_MAX_SIZE)
+#define HSM_STATE_ARGS_MAX_SIZE 32 // Max size in bytes of state args stored inline in a Transition
+#endif
+#define HSM_EVENT_MAX_SIZE 32 // Max size in bytes of an event posted to a StateMachine
+#if !defined(HSM_DEFERRED_TRANSITION_QUEUE_SIZE)
+#define HSM_DEFERRED_TRANSITION_QUEUE_SIZE 4 // Max number of states per StateMachine with a deferred transition
+#endif
 
 #define HSM_STATE_UPDATE_ARGS void
 #define HSM_STATE_UPDATE_ARGS_FORWARD
@@ -139,38 +272,171 @@ typedef void Owner;
 #define HSM_USE_CPP_RTTI
 #endif
 
+#if HSM_USE_SHARED_STATE_TYPE_REGISTRY
+#include <mutex>
+#include <string>
+#endif
+
+namespace hsm {
+
+// Identifies a state type. Each state type is assigned a dense integer index the first time its StateTypeId is
+// requested, which makes comparing and hashing StateTypeIds O(1), and allows indexing per-type tables directly.
+// The state's human-readable name is computed once per type and cached for debugging and tracing.
+struct StateTypeId
+{
+	StateTypeId() : mIndex(~static_cast<size_t>(0)), mStateName(0) {}
+	StateTypeId(size_t index, const hsm_char* stateName) : mIndex(index), mStateName(stateName) {}
+
+	hsm_bool operator==(const StateTypeId& rhs) const
+	{
+		HSM_ASSERT_MSG(IsValid() && rhs.IsValid(), "StateTypeId was not properly initialized");
+		return mIndex == rhs.mIndex;
+	}
+
+	hsm_bool operator!=(const StateTypeId& rhs) const { return !(*this == rhs); }
+
+	hsm_bool IsValid() const { return mIndex != ~static_cast<size_t>(0); }
+
+	size_t mIndex; // Dense index in [0, GetNumStateTypes())
+	const hsm_char* mStateName;
+};
+
+#if HSM_USE_SHARED_STATE_TYPE_REGISTRY
+
+namespace detail
+{
+	// Assigns indices to state types by name, shared by all modules (see HSM_USE_SHARED_STATE_TYPE_REGISTRY)
+	class StateTypeRegistry
+	{
+	public:
+		StateTypeRegistry() : mNumStateTypes(0) {}
+
+		// Returns the index of the state type with the input name, assigning the next one if it's new
+		size_t Register(const char* stateTypeName)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			IndexMap::iterator iter = mIndices.find(stateTypeName);
+			if (iter == mIndices.end())
+			{
+				iter = mIndices.insert(std::make_pair(std::string(stateTypeName), mNumStateTypes.load(std::memory_order_relaxed))).first;
+				mNumStateTypes.fetch_add(1, std::memory_order_release);
+			}
+			return iter->second;
+		}
+
+		size_t GetNumStateTypes() const { return mNumStateTypes.load(std::memory_order_acquire); }
+
+	private:
+		typedef HSM_STD_MAP<std::string, size_t> IndexMap;
+		std::mutex mMutex;
+		IndexMap mIndices;
+		std::atomic<size_t> mNumStateTypes;
+	};
+
+	// Defined by HSM_DEFINE_STATE_TYPE_REGISTRY in exactly one module
+	HSM_STATE_TYPE_REGISTRY_API StateTypeRegistry& GetStateTypeRegistry();
+
+	// Returns the index for a newly registered state type, which is the same in every module for a given name
+	inline size_t RegisterStateType(const char* stateTypeName)
+	{
+		return GetStateTypeRegistry().Register(stateTypeName);
+	}
+}
+
+// Returns the number of state types registered so far, which is one more than the largest StateTypeId::mIndex
+inline size_t GetNumStateTypes()
+{
+	return detail::GetStateTypeRegistry().GetNumStateTypes();
+}
+
+#define HSM_DEFINE_STATE_TYPE_REGISTRY() \
+	HSM_STATE_TYPE_REGISTRY_API hsm::detail::StateTypeRegistry& hsm::detail::GetStateTypeRegistry() \
+	{ \
+		static hsm::detail::StateTypeRegistry registry; \
+		return registry; \
+	}
+
+#else // !HSM_USE_SHARED_STATE_TYPE_REGISTRY
+
+namespace detail
+{
+	inline std::atomic<size_t>& GetStateTypeCounter()
+	{
+		static std::atomic<size_t> counter(0);
+		return counter;
+	}
+
+	// Returns the index for a newly registered state type. The name is only used with a shared registry.
+	inline size_t RegisterStateType(const char* /*stateTypeName*/)
+	{
+		return GetStateTypeCounter()++;
+	}
+}
+
+// Returns the number of state types registered so far, which is one more than the largest StateTypeId::mIndex
+inline size_t GetNumStateTypes()
+{
+	return detail::GetStateTypeCounter();
+}
+
+#endif // !HSM_USE_SHARED_STATE_TYPE_REGISTRY
+
+} // namespace hsm
+
+namespace std
+{
+	template <>
+	struct hash<hsm::StateTypeId>
+	{
+		size_t operator()(const hsm::StateTypeId& stateTypeId) const { return stateTypeId.mIndex; }
+	};
+}
+
 #ifdef HSM_USE_CPP_RTTI
 
 #include <typeinfo>
+#if defined(HSM_COMPILER_CLANG_OR_GCC)
+#include <cxxabi.h> // for abi::__cxa_demangle
+#endif
 
 namespace hsm {
 
-// We use standard C++ RTTI
+// We use standard C++ RTTI to register state types
 
-// We need a copyable wrapper around std::type_info since std::type_info is non-copyable
-struct StateTypeId
+namespace detail
 {
-	StateTypeId() : mTypeInfo(0) {}
-	StateTypeId(const std::type_info& typeInfo) : mTypeInfo(&typeInfo) {}
-	hsm_bool operator==(const StateTypeId& rhs) const
+	// Returns a human-readable name for the input type, demangling it if the compiler mangles type names.
+	// Only called once per state type, and the result is never freed.
+	inline const char* GetReadableTypeName(const std::type_info& typeInfo)
 	{
-		HSM_ASSERT_MSG(mTypeInfo != 0, "mTypeInfo was not properly initialized");
-		return *mTypeInfo == *rhs.mTypeInfo;
+		const char* name = typeInfo.name();
+#if defined(HSM_COMPILER_CLANG_OR_GCC)
+		int status = 0;
+		if (const char* demangledName = abi::__cxa_demangle(name, 0, 0, &status))
+		{
+			name = demangledName;
+		}
+#endif
+		// MSVC prefixes type names with "struct " or "class "
+		if (strncmp(name, "struct ", 7) == 0)
+			name += 7;
+		else if (strncmp(name, "class ", 6) == 0)
+			name += 6;
+		return name;
 	}
-	const std::type_info* mTypeInfo;
-};
+}
 
 template <typename StateType>
 const StateTypeId& GetStateType()
 {
-	static StateTypeId stateTypeId(typeid(StateType));
+	static const StateTypeId stateTypeId(detail::RegisterStateType(typeid(StateType).name()), detail::GetReadableTypeName(typeid(StateType)));
 	return stateTypeId;
 }
 
 template <typename StateType>
 const char* GetStateName()
 {
-	return GetStateType<StateType>().mTypeInfo->name();
+	return GetStateType<StateType>().mStateName;
 }
 
 } // namespace hsm
@@ -184,24 +450,11 @@ const char* GetStateName()
 namespace hsm {
 
 // Standard C++ RTTI is not available, so we roll our own custom RTTI. All states are required to use the
-// DEFINE_HSM_STATE macro, which makes use of the input name of the state as the unique identifier. String
-// compares are used to determine equality.
+// DEFINE_HSM_STATE macro, which registers the state type the first time its StateTypeId is requested, and
+// uses the input name of the state as its name.
 
-// We need a comparable wrapper around the type name. We can't just compare const char* pointers
-// because GetTypeName<T> may return two different strings for the same T in different translation units.
-struct StateTypeId
-{
-	StateTypeId(const hsm_char* aStateName = 0) : mStateName(aStateName) {}
-	hsm_bool operator==(const StateTypeId& rhs) const
-	{
-		HSM_ASSERT_MSG(mStateName != 0, "StateTypeId was not properly initialized");
-		return STRCMP(mStateName, rhs.mStateName) == 0;
-	}
-	const hsm_char* mStateName;
-};
-	
 template <typename StateType>
-StateTypeId GetStateType()
+const StateTypeId& GetStateType()
 {
 	return StateType::GetStaticStateType();
 }
@@ -216,7 +469,7 @@ const char* GetStateName()
 
 // Must use this macro in every State to add RTTI support.
 #define DEFINE_HSM_STATE(__StateName__) \
-	static hsm::StateTypeId GetStaticStateType() { static hsm::StateTypeId sStateTypeId(HSM_TEXT(#__StateName__)); return sStateTypeId; } \
+	static const hsm::StateTypeId& GetStaticStateType() { static const hsm::StateTypeId sStateTypeId(hsm::detail::RegisterStateType(#__StateName__), HSM_TEXT(#__StateName__)); return sStateTypeId; } \
 	virtual hsm::StateTypeId DoGetStateType() const { return GetStaticStateType(); } \
 	virtual const hsm_char* DoGetStateDebugName() const { return HSM_TEXT(#__StateName__); }
 
@@ -226,1166 +479,5427 @@ const char* GetStateName()
 #pragma endregion "RTTI"
 #endif
 
+#if HSM_USE_STATE_POOLS
+
 #ifdef HSM_COMPILER_MSC
-#pragma region "Transition"
+#pragma region "StatePool"
 #endif
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-// Transition
+// StatePool
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 namespace hsm {
 
-struct State;
-struct StateFactory;
+#if HSM_STATE_POOLS_THREAD_SAFE
+namespace detail
+{
+	// Minimal spin lock, for short critical sections that are rarely contended
+	class SpinLock
+	{
+	public:
+		SpinLock() { mFlag.clear(); }
+		void Lock() { while (mFlag.test_and_set(std::memory_order_acquire)) {} }
+		void Unlock() { mFlag.clear(std::memory_order_release); }
 
-// Returns the one StateFactory instance for the input state. Note that this type can be used to effectively store
-// a state in a variable at runtime, which can subsequently be passed to a Transition function.
-template <typename TargetState>
-const StateFactory& GetStateFactory();
+	private:
+		std::atomic_flag mFlag;
+	};
+}
+#endif
 
-// State creation interface
-struct StateFactory
+// Allocation counters for a StatePool, or summed over all pools of a StatePoolSet
+struct StatePoolStats
 {
-	virtual StateTypeId GetStateType() const = 0;
-	virtual const char* GetStateName() const = 0;
-	virtual State* AllocateState() const = 0;
-};
+	StatePoolStats() : mNumHits(0), mNumMisses(0), mNumInUse(0), mPeakInUse(0), mNumCached(0) {}
 
-inline bool operator==(const StateFactory& lhs, const StateFactory& rhs) { return lhs.GetStateType() == rhs.GetStateType(); }
-inline bool operator!=(const StateFactory& lhs, const StateFactory& rhs) { return !(lhs == rhs); }
+	size_t mNumHits; // Allocations served from the free list
+	size_t mNumMisses; // Allocations that had to allocate a new block from the heap
+	size_t mNumInUse; // Blocks currently allocated
+	size_t mPeakInUse; // Highest value mNumInUse has reached
+	size_t mNumCached; // Blocks on the free list, ready to be reused
+};
 
-// ConcreteStateFactory is the actual state creator; these are allocated statically in the transition
-// functions (below) and stored within Transition instances.
-template <typename TargetState>
-struct ConcreteStateFactory : StateFactory
+// Free-list of fixed-size blocks, used to allocate states of a single type. Blocks are never returned to
+// the heap until Trim() is called or the pool is destroyed.
+class StatePool
 {
-	virtual StateTypeId GetStateType() const
+public:
+	explicit StatePool(size_t blockSize)
+		: mBlockSize(blockSize < sizeof(FreeBlock) ? sizeof(FreeBlock) : blockSize)
+		, mFreeList(0)
 	{
-		return hsm::GetStateType<TargetState>();
 	}
 
-	virtual const char* GetStateName() const
+	~StatePool()
 	{
-		return hsm::GetStateName<TargetState>();
+		HSM_ASSERT_MSG(mStats.mNumInUse == 0, "StatePool destroyed while some of its states are still allocated");
+		Trim();
 	}
 
-	virtual State* AllocateState() const
+	void* Allocate()
 	{
-		return HSM_NEW TargetState();
+		void* block;
+		if (mFreeList)
+		{
+			block = mFreeList;
+			mFreeList = mFreeList->mNext;
+			--mStats.mNumCached;
+			++mStats.mNumHits;
+		}
+		else
+		{
+			block = HSM_ALLOC(mBlockSize);
+			++mStats.mNumMisses;
+		}
+
+		if (++mStats.mNumInUse > mStats.mPeakInUse)
+			mStats.mPeakInUse = mStats.mNumInUse;
+
+		return block;
+	}
+
+	void Deallocate(void* block)
+	{
+		HSM_ASSERT(block != 0 && mStats.mNumInUse > 0);
+		FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+		freeBlock->mNext = mFreeList;
+		mFreeList = freeBlock;
+		--mStats.mNumInUse;
+		++mStats.mNumCached;
+	}
+
+	// Allocates blocks up front until at least numBlocks are either in use or cached
+	void Reserve(size_t numBlocks)
+	{
+		while (mStats.mNumInUse + mStats.mNumCached < numBlocks)
+		{
+			FreeBlock* freeBlock = static_cast<FreeBlock*>(HSM_ALLOC(mBlockSize));
+			freeBlock->mNext = mFreeList;
+			mFreeList = freeBlock;
+			++mStats.mNumCached;
+		}
+	}
+
+	// Returns all cached blocks to the heap
+	void Trim()
+	{
+		while (mFreeList)
+		{
+			FreeBlock* next = mFreeList->mNext;
+			HSM_FREE(mFreeList);
+			mFreeList = next;
+		}
+		mStats.mNumCached = 0;
 	}
 
+	size_t GetBlockSize() const { return mBlockSize; }
+	const StatePoolStats& GetStats() const { return mStats; }
+
 private:
-	// Only GetStateFactory can create this type
-	friend const StateFactory& GetStateFactory<TargetState>();
-	ConcreteStateFactory() {}
-};
+	StatePool(const StatePool&);
+	StatePool& operator=(const StatePool&);
 
-template <typename TargetState>
-const StateFactory& GetStateFactory()
-{
-	static_assert(std::is_convertible<TargetState, State>::value, "TargetState must derive from hsm::State");
-	static ConcreteStateFactory<TargetState> instance;
-	return instance;
-}
+	struct FreeBlock
+	{
+		FreeBlock* mNext;
+	};
 
-// Small wrapper used to carry the SourceState along with the StateFactory for a state override.
-// This allows us to provide an overload of transition functions that accept a state override with args.
-template <typename SourceState>
-struct StateOverride
-{
-	explicit StateOverride(const StateFactory& stateFactory) : mStateFactory(stateFactory) {}
-	operator const StateFactory& () const { return mStateFactory; }
-	const StateFactory& mStateFactory;
+	size_t mBlockSize;
+	FreeBlock* mFreeList;
+	StatePoolStats mStats;
 };
 
-typedef std::function<void (State*)> OnEnterArgsFunc;
-
-namespace detail
+// A set of StatePools, one per state type. A StateMachine allocates all of its states from a single
+// StatePoolSet, which can be shared by many state machines (e.g. one per world), or left to default to
+// the set returned by GetDefault. A StatePoolSet is not thread-safe unless
+// HSM_STATE_POOLS_THREAD_SAFE is set, so state machines that share one must otherwise be processed on the
+// same thread. Even then, only Allocate, Deallocate, Reserve and Trim are thread-safe.
+class StatePoolSet
 {
-	template <typename TargetState, typename... Args>
-	OnEnterArgsFunc GenerateOnEnterArgsFunc(Args&&... args);
-}
+public:
+	StatePoolSet() {}
 
-// Transition objects are created via the free-standing transition functions below, and typically returned by
-// GetTransition. They can also be stored as data members, passed around, and returned later. They are meant
-// to be copyable and lightweight.
-struct Transition
-{
-	enum Type { Sibling, Inner, InnerEntry, No };
+	~StatePoolSet()
+	{
+		for (size_t i = 0; i < mPools.size(); ++i)
+		{
+			HSM_DELETE mPools[i];
+		}
+		for (size_t i = 0; i < mSizeClassPools.size(); ++i)
+		{
+			HSM_DELETE mSizeClassPools[i];
+		}
+	}
 
-	// Default is no transition
-	Transition()
-		: mTransitionType(Transition::No)
-		, mStateFactory(0)
+	// Returns the pool for the input state type, creating it if necessary
+	StatePool& GetPool(StateTypeId stateTypeId, size_t stateSize)
 	{
+		if (stateTypeId.mIndex >= mPools.size())
+		{
+			mPools.resize(stateTypeId.mIndex + 1, 0);
+		}
+
+		StatePool*& pool = mPools[stateTypeId.mIndex];
+		if (!pool)
+		{
+			pool = HSM_NEW StatePool(stateSize);
+		}
+		HSM_ASSERT(pool->GetBlockSize() >= stateSize);
+		return *pool;
 	}
 
-	// Transition without state args
-	Transition(Transition::Type transitionType, const StateFactory& stateFactory)
-		: mTransitionType(transitionType)
-		, mStateFactory(&stateFactory)
+	template <typename StateType>
+	StatePool& GetPool()
 	{
+		return GetPool(GetStateType<StateType>(), sizeof(StateType));
 	}
 
-	// Transition with state args
-	Transition(Transition::Type transitionType, const StateFactory& stateFactory, OnEnterArgsFunc onEnterArgsFunc)
-		: mTransitionType(transitionType)
-		, mStateFactory(&stateFactory)
-		, mOnEnterArgsFunc(std::move(onEnterArgsFunc))
+	// Allocates a block for a state of type StateType from its pool
+	template <typename StateType>
+	void* Allocate()
 	{
+		ScopedLock lock(*this);
+		return GetPool<StateType>().Allocate();
 	}
 
-	Transition::Type GetTransitionType() const { return mTransitionType; }
-	StateTypeId GetTargetStateType() const { HSM_ASSERT(mStateFactory != 0); return mStateFactory->GetStateType(); }
-	const StateFactory& GetStateFactory() const { HSM_ASSERT(mStateFactory != 0); return *mStateFactory; }
-	const OnEnterArgsFunc& GetOnEnterArgsFunc() const { return mOnEnterArgsFunc; }
+	// Returns a block allocated via Allocate<StateType> to its pool
+	template <typename StateType>
+	void Deallocate(void* block)
+	{
+		ScopedLock lock(*this);
+		GetPool<StateType>().Deallocate(block);
+	}
 
-	hsm_bool IsSibling() const { return mTransitionType == Sibling; }
-	hsm_bool IsInner() const { return mTransitionType == Inner; }
-	hsm_bool IsInnerEntry() const { return mTransitionType == InnerEntry; }
-	hsm_bool IsNo() const { return mTransitionType == No; }
+	// Allocates a block of at least the input size for data that isn't a state (e.g. coroutine frames), from a
+	// pool shared by all blocks of the same size class
+	void* AllocateBlock(size_t size)
+	{
+		ScopedLock lock(*this);
+		return GetSizeClassPool(size).Allocate();
+	}
 
-private:
-	Transition::Type mTransitionType;
-	const StateFactory* mStateFactory; // Bald pointer is safe for shallow copying because StateFactory instances are always statically allocated
-	OnEnterArgsFunc mOnEnterArgsFunc; // Optional: set if transition specifies arguments
-};
+	// Returns a block allocated via AllocateBlock with the same size to its pool
+	void DeallocateBlock(void* block, size_t size)
+	{
+		ScopedLock lock(*this);
+		GetSizeClassPool(size).Deallocate(block);
+	}
 
+	// Pre-allocates blocks for numStates states of type StateType (e.g. at load time)
+	template <typename StateType>
+	void Reserve(size_t numStates)
+	{
+		ScopedLock lock(*this);
+		GetPool<StateType>().Reserve(numStates);
+	}
 
-// Transition generators - use these to return from State::GetTransition()
+	template <typename StateType>
+	StatePoolStats GetStats() const
+	{
+		const size_t index = GetStateType<StateType>().mIndex;
+		return (index < mPools.size() && mPools[index]) ? mPools[index]->GetStats() : StatePoolStats();
+	}
 
-// SiblingTransition
+	// Returns the sum of all pools' stats; note that the peak is the sum of each pool's peak.
+	StatePoolStats GetTotalStats() const
+	{
+		StatePoolStats total;
+		AddPoolStats(mPools, total);
+		return total;
+	}
 
-inline Transition SiblingTransition(const StateFactory& stateFactory)
-{
-	return Transition(Transition::Sibling, stateFactory);
-}
-
-template <typename TargetState>
-Transition SiblingTransition()
-{
-	return Transition(Transition::Sibling, GetStateFactory<TargetState>());
-}
-
-template <typename TargetState, typename... Args>
-Transition SiblingTransition(Args&&... args)
-{
-	return Transition(Transition::Sibling, GetStateFactory<TargetState>(), detail::GenerateOnEnterArgsFunc<TargetState>(std::forward<Args>(args)...));
-}
-
-// Deprecated after v1.5 upon realizing that it's not possible to bind to the correct OnEnter for state
-// overrides since the actual target state is not known at compile time, but rather at runtime.
-template <typename TargetState, typename T1, typename... Args>
-HSM_DEPRECATED("Passing state args to state overrides is not supported")
-Transition SiblingTransition(const StateOverride<TargetState>& stateOverride, T1&& arg1, Args&&... args);
+	// Returns the sum of the stats of the pools used by AllocateBlock
+	StatePoolStats GetBlockStats() const
+	{
+		StatePoolStats total;
+		AddPoolStats(mSizeClassPools, total);
+		return total;
+	}
 
-// InnerTransition
+	// Returns all cached blocks of all pools to the heap
+	void Trim()
+	{
+		ScopedLock lock(*this);
+		for (size_t i = 0; i < mPools.size(); ++i)
+		{
+			if (mPools[i])
+				mPools[i]->Trim();
+		}
+		for (size_t i = 0; i < mSizeClassPools.size(); ++i)
+		{
+			if (mSizeClassPools[i])
+				mSizeClassPools[i]->Trim();
+		}
+	}
 
-inline Transition InnerTransition(const StateFactory& stateFactory)
-{
-	return Transition(Transition::Inner, stateFactory);
-}
+	// Returns the StatePoolSet owned by the calling thread. The set is never destroyed, so that states can still
+	// be freed into it after the thread exits, or while static objects are destroyed after the thread's
+	// thread_local objects (e.g. a global StateMachine with states on its stack). Its cached blocks are returned
+	// to the heap when the thread exits.
+	static StatePoolSet& GetThreadLocal()
+	{
+		// Sets are kept on a process-wide list, so that those of exited threads remain reachable
+		struct ThreadSet
+		{
+			StatePoolSet mStatePoolSet;
+			ThreadSet* mNext;
+		};
+		struct ThreadExitTrimmer
+		{
+			~ThreadExitTrimmer() { mStatePoolSet->Trim(); }
+			StatePoolSet* mStatePoolSet;
+		};
+		static std::atomic<ThreadSet*> threadSets(0);
 
-template <typename TargetState>
-Transition InnerTransition()
-{
-	return Transition(Transition::Inner, GetStateFactory<TargetState>());
-}
+		static thread_local StatePoolSet* statePoolSet = 0;
+		if (!statePoolSet)
+		{
+			ThreadSet* threadSet = HSM_NEW ThreadSet();
+			threadSet->mNext = threadSets.load(std::memory_order_relaxed);
+			while (!threadSets.compare_exchange_weak(threadSet->mNext, threadSet, std::memory_order_relaxed)) {}
+			statePoolSet = &threadSet->mStatePoolSet;
 
-template <typename TargetState, typename... Args>
-Transition InnerTransition(Args&&... args)
-{
-	return Transition(Transition::Inner, GetStateFactory<TargetState>(), detail::GenerateOnEnterArgsFunc<TargetState>(std::forward<Args>(args)...));
-}
+			static thread_local ThreadExitTrimmer threadExitTrimmer = { statePoolSet };
+			(void)threadExitTrimmer;
+		}
+		return *statePoolSet;
+	}
 
-template <typename TargetState, typename T1, typename... Args>
-HSM_DEPRECATED("Passing state args to state overrides is not supported") // See details on SiblingTransition version
-Transition InnerTransition(const StateOverride<TargetState>& stateOverride, T1&& arg1, Args&&... args);
+	// Returns the StatePoolSet used by state machines that aren't given one: the calling thread's (see
+	// GetThreadLocal), or if HSM_STATE_POOLS_THREAD_SAFE is set, one of HSM_STATE_POOLS_NUM_PARTITIONS sets, since
+	// state machines may then migrate between threads. Threads are assigned partitions round-robin the first time
+	// they call GetDefault, so that each worker mostly locks its own set. Either way, the set lives as long as the
+	// process. Without the thread-safe option, a state machine must not be processed or destroyed on another
+	// thread while the thread that created its states may still use its set.
+	static StatePoolSet& GetDefault()
+	{
+#if HSM_STATE_POOLS_THREAD_SAFE
+		// Padded so that the locks of neighbouring partitions don't share a cache line
+		struct Partition
+		{
+			StatePoolSet mStatePoolSet;
+			char mPadding[64];
+		};
+		// Never destroyed, as static state machines may be destroyed after a function-local static
+		static Partition* const partitions = HSM_NEW Partition[HSM_STATE_POOLS_NUM_PARTITIONS];
+		static std::atomic<size_t> numThreads(0);
+		static thread_local const size_t partitionIndex = numThreads.fetch_add(1, std::memory_order_relaxed) % HSM_STATE_POOLS_NUM_PARTITIONS;
+		return partitions[partitionIndex].mStatePoolSet;
+#else
+		return GetThreadLocal();
+#endif
+	}
 
-// InnerEntryTransition
+private:
+	StatePoolSet(const StatePoolSet&);
+	StatePoolSet& operator=(const StatePoolSet&);
 
-inline Transition InnerEntryTransition(const StateFactory& stateFactory)
-{
-	return Transition(Transition::InnerEntry, stateFactory);
-}
+	// Locks the set for the current scope if HSM_STATE_POOLS_THREAD_SAFE is set
+	struct ScopedLock
+	{
+#if HSM_STATE_POOLS_THREAD_SAFE
+		explicit ScopedLock(StatePoolSet& statePoolSet) : mLock(statePoolSet.mLock) { mLock.Lock(); }
+		~ScopedLock() { mLock.Unlock(); }
+		detail::SpinLock& mLock;
+#else
+		explicit ScopedLock(StatePoolSet&) {}
+#endif
+	};
 
-template <typename TargetState>
-Transition InnerEntryTransition()
-{
-	return Transition(Transition::InnerEntry, GetStateFactory<TargetState>());
-}
+	static void AddPoolStats(const HSM_STD_VECTOR<StatePool*>& pools, StatePoolStats& total)
+	{
+		for (size_t i = 0; i < pools.size(); ++i)
+		{
+			if (const StatePool* pool = pools[i])
+			{
+				const StatePoolStats& stats = pool->GetStats();
+				total.mNumHits += stats.mNumHits;
+				total.mNumMisses += stats.mNumMisses;
+				total.mNumInUse += stats.mNumInUse;
+				total.mPeakInUse += stats.mPeakInUse;
+				total.mNumCached += stats.mNumCached;
+			}
+		}
+	}
 
-template <typename TargetState, typename... Args>
-Transition InnerEntryTransition(Args&&... args)
-{
-	return Transition(Transition::InnerEntry, GetStateFactory<TargetState>(), detail::GenerateOnEnterArgsFunc<TargetState>(std::forward<Args>(args)...));
-}
+	// Block sizes of AllocateBlock are rounded up to a multiple of this
+	static const size_t kSizeClassGranularity = 64;
 
-template <typename TargetState, typename T1, typename... Args>
-HSM_DEPRECATED("Passing state args to state overrides is not supported") // See details on SiblingTransition version
-Transition InnerEntryTransition(const StateOverride<TargetState>& stateOverride, T1&& arg1, Args&&... args);
+	StatePool& GetSizeClassPool(size_t size)
+	{
+		HSM_ASSERT(size > 0);
+		const size_t index = (size - 1) / kSizeClassGranularity;
+		if (index >= mSizeClassPools.size())
+		{
+			mSizeClassPools.resize(index + 1, 0);
+		}
 
-// NoTransition
+		StatePool*& pool = mSizeClassPools[index];
+		if (!pool)
+		{
+			pool = HSM_NEW StatePool((index + 1) * kSizeClassGranularity);
+		}
+		return *pool;
+	}
 
-inline Transition NoTransition()
-{
-	return Transition();
-}
+	HSM_STD_VECTOR<StatePool*> mPools; // Indexed by StateTypeId::mIndex
+	HSM_STD_VECTOR<StatePool*> mSizeClassPools; // Indexed by size class, for AllocateBlock
+#if HSM_STATE_POOLS_THREAD_SAFE
+	detail::SpinLock mLock;
+#endif
+};
 
 } // namespace hsm
 
 #ifdef HSM_COMPILER_MSC
-#pragma endregion "Transition"
+#pragma endregion "StatePool"
 #endif
 
+#endif // HSM_USE_STATE_POOLS
+
 #ifdef HSM_COMPILER_MSC
-#pragma region "State"
+#pragma region "Transition"
 #endif
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-// State
+// Transition
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 namespace hsm {
 
-class StateMachine;
-
-// StateValue
+struct State;
+struct StateFactory;
 
-template <typename T>
-struct ConcreteStateValueResetter;
+// Returns the one StateFactory instance for the input state. Note that this type can be used to effectively store
+// a state in a variable at runtime, which can subsequently be passed to a Transition function.
+template <typename TargetState>
+const StateFactory& GetStateFactory();
 
-template <typename T>
-struct StateValue
+// State creation interface
+struct StateFactory
 {
-	// Constructor - allows client to initialize StateValue; afterward,
-	// can only assign via State::SetStateValue().
-	// Note that T must be default constructable.
-	explicit StateValue(const T& initValue = T()) { mValue = initValue; }
-
-	// Sometimes value cannot be set only from constructor, so we provide this setter;
-	// however it should only be used to initialize the value before states manipulate it.
-	void SetInitialValue(const T& initValue) { mValue = initValue; }
-
-	// Implicit conversion operator to const T& (but not T&)
-	operator const T&() const { return mValue; }
-
-	// Explicitly returns value
-	const T& Value() const { return mValue; }
-
-private:
-	// Disable copy
-	StateValue(const StateValue& rhs);
-	StateValue& operator=(StateValue& rhs);
-
-	friend struct ConcreteStateValueResetter<T>;
-	friend struct State;
-	T mValue;
-};
+	virtual StateTypeId GetStateType() const = 0;
+	virtual const char* GetStateName() const = 0;
+	virtual State* AllocateState() const = 0;
+	virtual void DeallocateState(State* state) const = 0;
+
+	// In-place construction and destruction, for states allocated by the caller. DestructState returns the
+	// memory that was passed to ConstructState.
+	virtual size_t GetStateSize() const = 0;
+	virtual size_t GetStateAlignment() const = 0;
+	virtual State* ConstructState(void* memory) const = 0;
+	virtual void* DestructState(State* state) const = 0;
+
+	// Returns the address of the most derived object of a state created by this factory, which is
+	// GetStateSize() bytes long, and isn't the address of its State base if State isn't its first base
+	virtual void* GetStateObject(State* state) const = 0;
+
+#if HSM_USE_STATE_POOLS
+	// Pooled versions of the above: the state is constructed in, and returned to, a block from its type's
+	// pool in the input StatePoolSet.
+	virtual State* AllocateState(StatePoolSet& statePoolSet) const = 0;
+	virtual void DeallocateState(State* state, StatePoolSet& statePoolSet) const = 0;
+#endif
 
-struct StateValueResetter
-{
-	virtual ~StateValueResetter() {}
+#if HSM_USE_SNAPSHOTS
+	// Identifies the state type in snapshots; a hash of the state name, so it's stable across runs and builds
+	virtual uint32_t GetStateSnapshotId() const = 0;
+#endif
 };
 
-template <typename T>
-struct ConcreteStateValueResetter : StateValueResetter
+#if HSM_USE_SNAPSHOTS
+namespace detail
 {
-	ConcreteStateValueResetter(StateValue<T>& stateValue)
+	// FNV-1a hash of a state name
+	inline uint32_t HashStateName(const char* name)
 	{
-		mStateValue = &stateValue;
-		mOrigValue = stateValue.mValue;
+		uint32_t hash = 2166136261u;
+		for ( ; *name; ++name)
+		{
+			hash = (hash ^ static_cast<unsigned char>(*name)) * 16777619u;
+		}
+		return hash;
 	}
 
-	virtual ~ConcreteStateValueResetter()
+	typedef HSM_STD_MAP<uint32_t, const StateFactory*> StateFactoryRegistry;
+
+	inline StateFactoryRegistry& GetStateFactoryRegistry()
 	{
-		mStateValue->mValue = mOrigValue;
+		static StateFactoryRegistry registry;
+		return registry;
 	}
 
-	StateValue<T>* mStateValue;
-	T mOrigValue;
-};
+	inline hsm_bool RegisterStateFactory(const StateFactory& stateFactory)
+	{
+		const StateFactory*& registeredStateFactory = GetStateFactoryRegistry()[stateFactory.GetStateSnapshotId()];
+		HSM_ASSERT_MSG(!registeredStateFactory || registeredStateFactory == &stateFactory, "Two state types have the same name (or name hash), so snapshots can't tell them apart");
+		registeredStateFactory = &stateFactory;
+		return hsm_true;
+	}
 
+	// Returns the factory of the state type with the input snapshot id, or NULL if there's no such type
+	inline const StateFactory* FindStateFactory(uint32_t stateSnapshotId)
+	{
+		StateFactoryRegistry::const_iterator iter = GetStateFactoryRegistry().find(stateSnapshotId);
+		return iter != GetStateFactoryRegistry().end() ? iter->second : 0;
+	}
 
-// State
+	// Registers the factory of every state type used by the program during static initialization, so that
+	// snapshots can be loaded before the state types are used
+	template <typename TargetState>
+	struct StateFactoryRegistrar
+	{
+		static const hsm_bool sRegistered;
+	};
 
-namespace detail
-{
-	void InitState(State* state, StateMachine* ownerStateMachine, size_t stackDepth, const StateFactory& stateFactory);
+	template <typename TargetState>
+	const hsm_bool StateFactoryRegistrar<TargetState>::sRegistered = RegisterStateFactory(GetStateFactory<TargetState>());
 }
+#endif
 
-struct State
+inline bool operator==(const StateFactory& lhs, const StateFactory& rhs) { return lhs.GetStateType() == rhs.GetStateType(); }
+inline bool operator!=(const StateFactory& lhs, const StateFactory& rhs) { return !(lhs == rhs); }
+
+// ConcreteStateFactory is the actual state creator; these are allocated statically in the transition
+// functions (below) and stored within Transition instances.
+template <typename TargetState>
+struct ConcreteStateFactory : StateFactory
 {
-	State()
-		: mOwnerStateMachine(0)
-		, mStackDepth(0)
-		, mStateValueResetters(0)
-		, mStateDebugName(0)
+	virtual StateTypeId GetStateType() const
 	{
+		return hsm::GetStateType<TargetState>();
 	}
 
-	virtual ~State()
+	virtual const char* GetStateName() const
 	{
-		ResetStateValues();
+		return hsm::GetStateName<TargetState>();
 	}
 
-	// RTTI interface
-	StateTypeId GetStateType() const { return mStateTypeId; }
-	const hsm_char* GetStateDebugName() const { return mStateDebugName; }
+	virtual State* AllocateState() const
+	{
+		return HSM_NEW TargetState();
+	}
 
-	// Accessors
-	StateMachine& GetStateMachine() { HSM_ASSERT(mOwnerStateMachine != 0); return *mOwnerStateMachine; }
-	const StateMachine& GetStateMachine() const { HSM_ASSERT(mOwnerStateMachine != 0); return *mOwnerStateMachine; }
-	
-	Owner*& GetOwner() { return mOwner; }
-	Owner*const& GetOwner() const { return mOwner; }
+	virtual void DeallocateState(State* state) const
+	{
+		HSM_DELETE static_cast<TargetState*>(state);
+	}
 
-	// Searches for state on stack from outermost to innermost, returns NULL if not found
-	template <typename StateType>
-	StateType* GetState();
+	virtual size_t GetStateSize() const
+	{
+		return sizeof(TargetState);
+	}
 
-	template <typename StateType>
-	const StateType* GetState() const;
+	virtual size_t GetStateAlignment() const
+	{
+		return std::alignment_of<TargetState>::value;
+	}
 
-	// Searches for state on stack starting from immediate outer to outermost, returns NULL if not found
-	template <typename StateType>
-	StateType* GetOuterState();
+	virtual State* ConstructState(void* memory) const
+	{
+		return new (memory) TargetState();
+	}
 
-	template <typename StateType>
-	const StateType* GetOuterState() const;
+	virtual void* DestructState(State* state) const
+	{
+		TargetState* targetState = static_cast<TargetState*>(state);
+		targetState->~TargetState();
+		return targetState;
+	}
 
-	// Searches for state on stack starting from immediate inner to innermost, returns NULL if not found
-	template <typename StateType>
-	StateType* GetInnerState();
+	virtual void* GetStateObject(State* state) const
+	{
+		return static_cast<TargetState*>(state);
+	}
 
-	template <typename StateType>
-	const StateType* GetInnerState() const;
+#if HSM_USE_STATE_POOLS
+	virtual State* AllocateState(StatePoolSet& statePoolSet) const
+	{
+		static_assert(std::alignment_of<TargetState>::value <= std::alignment_of<std::max_align_t>::value, "Over-aligned states cannot be pooled");
+		void* block = statePoolSet.Allocate<TargetState>();
+		return new (block) TargetState();
+	}
 
-	// Returns state on the stack immediately below us (our inner) if one exists
-	State* GetImmediateInnerState();
-	const State* GetImmediateInnerState() const;
+	virtual void DeallocateState(State* state, StatePoolSet& statePoolSet) const
+	{
+		statePoolSet.Deallocate<TargetState>(DestructState(state));
+	}
+#endif
 
-	// Returns state on the stack immediately below us (our inner) if one exists AND is type StateType
-	template <typename StateType>
-	StateType* GetImmediateInnerState();
+#if HSM_USE_SNAPSHOTS
+	virtual uint32_t GetStateSnapshotId() const
+	{
+		static const uint32_t stateSnapshotId = detail::HashStateName(GetStateName());
+		return stateSnapshotId;
+	}
+#endif
 
-	template <typename StateType>
-	const StateType* GetImmediateInnerState() const;
+private:
+	// Only GetStateFactory can create this type
+	friend const StateFactory& GetStateFactory<TargetState>();
+	ConcreteStateFactory() {}
+};
+
+template <typename TargetState>
+const StateFactory& GetStateFactory()
+{
+	static_assert(std::is_convertible<TargetState, State>::value, "TargetState must derive from hsm::State");
+	static ConcreteStateFactory<TargetState> instance;
+#if HSM_USE_SNAPSHOTS
+	(void)detail::StateFactoryRegistrar<TargetState>::sRegistered;
+#endif
+	return instance;
+}
+
+// Small wrapper used to carry the SourceState along with the StateFactory for a state override.
+// This allows us to provide an overload of transition functions that accept a state override with args.
+template <typename SourceState>
+struct StateOverride
+{
+	explicit StateOverride(const StateFactory& stateFactory) : mStateFactory(stateFactory) {}
+	operator const StateFactory& () const { return mStateFactory; }
+	const StateFactory& mStateFactory;
+};
+
+namespace detail
+{
+	template <typename TargetState, typename... Args>
+	auto GenerateOnEnterArgsFunc(Args&&... args);
+
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+	// Reference-counted heap storage for state args that can't be stored inline in a Transition
+	struct OnEnterArgsHeapBlock
+	{
+		OnEnterArgsHeapBlock() : mRefCount(1) {}
+		virtual ~OnEnterArgsHeapBlock() {}
+		virtual const void* GetOnEnterArgs() const = 0;
+
+		void AddRef() { ++mRefCount; }
+		void Release() { if (--mRefCount == 0) HSM_DELETE this; }
+
+	private:
+		std::atomic<size_t> mRefCount;
+	};
+
+	template <typename OnEnterArgsFunc>
+	struct ConcreteOnEnterArgsHeapBlock : OnEnterArgsHeapBlock
+	{
+		explicit ConcreteOnEnterArgsHeapBlock(const OnEnterArgsFunc& onEnterArgsFunc) : mOnEnterArgsFunc(onEnterArgsFunc) {}
+		virtual const void* GetOnEnterArgs() const { return &mOnEnterArgsFunc; }
+		OnEnterArgsFunc mOnEnterArgsFunc;
+	};
+#endif
+}
+
+// Transition objects are created via the free-standing transition functions below, and typically returned by
+// GetTransition. They can also be stored as data members, passed around, and returned later. They are meant
+// to be copyable and lightweight: state args that are trivially copyable and fit in HSM_STATE_ARGS_MAX_SIZE
+// bytes are stored inline, so creating or copying a Transition never touches the heap. Other args (e.g. a
+// Transition passed as an arg) fail to compile, unless HSM_STATE_ARGS_HEAP_FALLBACK is set, in which case they
+// are stored in a reference-counted heap block, and Transition is no longer trivially copyable.
+struct Transition
+{
+	enum Type { Sibling, Inner, InnerEntry, No };
+
+	typedef void (*InvokeOnEnterArgsFunc)(State* state, const void* onEnterArgs);
+
+	// Default is no transition
+	Transition()
+		: mTransitionType(Transition::No)
+		, mStateFactory(0)
+		, mInvokeOnEnterArgsFunc(0)
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+		, mOnEnterArgsHeapBlock(0)
+#endif
+	{
+	}
+
+	// Transition without state args
+	Transition(Transition::Type transitionType, const StateFactory& stateFactory)
+		: mTransitionType(transitionType)
+		, mStateFactory(&stateFactory)
+		, mInvokeOnEnterArgsFunc(0)
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+		, mOnEnterArgsHeapBlock(0)
+#endif
+	{
+	}
+
+	// Transition with state args: onEnterArgsFunc is a function object that captures the args by value, and
+	// invokes OnEnter with them on the input state (see detail::GenerateOnEnterArgsFunc).
+	template <typename OnEnterArgsFunc>
+	Transition(Transition::Type transitionType, const StateFactory& stateFactory, const OnEnterArgsFunc& onEnterArgsFunc)
+		: mTransitionType(transitionType)
+		, mStateFactory(&stateFactory)
+		, mInvokeOnEnterArgsFunc(&InvokeOnEnterArgs<OnEnterArgsFunc>)
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+		, mOnEnterArgsHeapBlock(0)
+#endif
+	{
+		const hsm_bool storeInline = sizeof(OnEnterArgsFunc) <= HSM_STATE_ARGS_MAX_SIZE
+			&& std::alignment_of<OnEnterArgsFunc>::value <= std::alignment_of<std::max_align_t>::value
+			&& std::is_trivially_copyable<OnEnterArgsFunc>::value;
+
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+		StoreOnEnterArgs(onEnterArgsFunc, std::integral_constant<bool, storeInline>());
+#else
+		static_assert(storeInline, "State args must be trivially copyable and fit in HSM_STATE_ARGS_MAX_SIZE bytes (pass a pointer, use std::ref(), increase HSM_STATE_ARGS_MAX_SIZE or set HSM_STATE_ARGS_HEAP_FALLBACK)");
+		new (mOnEnterArgs) OnEnterArgsFunc(onEnterArgsFunc);
+#endif
+	}
+
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+	Transition(const Transition& rhs)
+	{
+		CopyFrom(rhs);
+	}
+
+	Transition& operator=(const Transition& rhs)
+	{
+		if (this != &rhs)
+		{
+			ReleaseOnEnterArgs();
+			CopyFrom(rhs);
+		}
+		return *this;
+	}
+
+	~Transition()
+	{
+		ReleaseOnEnterArgs();
+	}
+#endif
+
+	Transition::Type GetTransitionType() const { return mTransitionType; }
+	StateTypeId GetTargetStateType() const { HSM_ASSERT(mStateFactory != 0); return mStateFactory->GetStateType(); }
+	const StateFactory& GetStateFactory() const { HSM_ASSERT(mStateFactory != 0); return *mStateFactory; }
+
+	hsm_bool HasOnEnterArgs() const { return mInvokeOnEnterArgsFunc != 0; }
+	void InvokeOnEnterArgs(State* state) const { HSM_ASSERT(HasOnEnterArgs()); mInvokeOnEnterArgsFunc(state, GetOnEnterArgs()); }
+
+	hsm_bool IsSibling() const { return mTransitionType == Sibling; }
+	hsm_bool IsInner() const { return mTransitionType == Inner; }
+	hsm_bool IsInnerEntry() const { return mTransitionType == InnerEntry; }
+	hsm_bool IsNo() const { return mTransitionType == No; }
+
+private:
+	template <typename OnEnterArgsFunc>
+	static void InvokeOnEnterArgs(State* state, const void* onEnterArgs)
+	{
+		(*static_cast<const OnEnterArgsFunc*>(onEnterArgs))(state);
+	}
+
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+	template <typename OnEnterArgsFunc>
+	void StoreOnEnterArgs(const OnEnterArgsFunc& onEnterArgsFunc, std::true_type /*storeInline*/)
+	{
+		new (mOnEnterArgs) OnEnterArgsFunc(onEnterArgsFunc);
+	}
+
+	template <typename OnEnterArgsFunc>
+	void StoreOnEnterArgs(const OnEnterArgsFunc& onEnterArgsFunc, std::false_type /*storeInline*/)
+	{
+		mOnEnterArgsHeapBlock = HSM_NEW detail::ConcreteOnEnterArgsHeapBlock<OnEnterArgsFunc>(onEnterArgsFunc);
+	}
+
+	void CopyFrom(const Transition& rhs)
+	{
+		mTransitionType = rhs.mTransitionType;
+		mStateFactory = rhs.mStateFactory;
+		mInvokeOnEnterArgsFunc = rhs.mInvokeOnEnterArgsFunc;
+		mOnEnterArgsHeapBlock = rhs.mOnEnterArgsHeapBlock;
+
+		if (mOnEnterArgsHeapBlock)
+		{
+			mOnEnterArgsHeapBlock->AddRef();
+		}
+		else if (mInvokeOnEnterArgsFunc)
+		{
+			memcpy(mOnEnterArgs, rhs.mOnEnterArgs, sizeof(mOnEnterArgs));
+		}
+	}
+
+	void ReleaseOnEnterArgs()
+	{
+		if (mOnEnterArgsHeapBlock)
+		{
+			mOnEnterArgsHeapBlock->Release();
+			mOnEnterArgsHeapBlock = 0;
+		}
+	}
+
+	const void* GetOnEnterArgs() const { return mOnEnterArgsHeapBlock ? mOnEnterArgsHeapBlock->GetOnEnterArgs() : mOnEnterArgs; }
+#else
+	const void* GetOnEnterArgs() const { return mOnEnterArgs; }
+#endif
+
+	Transition::Type mTransitionType;
+	const StateFactory* mStateFactory; // Bald pointer is safe for shallow copying because StateFactory instances are always statically allocated
+	InvokeOnEnterArgsFunc mInvokeOnEnterArgsFunc; // Optional: set if transition specifies arguments
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+	detail::OnEnterArgsHeapBlock* mOnEnterArgsHeapBlock; // Set if args are not stored inline
+#endif
+	alignas(std::max_align_t) unsigned char mOnEnterArgs[HSM_STATE_ARGS_MAX_SIZE]; // Inline args storage
+};
+
+#if !HSM_STATE_ARGS_HEAP_FALLBACK
+static_assert(std::is_trivially_copyable<Transition>::value, "Transition must remain trivially copyable");
+#endif
+
+
+// Transition generators - use these to return from State::GetTransition()
+
+// SiblingTransition
+
+inline Transition SiblingTransition(const StateFactory& stateFactory)
+{
+	return Transition(Transition::Sibling, stateFactory);
+}
+
+template <typename TargetState>
+Transition SiblingTransition()
+{
+	return Transition(Transition::Sibling, GetStateFactory<TargetState>());
+}
+
+template <typename TargetState, typename... Args>
+Transition SiblingTransition(Args&&... args)
+{
+	return Transition(Transition::Sibling, GetStateFactory<TargetState>(), detail::GenerateOnEnterArgsFunc<TargetState>(std::forward<Args>(args)...));
+}
+
+// Deprecated after v1.5 upon realizing that it's not possible to bind to the correct OnEnter for state
+// overrides since the actual target state is not known at compile time, but rather at runtime.
+template <typename TargetState, typename T1, typename... Args>
+HSM_DEPRECATED("Passing state args to state overrides is not supported")
+Transition SiblingTransition(const StateOverride<TargetState>& stateOverride, T1&& arg1, Args&&... args);
+
+// InnerTransition
+
+inline Transition InnerTransition(const StateFactory& stateFactory)
+{
+	return Transition(Transition::Inner, stateFactory);
+}
+
+template <typename TargetState>
+Transition InnerTransition()
+{
+	return Transition(Transition::Inner, GetStateFactory<TargetState>());
+}
+
+template <typename TargetState, typename... Args>
+Transition InnerTransition(Args&&... args)
+{
+	return Transition(Transition::Inner, GetStateFactory<TargetState>(), detail::GenerateOnEnterArgsFunc<TargetState>(std::forward<Args>(args)...));
+}
+
+template <typename TargetState, typename T1, typename... Args>
+HSM_DEPRECATED("Passing state args to state overrides is not supported") // See details on SiblingTransition version
+Transition InnerTransition(const StateOverride<TargetState>& stateOverride, T1&& arg1, Args&&... args);
+
+// InnerEntryTransition
+
+inline Transition InnerEntryTransition(const StateFactory& stateFactory)
+{
+	return Transition(Transition::InnerEntry, stateFactory);
+}
+
+template <typename TargetState>
+Transition InnerEntryTransition()
+{
+	return Transition(Transition::InnerEntry, GetStateFactory<TargetState>());
+}
+
+template <typename TargetState, typename... Args>
+Transition InnerEntryTransition(Args&&... args)
+{
+	return Transition(Transition::InnerEntry, GetStateFactory<TargetState>(), detail::GenerateOnEnterArgsFunc<TargetState>(std::forward<Args>(args)...));
+}
+
+template <typename TargetState, typename T1, typename... Args>
+HSM_DEPRECATED("Passing state args to state overrides is not supported") // See details on SiblingTransition version
+Transition InnerEntryTransition(const StateOverride<TargetState>& stateOverride, T1&& arg1, Args&&... args);
+
+// NoTransition
+
+inline Transition NoTransition()
+{
+	return Transition();
+}
+
+} // namespace hsm
+
+#ifdef HSM_COMPILER_MSC
+#pragma endregion "Transition"
+#endif
+
+#ifdef HSM_COMPILER_MSC
+#pragma region "Event"
+#endif
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Event
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace hsm {
+
+namespace detail
+{
+	inline std::atomic<size_t>& GetEventTypeCounter()
+	{
+		static std::atomic<size_t> counter(0);
+		return counter;
+	}
+}
+
+// Returns the dense index of the input event type, assigned the first time it is requested. Does not rely on RTTI.
+template <typename EventType>
+size_t GetEventTypeIndex()
+{
+	static const size_t index = detail::GetEventTypeCounter()++;
+	return index;
+}
+
+// Holds a copy of an event posted via StateMachine::PostEvent. Any type can be used as an event so long as it
+// is trivially copyable and fits in HSM_EVENT_MAX_SIZE bytes, as it is stored inline.
+class Event
+{
+public:
+	template <typename EventType>
+	explicit Event(const EventType& event)
+		: mEventTypeIndex(hsm::GetEventTypeIndex<EventType>())
+	{
+		static_assert(std::is_trivially_copyable<EventType>::value, "Events must be trivially copyable");
+		static_assert(sizeof(EventType) <= HSM_EVENT_MAX_SIZE, "Event is too large, increase HSM_EVENT_MAX_SIZE");
+		static_assert(alignof(EventType) <= alignof(std::max_align_t), "Event is over-aligned");
+		::new (mData) EventType(event);
+	}
+
+	size_t GetEventTypeIndex() const { return mEventTypeIndex; }
+
+	template <typename EventType>
+	hsm_bool Is() const { return mEventTypeIndex == hsm::GetEventTypeIndex<EventType>(); }
+
+	// Returns the event if it is of type EventType, otherwise NULL
+	template <typename EventType>
+	const EventType* As() const { return Is<EventType>() ? reinterpret_cast<const EventType*>(mData) : 0; }
+
+private:
+	size_t mEventTypeIndex;
+	alignas(std::max_align_t) unsigned char mData[HSM_EVENT_MAX_SIZE];
+};
+
+} // namespace hsm
+
+#ifdef HSM_COMPILER_MSC
+#pragma endregion "Event"
+#endif
+
+#ifdef HSM_COMPILER_MSC
+#pragma region "TimerService"
+#endif
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// TimerService
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace hsm {
+
+struct State;
+class StateMachine;
+
+// Time in ticks of a TimerClock (e.g. milliseconds)
+typedef uint64_t TimerTime;
+
+// Source of time for a TimerService. Implement to use game time, frames, etc.
+class TimerClock
+{
+public:
+	virtual ~TimerClock() {}
+	virtual TimerTime GetTime() = 0;
+};
+
+// Real time in milliseconds, used by TimerService by default
+class SteadyTimerClock : public TimerClock
+{
+public:
+	virtual TimerTime GetTime()
+	{
+		return static_cast<TimerTime>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+};
+
+// Time that only changes when set, for deterministic tests or fixed time steps
+class ManualTimerClock : public TimerClock
+{
+public:
+	ManualTimerClock() : mTime(0) {}
+	virtual TimerTime GetTime() { return mTime; }
+	void SetTime(TimerTime time) { HSM_ASSERT(time >= mTime); mTime = time; }
+	void Advance(TimerTime ticks) { mTime += ticks; }
+
+private:
+	TimerTime mTime;
+};
+
+namespace detail
+{
+	struct TimerNode
+	{
+		TimerNode** mSlot; // Wheel slot that holds the timer
+		size_t mLevel; // Wheel level of the slot
+		TimerNode* mPrev; // Links in the wheel slot, or the free list
+		TimerNode* mNext;
+		TimerNode* mNextInState; // Links in the list of the state's timers
+		TimerNode* mPrevInState;
+		State* mState;
+		TimerTime mExpiry;
+		Transition mTransition; // Deferred on expiry, or if NoTransition, the state is woken
+	};
+}
+
+// Timers that wake states, or make them transition, after a delay (see State::StartTimer). Timers are kept in a
+// hierarchical timer wheel, so starting, cancelling and expiring a timer are constant-time, no matter how many
+// timers there are. Timers are cancelled when their state is popped.
+//
+// A TimerService is attached to state machines via StateMachine::SetTimerService or
+// StateMachineGroup::SetTimerService, and can be shared by any number of them, though it is not thread-safe:
+// state machines that share it must not be processed concurrently. Update must be called once per frame, before
+// processing the state machines (StateMachineGroup does this), to expire timers.
+class TimerService
+{
+public:
+	// Uses the input clock, or if NULL, a SteadyTimerClock (milliseconds)
+	explicit TimerService(TimerClock* clock = 0);
+	~TimerService();
+
+	// Reads the clock and expires all timers due by then, in order of expiry
+	void Update();
+
+	// Returns the time as of the last Update (or construction), which is used as the start time of timers and
+	// the entry time of states, so that it's consistent for all states within a frame
+	TimerTime GetTime() const { return mTime; }
+
+	size_t GetNumTimers() const { return mNumTimers; }
+
+	TimerClock& GetClock() { return *mClock; }
+
+private:
+	friend struct State;
+	friend class StateMachine;
+
+	TimerService(const TimerService&);
+	TimerService& operator=(const TimerService&);
+
+	// The wheel has kNumLevels levels of kNumSlots slots each. Level 0 has one slot per tick, and each slot of
+	// level N spans all the slots of level N - 1. Timers due within kNumSlots ticks go in level 0, and the
+	// others in the level of their delay; as time advances, the slots of upper levels are cascaded down.
+	static const size_t kSlotBits = 8;
+	static const size_t kNumSlots = 1 << kSlotBits;
+	static const size_t kNumLevels = 4;
+	static const TimerTime kMaxDelay = (TimerTime(1) << (kSlotBits * kNumLevels)) - 1;
+
+	void StartTimer(State* state, TimerTime delay, const Transition& transition);
+	void CancelTimers(State* state);
+	// Defers the timer's transition, or if the state machine's deferred queue is full, re-inserts the timer to
+	// expire again at the input time
+	void ExpireTimer(detail::TimerNode* node, TimerTime retryTime);
+
+	// Moves the state's timers to the input TimerService, keeping the time left until they expire
+	void MoveTimers(State* state, TimerService& timerService);
+
+	void Insert(detail::TimerNode* node);
+	void Unlink(detail::TimerNode* node);
+	void Cascade(size_t level);
+	void Advance(TimerTime time);
+
+	detail::TimerNode* AllocateNode();
+	void FreeNode(detail::TimerNode* node);
+
+	TimerClock* mClock;
+	SteadyTimerClock mDefaultClock;
+	TimerTime mTime; // Current tick of the wheel
+	size_t mNumTimers;
+	size_t mNumTimersPerLevel[kNumLevels]; // Used to skip ticks while the lower levels are empty
+	detail::TimerNode* mSlots[kNumLevels][kNumSlots];
+	detail::TimerNode* mFreeNodes;
+};
+
+inline TimerService::TimerService(TimerClock* clock)
+	: mClock(clock ? clock : &mDefaultClock)
+	, mNumTimers(0)
+	, mFreeNodes(0)
+{
+	mTime = mClock->GetTime();
+	memset(mNumTimersPerLevel, 0, sizeof(mNumTimersPerLevel));
+	memset(mSlots, 0, sizeof(mSlots));
+}
+
+inline TimerService::~TimerService()
+{
+	HSM_ASSERT_MSG(mNumTimers == 0, "TimerService destroyed while some states still have timers");
+	while (mFreeNodes)
+	{
+		detail::TimerNode* node = mFreeNodes;
+		mFreeNodes = node->mNext;
+		HSM_DELETE node;
+	}
+}
+
+inline void TimerService::Update()
+{
+	const TimerTime time = mClock->GetTime();
+	HSM_ASSERT_MSG(time >= mTime, "TimerClock must not go back in time");
+	if (time > mTime)
+	{
+		Advance(time);
+	}
+}
+
+inline void TimerService::Insert(detail::TimerNode* node)
+{
+	// Timers already due (when cascading) go in the current slot of level 0, which is about to be expired
+	TimerTime delay = node->mExpiry > mTime ? node->mExpiry - mTime : 0;
+	if (delay > kMaxDelay)
+	{
+		// Goes in the furthest slot, and is re-inserted when cascaded
+		delay = kMaxDelay;
+	}
+
+	size_t level = 0;
+	while (level + 1 < kNumLevels && delay >= (TimerTime(1) << (kSlotBits * (level + 1))))
+	{
+		++level;
+	}
+
+	const size_t slot = static_cast<size_t>(((mTime + delay) >> (kSlotBits * level)) & (kNumSlots - 1));
+	detail::TimerNode*& head = mSlots[level][slot];
+	node->mSlot = &head;
+	node->mLevel = level;
+	++mNumTimersPerLevel[level];
+	node->mPrev = 0;
+	node->mNext = head;
+	if (head)
+		head->mPrev = node;
+	head = node;
+}
+
+inline void TimerService::Unlink(detail::TimerNode* node)
+{
+	--mNumTimersPerLevel[node->mLevel];
+
+	if (node->mPrev)
+		node->mPrev->mNext = node->mNext;
+	else
+		*node->mSlot = node->mNext;
+
+	if (node->mNext)
+		node->mNext->mPrev = node->mPrev;
+}
+
+inline void TimerService::Cascade(size_t level)
+{
+	// Re-insert the timers of the current slot of this level, which now fall in lower levels
+	detail::TimerNode*& head = mSlots[level][static_cast<size_t>((mTime >> (kSlotBits * level)) & (kNumSlots - 1))];
+	detail::TimerNode* node = head;
+	head = 0;
+	while (node)
+	{
+		detail::TimerNode* next = node->mNext;
+		--mNumTimersPerLevel[level];
+		Insert(node);
+		node = next;
+	}
+}
+
+inline void TimerService::Advance(TimerTime time)
+{
+	while (mTime < time)
+	{
+		if (mNumTimers == 0)
+		{
+			mTime = time;
+			return;
+		}
+
+		// If the lowest levels are empty, nothing happens until the next slot of the lowest non-empty level is
+		// cascaded, so skip to the tick before it
+		size_t lowestLevel = 0;
+		while (mNumTimersPerLevel[lowestLevel] == 0)
+		{
+			++lowestLevel;
+		}
+		if (lowestLevel > 0)
+		{
+			const TimerTime levelMask = (TimerTime(1) << (kSlotBits * lowestLevel)) - 1;
+			const TimerTime nextCascadeTime = (mTime | levelMask) + 1;
+			if (nextCascadeTime > time)
+			{
+				mTime = time;
+				return;
+			}
+			mTime = nextCascadeTime - 1;
+		}
+
+		++mTime;
+
+		// When a level wraps around, cascade the next slot of the level above, starting with the highest level
+		// that wraps so that its timers cascade all the way down
+		size_t numLevelsToCascade = 0;
+		while (numLevelsToCascade + 1 < kNumLevels && ((mTime >> (kSlotBits * numLevelsToCascade)) & (kNumSlots - 1)) == 0)
+		{
+			++numLevelsToCascade;
+		}
+		for (size_t level = numLevelsToCascade; level > 0; --level)
+		{
+			Cascade(level);
+		}
+
+		// Expire the timers of the current slot; note that expiring a timer may start or cancel others. Timers
+		// that can't defer their transition are retried on the first tick after this Update, once the state
+		// machines have been processed.
+		detail::TimerNode*& head = mSlots[0][static_cast<size_t>(mTime & (kNumSlots - 1))];
+		while (head)
+		{
+			ExpireTimer(head, time + 1);
+		}
+	}
+}
+
+inline detail::TimerNode* TimerService::AllocateNode()
+{
+	detail::TimerNode* node = mFreeNodes;
+	if (node)
+	{
+		mFreeNodes = node->mNext;
+	}
+	else
+	{
+		node = HSM_NEW detail::TimerNode();
+	}
+	return node;
+}
+
+inline void TimerService::FreeNode(detail::TimerNode* node)
+{
+	node->mTransition = NoTransition(); // Release state args
+	node->mState = 0;
+	node->mNext = mFreeNodes;
+	mFreeNodes = node;
+}
+
+} // namespace hsm
+
+#ifdef HSM_COMPILER_MSC
+#pragma endregion "TimerService"
+#endif
+
+#if HSM_USE_SNAPSHOTS
+
+#ifdef HSM_COMPILER_MSC
+#pragma region "Snapshot"
+#endif
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Snapshot
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace hsm {
+
+// Appends binary data to a buffer, in native byte order. Passed to StateMachine::SaveSnapshot, and to
+// State::SaveState to save the state's own data. Any number of snapshots, along with other data, may be
+// written to the same buffer.
+class SnapshotWriter
+{
+public:
+	explicit SnapshotWriter(HSM_STD_VECTOR<unsigned char>& buffer) : mBuffer(buffer) {}
+
+	void WriteBytes(const void* data, size_t size)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		mBuffer.insert(mBuffer.end(), bytes, bytes + size);
+	}
+
+	template <typename T>
+	void Write(const T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable values can be written as is");
+		WriteBytes(&value, sizeof(T));
+	}
+
+	// Overwrites a value written earlier, at the input offset from the start of the buffer
+	template <typename T>
+	void WriteAt(size_t offset, const T& value)
+	{
+		HSM_ASSERT(offset + sizeof(T) <= mBuffer.size());
+		memcpy(&mBuffer[offset], &value, sizeof(T));
+	}
+
+	size_t GetSize() const { return mBuffer.size(); }
+
+private:
+	HSM_STD_VECTOR<unsigned char>& mBuffer;
+};
+
+// Reads binary data written by a SnapshotWriter. Reading past the end fails and sets the error flag, which
+// State::LoadState may also set to report invalid data, after which all reads fail.
+class SnapshotReader
+{
+public:
+	SnapshotReader(const void* data, size_t size)
+		: mData(static_cast<const unsigned char*>(data))
+		, mSize(size)
+		, mOffset(0)
+		, mError(hsm_false)
+	{
+	}
+
+	hsm_bool ReadBytes(void* data, size_t size)
+	{
+		const void* bytes = Skip(size);
+		if (bytes)
+		{
+			memcpy(data, bytes, size);
+		}
+		return bytes != 0;
+	}
+
+	template <typename T>
+	hsm_bool Read(T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable values can be read as is");
+		return ReadBytes(&value, sizeof(T));
+	}
+
+	// Returns the next size bytes and skips past them, or NULL if there aren't as many left
+	const void* Skip(size_t size)
+	{
+		if (mError || size > mSize - mOffset)
+		{
+			mError = hsm_true;
+			return 0;
+		}
+
+		const void* bytes = mData + mOffset;
+		mOffset += size;
+		return bytes;
+	}
+
+	size_t GetNumBytesLeft() const { return mSize - mOffset; }
+
+	void SetError() { mError = hsm_true; }
+	hsm_bool HasError() const { return mError; }
+
+private:
+	const unsigned char* mData;
+	size_t mSize;
+	size_t mOffset;
+	hsm_bool mError;
+};
+
+} // namespace hsm
+
+#ifdef HSM_COMPILER_MSC
+#pragma endregion "Snapshot"
+#endif
+
+#endif // HSM_USE_SNAPSHOTS
+
+#if HSM_USE_PROFILER
+
+#ifdef HSM_COMPILER_MSC
+#pragma region "Profiler"
+#endif
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Profiler
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm> // for std::sort, std::stable_sort
+#include <mutex>
+#include <thread> // for std::this_thread::get_id
+
+namespace hsm {
+
+// State functions timed by a Profiler
+namespace ProfileCall
+{
+	enum Type
+	{
+		GetTransition = 0,
+		Update,
+		OnEnter,
+		OnExit,
+		NumTypes
+	};
+}
+
+inline const hsm_char* GetProfileCallName(ProfileCall::Type profileCall)
+{
+	static const hsm_char* const names[ProfileCall::NumTypes] =
+	{
+		HSM_TEXT("GetTransition"), HSM_TEXT("Update"), HSM_TEXT("OnEnter"), HSM_TEXT("OnExit")
+	};
+	return names[profileCall];
+}
+
+// Time in nanoseconds
+typedef uint64_t ProfileTime;
+
+// Calls made to a state function, summed over calls
+struct ProfileStats
+{
+	ProfileStats() { Reset(); }
+
+	void Reset()
+	{
+		mNumCalls = 0;
+		mTotalTime = 0;
+		mMinTime = ~static_cast<ProfileTime>(0);
+		mMaxTime = 0;
+		mNumAllocations = 0;
+	}
+
+	void Add(ProfileTime time, uint64_t numAllocations)
+	{
+		++mNumCalls;
+		mTotalTime += time;
+		mMinTime = time < mMinTime ? time : mMinTime;
+		mMaxTime = time > mMaxTime ? time : mMaxTime;
+		mNumAllocations += numAllocations;
+	}
+
+	void Merge(const ProfileStats& stats)
+	{
+		mNumCalls += stats.mNumCalls;
+		mTotalTime += stats.mTotalTime;
+		mMinTime = stats.mMinTime < mMinTime ? stats.mMinTime : mMinTime;
+		mMaxTime = stats.mMaxTime > mMaxTime ? stats.mMaxTime : mMaxTime;
+		mNumAllocations += stats.mNumAllocations;
+	}
+
+	ProfileTime GetAverageTime() const { return mNumCalls ? mTotalTime / mNumCalls : 0; }
+
+	uint64_t mNumCalls;
+	ProfileTime mTotalTime;
+	ProfileTime mMinTime; // Max value if there were no calls
+	ProfileTime mMaxTime;
+	uint64_t mNumAllocations; // Counted by Profiler::CountAllocation during the calls
+};
+
+// Distribution of the times of calls made to a state function. Times are counted in buckets a quarter of a power
+// of two wide, so percentiles are within 25% of the exact time.
+class ProfileHistogram
+{
+public:
+	ProfileHistogram() { Reset(); }
+
+	void Reset() { memset(mCounts, 0, sizeof(mCounts)); }
+
+	void Add(ProfileTime time) { ++mCounts[GetBucket(time)]; }
+
+	void Merge(const ProfileHistogram& histogram)
+	{
+		for (size_t i = 0; i < kNumBuckets; ++i)
+		{
+			mCounts[i] += histogram.mCounts[i];
+		}
+	}
+
+	// Returns the upper bound of the bucket that holds the input percentile (in [0, 100]) of call times, or 0 if
+	// no calls were made
+	ProfileTime GetPercentileTime(double percentile) const
+	{
+		uint64_t numCalls = 0;
+		for (size_t i = 0; i < kNumBuckets; ++i)
+		{
+			numCalls += mCounts[i];
+		}
+		if (numCalls == 0)
+			return 0;
+
+		uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(numCalls) + 0.5);
+		rank = rank < 1 ? 1 : (rank > numCalls ? numCalls : rank);
+
+		uint64_t count = 0;
+		for (size_t i = 0; i < kNumBuckets; ++i)
+		{
+			count += mCounts[i];
+			if (count >= rank)
+				return GetBucketMaxTime(i);
+		}
+		return GetBucketMaxTime(kNumBuckets - 1);
+	}
+
+private:
+	static const size_t kNumSubBuckets = 4; // Per power of two
+	static const size_t kNumBuckets = 64 * kNumSubBuckets;
+
+	static size_t GetBucket(ProfileTime time)
+	{
+		if (time < kNumSubBuckets)
+			return static_cast<size_t>(time);
+
+		// Index of the most significant bit, then the next two bits
+#if defined(HSM_COMPILER_CLANG_OR_GCC)
+		const size_t msb = 63 - static_cast<size_t>(__builtin_clzll(time));
+#else
+		size_t msb = 0;
+		for (ProfileTime t = time >> 1; t != 0; t >>= 1)
+		{
+			++msb;
+		}
+#endif
+		const size_t subBucket = static_cast<size_t>(time >> (msb - 2)) & (kNumSubBuckets - 1);
+		return (msb - 1) * kNumSubBuckets + subBucket;
+	}
+
+	static ProfileTime GetBucketMaxTime(size_t bucket)
+	{
+		if (bucket < kNumSubBuckets)
+			return bucket;
+
+		const size_t msb = bucket / kNumSubBuckets + 1;
+		const ProfileTime subBucket = bucket % kNumSubBuckets;
+		const ProfileTime minTime = (kNumSubBuckets + subBucket) << (msb - 2);
+		return minTime + ((static_cast<ProfileTime>(1) << (msb - 2)) - 1);
+	}
+
+	uint32_t mCounts[kNumBuckets];
+};
+
+// Calls made to the functions of a state type, summed over all state machines
+struct StateTypeProfile
+{
+	// Total time of all functions
+	ProfileTime GetTotalTime() const
+	{
+		ProfileTime totalTime = 0;
+		for (size_t i = 0; i < ProfileCall::NumTypes; ++i)
+		{
+			totalTime += mStats[i].mTotalTime;
+		}
+		return totalTime;
+	}
+
+	// Returns the input percentile (in [0, 100]) of the times of calls made to the input function, clamped to
+	// the exact min and max times
+	ProfileTime GetPercentileTime(ProfileCall::Type profileCall, double percentile) const
+	{
+		const ProfileStats& stats = mStats[profileCall];
+		if (stats.mNumCalls == 0)
+			return 0;
+
+		const ProfileTime time = mHistograms[profileCall].GetPercentileTime(percentile);
+		return time < stats.mMinTime ? stats.mMinTime : (time > stats.mMaxTime ? stats.mMaxTime : time);
+	}
+
+	StateTypeId mStateTypeId; // Invalid if no calls were made
+	ProfileStats mStats[ProfileCall::NumTypes];
+	ProfileHistogram mHistograms[ProfileCall::NumTypes];
+};
+
+namespace detail
+{
+	class ProfileScope;
+
+	inline ProfileTime GetProfileTime()
+	{
+		return static_cast<ProfileTime>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// Number of calls to Profiler::CountAllocation made by the calling thread
+	inline uint64_t& GetThreadAllocationCount()
+	{
+		static thread_local uint64_t count = 0;
+		return count;
+	}
+
+	inline std::atomic<size_t>& GetProfilerCounter()
+	{
+		static std::atomic<size_t> counter(0);
+		return counter;
+	}
+
+	// Tables of an object shared by state machines processed on different threads (see Profiler and
+	// TransitionGraph). Each thread records into its own table, so recording doesn't take a lock; the tables are
+	// merged by visiting them all, which must not be done while the state machines are being processed.
+	template <typename Table>
+	class ThreadTables
+	{
+	public:
+		ThreadTables() : mId(++GetProfilerCounter()) {}
+
+		// Returns the calling thread's table, creating it on first use
+		Table& GetThreadTable();
+
+		template <typename Visitor>
+		void VisitTables(Visitor visitor) const
+		{
+			std::lock_guard<std::mutex> lock(mTablesMutex);
+			for (size_t i = 0; i < mTables.size(); ++i)
+			{
+				visitor(static_cast<const Table&>(*mTables[i].mTable));
+			}
+		}
+
+		template <typename Visitor>
+		void VisitTables(Visitor visitor)
+		{
+			std::lock_guard<std::mutex> lock(mTablesMutex);
+			for (size_t i = 0; i < mTables.size(); ++i)
+			{
+				visitor(*mTables[i].mTable);
+			}
+		}
+
+	private:
+		ThreadTables(const ThreadTables&);
+		ThreadTables& operator=(const ThreadTables&);
+
+		struct ThreadTable
+		{
+			std::thread::id mThreadId;
+			std::unique_ptr<Table> mTable;
+		};
+
+		const size_t mId; // Identifies this object in the threads' table caches
+		mutable std::mutex mTablesMutex; // Guards mTables, which only changes when a thread records for the first time
+		HSM_STD_VECTOR<ThreadTable> mTables;
+	};
+
+	template <typename Table>
+	Table& ThreadTables<Table>::GetThreadTable()
+	{
+		// Each thread caches the last table it recorded into, identified by the id of its object, which is never
+		// reused, so a destroyed object's table is never returned. Otherwise, the table is looked up by thread in
+		// the object; a thread that exits leaves its table to the next thread that gets the same id.
+		static thread_local size_t cachedId = 0;
+		static thread_local Table* cachedTable = 0;
+		if (cachedId == mId)
+			return *cachedTable;
+
+		const std::thread::id threadId = std::this_thread::get_id();
+		std::lock_guard<std::mutex> lock(mTablesMutex);
+		Table* table = 0;
+		for (size_t i = 0; i < mTables.size() && !table; ++i)
+		{
+			if (mTables[i].mThreadId == threadId)
+				table = mTables[i].mTable.get();
+		}
+		if (!table)
+		{
+			ThreadTable threadTable = { threadId, std::unique_ptr<Table>(HSM_NEW Table()) };
+			mTables.push_back(std::move(threadTable));
+			table = mTables.back().mTable.get();
+		}
+
+		cachedId = mId;
+		cachedTable = table;
+		return *table;
+	}
+}
+
+// Times the GetTransition, Update, OnEnter and OnExit calls made to the states of the state machines it's set on
+// (see StateMachine::SetProfiler), per state type, to find the states responsible for expensive frames. Each
+// StateMachine also keeps its own totals (see StateMachine::GetProfileStats). Times include anything the state
+// function does, such as processing other state machines.
+//
+// Allocations are only counted if the application calls CountAllocation from its allocator (e.g. from a global
+// operator new), in which case they're attributed to the state function being called on that thread, if any.
+//
+// A Profiler may be shared by state machines processed on different threads, as each thread records calls into
+// its own table; these are merged by GetReport. GetReport and Reset must not be called while the state
+// machines are being processed.
+class Profiler
+{
+public:
+	Profiler() {}
+
+	// Counts an allocation made by the calling thread
+	static void CountAllocation() { ++detail::GetThreadAllocationCount(); }
+
+	// Fills report with the profiles of the state types that were called, most expensive first, by total time
+	// of all functions, or of the input function
+	void GetReport(HSM_STD_VECTOR<StateTypeProfile>& report) const { GetReport(report, ProfileCall::NumTypes); }
+	void GetReport(HSM_STD_VECTOR<StateTypeProfile>& report, ProfileCall::Type sortBy) const;
+
+	// Prints the report, up to maxStateTypes state types, one line per state function called
+	void PrintReport(size_t maxStateTypes = ~static_cast<size_t>(0)) const;
+
+	void Reset();
+
+private:
+	friend class detail::ProfileScope;
+
+	Profiler(const Profiler&);
+	Profiler& operator=(const Profiler&);
+
+	typedef HSM_STD_VECTOR<StateTypeProfile> ProfileTable; // Indexed by StateTypeId::mIndex
+
+	void Record(const StateTypeId& stateTypeId, ProfileCall::Type profileCall, ProfileTime time, uint64_t numAllocations);
+
+	detail::ThreadTables<ProfileTable> mTables;
+};
+
+inline void Profiler::Record(const StateTypeId& stateTypeId, ProfileCall::Type profileCall, ProfileTime time, uint64_t numAllocations)
+{
+	ProfileTable& table = mTables.GetThreadTable();
+	if (stateTypeId.mIndex >= table.size())
+	{
+		const size_t numStateTypes = GetNumStateTypes();
+		table.resize(numStateTypes > stateTypeId.mIndex ? numStateTypes : stateTypeId.mIndex + 1);
+	}
+
+	StateTypeProfile& profile = table[stateTypeId.mIndex];
+	profile.mStateTypeId = stateTypeId;
+	profile.mStats[profileCall].Add(time, numAllocations);
+	profile.mHistograms[profileCall].Add(time);
+}
+
+inline void Profiler::GetReport(HSM_STD_VECTOR<StateTypeProfile>& report, ProfileCall::Type sortBy) const
+{
+	report.clear();
+
+	mTables.VisitTables([&report](const ProfileTable& table)
+	{
+		if (table.size() > report.size())
+		{
+			report.resize(table.size());
+		}
+
+		for (size_t index = 0; index < table.size(); ++index)
+		{
+			const StateTypeProfile& profile = table[index];
+			if (!profile.mStateTypeId.IsValid())
+				continue;
+
+			StateTypeProfile& reportProfile = report[index];
+			reportProfile.mStateTypeId = profile.mStateTypeId;
+			for (size_t call = 0; call < ProfileCall::NumTypes; ++call)
+			{
+				reportProfile.mStats[call].Merge(profile.mStats[call]);
+				reportProfile.mHistograms[call].Merge(profile.mHistograms[call]);
+			}
+		}
+	});
+
+	// Remove the state types that weren't called
+	size_t numProfiles = 0;
+	for (size_t index = 0; index < report.size(); ++index)
+	{
+		if (report[index].mStateTypeId.IsValid())
+		{
+			if (numProfiles != index)
+			{
+				report[numProfiles] = report[index];
+			}
+			++numProfiles;
+		}
+	}
+	report.resize(numProfiles);
+
+	std::sort(report.begin(), report.end(), [sortBy](const StateTypeProfile& lhs, const StateTypeProfile& rhs)
+	{
+		if (sortBy == ProfileCall::NumTypes)
+			return lhs.GetTotalTime() > rhs.GetTotalTime();
+		return lhs.mStats[sortBy].mTotalTime > rhs.mStats[sortBy].mTotalTime;
+	});
+}
+
+inline void Profiler::PrintReport(size_t maxStateTypes) const
+{
+	HSM_STD_VECTOR<StateTypeProfile> report;
+	GetReport(report);
+
+	HSM_PRINTF(HSM_TEXT("%-40s %-13s %10s %12s %10s %10s %10s %10s %10s\n"), HSM_TEXT("State"), HSM_TEXT("Function"), HSM_TEXT("Calls"),
+		HSM_TEXT("Total(us)"), HSM_TEXT("Avg(us)"), HSM_TEXT("P50(us)"), HSM_TEXT("P99(us)"), HSM_TEXT("Max(us)"), HSM_TEXT("Allocs"));
+
+	for (size_t i = 0; i < report.size() && i < maxStateTypes; ++i)
+	{
+		const StateTypeProfile& profile = report[i];
+		for (size_t call = 0; call < ProfileCall::NumTypes; ++call)
+		{
+			const ProfileCall::Type profileCall = static_cast<ProfileCall::Type>(call);
+			const ProfileStats& stats = profile.mStats[call];
+			if (stats.mNumCalls == 0)
+				continue;
+
+			HSM_PRINTF(HSM_TEXT("%-40s %-13s %10llu %12.1f %10.2f %10.2f %10.2f %10.2f %10llu\n"), profile.mStateTypeId.mStateName,
+				GetProfileCallName(profileCall), static_cast<unsigned long long>(stats.mNumCalls),
+				stats.mTotalTime / 1000.0, stats.GetAverageTime() / 1000.0,
+				profile.GetPercentileTime(profileCall, 50.0) / 1000.0, profile.GetPercentileTime(profileCall, 99.0) / 1000.0,
+				stats.mMaxTime / 1000.0, static_cast<unsigned long long>(stats.mNumAllocations));
+		}
+	}
+}
+
+inline void Profiler::Reset()
+{
+	mTables.VisitTables([](ProfileTable& table) { table.clear(); });
+}
+
+// A transition taken by the state machines a TransitionGraph is set on
+struct TransitionEdge
+{
+	TransitionEdge() : mTransitionType(Transition::No), mNumTaken(0), mNumExits(0), mTotalDwellTime(0) {}
+
+	// Average time the target state stayed on the stack when entered through this edge
+	ProfileTime GetAverageDwellTime() const { return mNumExits ? mTotalDwellTime / mNumExits : 0; }
+
+	StateTypeId mSourceStateTypeId; // State that returned the transition, invalid for the initial state
+	StateTypeId mTargetStateTypeId;
+	Transition::Type mTransitionType;
+	uint64_t mNumTaken;
+	uint64_t mNumExits; // Number of times the target state was popped after being entered through this edge
+	ProfileTime mTotalDwellTime; // Time the target state stayed on the stack, summed over mNumExits
+};
+
+// Counts the transitions taken by the state machines it's set on (see StateMachine::SetTransitionGraph), per
+// source state type, target state type and transition type, along with how long the target states stay on the
+// stack. A TransitionGraph is typically shared by all the state machines of the same kind, then written with
+// WriteFile so that tools/hsmToDot.py can overlay it on the static graph as a heatmap (see --heatmap), to find
+// the hot edges and long-lived states worth optimizing or flattening first.
+//
+// Like a Profiler, a TransitionGraph may be shared by state machines processed on different threads; GetEdges,
+// WriteFile and Reset must not be called while the state machines are being processed.
+class TransitionGraph
+{
+public:
+	TransitionGraph() {}
+
+	// Fills edges with the edges that were taken, most taken first
+	void GetEdges(HSM_STD_VECTOR<TransitionEdge>& edges) const;
+
+	// Writes the edges to a text file, one per line, with tab-separated fields: source state name ("-" for the
+	// initial state), target state name, transition type, times taken, times exited, and total dwell time in
+	// nanoseconds. Returns false if the file couldn't be opened.
+	hsm_bool WriteFile(const char* path) const;
+
+	void Reset();
+
+private:
+	friend class StateMachine;
+
+	TransitionGraph(const TransitionGraph&);
+	TransitionGraph& operator=(const TransitionGraph&);
+
+	struct EdgeKey
+	{
+		hsm_bool operator<(const EdgeKey& rhs) const
+		{
+			if (mSourceIndex != rhs.mSourceIndex)
+				return mSourceIndex < rhs.mSourceIndex;
+			if (mTargetIndex != rhs.mTargetIndex)
+				return mTargetIndex < rhs.mTargetIndex;
+			return mTransitionType < rhs.mTransitionType;
+		}
+
+		size_t mSourceIndex;
+		size_t mTargetIndex;
+		Transition::Type mTransitionType;
+	};
+
+	typedef HSM_STD_MAP<EdgeKey, TransitionEdge> EdgeTable;
+
+	// Returns the calling thread's edge, creating it on first use
+	TransitionEdge& GetEdge(const StateTypeId& sourceStateTypeId, const StateTypeId& targetStateTypeId, Transition::Type transitionType);
+
+	void RecordTransition(const StateTypeId& sourceStateTypeId, const StateTypeId& targetStateTypeId, Transition::Type transitionType)
+	{
+		++GetEdge(sourceStateTypeId, targetStateTypeId, transitionType).mNumTaken;
+	}
+
+	void RecordExit(const StateTypeId& sourceStateTypeId, const StateTypeId& targetStateTypeId, Transition::Type transitionType, ProfileTime dwellTime)
+	{
+		TransitionEdge& edge = GetEdge(sourceStateTypeId, targetStateTypeId, transitionType);
+		++edge.mNumExits;
+		edge.mTotalDwellTime += dwellTime;
+	}
+
+	detail::ThreadTables<EdgeTable> mTables;
+};
+
+inline TransitionEdge& TransitionGraph::GetEdge(const StateTypeId& sourceStateTypeId, const StateTypeId& targetStateTypeId, Transition::Type transitionType)
+{
+	const EdgeKey key = { sourceStateTypeId.mIndex, targetStateTypeId.mIndex, transitionType };
+	EdgeTable& table = mTables.GetThreadTable();
+	EdgeTable::iterator iter = table.find(key);
+	if (iter == table.end())
+	{
+		TransitionEdge edge;
+		edge.mSourceStateTypeId = sourceStateTypeId;
+		edge.mTargetStateTypeId = targetStateTypeId;
+		edge.mTransitionType = transitionType;
+		iter = table.insert(EdgeTable::value_type(key, edge)).first;
+	}
+	return iter->second;
+}
+
+inline void TransitionGraph::GetEdges(HSM_STD_VECTOR<TransitionEdge>& edges) const
+{
+	EdgeTable mergedTable;
+	mTables.VisitTables([&mergedTable](const EdgeTable& table)
+	{
+		for (EdgeTable::const_iterator iter = table.begin(); iter != table.end(); ++iter)
+		{
+			std::pair<EdgeTable::iterator, hsm_bool> result = mergedTable.insert(*iter);
+			if (!result.second)
+			{
+				TransitionEdge& edge = result.first->second;
+				edge.mNumTaken += iter->second.mNumTaken;
+				edge.mNumExits += iter->second.mNumExits;
+				edge.mTotalDwellTime += iter->second.mTotalDwellTime;
+			}
+		}
+	});
+
+	edges.clear();
+	edges.reserve(mergedTable.size());
+	for (EdgeTable::const_iterator iter = mergedTable.begin(); iter != mergedTable.end(); ++iter)
+	{
+		edges.push_back(iter->second);
+	}
+
+	std::stable_sort(edges.begin(), edges.end(), [](const TransitionEdge& lhs, const TransitionEdge& rhs)
+	{
+		return lhs.mNumTaken > rhs.mNumTaken;
+	});
+}
+
+inline hsm_bool TransitionGraph::WriteFile(const char* path) const
+{
+	FILE* file = fopen(path, "w");
+	if (!file)
+		return hsm_false;
+
+	// State names are identifiers, so narrowing them is safe if hsm_char is wide
+	auto writeStateName = [file](const StateTypeId& stateTypeId)
+	{
+		if (!stateTypeId.IsValid())
+		{
+			fputc('-', file);
+			return;
+		}
+		for (const hsm_char* c = stateTypeId.mStateName; *c; ++c)
+		{
+			fputc(static_cast<char>(*c), file);
+		}
+	};
+
+	static const char* const transitionTypeNames[] = { "Sibling", "Inner", "InnerEntry", "No" };
+
+	HSM_STD_VECTOR<TransitionEdge> edges;
+	GetEdges(edges);
+
+	fputs("# source\ttarget\ttype\ttaken\texits\tdwell_ns\n", file);
+	for (size_t i = 0; i < edges.size(); ++i)
+	{
+		const TransitionEdge& edge = edges[i];
+		writeStateName(edge.mSourceStateTypeId);
+		fputc('\t', file);
+		writeStateName(edge.mTargetStateTypeId);
+		fprintf(file, "\t%s\t%llu\t%llu\t%llu\n", transitionTypeNames[edge.mTransitionType], static_cast<unsigned long long>(edge.mNumTaken),
+			static_cast<unsigned long long>(edge.mNumExits), static_cast<unsigned long long>(edge.mTotalDwellTime));
+	}
+
+	const hsm_bool ok = ferror(file) == 0;
+	return fclose(file) == 0 && ok;
+}
+
+inline void TransitionGraph::Reset()
+{
+	mTables.VisitTables([](EdgeTable& table) { table.clear(); });
+}
+
+} // namespace hsm
+
+#ifdef HSM_COMPILER_MSC
+#pragma endregion "Profiler"
+#endif
+
+#endif // HSM_USE_PROFILER
+
+#ifdef HSM_COMPILER_MSC
+#pragma region "State"
+#endif
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// State
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace hsm {
+
+class StateMachine;
+class StateMachineGroup;
+
+// StateValue
+
+template <typename T>
+struct ConcreteStateValueResetter;
+
+template <typename T>
+struct StateValue
+{
+	// Constructor - allows client to initialize StateValue; afterward,
+	// can only assign via State::SetStateValue().
+	// Note that T must be default constructable.
+	explicit StateValue(const T& initValue = T()) { mValue = initValue; }
+
+	// Sometimes value cannot be set only from constructor, so we provide this setter;
+	// however it should only be used to initialize the value before states manipulate it.
+	void SetInitialValue(const T& initValue) { mValue = initValue; }
+
+	// Implicit conversion operator to const T& (but not T&)
+	operator const T&() const { return mValue; }
+
+	// Explicitly returns value
+	const T& Value() const { return mValue; }
+
+private:
+	// Disable copy
+	StateValue(const StateValue& rhs);
+	StateValue& operator=(StateValue& rhs);
+
+	friend struct ConcreteStateValueResetter<T>;
+	friend struct State;
+	T mValue;
+};
+
+struct StateValueResetter
+{
+	explicit StateValueResetter(void* value) : mValue(value) {}
+	virtual ~StateValueResetter() {}
+
+#if HSM_USE_SNAPSHOTS
+	// Used to save StateValue bindings in snapshots, which only supports trivially copyable values
+	virtual const void* GetOrigValue() const = 0;
+	virtual size_t GetValueSize() const = 0;
+	virtual hsm_bool IsTriviallyCopyable() const = 0;
+#endif
+
+	void* mValue; // Address of the StateValue's value
+};
+
+template <typename T>
+struct ConcreteStateValueResetter : StateValueResetter
+{
+	ConcreteStateValueResetter(StateValue<T>& stateValue)
+		: StateValueResetter(&stateValue.mValue)
+	{
+		mStateValue = &stateValue;
+		mOrigValue = stateValue.mValue;
+	}
+
+	virtual ~ConcreteStateValueResetter()
+	{
+		mStateValue->mValue = mOrigValue;
+	}
+
+#if HSM_USE_SNAPSHOTS
+	virtual const void* GetOrigValue() const { return &mOrigValue; }
+	virtual size_t GetValueSize() const { return sizeof(T); }
+	virtual hsm_bool IsTriviallyCopyable() const { return std::is_trivially_copyable<T>::value; }
+#endif
+
+	StateValue<T>* mStateValue;
+	T mOrigValue;
+};
+
+#if HSM_USE_SNAPSHOTS
+// Resets a StateValue bound by a state that was restored from a snapshot, where the value's type is unknown
+struct RestoredStateValueResetter : StateValueResetter
+{
+	RestoredStateValueResetter(void* value, const void* origValue, size_t valueSize)
+		: StateValueResetter(value)
+		, mOrigValue(static_cast<const unsigned char*>(origValue), static_cast<const unsigned char*>(origValue) + valueSize)
+	{
+	}
+
+	virtual ~RestoredStateValueResetter()
+	{
+		memcpy(mValue, mOrigValue.data(), mOrigValue.size());
+	}
+
+	virtual const void* GetOrigValue() const { return mOrigValue.data(); }
+	virtual size_t GetValueSize() const { return mOrigValue.size(); }
+	virtual hsm_bool IsTriviallyCopyable() const { return hsm_true; }
+
+	HSM_STD_VECTOR<unsigned char> mOrigValue;
+};
+#endif
+
+
+// State
+
+namespace detail
+{
+	void InitState(State* state, StateMachine* ownerStateMachine, size_t stackDepth, const StateFactory& stateFactory);
+	void InitStaticState(State* state, size_t stackDepth, const StateFactory& stateFactory);
+	State* CreateState(const StateFactory& stateFactory, StateMachine* ownerStateMachine, size_t stackDepth);
+	State* CreateState(const Transition& transition, StateMachine* ownerStateMachine, size_t stackDepth);
+	void DestroyState(State* state);
+	class TraceCallScope;
+#if HSM_USE_USDT_PROBES
+	class UpdateProbeScope;
+#endif
+}
+
+struct State
+{
+	State()
+		: mOwnerStateMachine(0)
+		, mStackDepth(0)
+		, mStateValueResetters(0)
+		, mStateFactory(0)
+		, mWakeFrame(0)
+		, mTimers(0)
+		, mEntryTime(0)
+#if HSM_USE_PROFILER
+		, mEntryTransitionType(Transition::No)
+		, mEntryProfileTime(0)
+#endif
+		, mStateDebugName(0)
+	{
+	}
+
+	virtual ~State()
+	{
+		ResetStateValues();
+	}
+
+	// RTTI interface
+	StateTypeId GetStateType() const { return mStateTypeId; }
+	const hsm_char* GetStateDebugName() const { return mStateDebugName; }
+
+	// Accessors
+	StateMachine& GetStateMachine() { HSM_ASSERT(mOwnerStateMachine != 0); return *mOwnerStateMachine; }
+	const StateMachine& GetStateMachine() const { HSM_ASSERT(mOwnerStateMachine != 0); return *mOwnerStateMachine; }
+	
+	Owner*& GetOwner() { return mOwner; }
+	Owner*const& GetOwner() const { return mOwner; }
+
+	// Searches for state on stack from outermost to innermost, returns NULL if not found
+	template <typename StateType>
+	StateType* GetState();
+
+	template <typename StateType>
+	const StateType* GetState() const;
+
+	// Searches for state on stack starting from immediate outer to outermost, returns NULL if not found
+	template <typename StateType>
+	StateType* GetOuterState();
+
+	template <typename StateType>
+	const StateType* GetOuterState() const;
+
+	// Searches for state on stack starting from immediate inner to innermost, returns NULL if not found
+	template <typename StateType>
+	StateType* GetInnerState();
+
+	template <typename StateType>
+	const StateType* GetInnerState() const;
+
+	// Returns state on the stack immediately below us (our inner) if one exists
+	State* GetImmediateInnerState();
+	const State* GetImmediateInnerState() const;
+
+	// Returns state on the stack immediately below us (our inner) if one exists AND is type StateType
+	template <typename StateType>
+	StateType* GetImmediateInnerState();
+
+	template <typename StateType>
+	const StateType* GetImmediateInnerState() const;
+
+	// Boolean query functions
+
+	template <typename StateType>
+	hsm_bool IsInState() const;
+
+	template <typename StateType>
+	hsm_bool IsInOuterState() const { return GetOuterState<StateType>() != 0; }
+
+	template <typename StateType>
+	hsm_bool IsInInnerState() const { return GetInnerState<StateType>() != 0; }
+
+	template <typename StateType>
+	hsm_bool IsInImmediateInnerState() const { return GetImmediateInnerState<StateType>() != 0; }
+
+	// Called from state functions (usually OnEnter()) to bind a StateValue to current state. Rather than
+	// passing in the new value, we return a writable reference to the StateValue's internal value to support
+	// modifying data members of structs/classes.
+	template <typename T>
+	T& SetStateValue(StateValue<T>& stateValue)
+	{
+		// Lazily add a resetter for this StateValue
+		if (!FindStateValueInResetterList(stateValue))
+		{
+			mStateValueResetters.push_back( HSM_NEW ConcreteStateValueResetter<T>(stateValue) );
+		}
+
+		// Return its value so it can be modified
+		return stateValue.mValue;
+	}
+
+	// Overridable functions
+
+	// OnEnter is invoked when a State is created; Note that GetStateMachine() is valid in OnEnter.
+	// Also note that the function does not need to be virtual as the state machine invokes it
+	// directly on the most-derived type (not polymorphically); however, we make it virtual to avoid
+	// compiler warnings about hiding base class functions.
+	virtual void OnEnter() {}
+
+	// You can also pass args to OnEnter via any of the transition functions. Just make sure to declare an 
+	// OnEnter that matches the argument types. Since the OnEnter call is delayed, the arguments will be copied.
+	// Use std::ref() to avoid the copy (but make sure the object is still valid by the time OnEnter is called!).
+	// 
+	//void OnEnter(...)
+
+	// OnExit is invoked just before a State is destroyed
+	virtual void OnExit() {}
+
+	// Called by StateMachine::ProcessStateTransitions from outermost to innermost state, repeatedly until
+	// the state stack has settled (i.e. all states return NoTransition). Override this function to return
+	// a state to transition to, or NoTransition to remain in this state. Generally, this function should avoid
+	// side-effects (updating state) as it may be called several times on the same state per ProcessStateTransitions.
+	// Instead, it should read state to determine whether a transition should be made. Override Update instead
+	// to update the current state.
+	virtual Transition GetTransition()
+	{
+		return NoTransition();
+	}
+
+	// Called by StateMachine::ProcessStateTransitions for each event posted via StateMachine::PostEvent, from
+	// innermost to outermost state until one returns true to mark the event as handled. A handler may set
+	// outTransition to make a transition as if it had been returned by GetTransition, after which the stack is
+	// settled before the next event is dispatched. Handling an event wakes a quiescent state, unless the
+	// handler quiesces it again.
+	virtual hsm_bool HandleEvent(const Event& /*event*/, Transition& /*outTransition*/)
+	{
+		return hsm_false;
+	}
+
+	// Called by StateMachine::UpdateStates from outermost to innermost state. Usually invoked after the state
+	// stack has settled, and is where a state can do it's work.
+	virtual void Update(HSM_STATE_UPDATE_ARGS) {}
+
+#if HSM_USE_SNAPSHOTS
+	// Called by StateMachine::SaveSnapshot to save this state's own data. When the snapshot is loaded, the
+	// state is created and pushed without calling OnEnter, and LoadState is called instead, once the outer
+	// states are loaded (but before StateValues and regions are restored). Timers are not saved, so LoadState
+	// should start them again if needed.
+	virtual void SaveState(SnapshotWriter& /*writer*/) const {}
+	virtual void LoadState(SnapshotReader& /*reader*/) {}
+#endif
+
+	template <typename SourceState>
+	StateOverride<SourceState> GetStateOverride();
+
+	// Quiescence: a quiescent state is skipped by StateMachine::ProcessStateTransitions (its GetTransition is not
+	// called) until it is woken, either explicitly via Wake() or StateMachine::WakeStates(), or once its deadline
+	// is reached. Useful for states that would otherwise return NoTransition frame after frame. Note that a
+	// quiescent state is not woken when its inner states change, so states that depend on their inner states
+	// (e.g. "done" states) must be woken explicitly. Update is still called on quiescent states.
+
+	// Stops calling GetTransition on this state until it is woken
+	void Quiesce();
+
+	// Stops calling GetTransition on this state for the remainder of the current ProcessStateTransitions,
+	// and for the next numFrames calls to it, or until it is woken
+	void QuiesceForFrames(size_t numFrames);
+
+	// Resumes calling GetTransition on this state, starting from the current ProcessStateTransitions if the
+	// state is woken while the stack is settling
+	void Wake();
+
+	hsm_bool IsQuiescent() const { return mWakeFrame != 0; }
+
+	// Orthogonal regions: a state can own any number of regions, each of which is a child StateMachine with its
+	// own state stack that runs concurrently with the inner states of this state. Regions share the owner, state
+	// overrides, StatePoolSet and TimerService of the root StateMachine, and are named after the state that owns
+	// them, so they allocate neither a debug name nor overrides of their own. They are processed as part of the
+	// root: ProcessStateTransitions settles the regions one after the other once the parent stack has settled
+	// (WorkStealingExecutor::ProcessStateTransitions settles them in parallel instead), and UpdateStates updates a
+	// state's regions right after the state. Regions are stopped (OnExit is invoked on their states) in reverse
+	// order when the state that owns them is popped, before the state's own OnExit. Stopped regions are kept by the
+	// parent StateMachine and reused by later calls, so re-entering a state that adds regions doesn't allocate them
+	// again. Note that with HSM_USE_STATE_ARENA, each region has an arena of its own, as the states of concurrent
+	// stacks can't share the LIFO arena of the parent. Usually called from OnEnter.
+	template <typename InitialStateType>
+	StateMachine& AddRegion();
+
+	// Returns the number of regions added by this state, and the region at the input index, which must be less
+	// than GetNumRegions()
+	size_t GetNumRegions() const;
+	StateMachine& GetRegion(size_t index);
+
+	// Timers (see TimerService): a timer either wakes this state (see Quiesce), or defers the input transition
+	// (see DeferTransition) once the input delay has elapsed, as measured by the clock of the state machine's
+	// TimerService. If HSM_DEFERRED_TRANSITION_QUEUE_SIZE other states already have a deferred transition when
+	// the timer expires, the timer stays pending and expires again on the next tick of the clock, after the
+	// state machine has been processed. Timers are cancelled when this state is popped. Usually called from
+	// OnEnter, e.g.:
+	//   StartTimer(500, SiblingTransition<Idle>());
+	// or to wait without polling:
+	//   StartTimer(500);
+	//   Quiesce();
+	void StartTimer(TimerTime delay);
+	void StartTimer(TimerTime delay, const Transition& transition);
+	void CancelTimers();
+	hsm_bool HasPendingTimers() const { return mTimers != 0; }
+
+	// Returns the time elapsed since this state was pushed, as measured by the state machine's TimerService
+	TimerTime GetTimeInState() const;
+
+	// Makes the input transition at the start of the next call to StateMachine::ProcessStateTransitions, as if
+	// returned by GetTransition, unless this state is popped first. Usually called from Update to avoid
+	// transitioning back and forth between states within the same frame. If called more than once before then,
+	// the last transition wins. Returns hsm_false if the transition could not be deferred because
+	// HSM_DEFERRED_TRANSITION_QUEUE_SIZE other states already have a deferred transition.
+	hsm_bool DeferTransition(const Transition& transition);
+
+private:
+	friend class StateMachine;
+	friend class TimerService;
+	friend void detail::InitState(State* state, StateMachine* ownerStateMachine, size_t stackDepth, const StateFactory& stateFactory);
+	friend void detail::InitStaticState(State* state, size_t stackDepth, const StateFactory& stateFactory);
+	friend void detail::DestroyState(State* state);
+	friend class detail::TraceCallScope;
+#if HSM_USE_USDT_PROBES
+	friend class detail::UpdateProbeScope;
+#endif
+
+	template <typename T>
+	StateValue<T>* FindStateValueInResetterList(StateValue<T>& stateValue)
+	{
+		StateValueResetterList::iterator iter = mStateValueResetters.begin();
+		const StateValueResetterList::iterator& iterEnd = mStateValueResetters.end();
+		for ( ; iter != iterEnd; ++iter)
+		{
+			if ((*iter)->mValue == &stateValue.mValue)
+			{
+				return &stateValue;
+			}
+		}
+		return 0;
+	}
+
+	void ResetStateValues()
+	{
+		// Destroy StateValues (will reset to old value)
+		StateValueResetterList::iterator iter = mStateValueResetters.begin();
+		const StateValueResetterList::iterator& iterEnd = mStateValueResetters.end();
+		for ( ; iter != iterEnd; ++iter)
+		{
+			HSM_DELETE(*iter);
+		}
+		mStateValueResetters.clear();
+	}
+
+	typedef HSM_STD_VECTOR<StateValueResetter*> StateValueResetterList;
+
+	StateMachine* mOwnerStateMachine;
+	Owner* mOwner; // Cached for performance and easier debugging
+	size_t mStackDepth; // Depth of this state instance on the stack
+	StateValueResetterList mStateValueResetters;
+
+	const StateFactory* mStateFactory; // Factory that allocated this state, used to deallocate it
+	size_t mWakeFrame; // Frame at which a quiescent state wakes, or 0 if awake (see Quiesce)
+	detail::TimerNode* mTimers; // Pending timers (see StartTimer)
+	TimerTime mEntryTime; // Time at which the state was pushed, if the state machine has a TimerService
+
+#if HSM_USE_PROFILER
+	// Edge through which the state was entered, if the state machine has a TransitionGraph
+	StateTypeId mEntrySourceStateTypeId;
+	Transition::Type mEntryTransitionType;
+	ProfileTime mEntryProfileTime; // 0 if not recorded
+#endif
+
+	// Values cached to avoid virtual call, especially since the values are constant
+	StateTypeId mStateTypeId;
+	const hsm_char* mStateDebugName;
+};
+
+namespace detail
+{
+	// Generates a lambda that will invoke TargetState::OnEnter with matching args. The lambda is stored inline
+	// in the Transition, so the args it captures must be trivially copyable.
+	// We get a compiler-time error if a matching OnEnter is not found.
+	template <typename TargetState, typename... Args>
+	auto DoGenerateOnEnterArgsFunc(Args&&... args)
+	{
+		static_assert(std::is_convertible<TargetState, State>::value, "TargetState must derive from hsm::State");
+
+		// Purposely capture args by copy rather than by reference in case args are
+		// created on the stack. Use std::ref() to wrap args that do not need to be copied.
+		return[args...](State* state)
+		{
+			HSM_ASSERT_MSG(state->GetStateType() == GetStateType<TargetState>(),
+				"Type of state to call OnEnter on doesn't match original target state returned by transition");
+
+			static_cast<TargetState*>(state)->OnEnter(args...);
+		};
+	}
+
+	// Base case: do nothing
+	template <typename T>
+	T&& DecayIfImmediateString(T&& arg1)
+	{
+		return std::forward<T>(arg1);
+	}
+
+	// If immediate string, decay to const char*
+	template <size_t _Nx>
+	const char* DecayIfImmediateString(const char(&arr)[_Nx])
+	{
+		return static_cast<const char*>(arr);
+	}
+
+	// Immediate strings are forwarded as "const char*" rather than captured as C-style arrays ("const T(&)[n]"),
+	// which keeps them from eating up the Transition's args storage, and works around MSVC 14 (VS 2015) failing
+	// to generate lambdas that capture such arrays by value. This is safe since immediate strings have global
+	// lifetime.
+	template <typename TargetState, typename... Args>
+	auto GenerateOnEnterArgsFunc(Args&&... args)
+	{
+		return DoGenerateOnEnterArgsFunc<TargetState>(DecayIfImmediateString(std::forward<Args>(args))...);
+	}
+} // namespace detail
+
+
+
+// StateWithOwner
+
+// Class that clients can use instead of deriving directly from State that provides convenient
+// typed access to the Owner. This class can also be chained via the StateBaseType parameter,
+// which is useful when inheriting state machines.
+
+template <typename OwnerType, typename StateBaseType = State>
+struct StateWithOwner : StateBaseType
+{
+	using State::GetStateMachine;
+	using State::GetOwner;
+
+	StateWithOwner() : mOwner(reinterpret_cast<OwnerType*&>(GetOwner())) {}
+
+	const OwnerType& Owner() const
+	{
+		HSM_ASSERT(mOwner);
+		return *mOwner;
+	}
+
+	OwnerType& Owner()
+	{
+		HSM_ASSERT(mOwner);
+		return *mOwner;
+	}
+
+private:
+	// Hide base class member with one who's type is OwnerType*, rather than void*. Also helpful when debugging.
+	OwnerType* const& mOwner;
+};
+
+} // namespace hsm
+
+#ifdef HSM_COMPILER_MSC
+#pragma endregion "State"
+#endif
+
+#ifdef HSM_COMPILER_MSC
+#pragma region "StateMachine"
+#endif
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// StateMachine
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace hsm {
+
+#if HSM_USE_STATE_ARENA
+
+namespace detail
+{
+	// Fixed-capacity replacement for HSM_STD_VECTOR<State*>, stored inline in the StateMachine
+	class InlineStateStack
+	{
+	public:
+		typedef State** iterator;
+		typedef std::reverse_iterator<iterator> reverse_iterator;
+
+		InlineStateStack() : mSize(0) {}
+
+		hsm_bool empty() const { return mSize == 0; }
+		size_t size() const { return mSize; }
+
+		State*& operator[](size_t index) { return mStates[index]; }
+		State* operator[](size_t index) const { return mStates[index]; }
+		State*& at(size_t index) { HSM_ASSERT(index < mSize); return mStates[index]; }
+		State*& back() { HSM_ASSERT(mSize > 0); return mStates[mSize - 1]; }
+
+		void push_back(State* state)
+		{
+			HSM_ASSERT_MSG(mSize < HSM_STATE_ARENA_MAX_DEPTH, "State stack is deeper than HSM_STATE_ARENA_MAX_DEPTH");
+			mStates[mSize++] = state;
+		}
+
+		void pop_back() { HSM_ASSERT(mSize > 0); --mSize; }
+
+		iterator begin() { return mStates; }
+		iterator end() { return mStates + mSize; }
+		reverse_iterator rbegin() { return reverse_iterator(end()); }
+		reverse_iterator rend() { return reverse_iterator(begin()); }
+
+	private:
+		State* mStates[HSM_STATE_ARENA_MAX_DEPTH];
+		size_t mSize;
+	};
+
+	// Bump allocator for states. Since states are pushed and popped in stack order, freeing a block simply
+	// resets the top of the arena to the start of that block.
+	class StateArena
+	{
+	public:
+		StateArena() : mTop(0) {}
+
+		// Returns NULL if there isn't enough space left
+		void* Allocate(size_t size, size_t alignment)
+		{
+			const size_t offset = (mTop + alignment - 1) & ~(alignment - 1);
+			if (offset + size > sizeof(mBuffer))
+			{
+				return 0;
+			}
+			mTop = offset + size;
+			return mBuffer + offset;
+		}
+
+		// Frees block, which must be the most recently allocated block still in use
+		void Deallocate(void* block)
+		{
+			HSM_ASSERT(Owns(block));
+			mTop = static_cast<size_t>(static_cast<unsigned char*>(block) - mBuffer);
+		}
+
+		hsm_bool Owns(const void* block) const
+		{
+			return block >= mBuffer && block < mBuffer + sizeof(mBuffer);
+		}
+
+	private:
+		alignas(std::max_align_t) unsigned char mBuffer[HSM_STATE_ARENA_MAX_DEPTH * HSM_STATE_ARENA_MAX_STATE_SIZE];
+		size_t mTop;
+	};
+}
+
+// State stack types
+typedef detail::InlineStateStack StackType;
+
+#else
+
+// State stack types
+typedef HSM_STD_VECTOR<State*> StackType;
+
+#endif // HSM_USE_STATE_ARENA
+
+typedef StackType::iterator OuterToInnerIterator;
+typedef StackType::reverse_iterator InnerToOuterIterator;
+
+#if HSM_USE_ACTIVE_STATE_TABLE
+
+namespace detail
+{
+	// Tracks which state types are on a state stack, and at which depth, indexed by StateTypeId::mIndex. If a
+	// state type is on the stack more than once, only its outermost depth is recorded, and the duplicate is
+	// counted so that queries know when they must fall back to searching the stack.
+	class ActiveStateTable
+	{
+	public:
+		ActiveStateTable() : mNumDuplicates(0) {}
+
+		void OnPushState(StateTypeId stateType, size_t depth)
+		{
+			const size_t index = stateType.mIndex;
+			if (index >= mOutermostDepths.size())
+			{
+				Grow(index);
+			}
+
+			if (IsActive(index))
+			{
+				++mNumDuplicates;
+			}
+			else
+			{
+				HSM_ASSERT(depth <= 0xFFFF);
+				mActiveBits[index / BitsPerWord] |= GetBitMask(index);
+				mOutermostDepths[index] = static_cast<unsigned short>(depth);
+			}
+		}
+
+		void OnPopState(StateTypeId stateType, size_t depth)
+		{
+			const size_t index = stateType.mIndex;
+			HSM_ASSERT(IsActive(index));
+
+			// States are popped from innermost to outermost, so if we're popping the outermost instance of this
+			// state type, there are no other instances left.
+			if (mOutermostDepths[index] == depth)
+			{
+				mActiveBits[index / BitsPerWord] &= ~GetBitMask(index);
+			}
+			else
+			{
+				HSM_ASSERT(mNumDuplicates > 0);
+				--mNumDuplicates;
+			}
+		}
+
+		hsm_bool IsActive(size_t index) const
+		{
+			const size_t word = index / BitsPerWord;
+			return word < mActiveBits.size() && (mActiveBits[word] & GetBitMask(index)) != 0;
+		}
+
+		// Only valid if IsActive(index)
+		size_t GetOutermostDepth(size_t index) const
+		{
+			HSM_ASSERT(IsActive(index));
+			return mOutermostDepths[index];
+		}
+
+		// True if any state type is on the stack more than once
+		hsm_bool HasDuplicates() const { return mNumDuplicates != 0; }
+
+	private:
+		enum { BitsPerWord = sizeof(size_t) * 8 };
+
+		static size_t GetBitMask(size_t index) { return static_cast<size_t>(1) << (index % BitsPerWord); }
+
+		void Grow(size_t index)
+		{
+			// Make room for all state types registered so far to avoid growing one type at a time
+			const size_t numStateTypes = index < GetNumStateTypes() ? GetNumStateTypes() : index + 1;
+			mOutermostDepths.resize(numStateTypes, 0);
+			mActiveBits.resize((numStateTypes + BitsPerWord - 1) / BitsPerWord, 0);
+		}
+
+		HSM_STD_VECTOR<size_t> mActiveBits;
+		HSM_STD_VECTOR<unsigned short> mOutermostDepths;
+		size_t mNumDuplicates;
+	};
+}
+
+#endif // HSM_USE_ACTIVE_STATE_TABLE
+
+namespace TraceLevel
+{
+	enum Type
+	{
+		None = 0,
+		Basic = 1,
+		Diagnostic = 2,
+		Calls = 3 // Also reports each GetTransition and Update call, with its duration (TraceSink only, if HSM_USE_TRACE_CALLS is set)
+	};
+};
+
+// Kinds of transitions reported to a TraceSink
+namespace TraceEvent
+{
+	enum Type
+	{
+		Init = 0, // Initial state pushed
+		Entry, // Inner entry transition
+		Inner, // Inner transition
+		Sibling, // Sibling transition
+		Pop, // State popped
+		Deferred, // Deferred transition made (see State::DeferTransition)
+		Event, // Event handled (see State::HandleEvent)
+		GetTransition, // GetTransition called (see TraceLevel::Calls)
+		Update, // Update called (see TraceLevel::Calls)
+		NumTypes
+	};
+}
+
+inline const hsm_char* GetTraceEventName(TraceEvent::Type traceEvent)
+{
+	static const hsm_char* const names[TraceEvent::NumTypes] =
+	{
+		HSM_TEXT("Init"), HSM_TEXT("Entry"), HSM_TEXT("Inner"), HSM_TEXT("Sibling"), HSM_TEXT("Pop"), HSM_TEXT("Deferred"), HSM_TEXT("Event"),
+		HSM_TEXT("GetTransition"), HSM_TEXT("Update")
+	};
+	return names[traceEvent];
+}
+
+// Fixed-size binary record of a transition, written to a TraceSink instead of being formatted. The state name
+// has static lifetime, so the sink may resolve it later.
+struct TraceRecord
+{
+	uint64_t mTime; // Nanoseconds of std::chrono::steady_clock
+	uint64_t mDuration; // Nanoseconds spent in the call for TraceEvent::GetTransition and Update, otherwise 0
+	uint64_t mStateMachineId; // Address of the StateMachine
+	const hsm_char* mStateName;
+	uint16_t mDepth;
+	uint8_t mEvent; // TraceEvent::Type
+	uint8_t mLevel; // TraceLevel::Type
+};
+
+// Receives the transitions of the state machines it's set on (see StateMachine::SetTraceSink), in all builds,
+// unlike debug tracing. Write may be called concurrently by machines processed on different threads (see
+// hsm_trace.h for a sink that writes to a file).
+class TraceSink
+{
+public:
+	virtual ~TraceSink() {}
+	virtual void Write(const TraceRecord& record) = 0;
+};
+
+namespace detail
+{
+	// Time of TraceRecord::mTime
+	inline uint64_t GetTraceTime()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+}
+
+// Determines where ProcessStateTransitions resumes calling GetTransition after a transition is made
+namespace SettlePolicy
+{
+	enum Type
+	{
+		// Start over from the outermost state (default). This is always correct, but a cascade of N transitions
+		// costs O(N^2) GetTransition calls.
+		Restart = 0,
+
+		// Resume from the state that made the transition, trusting that the states outside of it will not
+		// transition as a result, so a cascade of N transitions costs O(N) GetTransition calls. This does not
+		// hold for states whose GetTransition depends on their inner states (e.g. "done" states), which will
+		// only transition on the next call to ProcessStateTransitions.
+		Resume = 1,
+
+		// Same as Resume, but once the stack has settled, re-checks all states from the outermost. Any state that
+		// transitions then is reported (it either has side-effects or depends on its inner states), and the stack
+		// is settled again as with Restart. Only available when HSM_DEBUG is set, otherwise same as Resume.
+		ResumeAndVerify = 2
+	};
+};
+
+// Work done by a state machine during a frame, i.e. a call to ProcessStateTransitions, or to
+// EvaluateStateTransitions and ApplyStateTransitions, which is counted in all builds, to detect machines that
+// thrash transitions (see StateMachine::GetFrameMetrics and StateMachineGroup::GetFrameMetrics)
+struct FrameMetrics
+{
+	FrameMetrics() { Reset(); }
+
+	void Reset()
+	{
+		mNumSettleIterations = 0;
+		mNumGetTransitionCalls = 0;
+		mNumPushes = 0;
+		mNumPops = 0;
+		mNumStateAllocations = 0;
+		mPeakStackDepth = 0;
+	}
+
+	// Sums the counts, and keeps the highest peak stack depth
+	void Add(const FrameMetrics& metrics)
+	{
+		mNumSettleIterations += metrics.mNumSettleIterations;
+		mNumGetTransitionCalls += metrics.mNumGetTransitionCalls;
+		mNumPushes += metrics.mNumPushes;
+		mNumPops += metrics.mNumPops;
+		mNumStateAllocations += metrics.mNumStateAllocations;
+		mPeakStackDepth = metrics.mPeakStackDepth > mPeakStackDepth ? metrics.mPeakStackDepth : mPeakStackDepth;
+	}
+
+	size_t mNumSettleIterations; // Passes over the stack calling GetTransition until one makes a transition
+	size_t mNumGetTransitionCalls;
+	size_t mNumPushes;
+	size_t mNumPops;
+	size_t mNumStateAllocations; // States allocated from a pool or the heap, i.e. not from the machine's arena
+	size_t mPeakStackDepth;
+};
+
+// The main interface to the hierarchical state machine; a single state machine
+// manages a stack of states.
+class StateMachine
+{
+public:
+	StateMachine();
+	~StateMachine();
+
+	// Initializes the state machine
+	template <typename InitialStateType>
+	void Initialize(Owner* owner = 0)
+	{
+		HSM_ASSERT(mInitialTransition.IsNo());
+		mInitialTransition = SiblingTransition(GetStateFactory<InitialStateType>());
+		mOwner = owner;
+	}
+
+	//@NOTE: Removing this overload as it causes ambiguity when owner is not specified.
+	// Can make this work using SFINAE to enable this overload when StateArgsType derives
+	// from hsm::StateArgs. This would be simpler in C++11.
+	//
+	// Initializes the state machie with StateArgs for the initial state.
+	//template <typename InitialStateType, typename StateArgsType>
+	//void Initialize(const StateArgsType& initialStateArgs, Owner* owner = 0)
+	//{
+	//	HSM_ASSERT(mInitialTransition.IsNo());
+	//	mInitialTransition = SiblingTransition(GetStateFactory<InitialStateType>(), initialStateArgs);
+	//	mOwner = owner;
+	//}
+
+	// Shuts down the state machine, after which Initialize() must be called to use the state machine again.
+	// If stop is true, invokes Stop(). Destructor calls Shutdown(false).
+	void Shutdown(hsm_bool stop = hsm_true);
+
+	// Returns true after Initialize and before Shutdown are invoked
+	hsm_bool IsInitialized() const { return !mInitialTransition.IsNo(); }
+
+	// Pops all states off the state stack, including initial state, invoking OnExit on each one in inner-to-outer order.
+	// A subsequent call to ProcessStateTransitions will re-populate the state stack.
+	// After invoking Stop and before ProcessStateTransitions, IsStarted returns false.
+	void Stop();
+
+	// Started means the state stack is not empty
+	hsm_bool IsStarted() { return !mStateStack.empty(); }
+
+	// Debug tracing
+	void SetDebugInfo(const hsm_char* name, TraceLevel::Type traceLevel);
+	void SetDebugName(const hsm_char* name);
+	const hsm_char* GetDebugName() const { return mDebugName; }
+	void SetDebugTraceLevel(TraceLevel::Type trace) { mDebugTraceLevel = trace; }
+	TraceLevel::Type GetDebugTraceLevel() const { return mDebugTraceLevel; }
+
+	// Writes transitions up to the input level as binary records to the sink, in all builds; or stops if NULL.
+	// Regions added afterwards use the same sink.
+	void SetTraceSink(TraceSink* traceSink, TraceLevel::Type traceLevel = TraceLevel::Basic) { mTraceSink = traceSink; mTraceSinkLevel = traceLevel; }
+	TraceSink* GetTraceSink() const { return mTraceSink; }
+
+	// Settle policy used by ProcessStateTransitions (default is SettlePolicy::Restart)
+	void SetSettlePolicy(SettlePolicy::Type settlePolicy) { mSettlePolicy = settlePolicy; }
+	SettlePolicy::Type GetSettlePolicy() const { return mSettlePolicy; }
+
+	// Call to update the state stack (usually once per frame). This function will iterate over the state stack,
+	// calling GetTransition() on each state, and will perform transitions until all states return NoTransition.
+	// Quiescent states are skipped (see State::Quiesce), and if all states are quiescent, returns immediately.
+	void ProcessStateTransitions();
+
+	// ProcessStateTransitions split so that the regions (see State::AddRegion) can be settled in parallel (see
+	// WorkStealingExecutor::ProcessStateTransitions in hsm_parallel.h). BeginProcessStateTransitions settles this
+	// machine's own stack. ProcessStateTransitions must then be called once on each of its GetNumActiveRegions()
+	// regions, in any order, and finally EndProcessStateTransitions, which adds their frame metrics to this
+	// machine's. Active regions are those of the states on the stack, ordered by depth.
+	void BeginProcessStateTransitions();
+	size_t GetNumActiveRegions() const { return mRegions.size(); }
+	StateMachine& GetActiveRegion(size_t index) { return *mRegions[index].mStateMachine; }
+	void EndProcessStateTransitions();
+
+	// ProcessStateTransitions split into two phases, so that the first can run in parallel over many machines
+	// (see StateMachineGroup and hsm_parallel.h). EvaluateStateTransitions calls GetTransition on each state
+	// like ProcessStateTransitions, but only records the first transition that would be made, without
+	// modifying the stack, which relies on GetTransition only reading data. ApplyStateTransitions must then be
+	// called once, with no other calls made on the machine in between, to make the recorded transition (even if
+	// the data it was based on has changed since), settle the stack as ProcessStateTransitions would, and
+	// process events and deferred transitions. Data written between the two calls is seen by the states only
+	// once the stack is settled again, which may be on the next frame.
+	//
+	// EvaluateStateTransitions returns true if ApplyStateTransitions has work to do. In HSM_DEBUG builds, it
+	// asserts that GetTransition does not modify the data members of the state (those of the types derived
+	// from State), or of the owner if SetOwnerSize was called.
+	hsm_bool EvaluateStateTransitions();
+	void ApplyStateTransitions();
+
+	// Size of the owner's data, checked for modifications by EvaluateStateTransitions (HSM_DEBUG only), and
+	// required to save and load the StateValues that are members of the owner (see SaveSnapshot)
+	void SetOwnerSize(size_t ownerSize) { mOwnerSize = ownerSize; }
+	size_t GetOwnerSize() const { return mOwnerSize; }
+
+	HSM_DEPRECATED("Use SetOwnerSize")
+	void SetDebugOwnerSize(size_t ownerSize) { SetOwnerSize(ownerSize); }
+
+	// Wakes all quiescent states on the stack
+	void WakeStates();
+
+	// Returns true if the machine has settled and has nothing left to do until it is woken: all states on the
+	// stack, and on those of its regions, are quiescent with no deadline (see State::Quiesce), and no events or
+	// deferred transitions are pending. Timers that wake states or defer transitions still fire.
+	hsm_bool IsIdle() const;
+
+	// Wakes the machine if its StateMachineGroup put it to sleep (see StateMachineGroup::SetSleepIdleStateMachines),
+	// so that it is processed and updated again. Called whenever a state is woken, an event is posted or a
+	// transition is deferred, including by timers; call it directly when only Update has work to do, as
+	// quiescent states stay quiescent. Like PostEvent, not thread-safe.
+	void Wake();
+	hsm_bool IsAsleep() const { return mAsleep; }
+
+	// Wakes the outermost state of type StateType, if on the stack
+	template <typename StateType>
+	void WakeState() { if (State* state = GetState<StateType>()) state->Wake(); }
+
+	// If this state machine is a region (see State::AddRegion), returns the state that owns it and its state
+	// machine, otherwise NULL
+	State* GetParentState() { return mParentState; }
+	StateMachine* GetParentStateMachine() { return mParentState ? &mParentState->GetStateMachine() : 0; }
+
+	// Sets the TimerService used by the states' timers and GetTimeInState; may be shared with other state
+	// machines. Regions use the TimerService of their parent. If states are on the stack, they keep their time
+	// in state, and their timers are moved to the new TimerService, which can't be NULL if there are any.
+	void SetTimerService(TimerService* timerService);
+	TimerService* GetTimerService() { return mTimerService; }
+	const TimerService* GetTimerService() const { return mTimerService; }
+
+#if HSM_USE_PROFILER
+	// Sets the Profiler that times the calls made to the states, or NULL to stop profiling; may be shared with
+	// other state machines. Also sets the Profiler of the regions, which use the Profiler of their parent.
+	void SetProfiler(Profiler* profiler);
+	Profiler* GetProfiler() const { return mProfiler; }
+
+	// Calls made to the states of this machine (not including its regions) while it had a Profiler, summed
+	// over all state types
+	const ProfileStats& GetProfileStats(ProfileCall::Type profileCall) const { return mProfileStats[profileCall]; }
+	void ResetProfileStats();
+
+	// Sets the TransitionGraph that counts the transitions taken by this machine, or NULL to stop counting; may
+	// be shared with other state machines of the same kind. Also sets the TransitionGraph of the regions.
+	void SetTransitionGraph(TransitionGraph* transitionGraph);
+	TransitionGraph* GetTransitionGraph() const { return mTransitionGraph; }
+#endif
+
+#if HSM_USE_SNAPSHOTS
+	// Saves the state stack, including the stacks of regions, to a binary snapshot: the type of each state, its
+	// quiescence and time in state, its own data (see State::SaveState), the StateValues bound by the states,
+	// and the state overrides. StateValues must be members of a state on the stack, or of the owner if its
+	// size was set with SetOwnerSize, and have trivially copyable values. Events, deferred transitions and timers
+	// are not saved, so the machine should be settled, with no events or deferred transitions pending.
+	void SaveSnapshot(SnapshotWriter& writer) const;
+
+	// Restores a snapshot saved by SaveSnapshot, in a process running the same build. The machine must be
+	// initialized (with the same type of owner), and stopped. States are created and pushed directly, without
+	// evaluating transitions or calling OnEnter (see State::LoadState). Returns false if the snapshot is
+	// invalid, refers to unknown state types, or restores StateValues outside of their state or of the owner (so
+	// the owner size must be set as when saving), in which case the machine is left stopped with its state
+	// overrides unchanged.
+	hsm_bool LoadSnapshot(SnapshotReader& reader);
+#endif
+
+	// Returns the number of calls made to ProcessStateTransitions, which is the "frame" used by quiescent states
+	size_t GetFrameIndex() const { return mFrameIndex; }
+
+	// Work done since the start of the last frame (ProcessStateTransitions or EvaluateStateTransitions),
+	// including by the regions, and summed over all frames since the machine was created or ResetMetrics was
+	// called
+	const FrameMetrics& GetFrameMetrics() const { return mFrameMetrics; }
+	FrameMetrics GetTotalMetrics() const { FrameMetrics metrics = mTotalMetrics; metrics.Add(mFrameMetrics); return metrics; }
+	void ResetMetrics() { mFrameMetrics.Reset(); mTotalMetrics.Reset(); }
+
+	// Queues a copy of the input event, to be dispatched to the states' HandleEvent on the next call to
+	// ProcessStateTransitions. Events are dispatched in the order they are posted; events posted while
+	// dispatching are queued for the following call.
+	template <typename EventType>
+	void PostEvent(const EventType& event) { mEventQueue.push_back(Event(event)); Wake(); }
+
+	// Constructs the event from the input args, e.g. PostEvent<JumpEvent>(height)
+	template <typename EventType, typename... Args>
+	void PostEvent(Args&&... args) { mEventQueue.push_back(Event(EventType{std::forward<Args>(args)...})); Wake(); }
+
+	hsm_bool HasPendingEvents() const { return !mEventQueue.empty(); }
+
+	// Call after ProcessStateTransitions (once the state stack has settled) to allow each state to perform its
+	// work. Will invoke Update() on each state, from outermost to innermost.
+	void UpdateStates(HSM_STATE_UPDATE_ARGS);
+
+	// Owner accessors (may return NULL)
+	Owner* GetOwner() { return mOwner; }
+	const Owner* GetOwner() const { return mOwner; }
+
+	// State stack iterators
+	OuterToInnerIterator BeginOuterToInner() { return mStateStack.begin(); }
+	OuterToInnerIterator EndOuterToInner() { return mStateStack.end(); }
+	InnerToOuterIterator BeginInnerToOuter() { return mStateStack.rbegin(); }
+	InnerToOuterIterator EndInnerToOuter() { return mStateStack.rend(); }
+
+	// State stack query functions
+
+	// Returns NULL if state is not found on the stack
+	State* GetState(StateTypeId stateType);
+	const State* GetState(StateTypeId stateType) const { return const_cast<const State*>( const_cast<StateMachine*>(this)->GetState(stateType) ); }
+
+	hsm_bool IsInState(StateTypeId stateType) const { return GetState(stateType) != 0; }
+
+	template <typename StateType>
+	StateType* GetState() { return static_cast<StateType*>(GetState(hsm::GetStateType<StateType>())); }
+
+	template <typename StateType>
+	hsm_bool IsInState() const { return IsInState(hsm::GetStateType<StateType>()); }
+
+	// State override functions
+
+	template <typename SourceState, typename TargetState>
+	void AddStateOverride();
+
+	template <typename SourceState>
+	void RemoveStateOverride();
+
+	template <typename SourceState>
+	const StateFactory& GetStateOverride();
+
+#if HSM_USE_STATE_POOLS
+	// Sets the StatePoolSet to allocate states from, which may be shared with other state machines. If never
+	// set, the state machine uses StatePoolSet::GetDefault() of the thread that first allocates one of its states,
+	// and keeps using that set when processed on other threads.
+	// Can only be changed while the state stack is empty.
+	void SetStatePoolSet(StatePoolSet* statePoolSet);
+	StatePoolSet& GetStatePoolSet();
+#endif
+
+	template <typename InitialStateType>
+	HSM_DEPRECATED("Initialize should no longer accept debug info. Use SetDebugInfo instead.")
+	void Initialize(Owner* owner, const hsm_char* debugName, size_t debugLevel)
+	{
+		HSM_ASSERT(mInitialTransition.IsNo());
+		mInitialTransition = SiblingTransition(GetStateFactory<InitialStateType>());
+		mOwner = owner;
+		SetDebugInfo(debugName, debugLevel);
+	}
+
+	HSM_DEPRECATED("Use SetDebugInfo(const hsm_char*, TraceLevel::Type)")
+	void SetDebugInfo(const hsm_char* name, size_t level) { SetDebugName(name); SetDebugTraceLevel(static_cast<TraceLevel::Type>(level)); }
+
+	HSM_DEPRECATED("Use SetDebugTraceLevel")
+	void SetDebugLevel(size_t level) { SetDebugTraceLevel(static_cast<TraceLevel::Type>(level)); }
+
+	HSM_DEPRECATED("Use GetDebugLevel")
+	size_t GetDebugLevel() { return static_cast<size_t>(GetDebugTraceLevel()); }
+
+private:
+	friend struct State;
+	friend class StateMachineGroup;
+	friend class StateMachineStore;
+	friend class TimerService;
+#if HSM_USE_PROFILER
+	friend class detail::ProfileScope;
+#endif
+	friend class detail::TraceCallScope;
+	friend State* detail::CreateState(const StateFactory& stateFactory, StateMachine* ownerStateMachine, size_t stackDepth);
+	friend void detail::DestroyState(State* state);
+
+	void CreateAndPushInitialState(const Transition& transition);
+
+	// Returns state at input depth, or NULL if depth is invalid
+	State* GetStateAtDepth(size_t depth);
+
+	// Overload returns state at input depth if it matches input type
+	State* GetStateAtDepth(size_t depth, StateTypeId stateType);
+
+	State* GetOuterState(StateTypeId stateType, size_t startDepth);
+	const State* GetOuterState(StateTypeId stateType, size_t startDepth) const;
+	State* GetInnerState(StateTypeId stateType, size_t startDepth);
+	const State* GetInnerState(StateTypeId stateType, size_t startDepth) const;
+
+	// Pops states from most inner up to and including depth
+	void PopStatesToDepth(size_t depth, hsm_bool invokeOnExit = hsm_true);
+
+	// Calls GetTransition on states from startDepth to innermost until one makes a transition. Returns true if a
+	// transition was made, meaning we must keep processing, and sets transitionDepth to the depth of the state
+	// that made it.
+	hsm_bool ProcessStateTransitionsOnce(size_t startDepth, size_t& transitionDepth);
+
+	// Processes transitions until all states return NoTransition
+	void SettleStateTransitions(hsm_bool resumeFromTransitionDepth);
+
+	// Settles according to the settle policy, including its verification in HSM_DEBUG builds
+	void SettleStateTransitionsWithPolicy();
+
+	// Returns true if ApplyTransition would modify the stack
+	hsm_bool WouldApplyTransition(size_t depth, const Transition& transition);
+
+	// Applies transition returned by the state at input depth. Returns true if the state stack was modified.
+	hsm_bool ApplyTransition(size_t depth, const Transition& transition);
+
+#if HSM_DEBUG
+	// Used by SettlePolicy::ResumeAndVerify once settled: reports and applies the first transition still made by
+	// any state, and returns true if one was found.
+	hsm_bool VerifySettledStateTransitions();
+#endif
+
+	void PushState(State* state);
+	void PopState();
+
+#if HSM_USE_PROFILER
+	// Records the transition that pushed targetState in the TransitionGraph, if any
+	void RecordTransition(const StateTypeId& sourceStateTypeId, const Transition& transition, State* targetState);
+	#define HSM_RECORD_TRANSITION(sourceStateTypeId, transition, targetState) RecordTransition(sourceStateTypeId, transition, targetState)
+#else
+	#define HSM_RECORD_TRANSITION(sourceStateTypeId, transition, targetState)
+#endif
+
+	// Sets the frame at which the state wakes, or 0 to wake it now, keeping track of quiescent states
+	void SetStateWakeFrame(State* state, size_t wakeFrame);
+
+	// Wakes states whose deadline has been reached
+	void WakeExpiredStates();
+
+	// Dispatches queued events, settling the stack after each transition made by an event handler
+	void DispatchEvents();
+
+	hsm_bool DeferTransition(size_t depth, const Transition& transition);
+
+#if HSM_USE_SNAPSHOTS
+	// Saves and loads the stack, StateValues and regions of this machine (see SaveSnapshot)
+	void SaveStateStack(SnapshotWriter& writer) const;
+	hsm_bool LoadStateStack(SnapshotReader& reader);
+#endif
+
+	// Regions owned by the states on the stack (see State::AddRegion)
+	StateMachine& AddRegion(size_t depth, const Transition& initialTransition);
+	size_t GetNumRegions(size_t depth) const;
+	StateMachine& GetRegion(size_t depth, size_t index);
+	void ProcessRegionStateTransitions();
+
+	// Adds the metrics of the last frame to the totals, and starts counting a new frame
+	void BeginFrameMetrics();
+	void DestroyRegions(size_t depth, hsm_bool invokeOnExit);
+
+	// Applies deferred transitions in the order they were deferred
+	void ApplyDeferredTransitions();
+	void RemoveDeferredTransition(size_t index);
+
+	void Log(size_t minLevel, size_t numSpaces, const hsm_char* format, ...);
+	void LogTransition(size_t minLevel, size_t depth, TraceEvent::Type traceEvent, State* state);
+
+	Owner* mOwner; // Provided by client, accessed within states via StateWithOwner<>::Owner()
+	Transition mInitialTransition;
+	StackType mStateStack;
+
+#if HSM_USE_STATE_ARENA
+	detail::StateArena mStateArena;
+#endif
+
+#if HSM_USE_ACTIVE_STATE_TABLE
+	detail::ActiveStateTable mActiveStates;
+#endif
+
+	typedef std::map<const StateFactory*, const StateFactory*> OverrideMap;
+	OverrideMap* mStateOverrides; // Allocated by the first override added; regions use those of the root instead
+
+#if HSM_USE_STATE_POOLS
+	StatePoolSet* mStatePoolSet;
+#endif
+
+	SettlePolicy::Type mSettlePolicy;
+	TimerService* mTimerService;
+
+#if HSM_USE_PROFILER
+	Profiler* mProfiler;
+	ProfileStats mProfileStats[ProfileCall::NumTypes];
+	TransitionGraph* mTransitionGraph;
+#endif
+
+	// Result of EvaluateStateTransitions
+	enum EvaluationResult
+	{
+		NotEvaluated, // EvaluateStateTransitions wasn't called
+		MustProcess, // Evaluation was skipped, and ApplyStateTransitions must process transitions as usual
+		NoTransitionEvaluated,
+		TransitionEvaluated // mEvaluatedTransition is made by the state at mEvaluatedTransitionDepth
+	};
+	// Regions of states on the stack, ordered by depth, then by the order in which they were added
+	struct Region
+	{
+		size_t mDepth;
+		StateMachine* mStateMachine;
+	};
+	HSM_STD_VECTOR<Region> mRegions;
+	HSM_STD_VECTOR<StateMachine*> mSpareRegions; // Stopped regions, reused by AddRegion
+	State* mParentState; // If this is a region, the state that owns it
+
+	StateMachineGroup* mGroup; // Group this machine was added to, if any
+	hsm_bool mAsleep; // Set by mGroup when it stops processing this idle machine (see Wake)
+
+	EvaluationResult mEvaluationResult;
+	Transition mEvaluatedTransition;
+	size_t mEvaluatedTransitionDepth;
+	size_t mOwnerSize;
+
+	size_t mFrameIndex; // Incremented by each call to ProcessStateTransitions
+	FrameMetrics mFrameMetrics;
+	FrameMetrics mTotalMetrics; // Not including mFrameMetrics
+	size_t mNumQuiescentStates; // Number of states on the stack that are quiescent
+	size_t mNextWakeFrame; // Earliest frame at which a quiescent state may need waking
+
+	typedef HSM_STD_VECTOR<Event> EventQueue;
+	EventQueue mEventQueue;
+	EventQueue mDispatchingEvents; // Swapped with mEventQueue while dispatching, kept to reuse its memory
+	State* mEventHandlerState; // State whose HandleEvent is being called, if any
+	hsm_bool mEventHandlerSetWakeFrame; // Set if mEventHandlerState quiesced or woke itself during the call
+
+	// Deferred transitions, at most one per depth, removed when the state at that depth is popped
+	struct DeferredTransition
+	{
+		size_t mDepth;
+		Transition mTransition;
+	};
+	DeferredTransition mDeferredTransitions[HSM_DEFERRED_TRANSITION_QUEUE_SIZE];
+	size_t mNumDeferredTransitions;
+
+	const hsm_char* mDebugName; // Points to mDebugNameBuffer, or for a region, to the name of the state that owns it
+	hsm_char* mDebugNameBuffer; // Allocated by the first SetDebugName
+	TraceLevel::Type mDebugTraceLevel;
+	TraceSink* mTraceSink;
+	TraceLevel::Type mTraceSinkLevel;
+};
+
+
+// Inline State member function implementations - implemented here because they depend StateMachine being defined
+
+template <typename StateType>
+StateType* State::GetState()
+{
+	return GetStateMachine().GetState<StateType>();
+}
+
+template <typename StateType>
+const StateType* State::GetState() const
+{
+	return const_cast<State*>(this)->GetState<StateType>();
+}
+
+template <typename StateType>
+StateType* State::GetOuterState()
+{
+	return static_cast<StateType*>(GetStateMachine().GetOuterState(hsm::GetStateType<StateType>(), mStackDepth - 1));
+}
+
+template <typename StateType>
+const StateType* State::GetOuterState() const
+{
+	return const_cast<State*>(this)->GetOuterState<StateType>();
+}
+
+template <typename StateType>
+StateType* State::GetInnerState()
+{
+	return static_cast<StateType*>(GetStateMachine().GetInnerState(hsm::GetStateType<StateType>(), mStackDepth + 1));
+}
+
+template <typename StateType>
+const StateType* State::GetInnerState() const
+{
+	return const_cast<State*>(this)->GetInnerState<StateType>();
+}
+
+template <typename StateType>
+hsm_bool State::IsInState() const
+{
+	return GetStateMachine().IsInState<StateType>();
+}
+
+inline State* State::GetImmediateInnerState()
+{
+	return GetStateMachine().GetStateAtDepth(mStackDepth + 1);
+}
+
+inline const State* State::GetImmediateInnerState() const
+{
+	return const_cast<State*>(this)->GetImmediateInnerState();
+}
+
+template <typename StateType>
+inline StateType* State::GetImmediateInnerState()
+{
+	return static_cast<StateType*>(GetStateMachine().GetStateAtDepth(mStackDepth + 1, hsm::GetStateType<StateType>()));
+}
+
+template <typename StateType>
+inline const StateType* State::GetImmediateInnerState() const
+{
+	return const_cast<State*>(this)->GetImmediateInnerState<StateType>();
+}
+
+template <typename SourceState>
+inline StateOverride<SourceState> State::GetStateOverride()
+{
+	return StateOverride<SourceState>(GetStateMachine().GetStateOverride<SourceState>());
+}
+
+inline void State::Quiesce()
+{
+	GetStateMachine().SetStateWakeFrame(this, static_cast<size_t>(-1));
+}
+
+inline void State::QuiesceForFrames(size_t numFrames)
+{
+	GetStateMachine().SetStateWakeFrame(this, GetStateMachine().GetFrameIndex() + numFrames + 1);
+}
+
+inline void State::Wake()
+{
+	GetStateMachine().SetStateWakeFrame(this, 0);
+}
+
+inline hsm_bool State::DeferTransition(const Transition& transition)
+{
+	return GetStateMachine().DeferTransition(mStackDepth, transition);
+}
+
+inline void State::StartTimer(TimerTime delay)
+{
+	StartTimer(delay, NoTransition());
+}
+
+inline void State::StartTimer(TimerTime delay, const Transition& transition)
+{
+	TimerService* timerService = GetStateMachine().GetTimerService();
+	HSM_ASSERT_MSG(timerService, "StateMachine has no TimerService (see StateMachine::SetTimerService)");
+	timerService->StartTimer(this, delay, transition);
+}
+
+inline void State::CancelTimers()
+{
+	if (mTimers)
+	{
+		GetStateMachine().GetTimerService()->CancelTimers(this);
+	}
+}
+
+inline TimerTime State::GetTimeInState() const
+{
+	const TimerService* timerService = GetStateMachine().GetTimerService();
+	HSM_ASSERT_MSG(timerService, "StateMachine has no TimerService (see StateMachine::SetTimerService)");
+	return timerService->GetTime() - mEntryTime;
+}
+
+inline void TimerService::StartTimer(State* state, TimerTime delay, const Transition& transition)
+{
+	detail::TimerNode* node = AllocateNode();
+	node->mState = state;
+	// A timer can't expire in the slot that was already expired by the last Update
+	node->mExpiry = mTime + (delay > 0 ? delay : 1);
+	node->mTransition = transition;
+
+	node->mPrevInState = 0;
+	node->mNextInState = state->mTimers;
+	if (state->mTimers)
+		state->mTimers->mPrevInState = node;
+	state->mTimers = node;
+
+	Insert(node);
+	++mNumTimers;
+}
+
+inline void TimerService::CancelTimers(State* state)
+{
+	while (detail::TimerNode* node = state->mTimers)
+	{
+		state->mTimers = node->mNextInState;
+		Unlink(node);
+		FreeNode(node);
+		--mNumTimers;
+	}
+}
+
+inline void TimerService::MoveTimers(State* state, TimerService& timerService)
+{
+	detail::TimerNode* node = state->mTimers;
+	state->mTimers = 0;
+	while (node)
+	{
+		detail::TimerNode* next = node->mNextInState;
+		Unlink(node);
+		--mNumTimers;
+		timerService.StartTimer(state, node->mExpiry > mTime ? node->mExpiry - mTime : 0, node->mTransition);
+		FreeNode(node);
+		node = next;
+	}
+}
+
+inline void TimerService::ExpireTimer(detail::TimerNode* node, TimerTime retryTime)
+{
+	State* state = node->mState;
+	Unlink(node);
+
+	StateMachine& stateMachine = state->GetStateMachine();
+	if (node->mTransition.IsNo())
+	{
+		stateMachine.SetStateWakeFrame(state, 0);
+	}
+	else if (!stateMachine.DeferTransition(state->mStackDepth, node->mTransition))
+	{
+		// The deferred queue is full until the state machine is processed, so keep the timer pending and retry
+		// on the next Update
+		node->mExpiry = retryTime;
+		Insert(node);
+		return;
+	}
+
+	if (node->mPrevInState)
+		node->mPrevInState->mNextInState = node->mNextInState;
+	else
+		state->mTimers = node->mNextInState;
+	if (node->mNextInState)
+		node->mNextInState->mPrevInState = node->mPrevInState;
+	--mNumTimers;
+
+	FreeNode(node);
+}
+
+template <typename InitialStateType>
+inline StateMachine& State::AddRegion()
+{
+	return GetStateMachine().AddRegion(mStackDepth, SiblingTransition(GetStateFactory<InitialStateType>()));
+}
+
+inline size_t State::GetNumRegions() const
+{
+	return GetStateMachine().GetNumRegions(mStackDepth);
+}
+
+inline StateMachine& State::GetRegion(size_t index)
+{
+	return GetStateMachine().GetRegion(mStackDepth, index);
+}
+
+// Inline StateMachine function implementations
+
+template <typename SourceState, typename TargetState>
+inline void StateMachine::AddStateOverride()
+{
+	if (!mStateOverrides)
+	{
+		mStateOverrides = HSM_NEW OverrideMap();
+	}
+	(*mStateOverrides)[&hsm::GetStateFactory<SourceState>()] = &hsm::GetStateFactory<TargetState>();
+}
+
+template <typename SourceState>
+inline void StateMachine::RemoveStateOverride()
+{
+	HSM_ASSERT_MSG(mStateOverrides, "No state overrides were added");
+	mStateOverrides->erase(&hsm::GetStateFactory<SourceState>());
+}
+
+template <typename SourceState>
+inline const StateFactory& StateMachine::GetStateOverride()
+{
+	// Regions share the overrides of the root state machine
+	if (StateMachine* parentStateMachine = GetParentStateMachine())
+	{
+		return parentStateMachine->GetStateOverride<SourceState>();
+	}
+
+	const StateFactory& sourceStateFactory = GetStateFactory<SourceState>();
+	if (!mStateOverrides)
+	{
+		return sourceStateFactory;
+	}
+	OverrideMap::iterator iter = mStateOverrides->find(&sourceStateFactory);
+	return iter == mStateOverrides->end() ? sourceStateFactory : *iter->second;
+}
+
+// Transitions are logged in all builds, since they may be written to a TraceSink
+#if !HSM_DEBUG
+	#define HSM_LOG(minLevel, numSpaces, printfArgs)
+#else
+	#define HSM_LOG Log
+#endif
+#define HSM_LOG_TRANSITION LogTransition
+
+namespace detail
+{
+	inline void InitState(State* state, StateMachine* ownerStateMachine, size_t stackDepth, const StateFactory& stateFactory)
+	{
+		HSM_ASSERT(ownerStateMachine != 0);
+		state->mOwnerStateMachine = ownerStateMachine;
+		state->mOwner = ownerStateMachine->GetOwner();
+		state->mStackDepth = stackDepth;
+		state->mStateFactory = &stateFactory;
+		state->mStateTypeId = stateFactory.GetStateType();
+		state->mStateDebugName = stateFactory.GetStateName();
+	}
+
+	// FNV-1a hash of the input bytes, used to detect modifications in debug builds
+	inline size_t HashBytes(const void* data, size_t size, size_t hash = static_cast<size_t>(2166136261u))
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; ++i)
+		{
+			hash = (hash ^ bytes[i]) * static_cast<size_t>(16777619u);
+		}
+		return hash;
+	}
+
+	// Hashes the bytes of a state's most derived object, except for its State subobject, which may be anywhere
+	// in the object (e.g. if State isn't its first base)
+	inline size_t HashStateData(const void* stateObject, size_t stateSize, const State* state)
+	{
+		const unsigned char* begin = static_cast<const unsigned char*>(stateObject);
+		const unsigned char* stateBegin = reinterpret_cast<const unsigned char*>(state);
+		HSM_ASSERT(stateBegin >= begin && stateBegin + sizeof(State) <= begin + stateSize);
+		const size_t hash = HashBytes(begin, static_cast<size_t>(stateBegin - begin));
+		const unsigned char* stateEnd = stateBegin + sizeof(State);
+		return HashBytes(stateEnd, static_cast<size_t>(begin + stateSize - stateEnd), hash);
+	}
+
+	// Initializes a state owned by a StaticStateMachine (see hsm_static.h), which has no StateMachine
+	inline void InitStaticState(State* state, size_t stackDepth, const StateFactory& stateFactory)
+	{
+		state->mStackDepth = stackDepth;
+		state->mStateFactory = &stateFactory;
+		state->mStateTypeId = stateFactory.GetStateType();
+		state->mStateDebugName = stateFactory.GetStateName();
+	}
+
+	inline State* CreateState(const StateFactory& stateFactory, StateMachine* ownerStateMachine, size_t stackDepth)
+	{
+		State* state = 0;
+
+#if HSM_USE_STATE_ARENA
+		if (void* memory = ownerStateMachine->mStateArena.Allocate(stateFactory.GetStateSize(), stateFactory.GetStateAlignment()))
+		{
+			state = stateFactory.ConstructState(memory);
+		}
+#endif
+
+		if (!state)
+		{
+#if HSM_USE_STATE_POOLS
+			state = stateFactory.AllocateState(ownerStateMachine->GetStatePoolSet());
+#else
+			state = stateFactory.AllocateState();
+#endif
+			++ownerStateMachine->mFrameMetrics.mNumStateAllocations;
+		}
+
+		InitState(state, ownerStateMachine, stackDepth, stateFactory);
+		return state;
+	}
+
+	inline State* CreateState(const Transition& transition, StateMachine* ownerStateMachine, size_t stackDepth)
+	{
+		return CreateState(transition.GetStateFactory(), ownerStateMachine, stackDepth);
+	}
+
+	inline void DestroyState(State* state)
+	{
+		HSM_ASSERT(state->mStateFactory != 0);
+		StateMachine& stateMachine = state->GetStateMachine();
+
+#if HSM_USE_STATE_ARENA
+		if (stateMachine.mStateArena.Owns(state))
+		{
+			stateMachine.mStateArena.Deallocate(state->mStateFactory->DestructState(state));
+			return;
+		}
+#endif
+
+#if HSM_USE_STATE_POOLS
+		state->mStateFactory->DeallocateState(state, stateMachine.GetStatePoolSet());
+#else
+		(void)stateMachine;
+		state->mStateFactory->DeallocateState(state);
+#endif
+	}
+
+#if HSM_USE_PROFILER
+	// Times a call made to a state for the current scope, if the state's machine has a Profiler
+	class ProfileScope
+	{
+	public:
+		ProfileScope(State* state, ProfileCall::Type profileCall)
+			: mStateMachine(&state->GetStateMachine())
+			, mProfiler(mStateMachine->mProfiler)
+		{
+			if (mProfiler)
+			{
+				// The state may be popped during the call, so everything needed is copied
+				mStateTypeId = state->GetStateType();
+				mProfileCall = profileCall;
+				mNumAllocations = GetThreadAllocationCount();
+				mStartTime = GetProfileTime();
+			}
+		}
+
+		~ProfileScope()
+		{
+			if (mProfiler)
+			{
+				const ProfileTime time = GetProfileTime() - mStartTime;
+				const uint64_t numAllocations = GetThreadAllocationCount() - mNumAllocations;
+				mProfiler->Record(mStateTypeId, mProfileCall, time, numAllocations);
+				mStateMachine->mProfileStats[mProfileCall].Add(time, numAllocations);
+			}
+		}
+
+	private:
+		StateMachine* mStateMachine;
+		Profiler* mProfiler;
+		StateTypeId mStateTypeId;
+		ProfileCall::Type mProfileCall;
+		uint64_t mNumAllocations;
+		ProfileTime mStartTime;
+	};
+
+	#define HSM_PROFILE_SCOPE(state, profileCall) detail::ProfileScope profileScope(state, profileCall)
+#else
+	#define HSM_PROFILE_SCOPE(state, profileCall)
+#endif
+
+#if HSM_USE_TRACE_CALLS
+	// Reports a call made to a state for the current scope to its machine's TraceSink, if its trace level is
+	// TraceLevel::Calls
+	class TraceCallScope
+	{
+	public:
+		TraceCallScope(State* state, TraceEvent::Type traceEvent)
+		{
+			StateMachine& stateMachine = state->GetStateMachine();
+			mTraceSink = stateMachine.mTraceSinkLevel >= TraceLevel::Calls ? stateMachine.mTraceSink : 0;
+			if (mTraceSink)
+			{
+				mRecord.mStateMachineId = reinterpret_cast<uintptr_t>(&stateMachine);
+				mRecord.mStateName = state->GetStateType().mStateName;
+				mRecord.mDepth = static_cast<uint16_t>(state->mStackDepth);
+				mRecord.mEvent = static_cast<uint8_t>(traceEvent);
+				mRecord.mLevel = static_cast<uint8_t>(TraceLevel::Calls);
+				mRecord.mTime = GetTraceTime();
+			}
+		}
+
+		~TraceCallScope()
+		{
+			if (mTraceSink)
+			{
+				mRecord.mDuration = GetTraceTime() - mRecord.mTime;
+				mTraceSink->Write(mRecord);
+			}
+		}
+
+	private:
+		TraceSink* mTraceSink;
+		TraceRecord mRecord;
+	};
+
+	#define HSM_TRACE_CALL_SCOPE(state, traceEvent) detail::TraceCallScope traceCallScope(state, traceEvent)
+#else
+	#define HSM_TRACE_CALL_SCOPE(state, traceEvent)
+#endif
+
+#if HSM_USE_USDT_PROBES
+	// Fires the update_enter and update_exit probes around an Update call
+	class UpdateProbeScope
+	{
+	public:
+		UpdateProbeScope(State* state)
+			: mStateMachine(&state->GetStateMachine())
+			, mDepth(state->mStackDepth)
+			, mStateTypeId(state->GetStateType())
+		{
+			HSM_PROBE4(update_enter, mStateMachine, mDepth, mStateTypeId.mIndex, mStateTypeId.mStateName);
+		}
+
+		~UpdateProbeScope()
+		{
+			HSM_PROBE4(update_exit, mStateMachine, mDepth, mStateTypeId.mIndex, mStateTypeId.mStateName);
+		}
+
+	private:
+		StateMachine* mStateMachine;
+		size_t mDepth;
+		StateTypeId mStateTypeId;
+	};
+
+	#define HSM_UPDATE_PROBE_SCOPE(state) detail::UpdateProbeScope updateProbeScope(state)
+#else
+	#define HSM_UPDATE_PROBE_SCOPE(state)
+#endif
+
+	inline Transition InvokeStateGetTransition(State* state)
+	{
+		HSM_PROFILE_SCOPE(state, ProfileCall::GetTransition);
+		HSM_TRACE_CALL_SCOPE(state, TraceEvent::GetTransition);
+		return state->GetTransition();
+	}
 
-	// Boolean query functions
+	inline void InvokeStateOnEnter(const Transition& transition, State* state)
+	{
+		HSM_PROFILE_SCOPE(state, ProfileCall::OnEnter);
+		if (transition.HasOnEnterArgs())
+		{
+			transition.InvokeOnEnterArgs(state);
+		}
+		else
+		{
+			state->OnEnter();
+		}
+	}
 
-	template <typename StateType>
-	hsm_bool IsInState() const;
+	inline void InvokeStateOnExit(State* state)
+	{
+		HSM_PROFILE_SCOPE(state, ProfileCall::OnExit);
+		state->OnExit();
+	}
+}
 
-	template <typename StateType>
-	hsm_bool IsInOuterState() const { return GetOuterState<StateType>() != 0; }
+inline StateMachine::StateMachine()
+	: mOwner(0)
+	, mStateOverrides(0)
+#if HSM_USE_STATE_POOLS
+	, mStatePoolSet(0)
+#endif
+	, mSettlePolicy(SettlePolicy::Restart)
+	, mTimerService(0)
+#if HSM_USE_PROFILER
+	, mProfiler(0)
+	, mTransitionGraph(0)
+#endif
+	, mParentState(0)
+	, mGroup(0)
+	, mAsleep(hsm_false)
+	, mEvaluationResult(NotEvaluated)
+	, mEvaluatedTransitionDepth(0)
+	, mOwnerSize(0)
+	, mFrameIndex(0)
+	, mNumQuiescentStates(0)
+	, mNextWakeFrame(static_cast<size_t>(-1))
+	, mEventHandlerState(0)
+	, mEventHandlerSetWakeFrame(hsm_false)
+	, mNumDeferredTransitions(0)
+	, mDebugName(HSM_TEXT(""))
+	, mDebugNameBuffer(0)
+	, mDebugTraceLevel(TraceLevel::None)
+	, mTraceSink(0)
+	, mTraceSinkLevel(TraceLevel::None)
+{
+}
 
-	template <typename StateType>
-	hsm_bool IsInInnerState() const { return GetInnerState<StateType>() != 0; }
+inline StateMachine::~StateMachine()
+{
+	HSM_ASSERT_MSG(mGroup == 0, "StateMachine destroyed while still in a StateMachineGroup");
+	Shutdown(hsm_false);
 
-	template <typename StateType>
-	hsm_bool IsInImmediateInnerState() const { return GetImmediateInnerState<StateType>() != 0; }
+	for (size_t i = 0; i < mSpareRegions.size(); ++i)
+	{
+		HSM_DELETE mSpareRegions[i];
+	}
 
-	// Called from state functions (usually OnEnter()) to bind a StateValue to current state. Rather than
-	// passing in the new value, we return a writable reference to the StateValue's internal value to support
-	// modifying data members of structs/classes.
-	template <typename T>
-	T& SetStateValue(StateValue<T>& stateValue)
+	HSM_DELETE mStateOverrides;
+	if (mDebugNameBuffer)
 	{
-		// Lazily add a resetter for this StateValue
-		if (!FindStateValueInResetterList(stateValue))
+		HSM_FREE(mDebugNameBuffer);
+	}
+}
+
+inline void StateMachine::Shutdown(hsm_bool stop)
+{
+	if (stop)
+		Stop();
+
+	// Free any allocated states
+	PopStatesToDepth(0, hsm_false);
+
+	mEventQueue.clear();
+	Wake();
+
+	mOwner = 0;
+	mInitialTransition = NoTransition();
+}
+
+inline void StateMachine::Stop()
+{
+	PopStatesToDepth(0);
+	HSM_ASSERT(mStateStack.empty());
+	Wake();
+}
+
+inline void StateMachine::SetDebugInfo(const hsm_char* name, TraceLevel::Type traceLevel)
+{
+	SetDebugName(name);
+	SetDebugTraceLevel(traceLevel);
+}
+
+inline void StateMachine::SetTimerService(TimerService* timerService)
+{
+	if (timerService == mTimerService)
+		return;
+
+	for (size_t depth = 0; depth < mStateStack.size(); ++depth)
+	{
+		State* state = mStateStack[depth];
+		if (timerService)
 		{
-			mStateValueResetters.push_back( HSM_NEW ConcreteStateValueResetter<T>(stateValue) );
+			// Time in state starts now if there was no TimerService to measure it
+			const TimerTime timeInState = mTimerService ? mTimerService->GetTime() - state->mEntryTime : 0;
+			const TimerTime time = timerService->GetTime();
+			state->mEntryTime = time - (timeInState < time ? timeInState : time);
 		}
 
-		// Return its value so it can be modified
-		return stateValue.mValue;
+		if (state->mTimers)
+		{
+			HSM_ASSERT_MSG(timerService, "Cannot remove the TimerService while states have timers");
+			if (timerService)
+				mTimerService->MoveTimers(state, *timerService);
+			else
+				mTimerService->CancelTimers(state);
+		}
 	}
 
-	// Overridable functions
+	mTimerService = timerService;
+	for (size_t i = 0; i < mRegions.size(); ++i)
+	{
+		mRegions[i].mStateMachine->SetTimerService(timerService);
+	}
+}
 
-	// OnEnter is invoked when a State is created; Note that GetStateMachine() is valid in OnEnter.
-	// Also note that the function does not need to be virtual as the state machine invokes it
-	// directly on the most-derived type (not polymorphically); however, we make it virtual to avoid
-	// compiler warnings about hiding base class functions.
-	virtual void OnEnter() {}
+#if HSM_USE_PROFILER
+inline void StateMachine::SetProfiler(Profiler* profiler)
+{
+	mProfiler = profiler;
+	for (size_t i = 0; i < mRegions.size(); ++i)
+	{
+		mRegions[i].mStateMachine->SetProfiler(profiler);
+	}
+}
 
-	// You can also pass args to OnEnter via any of the transition functions. Just make sure to declare an 
-	// OnEnter that matches the argument types. Since the OnEnter call is delayed, the arguments will be copied.
-	// Use std::ref() to avoid the copy (but make sure the object is still valid by the time OnEnter is called!).
-	// 
-	//void OnEnter(...)
+inline void StateMachine::ResetProfileStats()
+{
+	for (size_t i = 0; i < ProfileCall::NumTypes; ++i)
+	{
+		mProfileStats[i].Reset();
+	}
+}
 
-	// OnExit is invoked just before a State is destroyed
-	virtual void OnExit() {}
+inline void StateMachine::SetTransitionGraph(TransitionGraph* transitionGraph)
+{
+	mTransitionGraph = transitionGraph;
+	for (size_t i = 0; i < mRegions.size(); ++i)
+	{
+		mRegions[i].mStateMachine->SetTransitionGraph(transitionGraph);
+	}
+}
+#endif
 
-	// Called by StateMachine::ProcessStateTransitions from outermost to innermost state, repeatedly until
-	// the state stack has settled (i.e. all states return NoTransition). Override this function to return
-	// a state to transition to, or NoTransition to remain in this state. Generally, this function should avoid
-	// side-effects (updating state) as it may be called several times on the same state per ProcessStateTransitions.
-	// Instead, it should read state to determine whether a transition should be made. Override Update instead
-	// to update the current state.
-	virtual Transition GetTransition()
+#if HSM_USE_SNAPSHOTS
+namespace detail
+{
+	const uint32_t kSnapshotMagic = 0x534d5348; // "HSMS"
+	const uint32_t kSnapshotVersion = 2;
+	const uint32_t kSnapshotOwnerDepth = ~static_cast<uint32_t>(0); // StateValue is a member of the owner
+	const uint64_t kSnapshotNoWakeFrame = ~static_cast<uint64_t>(0); // Quiescent until woken
+}
+
+inline void StateMachine::SaveSnapshot(SnapshotWriter& writer) const
+{
+	writer.Write(detail::kSnapshotMagic);
+	writer.Write(detail::kSnapshotVersion);
+
+	writer.Write(static_cast<uint32_t>(mStateOverrides ? mStateOverrides->size() : 0));
+	if (mStateOverrides)
 	{
-		return NoTransition();
+		for (OverrideMap::const_iterator iter = mStateOverrides->begin(); iter != mStateOverrides->end(); ++iter)
+		{
+			writer.Write(iter->first->GetStateSnapshotId());
+			writer.Write(iter->second->GetStateSnapshotId());
+		}
 	}
 
-	// Called by StateMachine::UpdateStates from outermost to innermost state. Usually invoked after the state
-	// stack has settled, and is where a state can do it's work.
-	virtual void Update(HSM_STATE_UPDATE_ARGS) {}
+	SaveStateStack(writer);
+}
 
-	template <typename SourceState>
-	StateOverride<SourceState> GetStateOverride();
+inline void StateMachine::SaveStateStack(SnapshotWriter& writer) const
+{
+	HSM_ASSERT_MSG(mEvaluationResult == NotEvaluated, "Must call ApplyStateTransitions() after EvaluateStateTransitions()");
+	HSM_ASSERT_MSG(mEventQueue.empty() && mNumDeferredTransitions == 0, "Events and deferred transitions are not saved in snapshots");
 
-private:
-	friend void detail::InitState(State* state, StateMachine* ownerStateMachine, size_t stackDepth, const StateFactory& stateFactory);
+	const uint32_t numStates = static_cast<uint32_t>(mStateStack.size());
+	writer.Write(numStates);
 
-	template <typename T>
-	StateValue<T>* FindStateValueInResetterList(StateValue<T>& stateValue)
+	uint32_t numStateValues = 0;
+	for (uint32_t depth = 0; depth < numStates; ++depth)
 	{
-		StateValueResetterList::iterator iter = mStateValueResetters.begin();
-		const StateValueResetterList::iterator& iterEnd = mStateValueResetters.end();
-		for ( ; iter != iterEnd; ++iter)
+		const State* state = mStateStack[depth];
+		writer.Write(state->mStateFactory->GetStateSnapshotId());
+
+		// Deadlines are saved relative to the current frame
+		uint64_t wakeFrame = state->mWakeFrame;
+		if (wakeFrame == static_cast<size_t>(-1))
+			wakeFrame = detail::kSnapshotNoWakeFrame;
+		else if (wakeFrame != 0)
+			wakeFrame = state->mWakeFrame > mFrameIndex ? state->mWakeFrame - mFrameIndex : 1;
+		writer.Write(wakeFrame);
+
+		const TimerTime timeInState = mTimerService ? mTimerService->GetTime() - state->mEntryTime : 0;
+		writer.Write(timeInState);
+
+		// The state's own data is prefixed with its size, so that loading can't read past it
+		const size_t sizeOffset = writer.GetSize();
+		writer.Write(static_cast<uint32_t>(0));
+		state->SaveState(writer);
+		writer.WriteAt(sizeOffset, static_cast<uint32_t>(writer.GetSize() - sizeOffset - sizeof(uint32_t)));
+
+		numStateValues += static_cast<uint32_t>(state->mStateValueResetters.size());
+	}
+
+	// StateValues are located by their offset within a state on the stack (from its most derived object), or
+	// else within the owner
+	writer.Write(numStateValues);
+	for (uint32_t depth = 0; depth < numStates; ++depth)
+	{
+		const State* state = mStateStack[depth];
+		for (size_t i = 0; i < state->mStateValueResetters.size(); ++i)
 		{
-			if (&stateValue == static_cast<ConcreteStateValueResetter<T>*>(*iter)->mStateValue)
+			const StateValueResetter* resetter = state->mStateValueResetters[i];
+			HSM_ASSERT_MSG(resetter->IsTriviallyCopyable(), "Only StateValues of trivially copyable types can be saved in snapshots");
+			const unsigned char* value = static_cast<const unsigned char*>(resetter->mValue);
+
+			const uint32_t valueSize = static_cast<uint32_t>(resetter->GetValueSize());
+
+			uint32_t baseDepth = detail::kSnapshotOwnerDepth;
+			const unsigned char* base = static_cast<const unsigned char*>(static_cast<const void*>(mOwner));
+			for (uint32_t stateDepth = 0; stateDepth < numStates; ++stateDepth)
 			{
-				return &stateValue;
+				const StateFactory* stateFactory = mStateStack[stateDepth]->mStateFactory;
+				const unsigned char* stateBase = static_cast<const unsigned char*>(stateFactory->GetStateObject(mStateStack[stateDepth]));
+				if (value >= stateBase && value < stateBase + stateFactory->GetStateSize())
+				{
+					baseDepth = stateDepth;
+					base = stateBase;
+					break;
+				}
 			}
+			HSM_ASSERT_MSG(baseDepth != detail::kSnapshotOwnerDepth || (base != 0 && value >= base && value + valueSize <= base + mOwnerSize),
+				"StateValue must be a member of a state on the stack, or of the owner if SetOwnerSize was called");
+
+			writer.Write(depth);
+			writer.Write(baseDepth);
+			writer.Write(static_cast<int64_t>(value - base));
+			writer.Write(valueSize);
+			writer.WriteBytes(resetter->GetOrigValue(), valueSize);
+			writer.WriteBytes(value, valueSize);
 		}
-		return 0;
 	}
 
-	void ResetStateValues()
+	writer.Write(static_cast<uint32_t>(mRegions.size()));
+	for (size_t i = 0; i < mRegions.size(); ++i)
 	{
-		// Destroy StateValues (will reset to old value)
-		StateValueResetterList::iterator iter = mStateValueResetters.begin();
-		const StateValueResetterList::iterator& iterEnd = mStateValueResetters.end();
-		for ( ; iter != iterEnd; ++iter)
+		const StateMachine* region = mRegions[i].mStateMachine;
+		writer.Write(static_cast<uint32_t>(mRegions[i].mDepth));
+		writer.Write(region->mInitialTransition.GetStateFactory().GetStateSnapshotId());
+		region->SaveStateStack(writer);
+	}
+}
+
+inline hsm_bool StateMachine::LoadSnapshot(SnapshotReader& reader)
+{
+	HSM_ASSERT_MSG(IsInitialized(), "Must call Initialize() before LoadSnapshot()");
+	HSM_ASSERT_MSG(mStateStack.empty(), "Must call Stop() before LoadSnapshot()");
+
+	uint32_t magic = 0;
+	uint32_t version = 0;
+	uint32_t numOverrides = 0;
+	if (!reader.Read(magic) || magic != detail::kSnapshotMagic || !reader.Read(version) || version != detail::kSnapshotVersion
+		|| !reader.Read(numOverrides))
+	{
+		return hsm_false;
+	}
+
+	// The overrides are only replaced once the whole snapshot has loaded, so that the machine keeps its own on
+	// failure
+	OverrideMap stateOverrides;
+	for (uint32_t i = 0; i < numOverrides; ++i)
+	{
+		uint32_t sourceId = 0;
+		uint32_t targetId = 0;
+		reader.Read(sourceId);
+		reader.Read(targetId);
+		const StateFactory* sourceStateFactory = detail::FindStateFactory(sourceId);
+		const StateFactory* targetStateFactory = detail::FindStateFactory(targetId);
+		if (reader.HasError() || !sourceStateFactory || !targetStateFactory)
+			return hsm_false;
+		stateOverrides[sourceStateFactory] = targetStateFactory;
+	}
+
+	if (!LoadStateStack(reader))
+	{
+		PopStatesToDepth(0, hsm_false);
+		return hsm_false;
+	}
+
+	if (!mStateOverrides && !stateOverrides.empty())
+	{
+		mStateOverrides = HSM_NEW OverrideMap();
+	}
+	if (mStateOverrides)
+	{
+		mStateOverrides->swap(stateOverrides);
+	}
+	Wake();
+	return hsm_true;
+}
+
+inline hsm_bool StateMachine::LoadStateStack(SnapshotReader& reader)
+{
+	uint32_t numStates = 0;
+	if (!reader.Read(numStates))
+		return hsm_false;
+
+	for (uint32_t depth = 0; depth < numStates; ++depth)
+	{
+		uint32_t stateSnapshotId = 0;
+		uint64_t wakeFrame = 0;
+		TimerTime timeInState = 0;
+		uint32_t dataSize = 0;
+		reader.Read(stateSnapshotId);
+		reader.Read(wakeFrame);
+		reader.Read(timeInState);
+		reader.Read(dataSize);
+		const void* data = reader.Skip(dataSize);
+		const StateFactory* stateFactory = detail::FindStateFactory(stateSnapshotId);
+		if (reader.HasError() || !stateFactory)
+			return hsm_false;
+
+		State* state = detail::CreateState(*stateFactory, this, depth);
+		PushState(state);
+
+		if (wakeFrame != 0)
 		{
-			HSM_DELETE(*iter);
+			SetStateWakeFrame(state, wakeFrame == detail::kSnapshotNoWakeFrame ? static_cast<size_t>(-1) : mFrameIndex + static_cast<size_t>(wakeFrame));
 		}
-		mStateValueResetters.clear();
+
+		if (mTimerService)
+		{
+			state->mEntryTime = mTimerService->GetTime() - (timeInState < mTimerService->GetTime() ? timeInState : mTimerService->GetTime());
+		}
+
+		SnapshotReader stateReader(data, dataSize);
+		state->LoadState(stateReader);
+		if (stateReader.HasError())
+			return hsm_false;
 	}
 
-	typedef HSM_STD_VECTOR<StateValueResetter*> StateValueResetterList;
+	uint32_t numStateValues = 0;
+	if (!reader.Read(numStateValues))
+		return hsm_false;
 
-	StateMachine* mOwnerStateMachine;
-	Owner* mOwner; // Cached for performance and easier debugging
-	size_t mStackDepth; // Depth of this state instance on the stack
-	StateValueResetterList mStateValueResetters;
+	for (uint32_t i = 0; i < numStateValues; ++i)
+	{
+		uint32_t depth = 0;
+		uint32_t baseDepth = 0;
+		int64_t offset = 0;
+		uint32_t valueSize = 0;
+		reader.Read(depth);
+		reader.Read(baseDepth);
+		reader.Read(offset);
+		reader.Read(valueSize);
+		const void* origValue = reader.Skip(valueSize);
+		const void* currValue = reader.Skip(valueSize);
+		if (reader.HasError() || depth >= numStates || (baseDepth != detail::kSnapshotOwnerDepth && baseDepth >= numStates))
+			return hsm_false;
+
+		// The value must fit in the state or owner it was saved from
+		unsigned char* base = 0;
+		size_t baseSize = 0;
+		if (baseDepth == detail::kSnapshotOwnerDepth)
+		{
+			base = static_cast<unsigned char*>(static_cast<void*>(mOwner));
+			baseSize = mOwnerSize;
+		}
+		else
+		{
+			const StateFactory* stateFactory = mStateStack[baseDepth]->mStateFactory;
+			base = static_cast<unsigned char*>(stateFactory->GetStateObject(mStateStack[baseDepth]));
+			baseSize = stateFactory->GetStateSize();
+		}
+		if (!base || valueSize == 0 || offset < 0 || static_cast<uint64_t>(offset) > baseSize || valueSize > baseSize - static_cast<size_t>(offset))
+			return hsm_false;
 
-	// Values cached to avoid virtual call, especially since the values are constant
-	StateTypeId mStateTypeId;
-	const hsm_char* mStateDebugName;
-};
+		void* value = base + offset;
+		memcpy(value, currValue, valueSize);
+		mStateStack[depth]->mStateValueResetters.push_back(HSM_NEW RestoredStateValueResetter(value, origValue, valueSize));
+	}
+
+	uint32_t numRegions = 0;
+	if (!reader.Read(numRegions))
+		return hsm_false;
+
+	for (uint32_t i = 0; i < numRegions; ++i)
+	{
+		uint32_t depth = 0;
+		uint32_t initialStateSnapshotId = 0;
+		reader.Read(depth);
+		reader.Read(initialStateSnapshotId);
+		const StateFactory* initialStateFactory = detail::FindStateFactory(initialStateSnapshotId);
+		if (reader.HasError() || depth >= numStates || !initialStateFactory || (!mRegions.empty() && mRegions.back().mDepth > depth))
+			return hsm_false;
+
+		// The initial transition's args, if any, are lost
+		StateMachine& region = AddRegion(depth, SiblingTransition(*initialStateFactory));
+		if (!region.LoadStateStack(reader))
+			return hsm_false;
+	}
 
-// MSVC 14 (VS 2015) doesn't handle generating lambdas that capture C-style arrays ("const T(&)[n]")
-// by value, emitting error "array initialization requires a brace-enclosed initializer list".
-// The most common case that this affects are immediate strings, so we work around this issue by
-// detecting this case and forwarding them as "const char*", which is safe since immediate strings
-// have global lifetime.
-#ifdef _MSC_VER
-#define DECAY_IMMEDIATE_STRINGS_WHEN_FORWARDING
+	return hsm_true;
+}
 #endif
 
-namespace detail
+inline void StateMachine::SetDebugName(const hsm_char* name)
 {
-	// Generates a lambda that will invoke TargetState::OnEnter with matching args.
-	// We get a compiler-time error if a matching OnEnter is not found.
-	template <typename TargetState, typename... Args>
-	OnEnterArgsFunc DoGenerateOnEnterArgsFunc(Args&&... args)
+	if (!mDebugNameBuffer)
 	{
-		static_assert(std::is_convertible<TargetState, State>::value, "TargetState must derive from hsm::State");
+		mDebugNameBuffer = static_cast<hsm_char*>(HSM_ALLOC(HSM_DEBUG_NAME_MAXLEN * sizeof(hsm_char)));
+	}
+	STRNCPY(mDebugNameBuffer, name, HSM_DEBUG_NAME_MAXLEN);
+	mDebugNameBuffer[HSM_DEBUG_NAME_MAXLEN - 1] = '\0';
+	mDebugName = mDebugNameBuffer;
+}
 
-		// Purposely capture args by copy rather than by reference in case args are
-		// created on the stack. Use std::ref() to wrap args that do not need to be copied.
-		return[args...](State* state)
-		{
-			HSM_ASSERT_MSG(state->GetStateType() == GetStateType<TargetState>(),
-				"Type of state to call OnEnter on doesn't match original target state returned by transition");
+#if HSM_USE_STATE_POOLS
+inline void StateMachine::SetStatePoolSet(StatePoolSet* statePoolSet)
+{
+	HSM_ASSERT_MSG(mStateStack.empty(), "Cannot change StatePoolSet while states are allocated");
+	mStatePoolSet = statePoolSet;
+}
+
+inline StatePoolSet& StateMachine::GetStatePoolSet()
+{
+	if (!mStatePoolSet)
+	{
+		mStatePoolSet = &StatePoolSet::GetDefault();
+	}
+	return *mStatePoolSet;
+}
+#endif
+
+inline void StateMachine::ProcessStateTransitions()
+{
+	BeginProcessStateTransitions();
+	ProcessRegionStateTransitions();
+}
+
+inline void StateMachine::BeginProcessStateTransitions()
+{
+	HSM_ASSERT_MSG(mEvaluationResult == NotEvaluated, "Must call ApplyStateTransitions() after EvaluateStateTransitions()");
+	++mFrameIndex;
+	BeginFrameMetrics();
+
+	// Early out if all states are quiescent and none need waking
+	if (mNumQuiescentStates == mStateStack.size() && !mStateStack.empty() && mFrameIndex < mNextWakeFrame
+		&& mEventQueue.empty() && mNumDeferredTransitions == 0)
+	{
+		return;
+	}
+
+	// If the state stack is empty, push the initial state
+	if (mStateStack.empty())
+	{
+		HSM_ASSERT_MSG(!mInitialTransition.IsNo(), "Must call Initialize()");
+		CreateAndPushInitialState(mInitialTransition);
+	}
+
+	if (mNumDeferredTransitions > 0)
+	{
+		ApplyDeferredTransitions();
+	}
+
+	if (mFrameIndex >= mNextWakeFrame)
+	{
+		WakeExpiredStates();
+	}
+
+	SettleStateTransitionsWithPolicy();
+
+	if (!mEventQueue.empty())
+	{
+		DispatchEvents();
+	}
+}
+
+inline void StateMachine::EndProcessStateTransitions()
+{
+	for (size_t i = 0; i < mRegions.size(); ++i)
+	{
+		mFrameMetrics.Add(mRegions[i].mStateMachine->mFrameMetrics);
+	}
+}
+
+inline void StateMachine::BeginFrameMetrics()
+{
+	mTotalMetrics.Add(mFrameMetrics);
+	mFrameMetrics.Reset();
+	mFrameMetrics.mPeakStackDepth = mStateStack.size();
+}
 
-			static_cast<TargetState*>(state)->OnEnter(std::move(args)...);
-		};
-	}
+inline void StateMachine::SettleStateTransitionsWithPolicy()
+{
+	SettleStateTransitions(mSettlePolicy != SettlePolicy::Restart);
 
-	// Base case: do nothing
-	template <typename T>
-	T&& DecayIfImmediateString(T&& arg1)
+#if HSM_DEBUG
+	if (mSettlePolicy == SettlePolicy::ResumeAndVerify && VerifySettledStateTransitions())
 	{
-		return std::forward<T>(arg1);
+		SettleStateTransitions(hsm_false);
 	}
+#endif
+}
 
-	// If immediate string, decay to const char*
-	template <size_t _Nx>
-	const char* DecayIfImmediateString(const char(&arr)[_Nx])
+inline hsm_bool StateMachine::EvaluateStateTransitions()
+{
+	HSM_ASSERT_MSG(mEvaluationResult == NotEvaluated, "Must call ApplyStateTransitions() after EvaluateStateTransitions()");
+	BeginFrameMetrics();
+
+	// Deferred transitions are made before GetTransition is called, so we can't evaluate ahead of them
+	if (mStateStack.empty() || mNumDeferredTransitions > 0)
 	{
-		return static_cast<const char*>(arr);
+		mEvaluationResult = MustProcess;
+		return hsm_true;
 	}
 
-	template <typename TargetState, typename... Args>
-	OnEnterArgsFunc GenerateOnEnterArgsFunc(Args&&... args)
+	for (size_t depth = 0; depth < mStateStack.size(); ++depth)
 	{
-#ifdef DECAY_IMMEDIATE_STRINGS_WHEN_FORWARDING
-		return DoGenerateOnEnterArgsFunc<TargetState>(DecayIfImmediateString(args)...);
-#else
-		return DoGenerateOnEnterArgsFunc<TargetState>(std::forward<Args>(args)...);
-#endif // DECAY_IMMEDIATE_STRINGS_WHEN_FORWARDING
-	}
-} // namespace detail
+		State* state = mStateStack[depth];
+		if (state->IsQuiescent())
+			continue;
+
+#if HSM_DEBUG
+		// Hash the data of the types derived from State, since the State members may be modified by the
+		// library (e.g. if the state quiesces)
+		const void* stateObject = state->mStateFactory->GetStateObject(state);
+		const size_t stateSize = state->mStateFactory->GetStateSize();
+		const size_t stateHash = detail::HashStateData(stateObject, stateSize, state);
+		const size_t ownerHash = mOwner ? detail::HashBytes(mOwner, mOwnerSize) : 0;
+#endif
 
+		++mFrameMetrics.mNumGetTransitionCalls;
+		const Transition& transition = detail::InvokeStateGetTransition(state);
 
+#if HSM_DEBUG
+		if (stateHash != detail::HashStateData(stateObject, stateSize, state))
+		{
+			Log(0, depth, HSM_TEXT("%-8s: %s modified itself in GetTransition\n"), HSM_TEXT("Evaluate"), state->GetStateDebugName());
+			HSM_ASSERT_MSG(hsm_false, "GetTransition must not modify its state when called by EvaluateStateTransitions");
+		}
 
-// StateWithOwner
+		if (mOwner && ownerHash != detail::HashBytes(mOwner, mOwnerSize))
+		{
+			Log(0, depth, HSM_TEXT("%-8s: %s modified its owner in GetTransition\n"), HSM_TEXT("Evaluate"), state->GetStateDebugName());
+			HSM_ASSERT_MSG(hsm_false, "GetTransition must not modify its owner when called by EvaluateStateTransitions");
+		}
+#endif
 
-// Class that clients can use instead of deriving directly from State that provides convenient
-// typed access to the Owner. This class can also be chained via the StateBaseType parameter,
-// which is useful when inheriting state machines.
+		if (WouldApplyTransition(depth, transition))
+		{
+			mEvaluationResult = TransitionEvaluated;
+			mEvaluatedTransition = transition;
+			mEvaluatedTransitionDepth = depth;
+			return hsm_true;
+		}
+	}
 
-template <typename OwnerType, typename StateBaseType = State>
-struct StateWithOwner : StateBaseType
+	mEvaluationResult = NoTransitionEvaluated;
+	return !mEventQueue.empty() || mFrameIndex + 1 >= mNextWakeFrame;
+}
+
+inline void StateMachine::ApplyStateTransitions()
 {
-	using State::GetStateMachine;
-	using State::GetOwner;
+	HSM_ASSERT_MSG(mEvaluationResult != NotEvaluated, "Must call EvaluateStateTransitions() first");
+	const EvaluationResult evaluationResult = mEvaluationResult;
+	mEvaluationResult = NotEvaluated;
 
-	StateWithOwner() : mOwner(reinterpret_cast<OwnerType*&>(GetOwner())) {}
+	if (evaluationResult == MustProcess)
+	{
+		ProcessStateTransitions();
+		return;
+	}
 
-	const OwnerType& Owner() const
+	++mFrameIndex;
+
+	// States that were evaluated are settled unless one made a transition, but states woken now were not
+	hsm_bool mustSettle = hsm_false;
+	if (mFrameIndex >= mNextWakeFrame)
 	{
-		HSM_ASSERT(mOwner);
-		return *mOwner;
+		WakeExpiredStates();
+		mustSettle = hsm_true;
 	}
 
-	OwnerType& Owner()
+	if (evaluationResult == TransitionEvaluated)
 	{
-		HSM_ASSERT(mOwner);
-		return *mOwner;
+		ApplyTransition(mEvaluatedTransitionDepth, mEvaluatedTransition);
+		mEvaluatedTransition = NoTransition();
+		mustSettle = hsm_true;
 	}
 
-private:
-	// Hide base class member with one who's type is OwnerType*, rather than void*. Also helpful when debugging.
-	OwnerType* const& mOwner;
-};
+	if (mustSettle)
+	{
+		SettleStateTransitionsWithPolicy();
+	}
 
-} // namespace hsm
+	if (!mEventQueue.empty())
+	{
+		DispatchEvents();
+	}
 
-#ifdef HSM_COMPILER_MSC
-#pragma endregion "State"
-#endif
+	// Regions are not evaluated ahead, but processed as usual
+	ProcessRegionStateTransitions();
+}
 
-#ifdef HSM_COMPILER_MSC
-#pragma region "StateMachine"
-#endif
-///////////////////////////////////////////////////////////////////////////////////////////////////
-// StateMachine
-///////////////////////////////////////////////////////////////////////////////////////////////////
+inline hsm_bool StateMachine::DeferTransition(size_t depth, const Transition& transition)
+{
+	for (size_t i = 0; i < mNumDeferredTransitions; ++i)
+	{
+		if (mDeferredTransitions[i].mDepth == depth)
+		{
+			mDeferredTransitions[i].mTransition = transition;
+			Wake();
+			return hsm_true;
+		}
+	}
 
-namespace hsm {
+	if (mNumDeferredTransitions == HSM_DEFERRED_TRANSITION_QUEUE_SIZE)
+	{
+		return hsm_false;
+	}
 
-// State stack types
-typedef HSM_STD_VECTOR<State*> StackType;
-typedef StackType::iterator OuterToInnerIterator;
-typedef StackType::reverse_iterator InnerToOuterIterator;
+	DeferredTransition& deferredTransition = mDeferredTransitions[mNumDeferredTransitions++];
+	deferredTransition.mDepth = depth;
+	deferredTransition.mTransition = transition;
+	Wake();
+	return hsm_true;
+}
 
-namespace TraceLevel
+inline void StateMachine::ApplyDeferredTransitions()
 {
-	enum Type
+	// Applying a transition pops states, which removes their deferred transitions, so we always apply the
+	// first remaining one
+	while (mNumDeferredTransitions > 0)
 	{
-		None = 0,
-		Basic = 1,
-		Diagnostic = 2
-	};
-};
+		const size_t depth = mDeferredTransitions[0].mDepth;
+		const Transition transition = mDeferredTransitions[0].mTransition;
+		RemoveDeferredTransition(0);
 
-// The main interface to the hierarchical state machine; a single state machine
-// manages a stack of states.
-class StateMachine
-{
-public:
-	StateMachine();
-	~StateMachine();
+		HSM_LOG_TRANSITION(2, depth, TraceEvent::Deferred, mStateStack[depth]);
+		ApplyTransition(depth, transition);
+	}
+}
 
-	// Initializes the state machine
-	template <typename InitialStateType>
-	void Initialize(Owner* owner = 0)
+inline void StateMachine::RemoveDeferredTransition(size_t index)
+{
+	--mNumDeferredTransitions;
+	for (size_t i = index; i < mNumDeferredTransitions; ++i)
 	{
-		HSM_ASSERT(mInitialTransition.IsNo());
-		mInitialTransition = SiblingTransition(GetStateFactory<InitialStateType>());
-		mOwner = owner;
+		mDeferredTransitions[i] = mDeferredTransitions[i + 1];
 	}
 
-	//@NOTE: Removing this overload as it causes ambiguity when owner is not specified.
-	// Can make this work using SFINAE to enable this overload when StateArgsType derives
-	// from hsm::StateArgs. This would be simpler in C++11.
-	//
-	// Initializes the state machie with StateArgs for the initial state.
-	//template <typename InitialStateType, typename StateArgsType>
-	//void Initialize(const StateArgsType& initialStateArgs, Owner* owner = 0)
-	//{
-	//	HSM_ASSERT(mInitialTransition.IsNo());
-	//	mInitialTransition = SiblingTransition(GetStateFactory<InitialStateType>(), initialStateArgs);
-	//	mOwner = owner;
-	//}
-
-	// Shuts down the state machine, after which Initialize() must be called to use the state machine again.
-	// If stop is true, invokes Stop(). Destructor calls Shutdown(false).
-	void Shutdown(hsm_bool stop = hsm_true);
-
-	// Returns true after Initialize and before Shutdown are invoked
-	hsm_bool IsInitialized() const { return !mInitialTransition.IsNo(); }
-
-	// Pops all states off the state stack, including initial state, invoking OnExit on each one in inner-to-outer order.
-	// A subsequent call to ProcessStateTransitions will re-populate the state stack.
-	// After invoking Stop and before ProcessStateTransitions, IsStarted returns false.
-	void Stop();
+	// Release any state args held by the vacated entry
+	mDeferredTransitions[mNumDeferredTransitions].mTransition = NoTransition();
+}
 
-	// Started means the state stack is not empty
-	hsm_bool IsStarted() { return !mStateStack.empty(); }
+inline void StateMachine::DispatchEvents()
+{
+	// Dispatch from a separate queue so that events posted by handlers are kept for the next call
+	HSM_ASSERT(mDispatchingEvents.empty());
+	mDispatchingEvents.swap(mEventQueue);
 
-	// Debug tracing
-	void SetDebugInfo(const hsm_char* name, TraceLevel::Type traceLevel);
-	void SetDebugName(const hsm_char* name);
-	const hsm_char* GetDebugName() const { return mDebugName; }
-	void SetDebugTraceLevel(TraceLevel::Type trace) { mDebugTraceLevel = trace; }
-	TraceLevel::Type GetDebugTraceLevel() const { return mDebugTraceLevel; }
+	for (size_t i = 0; i < mDispatchingEvents.size(); ++i)
+	{
+		const Event& event = mDispatchingEvents[i];
 
-	// Call to update the state stack (usually once per frame). This function will iterate over the state stack,
-	// calling GetTransition() on each state, and will perform transitions until all states return NoTransition.
-	void ProcessStateTransitions();
+		for (size_t depth = mStateStack.size(); depth-- > 0; )
+		{
+			State* state = mStateStack[depth];
+			Transition transition;
 
-	// Call after ProcessStateTransitions (once the state stack has settled) to allow each state to perform its
-	// work. Will invoke Update() on each state, from outermost to innermost.
-	void UpdateStates(HSM_STATE_UPDATE_ARGS);
+			mEventHandlerState = state;
+			mEventHandlerSetWakeFrame = hsm_false;
+			const hsm_bool handled = state->HandleEvent(event, transition);
+			mEventHandlerState = 0;
 
-	// Owner accessors (may return NULL)
-	Owner* GetOwner() { return mOwner; }
-	const Owner* GetOwner() const { return mOwner; }
+			if (handled)
+			{
+				HSM_LOG_TRANSITION(2, depth, TraceEvent::Event, state);
 
-	// State stack iterators
-	OuterToInnerIterator BeginOuterToInner() { return mStateStack.begin(); }
-	OuterToInnerIterator EndOuterToInner() { return mStateStack.end(); }
-	InnerToOuterIterator BeginInnerToOuter() { return mStateStack.rbegin(); }
-	InnerToOuterIterator EndInnerToOuter() { return mStateStack.rend(); }
+				// Quiescing again, even with the same deadline, keeps the handler quiescent
+				if (!mEventHandlerSetWakeFrame)
+				{
+					SetStateWakeFrame(state, 0);
+				}
 
-	// State stack query functions
+				if (ApplyTransition(depth, transition))
+				{
+					SettleStateTransitions(mSettlePolicy != SettlePolicy::Restart);
+				}
+				break;
+			}
+		}
+	}
 
-	// Returns NULL if state is not found on the stack
-	State* GetState(StateTypeId stateType);
-	const State* GetState(StateTypeId stateType) const { return const_cast<const State*>( const_cast<StateMachine*>(this)->GetState(stateType) ); }
+	mDispatchingEvents.clear();
+}
 
-	hsm_bool IsInState(StateTypeId stateType) const { return GetState(stateType) != 0; }
+inline void StateMachine::SettleStateTransitions(hsm_bool resumeFromTransitionDepth)
+{
+	// After we make a transition, we must process all transitions again until we get no transitions
+	// from all states on the stack.
+	hsm_bool keepProcessing = hsm_true;
+	int numTransitionsProcessed = 0;
+	size_t startDepth = 0;
+	while (keepProcessing)
+	{
+		size_t transitionDepth = 0;
+		keepProcessing = ProcessStateTransitionsOnce(startDepth, transitionDepth);
+		++mFrameMetrics.mNumSettleIterations;
 
-	template <typename StateType>
-	StateType* GetState() { return static_cast<StateType*>(GetState(hsm::GetStateType<StateType>())); }
+		if (resumeFromTransitionDepth)
+		{
+			startDepth = transitionDepth;
+		}
 
-	template <typename StateType>
-	hsm_bool IsInState() const { return IsInState(hsm::GetStateType<StateType>()); }
+		if (++numTransitionsProcessed >= 1000)
+		{
+			HSM_ASSERT_MSG(hsm_false, "ProcessStateTransitions: detected infinite transition loop");
+		}
+	}
 
-	// State override functions
+	HSM_PROBE3(settle, this, numTransitionsProcessed, mStateStack.size());
+}
 
-	template <typename SourceState, typename TargetState>
-	void AddStateOverride();
+#if HSM_DEBUG
+inline hsm_bool StateMachine::VerifySettledStateTransitions()
+{
+	for (size_t depth = 0; depth < mStateStack.size(); ++depth)
+	{
+		State* state = GetStateAtDepth(depth);
+		if (state->IsQuiescent())
+			continue;
 
-	template <typename SourceState>
-	void RemoveStateOverride();
+		const hsm_char* stateName = state->GetStateDebugName(); // Static string, still valid if state is popped
+		++mFrameMetrics.mNumGetTransitionCalls;
+		const Transition& transition = detail::InvokeStateGetTransition(state);
 
-	template <typename SourceState>
-	const StateFactory& GetStateOverride();
+		if (ApplyTransition(depth, transition))
+		{
+			// Logged regardless of trace level
+			Log(0, depth, HSM_TEXT("%-8s: %s transitioned after its inner states settled (see SettlePolicy::ResumeAndVerify)\n"), HSM_TEXT("Verify"), stateName);
+			return hsm_true;
+		}
+	}
+	return hsm_false;
+}
+#endif
 
-	template <typename InitialStateType>
-	HSM_DEPRECATED("Initialize should no longer accept debug info. Use SetDebugInfo instead.")
-	void Initialize(Owner* owner, const hsm_char* debugName, size_t debugLevel)
+inline void StateMachine::WakeStates()
+{
+	for (size_t depth = 0; mNumQuiescentStates > 0 && depth < mStateStack.size(); ++depth)
 	{
-		HSM_ASSERT(mInitialTransition.IsNo());
-		mInitialTransition = SiblingTransition(GetStateFactory<InitialStateType>());
-		mOwner = owner;
-		SetDebugInfo(debugName, debugLevel);
+		SetStateWakeFrame(mStateStack[depth], 0);
 	}
+}
 
-	HSM_DEPRECATED("Use SetDebugInfo(const hsm_char*, TraceLevel::Type)")
-	void SetDebugInfo(const hsm_char* name, size_t level) { SetDebugName(name); SetDebugTraceLevel(static_cast<TraceLevel::Type>(level)); }
+inline void StateMachine::WakeExpiredStates()
+{
+	mNextWakeFrame = static_cast<size_t>(-1);
+	for (size_t depth = 0; depth < mStateStack.size(); ++depth)
+	{
+		State* state = mStateStack[depth];
+		if (state->mWakeFrame == 0)
+			continue;
+
+		if (state->mWakeFrame <= mFrameIndex)
+			SetStateWakeFrame(state, 0);
+		else if (state->mWakeFrame < mNextWakeFrame)
+			mNextWakeFrame = state->mWakeFrame;
+	}
+}
 
-	HSM_DEPRECATED("Use SetDebugTraceLevel")
-	void SetDebugLevel(size_t level) { SetDebugTraceLevel(static_cast<TraceLevel::Type>(level)); }
+inline hsm_bool StateMachine::IsIdle() const
+{
+	if (mStateStack.empty() || mNumQuiescentStates != mStateStack.size() || !mEventQueue.empty()
+		|| mNumDeferredTransitions > 0 || mEvaluationResult != NotEvaluated)
+	{
+		return hsm_false;
+	}
 
-	HSM_DEPRECATED("Use GetDebugLevel")
-	size_t GetDebugLevel() { return static_cast<size_t>(GetDebugTraceLevel()); }
+	for (size_t depth = 0; depth < mStateStack.size(); ++depth)
+	{
+		if (mStateStack[depth]->mWakeFrame != static_cast<size_t>(-1))
+			return hsm_false;
+	}
 
-private:
-	friend struct State;
+	for (size_t i = 0; i < mRegions.size(); ++i)
+	{
+		if (!mRegions[i].mStateMachine->IsIdle())
+			return hsm_false;
+	}
 
-	void CreateAndPushInitialState(const Transition& transition);
+	return hsm_true;
+}
 
-	// Returns state at input depth, or NULL if depth is invalid
-	State* GetStateAtDepth(size_t depth);
+inline void StateMachine::SetStateWakeFrame(State* state, size_t wakeFrame)
+{
+	if (state == mEventHandlerState)
+	{
+		mEventHandlerSetWakeFrame = hsm_true;
+	}
 
-	// Overload returns state at input depth if it matches input type
-	State* GetStateAtDepth(size_t depth, StateTypeId stateType);
+	if ((state->mWakeFrame != 0) != (wakeFrame != 0))
+	{
+		if (wakeFrame != 0)
+			++mNumQuiescentStates;
+		else
+			--mNumQuiescentStates;
+	}
 
-	State* GetOuterState(StateTypeId stateType, size_t startDepth);
-	const State* GetOuterState(StateTypeId stateType, size_t startDepth) const;
-	State* GetInnerState(StateTypeId stateType, size_t startDepth);
-	const State* GetInnerState(StateTypeId stateType, size_t startDepth) const;
+	state->mWakeFrame = wakeFrame;
 
-	// Pops states from most inner up to and including depth
-	void PopStatesToDepth(size_t depth, hsm_bool invokeOnExit = hsm_true);
+	if (wakeFrame != 0 && wakeFrame < mNextWakeFrame)
+	{
+		mNextWakeFrame = wakeFrame;
+	}
 
-	// Returns true if a transition was made, meaning we must keep processing
-	hsm_bool ProcessStateTransitionsOnce();
+	// The frame index only advances while the machine is awake, so it must not sleep through a deadline
+	if (wakeFrame != static_cast<size_t>(-1))
+	{
+		Wake();
+	}
+}
 
-	void PushState(State* state);
-	void PopState();
+inline void StateMachine::UpdateStates(HSM_STATE_UPDATE_ARGS)
+{
+	if (mRegions.empty())
+	{
+		OuterToInnerIterator iter = BeginOuterToInner();
+		OuterToInnerIterator end = EndOuterToInner();
+		for ( ; iter != end; ++iter)
+		{
+			HSM_PROFILE_SCOPE(*iter, ProfileCall::Update);
+			HSM_UPDATE_PROBE_SCOPE(*iter);
+			HSM_TRACE_CALL_SCOPE(*iter, TraceEvent::Update);
+			(*iter)->Update(HSM_STATE_UPDATE_ARGS_FORWARD);
+		}
+		return;
+	}
 
-	void Log(size_t minLevel, size_t numSpaces, const hsm_char* format, ...);
-	void LogTransition(size_t minLevel, size_t depth, const hsm_char* transType, State* state);
+	// Update each state's regions right after the state. Note that Update may add regions.
+	size_t regionIndex = 0;
+	for (size_t depth = 0; depth < mStateStack.size(); ++depth)
+	{
+		{
+			HSM_PROFILE_SCOPE(mStateStack[depth], ProfileCall::Update);
+			HSM_UPDATE_PROBE_SCOPE(mStateStack[depth]);
+			HSM_TRACE_CALL_SCOPE(mStateStack[depth], TraceEvent::Update);
+			mStateStack[depth]->Update(HSM_STATE_UPDATE_ARGS_FORWARD);
+		}
 
-	Owner* mOwner; // Provided by client, accessed within states via StateWithOwner<>::Owner()
-	Transition mInitialTransition;
-	StackType mStateStack;
+		for ( ; regionIndex < mRegions.size() && mRegions[regionIndex].mDepth == depth; ++regionIndex)
+		{
+			mRegions[regionIndex].mStateMachine->UpdateStates(HSM_STATE_UPDATE_ARGS_FORWARD);
+		}
+	}
+}
 
-	typedef std::map<const StateFactory*, const StateFactory*> OverrideMap;
-	OverrideMap mStateOverrides;
+inline StateMachine& StateMachine::AddRegion(size_t depth, const Transition& initialTransition)
+{
+	HSM_ASSERT_MSG(mRegions.empty() || mRegions.back().mDepth <= depth, "Regions can only be added by the innermost state that has regions");
 
-	hsm_char mDebugName[HSM_DEBUG_NAME_MAXLEN];
-	TraceLevel::Type mDebugTraceLevel;
-};
+	StateMachine* region;
+	if (mSpareRegions.empty())
+	{
+		region = HSM_NEW StateMachine();
+	}
+	else
+	{
+		// Its stack and queues keep their capacity, so the region is reused without allocating
+		region = mSpareRegions.back();
+		mSpareRegions.pop_back();
+		region->ResetMetrics();
+#if HSM_USE_PROFILER
+		region->ResetProfileStats();
+#endif
+	}
 
+	region->mParentState = mStateStack[depth];
+	region->mInitialTransition = initialTransition;
+	region->mOwner = mOwner;
+	region->mOwnerSize = mOwnerSize;
+	region->mSettlePolicy = mSettlePolicy;
+	region->mTimerService = mTimerService;
+#if HSM_USE_STATE_POOLS
+	region->mStatePoolSet = &GetStatePoolSet();
+#endif
+	region->mDebugName = mStateStack[depth]->GetStateDebugName(); // Named after the state that owns it
+	region->mDebugTraceLevel = mDebugTraceLevel;
+	region->SetTraceSink(mTraceSink, mTraceSinkLevel);
+#if HSM_USE_PROFILER
+	region->mProfiler = mProfiler;
+	region->mTransitionGraph = mTransitionGraph;
+#endif
 
-// Inline State member function implementations - implemented here because they depend StateMachine being defined
+	Region entry = { depth, region };
+	mRegions.push_back(entry);
+	return *region;
+}
 
-template <typename StateType>
-StateType* State::GetState()
+inline size_t StateMachine::GetNumRegions(size_t depth) const
 {
-	return GetStateMachine().GetState<StateType>();
+	size_t numRegions = 0;
+	for (size_t i = 0; i < mRegions.size(); ++i)
+	{
+		if (mRegions[i].mDepth == depth)
+			++numRegions;
+	}
+	return numRegions;
 }
 
-template <typename StateType>
-const StateType* State::GetState() const
+inline StateMachine& StateMachine::GetRegion(size_t depth, size_t index)
 {
-	return const_cast<State*>(this)->GetState<StateType>();
+	size_t first = 0;
+	while (first < mRegions.size() && mRegions[first].mDepth != depth)
+	{
+		++first;
+	}
+	HSM_ASSERT_MSG(first + index < mRegions.size() && mRegions[first + index].mDepth == depth, "Invalid region index");
+	return *mRegions[first + index].mStateMachine;
 }
 
-template <typename StateType>
-StateType* State::GetOuterState()
+inline void StateMachine::ProcessRegionStateTransitions()
 {
-	return static_cast<StateType*>(GetStateMachine().GetOuterState(hsm::GetStateType<StateType>(), mStackDepth - 1));
+	// Processing a region can't affect our stack, so iterating by index is safe
+	for (size_t i = 0; i < mRegions.size(); ++i)
+	{
+		mRegions[i].mStateMachine->ProcessStateTransitions();
+	}
+	EndProcessStateTransitions();
 }
 
-template <typename StateType>
-const StateType* State::GetOuterState() const
+inline void StateMachine::DestroyRegions(size_t depth, hsm_bool invokeOnExit)
 {
-	return const_cast<State*>(this)->GetOuterState<StateType>();
+	// Since regions are ordered by depth, those of the state at depth are at the back
+	while (!mRegions.empty() && mRegions.back().mDepth == depth)
+	{
+		StateMachine* region = mRegions.back().mStateMachine;
+		mRegions.pop_back();
+		region->Shutdown(invokeOnExit);
+		region->mParentState = 0;
+		mSpareRegions.push_back(region);
+	}
 }
 
-template <typename StateType>
-StateType* State::GetInnerState()
+inline State* StateMachine::GetState(StateTypeId stateType)
 {
-	return static_cast<StateType*>(GetStateMachine().GetInnerState(hsm::GetStateType<StateType>(), mStackDepth + 1));
+#if HSM_USE_ACTIVE_STATE_TABLE
+	const size_t index = stateType.mIndex;
+	return mActiveStates.IsActive(index) ? mStateStack[mActiveStates.GetOutermostDepth(index)] : 0;
+#else
+	for (size_t i = 0; i < mStateStack.size(); ++i)
+	{
+		State* state = mStateStack[i];
+		if (state->GetStateType() == stateType)
+			return state;
+	}
+	return 0;
+#endif
 }
 
-template <typename StateType>
-const StateType* State::GetInnerState() const
+inline State* StateMachine::GetStateAtDepth(size_t depth)
 {
-	return const_cast<State*>(this)->GetInnerState<StateType>();
+	if (depth >= mStateStack.size())
+	{
+		return 0;
+	}
+
+	return mStateStack[depth];
 }
 
-template <typename StateType>
-hsm_bool State::IsInState() const
+inline State* StateMachine::GetStateAtDepth(size_t depth, StateTypeId stateType)
 {
-	return GetStateMachine().IsInState<StateType>();
+	State* state = GetStateAtDepth(depth);
+	return (state && state->GetStateType() == stateType) ? state : 0;
 }
 
-inline State* State::GetImmediateInnerState()
+inline State* StateMachine::GetOuterState(StateTypeId stateType, size_t startDepth)
 {
-	return GetStateMachine().GetStateAtDepth(mStackDepth + 1);
+	// Note that startDepth wraps around when searching from the outermost state
+	if (startDepth >= mStateStack.size())
+	{
+		return 0;
+	}
+
+#if HSM_USE_ACTIVE_STATE_TABLE
+	const size_t index = stateType.mIndex;
+	if (!mActiveStates.IsActive(index) || mActiveStates.GetOutermostDepth(index) > startDepth)
+	{
+		return 0;
+	}
+
+	if (!mActiveStates.HasDuplicates())
+	{
+		return mStateStack[mActiveStates.GetOutermostDepth(index)];
+	}
+#endif
+
+	const size_t numStatesToCompare = startDepth + 1;
+	size_t currDepth = startDepth;
+
+	for (size_t i = 0; i < numStatesToCompare; ++i, --currDepth)
+	{
+		State* state = mStateStack[currDepth];
+		if (state->GetStateType() == stateType)
+			return state;
+	}
+	return 0;
 }
 
-inline const State* State::GetImmediateInnerState() const
+inline const State* StateMachine::GetOuterState(StateTypeId stateType, size_t startDepth) const
 {
-	return const_cast<State*>(this)->GetImmediateInnerState();
+	return const_cast<StateMachine*>(this)->GetOuterState(stateType, startDepth);
 }
 
-template <typename StateType>
-inline StateType* State::GetImmediateInnerState()
+inline State* StateMachine::GetInnerState(StateTypeId stateType, size_t startDepth)
 {
-	return static_cast<StateType*>(GetStateMachine().GetStateAtDepth(mStackDepth + 1, hsm::GetStateType<StateType>()));
+#if HSM_USE_ACTIVE_STATE_TABLE
+	const size_t index = stateType.mIndex;
+	if (!mActiveStates.IsActive(index))
+	{
+		return 0;
+	}
+
+	if (mActiveStates.GetOutermostDepth(index) >= startDepth)
+	{
+		return mStateStack[mActiveStates.GetOutermostDepth(index)];
+	}
+
+	if (!mActiveStates.HasDuplicates())
+	{
+		return 0;
+	}
+#endif
+
+	for (size_t i = startDepth; i < mStateStack.size(); ++i)
+	{
+		State* state = mStateStack[i];
+		if (state->GetStateType() == stateType)
+			return state;
+	}
+	return 0;
 }
 
-template <typename StateType>
-inline const StateType* State::GetImmediateInnerState() const
+inline const State* StateMachine::GetInnerState(StateTypeId stateType, size_t startDepth) const
 {
-	return const_cast<State*>(this)->GetImmediateInnerState<StateType>();
+	return const_cast<StateMachine*>(this)->GetInnerState(stateType, startDepth);
 }
 
-template <typename SourceState>
-inline StateOverride<SourceState> State::GetStateOverride()
+inline void StateMachine::CreateAndPushInitialState(const Transition& transition)
 {
-	return StateOverride<SourceState>(GetStateMachine().GetStateOverride<SourceState>());
+	HSM_ASSERT(mStateStack.empty());
+	State* initialState = detail::CreateState(transition, this, 0);
+	HSM_LOG_TRANSITION(1, 0, TraceEvent::Init, initialState);
+	PushState(initialState);
+	HSM_RECORD_TRANSITION(StateTypeId(), transition, initialState);
+	detail::InvokeStateOnEnter(transition, initialState);
 }
 
-// Inline StateMachine function implementations
-
-template <typename SourceState, typename TargetState>
-inline void StateMachine::AddStateOverride()
+inline void StateMachine::PopStatesToDepth(size_t depth, hsm_bool invokeOnExit)
 {
-	mStateOverrides[&hsm::GetStateFactory<SourceState>()] = &hsm::GetStateFactory<TargetState>();
+	const size_t numStatesToPop = mStateStack.size() - depth;
+	size_t currDepth = mStateStack.size() - 1;
+
+	for (size_t i = 0; i < numStatesToPop; ++i, --currDepth)
+	{
+		State* state = mStateStack.back();
+		HSM_ASSERT(state == mStateStack.at(currDepth));
+
+		// Regions are stopped before the state that owns them, as they are effectively inner states
+		if (!mRegions.empty())
+		{
+			DestroyRegions(currDepth, invokeOnExit);
+		}
+
+		if (invokeOnExit)
+		{
+			HSM_LOG_TRANSITION(2, currDepth, TraceEvent::Pop, state);
+			detail::InvokeStateOnExit(state);
+		}
+		PopState();
+		detail::DestroyState(state);
+	}
 }
 
-template <typename SourceState>
-inline void StateMachine::RemoveStateOverride()
+inline hsm_bool StateMachine::ProcessStateTransitionsOnce(size_t startDepth, size_t& transitionDepth)
 {
-	const hsm::StateFactory& sourceStateFactory = hsm::GetStateFactory<SourceState>();
-	mStateOverrides.erase(mStateOverrides.find(&sourceStateFactory));
+	// Process transitions from outermost to innermost states, stopping at the first one that modifies the stack
+	for (size_t depth = startDepth; depth < mStateStack.size(); ++depth)
+	{
+		State* currState = GetStateAtDepth(depth);
+		if (currState->IsQuiescent())
+			continue;
+
+		++mFrameMetrics.mNumGetTransitionCalls;
+		const Transition& transition = detail::InvokeStateGetTransition(currState);
+
+		if (ApplyTransition(depth, transition))
+		{
+			transitionDepth = depth;
+			return hsm_true;
+		}
+	}
+
+	return hsm_false;
 }
 
-template <typename SourceState>
-inline const StateFactory& StateMachine::GetStateOverride()
+inline hsm_bool StateMachine::WouldApplyTransition(size_t depth, const Transition& transition)
 {
-	const StateFactory& sourceStateFactory = GetStateFactory<SourceState>();
-	OverrideMap::iterator iter = mStateOverrides.find(&sourceStateFactory);
-	return iter == mStateOverrides.end() ? sourceStateFactory : *iter->second;
+	// Must match the cases in which ApplyTransition modifies the stack
+	switch (transition.GetTransitionType())
+	{
+		case Transition::Inner:
+		{
+			State* innerState = GetStateAtDepth(depth + 1);
+			return !innerState || transition.GetTargetStateType() != innerState->GetStateType();
+		}
+
+		case Transition::InnerEntry:
+			return GetStateAtDepth(depth + 1) == 0;
+
+		case Transition::Sibling:
+			return hsm_true;
+
+		default:
+			return hsm_false;
+	}
 }
 
-#if !HSM_DEBUG
-	#define HSM_LOG(minLevel, numSpaces, printfArgs)
-	#define HSM_LOG_TRANSITION(minLevel, depth, transTypeStr, state)
-#else
-	#define HSM_LOG Log
-	#define HSM_LOG_TRANSITION LogTransition
+#define HSM_PROBE_TRANSITION(sourceDepth, appliedTransition) \
+	HSM_PROBE5(transition, this, sourceDepth, static_cast<int>(appliedTransition.GetTransitionType()), \
+		appliedTransition.GetTargetStateType().mIndex, appliedTransition.GetTargetStateType().mStateName)
+
+inline hsm_bool StateMachine::ApplyTransition(size_t depth, const Transition& transition)
+{
+	// If a valid sibling transition is returned, we must pop inners up to and including the state that
+	// returned the transition, then push the new inner. If an inner transition is returned, we must pop
+	// inners up to but not including the state that returned the transition (if any), then push the new inner.
+
+	switch (transition.GetTransitionType())
+	{
+		case Transition::No:
+		{
+			// Move on to next inner
+			return hsm_false;
+		}
+		break;
+
+		case Transition::Inner:
+		{
+			if (State* innerState = GetStateAtDepth(depth + 1))
+			{
+				if ( transition.GetTargetStateType() == innerState->GetStateType() )
+				{
+					// Inner is already target state so keep going to next inner
+					return hsm_false;
+				}
+				else
+				{
+					// Pop all states under us and push target
+					HSM_PROBE_TRANSITION(depth, transition);
+					PopStatesToDepth(depth + 1);
+
+					State* targetState = detail::CreateState(transition, this, depth + 1);
+					HSM_LOG_TRANSITION(1, depth + 1, TraceEvent::Inner, targetState);
+					PushState(targetState);
+					HSM_RECORD_TRANSITION(GetStateAtDepth(depth)->GetStateType(), transition, targetState);
+					detail::InvokeStateOnEnter(transition, targetState);
+					return hsm_true;
+				}
+			}
+			else
+			{
+				// No state under us so just push target
+				HSM_PROBE_TRANSITION(depth, transition);
+				State* targetState = detail::CreateState(transition, this, depth + 1);
+				HSM_LOG_TRANSITION(1, depth + 1, TraceEvent::Inner, targetState);
+				PushState(targetState);
+				HSM_RECORD_TRANSITION(GetStateAtDepth(depth)->GetStateType(), transition, targetState);
+				detail::InvokeStateOnEnter(transition, targetState);
+				return hsm_true;
+			}
+		}
+		break;
+
+		case Transition::InnerEntry:
+		{
+			// If current state has no inner (is currently the innermost), then push the entry state
+			if ( !GetStateAtDepth(depth + 1) )
+			{
+				HSM_PROBE_TRANSITION(depth, transition);
+				State* targetState = detail::CreateState(transition, this, depth + 1);
+				HSM_LOG_TRANSITION(1, depth + 1, TraceEvent::Entry, targetState);
+				PushState(targetState);
+				HSM_RECORD_TRANSITION(GetStateAtDepth(depth)->GetStateType(), transition, targetState);
+				detail::InvokeStateOnEnter(transition, targetState);
+				return hsm_true;
+			}
+		}
+		break;
+
+		case Transition::Sibling:
+		{
+#if HSM_USE_PROFILER
+			const StateTypeId sourceStateTypeId = GetStateAtDepth(depth)->GetStateType();
 #endif
+			HSM_PROBE_TRANSITION(depth, transition);
+			PopStatesToDepth(depth);
+
+			State* targetState = detail::CreateState(transition, this, depth);
+			HSM_LOG_TRANSITION(1, depth, TraceEvent::Sibling, targetState);
+			PushState(targetState);
+			HSM_RECORD_TRANSITION(sourceStateTypeId, transition, targetState);
+			detail::InvokeStateOnEnter(transition, targetState);
+			return hsm_true;
+		}
+		break;
 
-namespace detail
+	} // end switch on transition type
+
+	return hsm_false;
+}
+
+inline void StateMachine::PushState(State* state)
 {
-	inline void InitState(State* state, StateMachine* ownerStateMachine, size_t stackDepth, const StateFactory& stateFactory)
+	if (mTimerService)
 	{
-		HSM_ASSERT(ownerStateMachine != 0);
-		state->mOwnerStateMachine = ownerStateMachine;
-		state->mOwner = ownerStateMachine->GetOwner();
-		state->mStackDepth = stackDepth;
-		state->mStateTypeId = stateFactory.GetStateType();
-		state->mStateDebugName = stateFactory.GetStateName();
+		state->mEntryTime = mTimerService->GetTime();
 	}
 
-	inline State* CreateState(const Transition& transition, StateMachine* ownerStateMachine, size_t stackDepth)
+#if HSM_USE_ACTIVE_STATE_TABLE
+	mActiveStates.OnPushState(state->GetStateType(), mStateStack.size());
+#endif
+	mStateStack.push_back(state);
+	HSM_PROBE4(state_push, this, mStateStack.size() - 1, state->GetStateType().mIndex, state->GetStateType().mStateName);
+
+	++mFrameMetrics.mNumPushes;
+	if (mStateStack.size() > mFrameMetrics.mPeakStackDepth)
+	{
+		mFrameMetrics.mPeakStackDepth = mStateStack.size();
+	}
+}
+
+inline void StateMachine::PopState()
+{
+	if (mStateStack.back()->IsQuiescent())
 	{
-		State* state = transition.GetStateFactory().AllocateState();
-		InitState(state, ownerStateMachine, stackDepth, transition.GetStateFactory());
-		return state;
+		--mNumQuiescentStates;
 	}
 
-	inline void DestroyState(State* state)
+	if (mStateStack.back()->mTimers)
 	{
-		HSM_DELETE(state);
+		mTimerService->CancelTimers(mStateStack.back());
 	}
 
-	inline void InvokeStateOnEnter(const Transition& transition, State* state)
+	// Remove the deferred transition of the popped state, if any
+	const size_t depth = mStateStack.size() - 1;
+	for (size_t i = 0; i < mNumDeferredTransitions; ++i)
 	{
-		if (const auto& onEnterArgsFunc = transition.GetOnEnterArgsFunc())
-		{
-			onEnterArgsFunc(state);
-		}
-		else
+		if (mDeferredTransitions[i].mDepth == depth)
 		{
-			state->OnEnter();
+			RemoveDeferredTransition(i);
+			break;
 		}
 	}
 
-	inline void InvokeStateOnExit(State* state)
+#if HSM_USE_ACTIVE_STATE_TABLE
+	mActiveStates.OnPopState(mStateStack.back()->GetStateType(), depth);
+#endif
+
+	HSM_PROBE4(state_pop, this, depth, mStateStack.back()->GetStateType().mIndex, mStateStack.back()->GetStateType().mStateName);
+
+#if HSM_USE_PROFILER
+	const State* state = mStateStack.back();
+	if (mTransitionGraph && state->mEntryProfileTime != 0)
 	{
-		state->OnExit();
+		mTransitionGraph->RecordExit(state->mEntrySourceStateTypeId, state->GetStateType(), state->mEntryTransitionType,
+			detail::GetProfileTime() - state->mEntryProfileTime);
 	}
-}
+#endif
 
-inline StateMachine::StateMachine()
-	: mOwner(0)
-	, mDebugTraceLevel(TraceLevel::None)
-{
-	mDebugName[0] = '\0';
+	mStateStack.pop_back();
+	++mFrameMetrics.mNumPops;
 }
 
-inline StateMachine::~StateMachine()
+#if HSM_USE_PROFILER
+inline void StateMachine::RecordTransition(const StateTypeId& sourceStateTypeId, const Transition& transition, State* targetState)
 {
-	Shutdown(hsm_false);
+	if (mTransitionGraph)
+	{
+		targetState->mEntrySourceStateTypeId = sourceStateTypeId;
+		targetState->mEntryTransitionType = transition.GetTransitionType();
+		targetState->mEntryProfileTime = detail::GetProfileTime();
+		mTransitionGraph->RecordTransition(sourceStateTypeId, targetState->GetStateType(), targetState->mEntryTransitionType);
+	}
 }
+#endif
 
-inline void StateMachine::Shutdown(hsm_bool stop)
+inline void StateMachine::Log(size_t minLevel, size_t numSpaces, const hsm_char* format, ...)
 {
-	if (stop)
-		Stop();
+	if (static_cast<size_t>(mDebugTraceLevel) >= minLevel)
+	{
+		// Per thread, since state machines may be processed on different threads (see hsm_parallel.h)
+		static thread_local hsm_char buffer[4096];
+ 		int offset = SNPRINTF(buffer, sizeof(buffer), HSM_TEXT("HSM_%lu_%s:%*s "), static_cast<unsigned long>(minLevel), mDebugName, static_cast<int>(numSpaces), "");
 
-	// Free any allocated states
-	PopStatesToDepth(0, hsm_false);
+		va_list args;
+		va_start(args, format);
+		VSNPRINTF(buffer + offset, sizeof(buffer) - offset - 1, format, args);
 
-	mOwner = 0;
-	mInitialTransition = NoTransition();
+		// Print to stdout
+		HSM_PRINTF(HSM_TEXT("%s"), buffer);
+		va_end(args);
+	}
 }
 
-inline void StateMachine::Stop()
+inline void StateMachine::LogTransition(size_t minLevel, size_t depth, TraceEvent::Type traceEvent, State* state)
 {
-	PopStatesToDepth(0);
-	HSM_ASSERT(mStateStack.empty());
+	if (mTraceSink && static_cast<size_t>(mTraceSinkLevel) >= minLevel)
+	{
+		TraceRecord record;
+		record.mTime = detail::GetTraceTime();
+		record.mDuration = 0;
+		record.mStateMachineId = reinterpret_cast<uintptr_t>(this);
+		record.mStateName = state->GetStateType().mStateName;
+		record.mDepth = static_cast<uint16_t>(depth);
+		record.mEvent = static_cast<uint8_t>(traceEvent);
+		record.mLevel = static_cast<uint8_t>(minLevel);
+		mTraceSink->Write(record);
+	}
+
+#if HSM_DEBUG
+	Log(minLevel, depth, HSM_TEXT("%-8s: %s\n"), GetTraceEventName(traceEvent), state->GetStateDebugName());
+#endif
 }
 
-inline void StateMachine::SetDebugInfo(const hsm_char* name, TraceLevel::Type traceLevel)
+#undef HSM_LOG
+#undef HSM_LOG_TRANSITION
+#undef HSM_PROFILE_SCOPE
+#undef HSM_TRACE_CALL_SCOPE
+#undef HSM_UPDATE_PROBE_SCOPE
+#undef HSM_RECORD_TRANSITION
+#undef HSM_PROBE_TRANSITION
+#undef HSM_PROBE3
+#undef HSM_PROBE4
+#undef HSM_PROBE5
+
+} // namespace hsm
+
+#ifdef HSM_COMPILER_MSC
+#pragma endregion "StateMachine"
+#endif
+
+#ifdef HSM_COMPILER_MSC
+#pragma region "StateMachineGroup"
+#endif
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// StateMachineGroup
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace hsm {
+
+// Runs the transition and update phases of many state machines in batches. Machines are registered with the
+// group (not owned by it), and must be removed before they are destroyed. While iterating, the group prefetches
+// upcoming machines, their state stacks and their owners.
+class StateMachineGroup
 {
-	SetDebugName(name);
-	SetDebugTraceLevel(traceLevel);
-}
+public:
+	StateMachineGroup() : mBucketByLeafStateType(hsm_false), mTimerService(0), mSleepIdleStateMachines(hsm_false), mBusiestStateMachine(0), mMaxSettleIterations(0) {}
+	~StateMachineGroup();
+
+	void AddStateMachine(StateMachine* stateMachine);
+	void RemoveStateMachine(StateMachine* stateMachine);
+	size_t GetNumStateMachines() const { return mStateMachines.size(); }
+	StateMachine* GetStateMachine(size_t index) { return mStateMachines[index]; }
+
+	// If set, after each transition phase, machines are reordered so that machines with the same innermost
+	// state type are processed back to back, which improves instruction cache and branch prediction locality
+	// of the states' virtual functions. The relative order of machines in the same bucket is preserved, but
+	// otherwise machines are no longer processed in the order they were added, which loses any locality between
+	// that order and the order in which their states were allocated. Only worth enabling when there are enough
+	// state types with enough code to thrash the instruction cache (see benchmarks_group_frame_time in the
+	// samples). Off by default.
+	void SetBucketByLeafStateType(hsm_bool bucket) { mBucketByLeafStateType = bucket; }
+	hsm_bool GetBucketByLeafStateType() const { return mBucketByLeafStateType; }
+
+	// Sets the TimerService of the machines in the group, including those added later. The group updates it
+	// before processing the machines.
+	void SetTimerService(TimerService* timerService);
+	TimerService* GetTimerService() { return mTimerService; }
+
+	// Updates the group's TimerService, if any; called by ProcessStateTransitions and EvaluateStateTransitions
+	void UpdateTimers();
+
+	// If set, machines that are idle once their transitions are processed (see StateMachine::IsIdle) are put to
+	// sleep: they are removed from the active list, and are neither processed nor updated until woken (see
+	// StateMachine::Wake), which makes idle machines nearly free. Only enable if quiescent states have no work
+	// to do in Update. Off by default; turning it off wakes all machines.
+	void SetSleepIdleStateMachines(hsm_bool sleep);
+	hsm_bool GetSleepIdleStateMachines() const { return mSleepIdleStateMachines; }
+
+	// Machines that are processed and updated, which is all of them unless idle machines are put to sleep
+	size_t GetNumActiveStateMachines() const { return mActiveStateMachines.size(); }
+	StateMachine* GetActiveStateMachine(size_t index) { return mActiveStateMachines[index]; }
+
+	// Adds machines woken since the last call to the active list; called by ProcessStateTransitions,
+	// EvaluateStateTransitions and UpdateStates
+	void ActivateWokenStateMachines();
+
+	// Sums the frame metrics of the active machines, puts idle machines to sleep, if enabled, and sorts the
+	// remaining ones by leaf state type, if enabled; done by ProcessStateTransitions and ApplyStateTransitions
+	void FinishStateTransitions();
+
+	// Work done by the machines during the last frame, and summed over all frames since the group was created
+	// or ResetMetrics was called (see StateMachine::GetFrameMetrics)
+	const FrameMetrics& GetFrameMetrics() const { return mFrameMetrics; }
+	FrameMetrics GetTotalMetrics() const { FrameMetrics metrics = mTotalMetrics; metrics.Add(mFrameMetrics); return metrics; }
+	void ResetMetrics() { mFrameMetrics.Reset(); mTotalMetrics.Reset(); mBusiestStateMachine = 0; }
+
+	// Returns the machine that made the most settle iterations during the last frame, or NULL if none made any
+	StateMachine* GetBusiestStateMachine() { return mBusiestStateMachine; }
+
+	// Calls ProcessStateTransitions on every active machine
+	void ProcessStateTransitions();
 
-inline void StateMachine::SetDebugName(const hsm_char* name)
+	// Calls UpdateStates on every active machine
+	void UpdateStates(HSM_STATE_UPDATE_ARGS);
+
+	// Call EvaluateStateTransitions, then ApplyStateTransitions, on every active machine (see
+	// StateMachine::EvaluateStateTransitions). The evaluate phase may be run in parallel instead (see
+	// hsm_parallel.h), followed by this ApplyStateTransitions.
+	void EvaluateStateTransitions();
+	void ApplyStateTransitions();
+
+	// Reorders active machines by their innermost state type; done by FinishStateTransitions if bucketing is
+	// enabled
+	void SortByLeafStateType();
+
+private:
+	friend class StateMachine;
+
+	typedef HSM_STD_VECTOR<StateMachine*> StateMachineList;
+
+	static void RemoveFromList(StateMachineList& stateMachines, StateMachine* stateMachine);
+	static void Prefetch(StateMachineList& stateMachines, size_t index);
+	static size_t GetLeafStateTypeBucket(StateMachine& stateMachine);
+
+	// FinishStateTransitions, split so that it can be done for each machine right after processing it, while
+	// it's still cached, rather than in another pass over all machines. FinishStateMachine keeps active machines
+	// at the front of mActiveStateMachines, of which there are numActive, and records their buckets if enabled.
+	void BeginFinishStateTransitions();
+	void FinishStateMachine(StateMachine* stateMachine, size_t& numActive);
+	void EndFinishStateTransitions(size_t numActive);
+
+	// Counting sort of mActiveStateMachines by mLeafStateTypeBuckets
+	void SortByLeafStateTypeBuckets();
+
+	StateMachineList mStateMachines;
+	StateMachineList mActiveStateMachines; // Processed and updated, in that order
+	StateMachineList mWokenStateMachines; // Woken while asleep, added to mActiveStateMachines when next processed
+	hsm_bool mBucketByLeafStateType;
+	TimerService* mTimerService;
+	hsm_bool mSleepIdleStateMachines;
+	FrameMetrics mFrameMetrics;
+	FrameMetrics mTotalMetrics; // Not including mFrameMetrics
+	StateMachine* mBusiestStateMachine;
+	size_t mMaxSettleIterations; // Of mBusiestStateMachine
+
+	// Kept to avoid reallocating when sorting
+	StateMachineList mSortedStateMachines;
+	HSM_STD_VECTOR<size_t> mLeafStateTypeBuckets; // Bucket of each active machine, when sorting
+	HSM_STD_VECTOR<size_t> mBucketOffsets;
+};
+
+inline void StateMachine::Wake()
 {
-	STRNCPY(mDebugName, name, HSM_DEBUG_NAME_MAXLEN);
-	mDebugName[HSM_DEBUG_NAME_MAXLEN - 1] = '\0';
+	// Regions are processed by their parent, so it's the root machine that sleeps
+	if (mParentState)
+	{
+		mParentState->GetStateMachine().Wake();
+	}
+	else if (mAsleep)
+	{
+		mAsleep = hsm_false;
+		mGroup->mWokenStateMachines.push_back(this);
+	}
 }
 
-inline void StateMachine::ProcessStateTransitions()
+inline StateMachineGroup::~StateMachineGroup()
 {
-	// If the state stack is empty, push the initial state
-	if (mStateStack.empty())
+	for (size_t i = 0; i < mStateMachines.size(); ++i)
 	{
-		HSM_ASSERT_MSG(!mInitialTransition.IsNo(), "Must call Initialize()");
-		CreateAndPushInitialState(mInitialTransition);
+		mStateMachines[i]->mGroup = 0;
+		mStateMachines[i]->mAsleep = hsm_false;
 	}
+}
 
-	// After we make a transition, we must process all transitions again until we get no transitions
-	// from all states on the stack.
-	hsm_bool keepProcessing = hsm_true;
-	int numTransitionsProcessed = 0;
-	while (keepProcessing)
+inline void StateMachineGroup::AddStateMachine(StateMachine* stateMachine)
+{
+	HSM_ASSERT(stateMachine != 0);
+	HSM_ASSERT_MSG(stateMachine->mGroup == 0, "StateMachine is already in a StateMachineGroup");
+	HSM_ASSERT_MSG(stateMachine->mParentState == 0, "Regions are processed by their parent StateMachine");
+	stateMachine->mGroup = this;
+	mStateMachines.push_back(stateMachine);
+	mActiveStateMachines.push_back(stateMachine);
+
+	if (mTimerService)
 	{
-		keepProcessing = ProcessStateTransitionsOnce();
-
-		if (++numTransitionsProcessed >= 1000)
-		{
-			HSM_ASSERT_MSG(hsm_false, "ProcessStateTransitions: detected infinite transition loop");
-		}
+		stateMachine->SetTimerService(mTimerService);
 	}
 }
 
-inline void StateMachine::UpdateStates(HSM_STATE_UPDATE_ARGS)
+inline void StateMachineGroup::SetTimerService(TimerService* timerService)
 {
-	OuterToInnerIterator iter = BeginOuterToInner();
-	OuterToInnerIterator end = EndOuterToInner();
-	for ( ; iter != end; ++iter)
+	mTimerService = timerService;
+	for (size_t i = 0; i < mStateMachines.size(); ++i)
 	{
-		(*iter)->Update(HSM_STATE_UPDATE_ARGS_FORWARD);
+		mStateMachines[i]->SetTimerService(timerService);
 	}
 }
 
-inline State* StateMachine::GetState(StateTypeId stateType)
+inline void StateMachineGroup::UpdateTimers()
 {
-	for (size_t i = 0; i < mStateStack.size(); ++i)
+	if (mTimerService)
 	{
-		State* state = mStateStack[i];
-		if (state->GetStateType() == stateType)
-			return state;
+		mTimerService->Update();
 	}
-	return 0;
 }
 
-inline State* StateMachine::GetStateAtDepth(size_t depth)
+inline void StateMachineGroup::RemoveStateMachine(StateMachine* stateMachine)
 {
-	if (depth >= mStateStack.size())
+	HSM_ASSERT_MSG(stateMachine->mGroup == this, "StateMachine is not in this StateMachineGroup");
+	RemoveFromList(mStateMachines, stateMachine);
+	if (stateMachine->mAsleep)
 	{
-		return 0;
+		stateMachine->mAsleep = hsm_false;
+	}
+	else
+	{
+		// Either active, or woken and not yet active
+		RemoveFromList(mActiveStateMachines, stateMachine);
+		RemoveFromList(mWokenStateMachines, stateMachine);
 	}
 
-	return mStateStack[depth];
+	if (mBusiestStateMachine == stateMachine)
+	{
+		mBusiestStateMachine = 0;
+	}
+	stateMachine->mGroup = 0;
 }
 
-inline State* StateMachine::GetStateAtDepth(size_t depth, StateTypeId stateType)
+inline void StateMachineGroup::RemoveFromList(StateMachineList& stateMachines, StateMachine* stateMachine)
 {
-	State* state = GetStateAtDepth(depth);
-	return (state && state->GetStateType() == stateType) ? state : 0;
+	for (size_t i = 0; i < stateMachines.size(); ++i)
+	{
+		if (stateMachines[i] == stateMachine)
+		{
+			stateMachines.erase(stateMachines.begin() + i);
+			return;
+		}
+	}
 }
 
-inline State* StateMachine::GetOuterState(StateTypeId stateType, size_t startDepth)
+inline void StateMachineGroup::SetSleepIdleStateMachines(hsm_bool sleep)
 {
-	const size_t numStatesToCompare = startDepth + 1;
-	size_t currDepth = startDepth;
-
-	for (size_t i = 0; i < numStatesToCompare; ++i, --currDepth)
+	mSleepIdleStateMachines = sleep;
+	if (!sleep)
 	{
-		State* state = mStateStack[currDepth];
-		if (state->GetStateType() == stateType)
-			return state;
+		for (size_t i = 0; i < mStateMachines.size(); ++i)
+		{
+			mStateMachines[i]->Wake();
+		}
+		ActivateWokenStateMachines();
 	}
-	return 0;
 }
 
-inline const State* StateMachine::GetOuterState(StateTypeId stateType, size_t startDepth) const
+inline void StateMachineGroup::ActivateWokenStateMachines()
 {
-	return const_cast<StateMachine*>(this)->GetOuterState(stateType, startDepth);
+	if (!mWokenStateMachines.empty())
+	{
+		mActiveStateMachines.insert(mActiveStateMachines.end(), mWokenStateMachines.begin(), mWokenStateMachines.end());
+		mWokenStateMachines.clear();
+	}
 }
 
-inline State* StateMachine::GetInnerState(StateTypeId stateType, size_t startDepth)
+inline void StateMachineGroup::FinishStateTransitions()
 {
-	for (size_t i = startDepth; i < mStateStack.size(); ++i)
+	BeginFinishStateTransitions();
+
+	size_t numActive = 0;
+	for (size_t i = 0; i < mActiveStateMachines.size(); ++i)
 	{
-		State* state = mStateStack[i];
-		if (state->GetStateType() == stateType)
-			return state;
+		FinishStateMachine(mActiveStateMachines[i], numActive);
 	}
-	return 0;
+
+	EndFinishStateTransitions(numActive);
 }
 
-inline const State* StateMachine::GetInnerState(StateTypeId stateType, size_t startDepth) const
+inline void StateMachineGroup::BeginFinishStateTransitions()
 {
-	return const_cast<StateMachine*>(this)->GetInnerState(stateType, startDepth);
+	mTotalMetrics.Add(mFrameMetrics);
+	mFrameMetrics.Reset();
+	mBusiestStateMachine = 0;
+	mMaxSettleIterations = 0;
+	mLeafStateTypeBuckets.clear();
 }
 
-inline void StateMachine::CreateAndPushInitialState(const Transition& transition)
+inline void StateMachineGroup::FinishStateMachine(StateMachine* stateMachine, size_t& numActive)
 {
-	HSM_ASSERT(mStateStack.empty());
-	State* initialState = detail::CreateState(transition, this, 0);
-	HSM_LOG_TRANSITION(1, 0, HSM_TEXT("Init"), initialState);
-	PushState(initialState);
-	detail::InvokeStateOnEnter(transition, initialState);
+	const FrameMetrics& metrics = stateMachine->mFrameMetrics;
+	mFrameMetrics.Add(metrics);
+	if (metrics.mNumSettleIterations > mMaxSettleIterations)
+	{
+		mMaxSettleIterations = metrics.mNumSettleIterations;
+		mBusiestStateMachine = stateMachine;
+	}
+
+	if (mSleepIdleStateMachines && stateMachine->IsIdle())
+	{
+		stateMachine->mAsleep = hsm_true;
+	}
+	else
+	{
+		// Compact in place, preserving the order of the remaining machines
+		mActiveStateMachines[numActive++] = stateMachine;
+		if (mBucketByLeafStateType)
+		{
+			mLeafStateTypeBuckets.push_back(GetLeafStateTypeBucket(*stateMachine));
+		}
+	}
 }
 
-inline void StateMachine::PopStatesToDepth(size_t depth, hsm_bool invokeOnExit)
+inline void StateMachineGroup::EndFinishStateTransitions(size_t numActive)
 {
-	const size_t numStatesToPop = mStateStack.size() - depth;
-	size_t currDepth = mStateStack.size() - 1;
+	mActiveStateMachines.resize(numActive);
 
-	for (size_t i = 0; i < numStatesToPop; ++i, --currDepth)
+	if (mBucketByLeafStateType)
 	{
-		State* state = mStateStack.back();
-		HSM_ASSERT(state == mStateStack.at(currDepth));
+		SortByLeafStateTypeBuckets();
+	}
+}
 
-		if (invokeOnExit)
+inline void StateMachineGroup::Prefetch(StateMachineList& stateMachines, size_t index)
+{
+	// The machine two ahead is fetched first, so that by the time we get to the next one, its members are
+	// likely cached and we can follow its pointers without stalling.
+	if (index + 2 < stateMachines.size())
+	{
+		HSM_PREFETCH(stateMachines[index + 2]);
+	}
+
+	if (index + 1 < stateMachines.size())
+	{
+		StateMachine* stateMachine = stateMachines[index + 1];
+		HSM_PREFETCH(stateMachine->mOwner);
+		if (!stateMachine->mStateStack.empty())
 		{
-			HSM_LOG_TRANSITION(2, currDepth, HSM_TEXT("Pop"), state);
-			detail::InvokeStateOnExit(state);
+			HSM_PREFETCH(&stateMachine->mStateStack[0]);
+			HSM_PREFETCH(stateMachine->mStateStack.back());
 		}
-		PopState();
-		detail::DestroyState(state);
 	}
 }
 
-inline hsm_bool StateMachine::ProcessStateTransitionsOnce()
+inline void StateMachineGroup::ProcessStateTransitions()
 {
-	// Process transitions from outermost to innermost states; if a valid sibling transition
-	// is returned, we must pop inners up to and including the state that returned the transition,
-	// then push the new inner. If an inner transition is returned, we must pop inners up to but
-	// not including the state that returned the transition (if any), then push the new inner.
+	UpdateTimers();
+	ActivateWokenStateMachines();
 
-	for (size_t depth = 0; depth < mStateStack.size(); ++depth)
+	BeginFinishStateTransitions();
+
+	size_t numActive = 0;
+	for (size_t i = 0; i < mActiveStateMachines.size(); ++i)
 	{
-		State* currState = GetStateAtDepth(depth);
-		const Transition& transition = currState->GetTransition();
+		Prefetch(mActiveStateMachines, i);
+		StateMachine* stateMachine = mActiveStateMachines[i];
+		stateMachine->ProcessStateTransitions();
+		FinishStateMachine(stateMachine, numActive);
+	}
 
-		switch (transition.GetTransitionType())
-		{
-			case Transition::No:
-			{
-				// Move on to next inner
-				continue;
-			}
-			break;
+	EndFinishStateTransitions(numActive);
+}
 
-			case Transition::Inner:
-			{
-				if (State* innerState = GetStateAtDepth(depth + 1))
-				{
-					if ( transition.GetTargetStateType() == innerState->GetStateType() )
-					{
-						// Inner is already target state so keep going to next inner
-						continue;
-					}
-					else
-					{
-						// Pop all states under us and push target
-						PopStatesToDepth(depth + 1);
-
-						State* targetState = detail::CreateState(transition, this, depth + 1);
-						HSM_LOG_TRANSITION(1, depth + 1, HSM_TEXT("Inner"), targetState);
-						PushState(targetState);
-						detail::InvokeStateOnEnter(transition, targetState);
-						return hsm_true;
-					}
-				}
-				else
-				{
-					// No state under us so just push target
-					State* targetState = detail::CreateState(transition, this, depth + 1);
-					HSM_LOG_TRANSITION(1, depth + 1, HSM_TEXT("Inner"), targetState);
-					PushState(targetState);
-					detail::InvokeStateOnEnter(transition, targetState);
-					return hsm_true;
-				}
-			}
-			break;
+inline void StateMachineGroup::EvaluateStateTransitions()
+{
+	UpdateTimers();
+	ActivateWokenStateMachines();
 
-			case Transition::InnerEntry:
-			{
-				// If current state has no inner (is currently the innermost), then push the entry state
-				if ( !GetStateAtDepth(depth + 1) )
-				{
-					State* targetState = detail::CreateState(transition, this, depth + 1);
-					HSM_LOG_TRANSITION(1, depth + 1, HSM_TEXT("Entry"), targetState);
-					PushState(targetState);
-					detail::InvokeStateOnEnter(transition, targetState);
-					return hsm_true;
-				}
-			}
-			break;
+	for (size_t i = 0; i < mActiveStateMachines.size(); ++i)
+	{
+		Prefetch(mActiveStateMachines, i);
+		mActiveStateMachines[i]->EvaluateStateTransitions();
+	}
+}
 
-			case Transition::Sibling:
-			{
-				PopStatesToDepth(depth);
+inline void StateMachineGroup::ApplyStateTransitions()
+{
+	BeginFinishStateTransitions();
 
-				State* targetState = detail::CreateState(transition, this, depth);
-				HSM_LOG_TRANSITION(1, depth, HSM_TEXT("Sibling"), targetState);
-				PushState(targetState);
-				detail::InvokeStateOnEnter(transition, targetState);
-				return hsm_true;
-			}
-			break;
+	size_t numActive = 0;
+	for (size_t i = 0; i < mActiveStateMachines.size(); ++i)
+	{
+		Prefetch(mActiveStateMachines, i);
+		StateMachine* stateMachine = mActiveStateMachines[i];
+		stateMachine->ApplyStateTransitions();
+		FinishStateMachine(stateMachine, numActive);
+	}
+
+	EndFinishStateTransitions(numActive);
+}
 
-		} // end switch on transition type
-	} // end for each depth
+inline void StateMachineGroup::UpdateStates(HSM_STATE_UPDATE_ARGS)
+{
+	ActivateWokenStateMachines();
 
-	return hsm_false;
+	for (size_t i = 0; i < mActiveStateMachines.size(); ++i)
+	{
+		Prefetch(mActiveStateMachines, i);
+		mActiveStateMachines[i]->UpdateStates(HSM_STATE_UPDATE_ARGS_FORWARD);
+	}
 }
 
-inline void StateMachine::PushState(State* state)
+inline size_t StateMachineGroup::GetLeafStateTypeBucket(StateMachine& stateMachine)
 {
-	mStateStack.push_back(state);
+	// Bucket 0 is for machines with an empty stack, and bucket i + 1 for state type index i
+	return stateMachine.mStateStack.empty() ? 0 : stateMachine.mStateStack.back()->GetStateType().mIndex + 1;
 }
 
-inline void StateMachine::PopState()
+inline void StateMachineGroup::SortByLeafStateType()
 {
-	mStateStack.pop_back();
+	mLeafStateTypeBuckets.resize(mActiveStateMachines.size());
+	for (size_t i = 0; i < mActiveStateMachines.size(); ++i)
+	{
+		mLeafStateTypeBuckets[i] = GetLeafStateTypeBucket(*mActiveStateMachines[i]);
+	}
+
+	SortByLeafStateTypeBuckets();
 }
 
-inline void StateMachine::Log(size_t minLevel, size_t numSpaces, const hsm_char* format, ...)
+inline void StateMachineGroup::SortByLeafStateTypeBuckets()
 {
-	if (static_cast<size_t>(mDebugTraceLevel) >= minLevel)
+	// Counting sort on the innermost state's type index, which is stable and linear in the number of machines.
+	// Only the bucket array is read, so the machines themselves aren't touched again.
+	HSM_ASSERT(mLeafStateTypeBuckets.size() == mActiveStateMachines.size());
+	const size_t numBuckets = GetNumStateTypes() + 1;
+	mBucketOffsets.assign(numBuckets + 1, 0);
+
+	for (size_t i = 0; i < mLeafStateTypeBuckets.size(); ++i)
 	{
-		static hsm_char buffer[4096];
- 		int offset = SNPRINTF(buffer, sizeof(buffer), HSM_TEXT("HSM_%lu_%s:%*s "), static_cast<unsigned long>(minLevel), mDebugName, static_cast<int>(numSpaces), "");
+		++mBucketOffsets[mLeafStateTypeBuckets[i] + 1];
+	}
 
-		va_list args;
-		va_start(args, format);
-		VSNPRINTF(buffer + offset, sizeof(buffer) - offset - 1, format, args);
+	for (size_t bucket = 1; bucket <= numBuckets; ++bucket)
+	{
+		mBucketOffsets[bucket] += mBucketOffsets[bucket - 1];
+	}
 
-		// Print to stdout
-		HSM_PRINTF(HSM_TEXT("%s"), buffer);
-		va_end(args);
+	mSortedStateMachines.resize(mActiveStateMachines.size());
+	for (size_t i = 0; i < mActiveStateMachines.size(); ++i)
+	{
+		mSortedStateMachines[mBucketOffsets[mLeafStateTypeBuckets[i]]++] = mActiveStateMachines[i];
 	}
-}
 
-inline void StateMachine::LogTransition(size_t minLevel, size_t depth, const hsm_char* transType, State* state)
-{
-	Log(minLevel, depth, HSM_TEXT("%-8s: %s\n"), transType, state->GetStateDebugName());
+	mActiveStateMachines.swap(mSortedStateMachines);
 }
 
-#undef HSM_LOG
-#undef HSM_LOG_TRANSITION
-
 } // namespace hsm
 
 #ifdef HSM_COMPILER_MSC
-#pragma endregion "StateMachine"
+#pragma endregion "StateMachineGroup"
 #endif
 
 #endif // __HSM_H__
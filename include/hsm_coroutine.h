@@ -0,0 +1,420 @@
+// Hierarchical State Machine (HSM)
+//
+// Copyright (c) 2015 Antonio Maiorano
+//
+// Distributed under the MIT License (MIT)
+// (See accompanying file LICENSE.txt or copy at
+// http://opensource.org/licenses/MIT)
+
+/// \file hsm_coroutine.h
+/// \brief Coroutine states for long-running behaviors (requires C++20)
+
+#pragma once
+#ifndef __HSM_COROUTINE_H__
+#define __HSM_COROUTINE_H__
+
+#include "hsm.h"
+
+#if !defined(__cpp_impl_coroutine) || __cpp_impl_coroutine < 201902L
+#error "hsm_coroutine.h requires C++20 coroutines"
+#endif
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+
+namespace hsm {
+
+class CoroutineState;
+
+namespace detail
+{
+	// Something a CoroutineState is suspended on
+	struct CoroutineAwaiter
+	{
+		virtual hsm_bool IsReady(CoroutineState& state) = 0;
+		virtual hsm_bool AcceptEvent(const Event&) { return hsm_false; }
+
+		// Quiesces the state until it may be ready, if it doesn't need polling. Called when the coroutine
+		// suspends, and again if the state is woken before it's ready (e.g. by StateMachine::WakeStates).
+		virtual void Suspend(CoroutineState&) {}
+	};
+
+	// State machine of the CoroutineState whose Run is being called, if any
+	inline StateMachine*& GetCoroutineStateMachine()
+	{
+		static thread_local StateMachine* stateMachine = 0;
+		return stateMachine;
+	}
+
+#if HSM_USE_STATE_POOLS
+	// Coroutine frames are allocated from the StatePoolSet of the state machine, prefixed by a header that keeps
+	// the set to return the frame to, as the deallocation function only gets the frame and its size.
+	struct CoroutineFrameHeader
+	{
+		StatePoolSet* mStatePoolSet;
+	};
+	static const size_t kCoroutineFrameHeaderSize = (sizeof(CoroutineFrameHeader) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+	inline void* AllocateCoroutineFrame(size_t size, StateMachine& stateMachine)
+	{
+		StatePoolSet& statePoolSet = stateMachine.GetStatePoolSet();
+		unsigned char* block = static_cast<unsigned char*>(statePoolSet.AllocateBlock(kCoroutineFrameHeaderSize + size));
+		reinterpret_cast<CoroutineFrameHeader*>(block)->mStatePoolSet = &statePoolSet;
+		return block + kCoroutineFrameHeaderSize;
+	}
+
+	inline void DeallocateCoroutineFrame(void* frame, size_t size)
+	{
+		unsigned char* block = static_cast<unsigned char*>(frame) - kCoroutineFrameHeaderSize;
+		reinterpret_cast<CoroutineFrameHeader*>(block)->mStatePoolSet->DeallocateBlock(block, kCoroutineFrameHeaderSize + size);
+	}
+#else
+	inline void* AllocateCoroutineFrame(size_t size, StateMachine&)
+	{
+		return HSM_ALLOC(size);
+	}
+
+	inline void DeallocateCoroutineFrame(void* frame, size_t)
+	{
+		HSM_FREE(frame);
+	}
+#endif
+}
+
+// Return type of CoroutineState::Run
+class StateCoroutine
+{
+public:
+	struct promise_type
+	{
+		// Run is only called by CoroutineState, which sets the state machine to allocate from
+		static void* operator new(size_t size)
+		{
+			HSM_ASSERT_MSG(detail::GetCoroutineStateMachine(), "StateCoroutine may only be returned by CoroutineState::Run");
+			return detail::AllocateCoroutineFrame(size, *detail::GetCoroutineStateMachine());
+		}
+
+		static void operator delete(void* frame, size_t size)
+		{
+			detail::DeallocateCoroutineFrame(frame, size);
+		}
+
+		StateCoroutine get_return_object() { return StateCoroutine(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+		std::suspend_always final_suspend() noexcept { return std::suspend_always(); }
+		void return_value(const Transition& transition) { mTransition = transition; }
+		void unhandled_exception() { std::terminate(); }
+
+		Transition mTransition;
+	};
+
+	StateCoroutine(StateCoroutine&& rhs) : mHandle(rhs.mHandle) { rhs.mHandle = 0; }
+	~StateCoroutine() { if (mHandle) mHandle.destroy(); }
+
+private:
+	friend class CoroutineState;
+
+	explicit StateCoroutine(std::coroutine_handle<promise_type> handle) : mHandle(handle) {}
+	StateCoroutine(const StateCoroutine&);
+	StateCoroutine& operator=(const StateCoroutine&);
+
+	std::coroutine_handle<promise_type> mHandle;
+};
+
+// A state whose behavior is written as a coroutine, Run, that co_awaits frames, durations, predicates or events,
+// and finally co_returns the transition the state makes (or NoTransition() to stay in the state), e.g.:
+//
+//   StateCoroutine Run() override
+//   {
+//       Owner().PlayAnim("Open");
+//       co_await WaitUntil([this] { return Owner().IsAnimDone(); });
+//       co_return SiblingTransition<Opened>();
+//   }
+//
+// This replaces polling states and their "Done" marker states. The coroutine is started on the first call to
+// GetTransition, and resumed from GetTransition only once what it awaits is ready. While it awaits frames, an
+// event, or a delay measured by the state machine's TimerService, the state is quiescent (see State::Quiesce), so
+// the state machine skips it entirely. Once the coroutine
+// returns, GetTransition keeps returning its transition. The coroutine frame is allocated from the state
+// machine's StatePoolSet if HSM_USE_STATE_POOLS is set, and is destroyed along with the state.
+//
+// GetTransition and HandleEvent should not be overridden by derived states. Since GetTransition resumes the
+// coroutine, state machines with coroutine states may not use StateMachine::EvaluateStateTransitions. Use
+// StateWithOwner<OwnerType, CoroutineState> to access the owner.
+class CoroutineState : public State
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	CoroutineState() : mAwaiter(0) {}
+
+	virtual ~CoroutineState()
+	{
+		if (mCoroutine)
+			mCoroutine.destroy();
+	}
+
+	virtual StateCoroutine Run() = 0;
+
+	virtual Transition GetTransition();
+	virtual hsm_bool HandleEvent(const Event& event, Transition& outTransition);
+
+protected:
+	class FramesAwaiter;
+	class TimeAwaiter;
+	template <typename Predicate> class PredicateAwaiter;
+	template <typename EventType> class EventAwaiter;
+
+	// Resumes after numFrames more calls to ProcessStateTransitions
+	FramesAwaiter WaitFrames(size_t numFrames);
+	FramesAwaiter NextFrame();
+
+	// Resumes on the first call to ProcessStateTransitions once the input delay, in ticks of the state machine's
+	// TimerService clock, has elapsed. The state is woken by a timer (see State::StartTimer).
+	TimeAwaiter WaitFor(TimerTime delay);
+
+	// Resumes on the first call to ProcessStateTransitions once the input duration has elapsed. If the state
+	// machine has a TimerService, this is WaitFor(delay) with the duration in milliseconds, the unit of
+	// SteadyTimerClock; otherwise, the state polls std::chrono::steady_clock.
+	template <typename Rep, typename Period>
+	TimeAwaiter WaitFor(std::chrono::duration<Rep, Period> duration);
+
+	// Resumes on the first call to ProcessStateTransitions for which predicate() returns true. The predicate is
+	// polled once per call to ProcessStateTransitions.
+	template <typename Predicate>
+	PredicateAwaiter<Predicate> WaitUntil(Predicate predicate);
+
+	// Resumes when an event of type EventType is dispatched to this state, returning a copy of the event. The
+	// event is handled by this state.
+	template <typename EventType>
+	EventAwaiter<EventType> WaitForEvent();
+
+private:
+	void Resume();
+	Transition GetResult();
+
+	std::coroutine_handle<StateCoroutine::promise_type> mCoroutine;
+	detail::CoroutineAwaiter* mAwaiter; // Set while the coroutine is suspended on an awaiter
+};
+
+class CoroutineState::FramesAwaiter : public detail::CoroutineAwaiter
+{
+public:
+	FramesAwaiter(CoroutineState& state, size_t numFrames)
+		: mState(state)
+		, mWakeFrame(state.GetStateMachine().GetFrameIndex() + numFrames)
+		, mNumFrames(numFrames)
+	{
+	}
+
+	bool await_ready() const { return mNumFrames == 0; }
+	void await_suspend(std::coroutine_handle<>)
+	{
+		mState.mAwaiter = this;
+		Suspend(mState);
+	}
+	void await_resume() {}
+
+	virtual hsm_bool IsReady(CoroutineState& state) { return state.GetStateMachine().GetFrameIndex() >= mWakeFrame; }
+
+	// Skips the rest of the current frame, and the frames before the wake frame
+	virtual void Suspend(CoroutineState& state) { state.QuiesceForFrames(mWakeFrame - state.GetStateMachine().GetFrameIndex() - 1); }
+
+private:
+	CoroutineState& mState;
+	size_t mWakeFrame;
+	size_t mNumFrames;
+};
+
+class CoroutineState::TimeAwaiter : public detail::CoroutineAwaiter
+{
+public:
+	// Waits for the input delay on the input TimerService
+	TimeAwaiter(CoroutineState& state, TimerService& timerService, TimerTime delay)
+		: mState(state)
+		, mTimerService(&timerService)
+		, mTimerWakeTime(timerService.GetTime() + delay)
+		, mDelay(delay)
+	{
+	}
+
+	// Waits until the steady clock reaches the input time
+	TimeAwaiter(CoroutineState& state, Clock::time_point wakeTime)
+		: mState(state)
+		, mTimerService(0)
+		, mTimerWakeTime(0)
+		, mDelay(0)
+		, mWakeTime(wakeTime)
+	{
+	}
+
+	bool await_ready() const { return mTimerService ? mDelay == 0 : Clock::now() >= mWakeTime; }
+	void await_suspend(std::coroutine_handle<>)
+	{
+		mState.mAwaiter = this;
+		if (mTimerService)
+		{
+			mState.StartTimer(mDelay);
+			Suspend(mState);
+		}
+	}
+	void await_resume() {}
+
+	virtual hsm_bool IsReady(CoroutineState&) { return mTimerService ? mTimerService->GetTime() >= mTimerWakeTime : Clock::now() >= mWakeTime; }
+
+	// The timer wakes the state, while the steady clock must be polled
+	virtual void Suspend(CoroutineState& state)
+	{
+		if (mTimerService)
+			state.Quiesce();
+	}
+
+private:
+	CoroutineState& mState;
+	TimerService* mTimerService;
+	TimerTime mTimerWakeTime;
+	TimerTime mDelay;
+	Clock::time_point mWakeTime;
+};
+
+template <typename Predicate>
+class CoroutineState::PredicateAwaiter : public detail::CoroutineAwaiter
+{
+public:
+	PredicateAwaiter(CoroutineState& state, Predicate predicate) : mState(state), mPredicate(predicate) {}
+
+	bool await_ready() { return mPredicate(); }
+	void await_suspend(std::coroutine_handle<>) { mState.mAwaiter = this; }
+	void await_resume() {}
+
+	virtual hsm_bool IsReady(CoroutineState&) { return mPredicate(); }
+
+private:
+	CoroutineState& mState;
+	Predicate mPredicate;
+};
+
+template <typename EventType>
+class CoroutineState::EventAwaiter : public detail::CoroutineAwaiter
+{
+public:
+	explicit EventAwaiter(CoroutineState& state) : mState(state), mEvent(0) {}
+
+	bool await_ready() const { return false; }
+	void await_suspend(std::coroutine_handle<>)
+	{
+		mState.mAwaiter = this;
+		Suspend(mState);
+	}
+	// The coroutine is resumed from HandleEvent, while the event is still alive
+	EventType await_resume() { HSM_ASSERT(mEvent); return *mEvent; }
+
+	virtual hsm_bool IsReady(CoroutineState&) { return mEvent != 0; }
+
+	virtual void Suspend(CoroutineState& state) { state.Quiesce(); }
+
+	virtual hsm_bool AcceptEvent(const Event& event)
+	{
+		mEvent = event.As<EventType>();
+		return mEvent != 0;
+	}
+
+private:
+	CoroutineState& mState;
+	const EventType* mEvent;
+};
+
+inline Transition CoroutineState::GetTransition()
+{
+	if (!mCoroutine)
+	{
+		detail::GetCoroutineStateMachine() = &GetStateMachine();
+		StateCoroutine coroutine = Run();
+		detail::GetCoroutineStateMachine() = 0;
+		mCoroutine = coroutine.mHandle;
+		coroutine.mHandle = 0;
+		Resume();
+	}
+	else if (mAwaiter)
+	{
+		if (mAwaiter->IsReady(*this))
+			Resume();
+		else
+			mAwaiter->Suspend(*this);
+	}
+	return GetResult();
+}
+
+inline hsm_bool CoroutineState::HandleEvent(const Event& event, Transition& outTransition)
+{
+	if (!mAwaiter || !mAwaiter->AcceptEvent(event))
+		return hsm_false;
+
+	Resume();
+	outTransition = GetResult();
+	return hsm_true;
+}
+
+inline void CoroutineState::Resume()
+{
+	HSM_ASSERT(mCoroutine && !mCoroutine.done());
+	mAwaiter = 0;
+	if (IsQuiescent())
+		Wake();
+
+	mCoroutine.resume();
+
+	// Nothing left to do once the coroutine has returned and stays in this state
+	if (mCoroutine.done() && mCoroutine.promise().mTransition.IsNo())
+		Quiesce();
+}
+
+inline Transition CoroutineState::GetResult()
+{
+	return mCoroutine.done() ? mCoroutine.promise().mTransition : NoTransition();
+}
+
+inline CoroutineState::FramesAwaiter CoroutineState::WaitFrames(size_t numFrames)
+{
+	return FramesAwaiter(*this, numFrames);
+}
+
+inline CoroutineState::FramesAwaiter CoroutineState::NextFrame()
+{
+	return FramesAwaiter(*this, 1);
+}
+
+inline CoroutineState::TimeAwaiter CoroutineState::WaitFor(TimerTime delay)
+{
+	TimerService* timerService = GetStateMachine().GetTimerService();
+	HSM_ASSERT_MSG(timerService, "StateMachine has no TimerService (see StateMachine::SetTimerService)");
+	return TimeAwaiter(*this, *timerService, delay);
+}
+
+template <typename Rep, typename Period>
+inline CoroutineState::TimeAwaiter CoroutineState::WaitFor(std::chrono::duration<Rep, Period> duration)
+{
+	if (TimerService* timerService = GetStateMachine().GetTimerService())
+	{
+		const auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+		return TimeAwaiter(*this, *timerService, delay > 0 ? static_cast<TimerTime>(delay) : 0);
+	}
+	return TimeAwaiter(*this, Clock::now() + std::chrono::duration_cast<Clock::duration>(duration));
+}
+
+template <typename Predicate>
+inline CoroutineState::PredicateAwaiter<Predicate> CoroutineState::WaitUntil(Predicate predicate)
+{
+	return PredicateAwaiter<Predicate>(*this, predicate);
+}
+
+template <typename EventType>
+inline CoroutineState::EventAwaiter<EventType> CoroutineState::WaitForEvent()
+{
+	return EventAwaiter<EventType>(*this);
+}
+
+} // namespace hsm
+
+#endif // __HSM_COROUTINE_H__
@@ -0,0 +1,309 @@
+// Hierarchical State Machine (HSM)
+//
+// Copyright (c) 2015 Antonio Maiorano
+//
+// Distributed under the MIT License (MIT)
+// (See accompanying file LICENSE.txt or copy at
+// http://opensource.org/licenses/MIT)
+
+/// \file hsm_parallel.h
+/// \brief Multi-threaded processing of independent state machines, and of the regions of a state machine
+
+#pragma once
+#ifndef __HSM_PARALLEL_H__
+#define __HSM_PARALLEL_H__
+
+#include "hsm.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if HSM_USE_STATE_POOLS && !HSM_STATE_POOLS_THREAD_SAFE
+#error "hsm_parallel.h requires HSM_STATE_POOLS_THREAD_SAFE when HSM_USE_STATE_POOLS is set, as machines may migrate between threads"
+#endif
+
+namespace hsm {
+
+// Processes the state machines of a StateMachineGroup across a pool of worker threads. The machines must be
+// independent: states may not access other machines, or data shared with them (e.g. a common Owner), while
+// the group is being processed.
+//
+// The machines are split into one contiguous range per worker, so that as long as the group's machines and
+// their order don't change, each machine is processed by the same worker every frame, keeping its data in
+// that worker's cache (note that StateMachineGroup::SetBucketByLeafStateType reorders machines). Workers
+// claim small chunks of their own range, and once done, steal chunks from the other workers' ranges. Pinning
+// worker threads to cores is left to the client (see GetNativeThreadHandle).
+class WorkStealingExecutor
+{
+public:
+	// Creates numThreads - 1 worker threads, as the calling thread also does work. If numThreads is 0, uses the
+	// number of hardware threads.
+	explicit WorkStealingExecutor(size_t numThreads = 0);
+	~WorkStealingExecutor();
+
+	// Returns the number of threads that do work, including the calling thread
+	size_t GetNumThreads() const { return mNumThreads; }
+
+	// Returns the native handle of the thread for the input worker, in [1, GetNumThreads()); worker 0 is the
+	// thread that calls ParallelFor.
+	std::thread::native_handle_type GetNativeThreadHandle(size_t workerIndex) { return mThreads[workerIndex - 1].native_handle(); }
+
+	// Number of consecutive indices claimed at a time by a worker (default is 16)
+	void SetChunkSize(size_t chunkSize) { HSM_ASSERT(chunkSize > 0); mChunkSize = chunkSize; }
+	size_t GetChunkSize() const { return mChunkSize; }
+
+	// Calls func(index) for each index in [0, count), in parallel, and returns once all calls have returned
+	template <typename Func>
+	void ParallelFor(size_t count, const Func& func);
+
+	// Calls ProcessStateTransitions on every active machine of the group, then puts idle machines to sleep and
+	// sorts the group if enabled. The group's TimerService, if any, is updated first on the calling thread; note
+	// that it isn't thread-safe, so states processed by this executor may not start or cancel timers. Likewise,
+	// they may not wake other machines of the group (see StateMachine::Wake).
+	void ProcessStateTransitions(StateMachineGroup& group);
+
+	// Calls ProcessStateTransitions on the input machine, settling its regions (see State::AddRegion) in parallel
+	// once its own stack has settled. Regions of regions are settled by the worker that settles their parent
+	// region. The regions must be independent of each other: their states may only read the owner they share,
+	// may not access the other regions, and may not start or cancel timers, including by popping states that
+	// have some.
+	void ProcessStateTransitions(StateMachine& stateMachine);
+
+	// Calls EvaluateStateTransitions (respectively ApplyStateTransitions) on every active machine of the group (see
+	// StateMachine::EvaluateStateTransitions). Since the evaluate phase only reads data, the machines need not
+	// be independent for it, so long as nothing is modified while it runs. The apply phase may also be run
+	// serially via StateMachineGroup::ApplyStateTransitions.
+	void EvaluateStateTransitions(StateMachineGroup& group);
+	void ApplyStateTransitions(StateMachineGroup& group);
+
+	// Calls UpdateStates on every active machine of the group, forwarding the input args (if HSM_STATE_UPDATE_ARGS
+	// is set)
+	template <typename... Args>
+	void UpdateStates(StateMachineGroup& group, Args&&... args);
+
+private:
+	WorkStealingExecutor(const WorkStealingExecutor&);
+	WorkStealingExecutor& operator=(const WorkStealingExecutor&);
+
+	typedef void (*JobFunc)(const void* job, size_t index);
+
+	template <typename Func>
+	static void InvokeJob(const void* job, size_t index) { (*static_cast<const Func*>(job))(index); }
+
+	// Range of indices assigned to a worker; padded to a cache line to avoid false sharing between workers
+	// (rather than aligned, as over-aligned new requires C++17)
+	struct Partition
+	{
+		std::atomic<size_t> mNext;
+		size_t mEnd;
+		char mPadding[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+	};
+
+	void Run(size_t count, JobFunc jobFunc, const void* job);
+	void RunWorker(size_t workerIndex);
+	void WorkerThreadMain(size_t workerIndex);
+
+	size_t mNumThreads;
+	size_t mChunkSize;
+	std::vector<std::thread> mThreads;
+	std::unique_ptr<Partition[]> mPartitions;
+
+	// Current job
+	JobFunc mJobFunc;
+	const void* mJob;
+
+	std::mutex mMutex;
+	std::condition_variable mStartCondition;
+	std::condition_variable mDoneCondition;
+	size_t mGeneration; // Incremented for each job, which wakes the worker threads
+	size_t mNumBusyThreads;
+	bool mQuit;
+};
+
+inline WorkStealingExecutor::WorkStealingExecutor(size_t numThreads)
+	: mNumThreads(numThreads > 0 ? numThreads : std::thread::hardware_concurrency())
+	, mChunkSize(16)
+	, mJobFunc(0)
+	, mJob(0)
+	, mGeneration(0)
+	, mNumBusyThreads(0)
+	, mQuit(false)
+{
+	if (mNumThreads == 0)
+	{
+		mNumThreads = 1;
+	}
+
+	mPartitions.reset(new Partition[mNumThreads]);
+	for (size_t i = 0; i < mNumThreads; ++i)
+	{
+		mPartitions[i].mNext = 0;
+		mPartitions[i].mEnd = 0;
+	}
+
+	for (size_t i = 1; i < mNumThreads; ++i)
+	{
+		mThreads.push_back(std::thread(&WorkStealingExecutor::WorkerThreadMain, this, i));
+	}
+}
+
+inline WorkStealingExecutor::~WorkStealingExecutor()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mStartCondition.notify_all();
+
+	for (size_t i = 0; i < mThreads.size(); ++i)
+	{
+		mThreads[i].join();
+	}
+}
+
+template <typename Func>
+inline void WorkStealingExecutor::ParallelFor(size_t count, const Func& func)
+{
+	Run(count, &InvokeJob<Func>, &func);
+}
+
+inline void WorkStealingExecutor::ProcessStateTransitions(StateMachineGroup& group)
+{
+	group.UpdateTimers();
+	group.ActivateWokenStateMachines();
+
+	ParallelFor(group.GetNumActiveStateMachines(), [&group](size_t index)
+	{
+		group.GetActiveStateMachine(index)->ProcessStateTransitions();
+	});
+
+	group.FinishStateTransitions();
+}
+
+inline void WorkStealingExecutor::ProcessStateTransitions(StateMachine& stateMachine)
+{
+	stateMachine.BeginProcessStateTransitions();
+
+	ParallelFor(stateMachine.GetNumActiveRegions(), [&stateMachine](size_t index)
+	{
+		stateMachine.GetActiveRegion(index).ProcessStateTransitions();
+	});
+
+	stateMachine.EndProcessStateTransitions();
+}
+
+inline void WorkStealingExecutor::EvaluateStateTransitions(StateMachineGroup& group)
+{
+	group.UpdateTimers();
+	group.ActivateWokenStateMachines();
+
+	ParallelFor(group.GetNumActiveStateMachines(), [&group](size_t index)
+	{
+		group.GetActiveStateMachine(index)->EvaluateStateTransitions();
+	});
+}
+
+inline void WorkStealingExecutor::ApplyStateTransitions(StateMachineGroup& group)
+{
+	ParallelFor(group.GetNumActiveStateMachines(), [&group](size_t index)
+	{
+		group.GetActiveStateMachine(index)->ApplyStateTransitions();
+	});
+
+	group.FinishStateTransitions();
+}
+
+template <typename... Args>
+inline void WorkStealingExecutor::UpdateStates(StateMachineGroup& group, Args&&... args)
+{
+	group.ActivateWokenStateMachines();
+
+	ParallelFor(group.GetNumActiveStateMachines(), [&](size_t index)
+	{
+		group.GetActiveStateMachine(index)->UpdateStates(args...);
+	});
+}
+
+inline void WorkStealingExecutor::Run(size_t count, JobFunc jobFunc, const void* job)
+{
+	for (size_t i = 0; i < mNumThreads; ++i)
+	{
+		mPartitions[i].mNext.store(count * i / mNumThreads, std::memory_order_relaxed);
+		mPartitions[i].mEnd = count * (i + 1) / mNumThreads;
+	}
+
+	if (mNumThreads == 1)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			jobFunc(job, i);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJobFunc = jobFunc;
+		mJob = job;
+		mNumBusyThreads = mThreads.size();
+		++mGeneration;
+	}
+	mStartCondition.notify_all();
+
+	RunWorker(0);
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	mDoneCondition.wait(lock, [this] { return mNumBusyThreads == 0; });
+	mJobFunc = 0;
+	mJob = 0;
+}
+
+inline void WorkStealingExecutor::RunWorker(size_t workerIndex)
+{
+	// Process our own partition first, then steal from the others, starting with our neighbor
+	for (size_t i = 0; i < mNumThreads; ++i)
+	{
+		Partition& partition = mPartitions[(workerIndex + i) % mNumThreads];
+		for (;;)
+		{
+			const size_t begin = partition.mNext.fetch_add(mChunkSize, std::memory_order_relaxed);
+			if (begin >= partition.mEnd)
+				break;
+
+			const size_t end = begin + mChunkSize < partition.mEnd ? begin + mChunkSize : partition.mEnd;
+			for (size_t index = begin; index < end; ++index)
+			{
+				mJobFunc(mJob, index);
+			}
+		}
+	}
+}
+
+inline void WorkStealingExecutor::WorkerThreadMain(size_t workerIndex)
+{
+	size_t generation = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mStartCondition.wait(lock, [&] { return mQuit || mGeneration != generation; });
+			if (mQuit)
+				return;
+			generation = mGeneration;
+		}
+
+		RunWorker(workerIndex);
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			--mNumBusyThreads;
+		}
+		mDoneCondition.notify_one();
+	}
+}
+
+} // namespace hsm
+
+#endif // __HSM_PARALLEL_H__
@@ -0,0 +1,347 @@
+// Hierarchical State Machine (HSM)
+//
+// Copyright (c) 2015 Antonio Maiorano
+//
+// Distributed under the MIT License (MIT)
+// (See accompanying file LICENSE.txt or copy at
+// http://opensource.org/licenses/MIT)
+
+/// \file hsm_static.h
+/// \brief Static state machine engine for state machines whose set of states is known at compile time
+
+#pragma once
+#ifndef __HSM_STATIC_H__
+#define __HSM_STATIC_H__
+
+#include "hsm.h"
+
+namespace hsm {
+
+template <typename OwnerType, size_t MaxDepth, typename... States>
+class StaticStateMachineWithDepth;
+
+namespace detail
+{
+	// True if all input values are true
+	template <bool... Values>
+	struct AllOf : std::is_same<AllOf<Values...>, AllOf<(Values || true)...> > {};
+
+	// Largest of the input values
+	template <size_t... Values>
+	struct MaxOf;
+
+	template <size_t Value>
+	struct MaxOf<Value> : std::integral_constant<size_t, Value> {};
+
+	template <size_t Value, size_t... Values>
+	struct MaxOf<Value, Values...> : std::integral_constant<size_t, (Value > MaxOf<Values...>::value ? Value : MaxOf<Values...>::value)> {};
+
+	// Index of StateType in States; fails to compile if StateType is not one of States
+	template <typename StateType, typename... States>
+	struct StaticStateIndex;
+
+	template <typename StateType, typename... States>
+	struct StaticStateIndex<StateType, StateType, States...> : std::integral_constant<size_t, 0> {};
+
+	template <typename StateType, typename FirstState, typename... States>
+	struct StaticStateIndex<StateType, FirstState, States...> : std::integral_constant<size_t, 1 + StaticStateIndex<StateType, States...>::value> {};
+
+	template <typename StateType>
+	struct StaticStateIndex<StateType>
+	{
+		static_assert(sizeof(StateType) == 0, "State is not part of this StaticStateMachine");
+	};
+
+	// Calls StateType::OnEnter() non-virtually, or nothing if it is hidden by an OnEnter that takes args (the
+	// same as StateMachine, which would then call State::OnEnter)
+	template <typename StateType>
+	auto InvokeStaticOnEnter(StateType* state, int) -> decltype(state->StateType::OnEnter(), void())
+	{
+		state->StateType::OnEnter();
+	}
+
+	template <typename StateType>
+	void InvokeStaticOnEnter(StateType* state, long)
+	{
+	}
+}
+
+// Base class for states of a StaticStateMachine. States are written as usual, deriving from this class rather
+// than from StateWithOwner, and use the same transition functions (SiblingTransition, InnerTransition, etc.).
+//
+// A StaticStateMachine calls OnEnter, OnExit, GetTransition and Update on the most-derived state type directly
+// rather than virtually, so these functions should not be overridden in a further derived type. Since there is
+// no StateMachine, states may not call GetStateMachine(), nor the State query functions (GetState, IsInState,
+// GetOuterState, etc.) that depend on it; use the StaticStateMachine's query functions from the owner instead.
+// GetStateType and GetStateDebugName are supported.
+template <typename OwnerType>
+struct StaticState : State
+{
+	StaticState() : mStaticOwner(0) {}
+
+	OwnerType& Owner() { HSM_ASSERT(mStaticOwner != 0); return *mStaticOwner; }
+	const OwnerType& Owner() const { HSM_ASSERT(mStaticOwner != 0); return *mStaticOwner; }
+
+private:
+	template <typename, size_t, typename...> friend class StaticStateMachineWithDepth;
+	OwnerType* mStaticOwner;
+};
+
+// A state machine over a fixed set of state types. Each depth of the state stack is stored inline, large enough
+// for any of the states, so states are never allocated on the heap, and functions are dispatched through
+// per-type tables rather than virtual calls. The stack can be up to MaxDepth states deep; a transition that would
+// push deeper asserts and is dropped, so MaxDepth must account for state types (e.g. reusable states) that can
+// be on the stack more than once. The same transition semantics as StateMachine apply (equivalent to
+// SettlePolicy::Restart), but state overrides, quiescence, events, deferred transitions and debug tracing are
+// not supported.
+template <typename OwnerType, size_t MaxDepth, typename... States>
+class StaticStateMachineWithDepth
+{
+public:
+	static const size_t kNumStates = sizeof...(States);
+	static const size_t kMaxDepth = MaxDepth;
+
+	StaticStateMachineWithDepth()
+		: mOwner(0)
+		, mInitialStateIndex(kInvalidIndex)
+		, mDepth(0)
+	{
+		static_assert(kNumStates > 0, "StaticStateMachine must have at least one state");
+		static_assert(kMaxDepth > 0, "StaticStateMachine must have a max depth of at least one");
+		static_assert(detail::AllOf<std::is_base_of<StaticState<OwnerType>, States>::value...>::value, "States of a StaticStateMachine must derive from StaticState<OwnerType>");
+	}
+
+	~StaticStateMachineWithDepth()
+	{
+		Shutdown(hsm_false);
+	}
+
+	template <typename InitialStateType>
+	void Initialize(OwnerType* owner = 0)
+	{
+		HSM_ASSERT(mInitialStateIndex == kInvalidIndex);
+		mInitialStateIndex = static_cast<unsigned char>(detail::StaticStateIndex<InitialStateType, States...>::value);
+		mOwner = owner;
+	}
+
+	// Pops all states, invoking OnExit on them if stop is true
+	void Shutdown(hsm_bool stop = hsm_true)
+	{
+		PopStatesToDepth(0, stop);
+		mOwner = 0;
+		mInitialStateIndex = kInvalidIndex;
+	}
+
+	hsm_bool IsInitialized() const { return mInitialStateIndex != kInvalidIndex; }
+
+	void Stop() { PopStatesToDepth(0, hsm_true); }
+
+	hsm_bool IsStarted() const { return mDepth > 0; }
+
+	void ProcessStateTransitions()
+	{
+		if (mDepth == 0)
+		{
+			HSM_ASSERT_MSG(IsInitialized(), "Must call Initialize()");
+			PushState(mInitialStateIndex, Transition());
+		}
+
+		int numTransitionsProcessed = 0;
+		while (ProcessStateTransitionsOnce())
+		{
+			if (++numTransitionsProcessed >= 1000)
+			{
+				HSM_ASSERT_MSG(hsm_false, "ProcessStateTransitions: detected infinite transition loop");
+			}
+		}
+	}
+
+	void UpdateStates(HSM_STATE_UPDATE_ARGS)
+	{
+		for (size_t depth = 0; depth < mDepth; ++depth)
+		{
+			Visit(depth, [&](auto* state)
+			{
+				typedef typename std::remove_pointer<decltype(state)>::type StateType;
+				state->StateType::Update(HSM_STATE_UPDATE_ARGS_FORWARD);
+			});
+		}
+	}
+
+	OwnerType* GetOwner() { return mOwner; }
+	const OwnerType* GetOwner() const { return mOwner; }
+
+	size_t GetDepth() const { return mDepth; }
+
+	// Returns the outermost state of type StateType, or NULL if not on the stack
+	template <typename StateType>
+	StateType* GetState()
+	{
+		const size_t index = detail::StaticStateIndex<StateType, States...>::value;
+		for (size_t depth = 0; depth < mDepth; ++depth)
+		{
+			if (mStateIndices[depth] == index)
+				return static_cast<StateType*>(GetStorage(depth));
+		}
+		return 0;
+	}
+
+	template <typename StateType>
+	hsm_bool IsInState() { return GetState<StateType>() != 0; }
+
+private:
+	static const unsigned char kInvalidIndex = 0xFF;
+	static_assert(kNumStates < kInvalidIndex, "Too many states in StaticStateMachine");
+
+	struct StateStorage
+	{
+		alignas(States...) unsigned char mData[detail::MaxOf<sizeof(States)...>::value];
+	};
+
+	// Returns the index in States of the state created by the input factory. Transitions only carry the target's
+	// factory, so this is a search over the (few) states, unlike the compile-time lookup of Initialize and GetState.
+	static unsigned char GetStateIndex(const StateFactory& stateFactory)
+	{
+		static const StateFactory* const stateFactories[] = { &GetStateFactory<States>()... };
+		for (size_t i = 0; i < kNumStates; ++i)
+		{
+			if (stateFactories[i] == &stateFactory)
+				return static_cast<unsigned char>(i);
+		}
+		HSM_ASSERT_MSG(hsm_false, "Transition to a state that is not part of this StaticStateMachine");
+		return kInvalidIndex;
+	}
+
+	void* GetStorage(size_t depth) { return &mStateStorage[depth]; }
+
+	// Invokes func with a pointer to the storage at the input depth cast to its state type
+	template <typename Func>
+	void Visit(size_t depth, Func&& func)
+	{
+		VisitIndex(mStateIndices[depth], GetStorage(depth), func);
+	}
+
+	template <typename Func>
+	static void VisitIndex(size_t stateIndex, void* storage, Func& func)
+	{
+		typedef void (*VisitFunc)(void*, Func&);
+		static const VisitFunc visitFuncs[] = { &VisitAs<States, Func>... };
+		HSM_ASSERT(stateIndex < kNumStates);
+		visitFuncs[stateIndex](storage, func);
+	}
+
+	template <typename StateType, typename Func>
+	static void VisitAs(void* storage, Func& func)
+	{
+		func(static_cast<StateType*>(storage));
+	}
+
+	hsm_bool ProcessStateTransitionsOnce()
+	{
+		for (size_t depth = 0; depth < mDepth; ++depth)
+		{
+			Transition transition;
+			Visit(depth, [&](auto* state)
+			{
+				typedef typename std::remove_pointer<decltype(state)>::type StateType;
+				transition = state->StateType::GetTransition();
+			});
+
+			switch (transition.GetTransitionType())
+			{
+				case Transition::No:
+				break;
+
+				case Transition::Inner:
+				{
+					const unsigned char targetIndex = GetStateIndex(transition.GetStateFactory());
+					if (depth + 1 < mDepth && mStateIndices[depth + 1] == targetIndex)
+					{
+						// Inner is already target state so keep going to next inner
+						break;
+					}
+					PopStatesToDepth(depth + 1, hsm_true);
+					return PushState(targetIndex, transition);
+				}
+
+				case Transition::InnerEntry:
+				{
+					if (depth + 1 == mDepth)
+					{
+						return PushState(GetStateIndex(transition.GetStateFactory()), transition);
+					}
+				}
+				break;
+
+				case Transition::Sibling:
+				{
+					PopStatesToDepth(depth, hsm_true);
+					return PushState(GetStateIndex(transition.GetStateFactory()), transition);
+				}
+			}
+		}
+		return hsm_false;
+	}
+
+	// Returns false if the stack is full, in which case the state is not pushed
+	hsm_bool PushState(unsigned char stateIndex, const Transition& transition)
+	{
+		// An invalid index was already asserted on by GetStateIndex
+		if (stateIndex == kInvalidIndex)
+			return hsm_false;
+
+		if (mDepth == kMaxDepth)
+		{
+			HSM_ASSERT_MSG(hsm_false, "StaticStateMachine stack is deeper than its max depth");
+			return hsm_false;
+		}
+
+		const size_t depth = mDepth++;
+		mStateIndices[depth] = stateIndex;
+
+		OwnerType* owner = mOwner;
+		Visit(depth, [&](auto* storage)
+		{
+			typedef typename std::remove_pointer<decltype(storage)>::type StateType;
+			StateType* state = ::new (storage) StateType();
+			detail::InitStaticState(state, depth, GetStateFactory<StateType>());
+			state->mStaticOwner = owner;
+
+			if (transition.HasOnEnterArgs())
+				transition.InvokeOnEnterArgs(state);
+			else
+				detail::InvokeStaticOnEnter(state, 0);
+		});
+		return hsm_true;
+	}
+
+	void PopStatesToDepth(size_t depth, hsm_bool invokeOnExit)
+	{
+		while (mDepth > depth)
+		{
+			Visit(mDepth - 1, [&](auto* state)
+			{
+				typedef typename std::remove_pointer<decltype(state)>::type StateType;
+				if (invokeOnExit)
+					state->StateType::OnExit();
+				state->StateType::~StateType();
+			});
+			--mDepth;
+		}
+	}
+
+	OwnerType* mOwner;
+	unsigned char mInitialStateIndex;
+	size_t mDepth;
+	unsigned char mStateIndices[kMaxDepth];
+	StateStorage mStateStorage[kMaxDepth];
+};
+
+// A StaticStateMachineWithDepth whose stack can be as deep as its number of states, which suffices unless a state
+// type can be on the stack more than once
+template <typename OwnerType, typename... States>
+using StaticStateMachine = StaticStateMachineWithDepth<OwnerType, sizeof...(States), States...>;
+
+} // namespace hsm
+
+#endif // __HSM_STATIC_H__
@@ -0,0 +1,591 @@
+// Hierarchical State Machine (HSM)
+//
+// Copyright (c) 2015 Antonio Maiorano
+//
+// Distributed under the MIT License (MIT)
+// (See accompanying file LICENSE.txt or copy at
+// http://opensource.org/licenses/MIT)
+
+/// \file hsm_store.h
+/// \brief Memory-mapped file store of state machine snapshots, for large populations of dormant machines
+
+#pragma once
+#ifndef __HSM_STORE_H__
+#define __HSM_STORE_H__
+
+#include "hsm.h"
+
+#if !HSM_USE_SNAPSHOTS
+#error "hsm_store.h requires HSM_USE_SNAPSHOTS"
+#endif
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#define HSM_UNDEF_WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#define HSM_UNDEF_NOMINMAX
+#endif
+#include <windows.h>
+#ifdef HSM_UNDEF_WIN32_LEAN_AND_MEAN
+#undef WIN32_LEAN_AND_MEAN
+#undef HSM_UNDEF_WIN32_LEAN_AND_MEAN
+#endif
+#ifdef HSM_UNDEF_NOMINMAX
+#undef NOMINMAX
+#undef HSM_UNDEF_NOMINMAX
+#endif
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+namespace hsm {
+
+namespace detail
+{
+	// File mapped read-write into memory, which can be resized
+	class MappedFile
+	{
+	public:
+		MappedFile()
+			: mData(0)
+			, mSize(0)
+#if defined(_WIN32)
+			, mFile(INVALID_HANDLE_VALUE)
+			, mMapping(0)
+#else
+			, mFile(-1)
+#endif
+		{
+		}
+
+		~MappedFile() { Close(mSize); }
+
+		// Opens the file, creating it if needed, and maps all of it
+		hsm_bool Open(const char* path);
+
+		// Unmaps the file and truncates (or extends) it to the input size
+		void Close(size_t size);
+
+		// Resizes the file and remaps it, which invalidates pointers into the mapping
+		hsm_bool Resize(size_t size);
+
+		// Writes modified pages back to the file
+		void Flush();
+
+		hsm_bool IsOpen() const;
+		unsigned char* GetData() { return mData; }
+		size_t GetSize() const { return mSize; }
+
+	private:
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
+
+		hsm_bool Map(size_t size);
+		void Unmap();
+
+		unsigned char* mData;
+		size_t mSize;
+#if defined(_WIN32)
+		HANDLE mFile;
+		HANDLE mMapping;
+#else
+		int mFile;
+#endif
+	};
+
+#if defined(_WIN32)
+	inline hsm_bool MappedFile::IsOpen() const
+	{
+		return mFile != INVALID_HANDLE_VALUE;
+	}
+
+	inline hsm_bool MappedFile::Open(const char* path)
+	{
+		HSM_ASSERT(!IsOpen());
+		mFile = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+		if (mFile == INVALID_HANDLE_VALUE)
+			return hsm_false;
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(mFile, &fileSize) || !Map(static_cast<size_t>(fileSize.QuadPart)))
+		{
+			Close(0);
+			return hsm_false;
+		}
+		return hsm_true;
+	}
+
+	inline void MappedFile::Close(size_t size)
+	{
+		if (!IsOpen())
+			return;
+
+		Unmap();
+		LARGE_INTEGER fileSize;
+		fileSize.QuadPart = static_cast<LONGLONG>(size);
+		if (SetFilePointerEx(mFile, fileSize, 0, FILE_BEGIN))
+		{
+			SetEndOfFile(mFile);
+		}
+		CloseHandle(mFile);
+		mFile = INVALID_HANDLE_VALUE;
+		mSize = 0;
+	}
+
+	inline hsm_bool MappedFile::Map(size_t size)
+	{
+		mSize = size;
+		if (size == 0)
+			return hsm_true; // Empty files can't be mapped
+
+		// Mapping more than the file's size extends it
+		const unsigned long long mappingSize = size;
+		mMapping = CreateFileMappingA(mFile, 0, PAGE_READWRITE, static_cast<DWORD>(mappingSize >> 32), static_cast<DWORD>(mappingSize), 0);
+		if (mMapping)
+		{
+			mData = static_cast<unsigned char*>(MapViewOfFile(mMapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+		}
+		if (!mData)
+		{
+			Unmap();
+			return hsm_false;
+		}
+		return hsm_true;
+	}
+
+	inline void MappedFile::Unmap()
+	{
+		if (mData)
+		{
+			UnmapViewOfFile(mData);
+			mData = 0;
+		}
+		if (mMapping)
+		{
+			CloseHandle(mMapping);
+			mMapping = 0;
+		}
+	}
+
+	inline void MappedFile::Flush()
+	{
+		if (mData)
+		{
+			FlushViewOfFile(mData, 0);
+			FlushFileBuffers(mFile);
+		}
+	}
+#else
+	inline hsm_bool MappedFile::IsOpen() const
+	{
+		return mFile != -1;
+	}
+
+	inline hsm_bool MappedFile::Open(const char* path)
+	{
+		HSM_ASSERT(!IsOpen());
+		mFile = open(path, O_RDWR | O_CREAT, 0644);
+		if (mFile == -1)
+			return hsm_false;
+
+		struct stat fileStat;
+		if (fstat(mFile, &fileStat) != 0 || !Map(static_cast<size_t>(fileStat.st_size)))
+		{
+			Close(0);
+			return hsm_false;
+		}
+		return hsm_true;
+	}
+
+	inline void MappedFile::Close(size_t size)
+	{
+		if (!IsOpen())
+			return;
+
+		Unmap();
+		if (ftruncate(mFile, static_cast<off_t>(size)) != 0)
+		{
+			// The file keeps its unused tail, which is harmless
+		}
+		close(mFile);
+		mFile = -1;
+		mSize = 0;
+	}
+
+	inline hsm_bool MappedFile::Map(size_t size)
+	{
+		mSize = size;
+		if (size == 0)
+			return hsm_true; // Empty files can't be mapped
+
+		void* data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, mFile, 0);
+		if (data == MAP_FAILED)
+			return hsm_false;
+
+		mData = static_cast<unsigned char*>(data);
+		return hsm_true;
+	}
+
+	inline void MappedFile::Unmap()
+	{
+		if (mData)
+		{
+			munmap(mData, mSize);
+			mData = 0;
+		}
+	}
+
+	inline void MappedFile::Flush()
+	{
+		if (mData)
+		{
+			msync(mData, mSize, MS_SYNC);
+		}
+	}
+#endif
+
+	inline hsm_bool MappedFile::Resize(size_t size)
+	{
+		HSM_ASSERT(IsOpen());
+		Unmap();
+#if !defined(_WIN32)
+		if (ftruncate(mFile, static_cast<off_t>(size)) != 0)
+		{
+			Map(mSize);
+			return hsm_false;
+		}
+#endif
+		return Map(size);
+	}
+}
+
+// Persists the snapshots (see StateMachine::SaveSnapshot) of many state machines in a single memory-mapped file,
+// so that dormant machines can be saved and stopped, then loaded back when woken, one at a time. Opening a store
+// only maps the file, so it takes constant time no matter how many machines it holds, and loading a machine only
+// touches the pages that hold its snapshot.
+//
+// Machines are stored in numbered slots. The file has a small header, followed by a table of slots stored by
+// column (the type and depth of each machine's innermost state, which can be queried without loading the
+// machine, and the location of its snapshot), followed by a heap of snapshots. A snapshot is overwritten in
+// place if it fits in the space of the previous one, otherwise it is appended to the heap and its old space is
+// wasted until Compact is called. Writes go to the mapping, and are written back to the file by the OS, or by
+// Flush. A StateMachineStore is not thread-safe.
+//
+// The snapshots are only valid for the build that saved them (see StateMachine::LoadSnapshot), and the file is
+// in native byte order.
+class StateMachineStore
+{
+public:
+	StateMachineStore() {}
+	~StateMachineStore() { Close(); }
+
+	// Opens the store at the input path, creating it if needed. Returns false if the file can't be mapped, isn't
+	// a store of this version, or its slot table doesn't fit. Slots are only checked when loaded or saved, so
+	// that opening takes constant time.
+	hsm_bool Open(const char* path);
+
+	// Flushes and closes the store, truncating the file to the space it uses
+	void Close();
+
+	hsm_bool IsOpen() const { return mFile.IsOpen(); }
+
+	// Adds empty slots at the end, and returns the index of the first one
+	size_t AddSlots(size_t numSlots);
+	size_t GetNumSlots() const { return IsOpen() ? static_cast<size_t>(GetHeader().mNumSlots) : 0; }
+
+	// Saves the machine's snapshot in the slot, replacing the slot's previous snapshot. Usually followed by
+	// StateMachine::Stop, to free the states of a dormant machine.
+	hsm_bool Save(size_t slot, const StateMachine& stateMachine);
+
+	// Loads the slot's snapshot into the machine, which must be initialized and stopped (see
+	// StateMachine::LoadSnapshot). The slot keeps its snapshot. Returns false if the slot is empty, its snapshot
+	// lies outside of the heap (if the file is damaged), or the snapshot can't be loaded.
+	hsm_bool Load(size_t slot, StateMachine& stateMachine);
+
+	// Empties the slot
+	void Clear(size_t slot);
+
+	hsm_bool IsEmpty(size_t slot) const { return GetPayloadSizes()[CheckSlot(slot)] == 0; }
+
+	// Snapshot id (see StateFactory::GetStateSnapshotId) of the innermost state of the machine saved in the slot,
+	// and the depth of its stack, read without loading the machine
+	uint32_t GetLeafStateSnapshotId(size_t slot) const { return GetLeafStateSnapshotIds()[CheckSlot(slot)]; }
+	uint32_t GetStackDepth(size_t slot) const { return GetStackDepths()[CheckSlot(slot)]; }
+
+	// Number of bytes in the heap of snapshots that are not used by any slot
+	size_t GetNumWastedBytes() const { return IsOpen() ? static_cast<size_t>(GetHeader().mNumWastedBytes) : 0; }
+
+	// Moves the snapshots to the front of the heap to reclaim wasted space. Touches every page of the heap.
+	void Compact();
+
+	// Writes modified pages back to the file
+	void Flush() { mFile.Flush(); }
+
+private:
+	StateMachineStore(const StateMachineStore&);
+	StateMachineStore& operator=(const StateMachineStore&);
+
+	static const uint32_t kMagic = 0x464d5348; // "HSMF"
+	static const uint32_t kVersion = 1;
+	static const size_t kHeaderSize = 64;
+	static const size_t kPayloadAlignment = 64;
+
+	struct Header
+	{
+		uint32_t mMagic;
+		uint32_t mVersion;
+		uint64_t mSlotCapacity; // Number of slots the columns have room for
+		uint64_t mNumSlots;
+		uint64_t mPayloadOffset; // Offset of the heap of snapshots in the file
+		uint64_t mPayloadSize; // Number of bytes of the heap in use, including wasted bytes
+		uint64_t mNumWastedBytes;
+	};
+	static_assert(sizeof(Header) <= kHeaderSize, "Header doesn't fit");
+
+	// Columns of the slot table, in file order, each mSlotCapacity entries long: leaf state snapshot ids, stack
+	// depths, snapshot sizes and capacities (all uint32_t), then snapshot offsets in the heap (uint64_t)
+	static const size_t kNumColumns = 5;
+	static size_t GetColumnOffset(size_t column, size_t slotCapacity) { return kHeaderSize + column * sizeof(uint32_t) * slotCapacity; }
+	static size_t GetPayloadOffset(size_t slotCapacity) { return RoundUp(GetColumnOffset(kNumColumns - 1, slotCapacity) + sizeof(uint64_t) * slotCapacity, kPayloadAlignment); }
+	static size_t RoundUp(size_t value, size_t alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+	Header& GetHeader() { return *reinterpret_cast<Header*>(mFile.GetData()); }
+	const Header& GetHeader() const { return *reinterpret_cast<const Header*>(const_cast<detail::MappedFile&>(mFile).GetData()); }
+
+	template <typename T>
+	T* GetColumn(size_t column) const
+	{
+		unsigned char* data = const_cast<detail::MappedFile&>(mFile).GetData();
+		return reinterpret_cast<T*>(data + GetColumnOffset(column, static_cast<size_t>(GetHeader().mSlotCapacity)));
+	}
+
+	uint32_t* GetLeafStateSnapshotIds() const { return GetColumn<uint32_t>(0); }
+	uint32_t* GetStackDepths() const { return GetColumn<uint32_t>(1); }
+	uint32_t* GetPayloadSizes() const { return GetColumn<uint32_t>(2); }
+	uint32_t* GetPayloadCapacities() const { return GetColumn<uint32_t>(3); }
+	uint64_t* GetPayloadOffsets() const { return GetColumn<uint64_t>(4); }
+	unsigned char* GetPayload() { return mFile.GetData() + GetHeader().mPayloadOffset; }
+
+	size_t CheckSlot(size_t slot) const { HSM_ASSERT_MSG(slot < GetNumSlots(), "Invalid slot"); return slot; }
+
+	// Returns true if the slot's snapshot, and the space reserved for it, lie within the heap
+	hsm_bool IsSlotInHeap(size_t slot) const
+	{
+		const uint64_t payloadSize = GetHeader().mPayloadSize;
+		const uint64_t offset = GetPayloadOffsets()[slot];
+		const uint32_t capacity = GetPayloadCapacities()[slot];
+		return GetPayloadSizes()[slot] <= capacity && offset <= payloadSize && capacity <= payloadSize - offset;
+	}
+
+	// Grows the file, if needed, so that it's at least the input size, doubling it to amortize remapping
+	hsm_bool Reserve(size_t fileSize);
+
+	detail::MappedFile mFile;
+	HSM_STD_VECTOR<unsigned char> mSnapshot; // Kept to avoid reallocating when saving
+	HSM_STD_VECTOR<size_t> mSortedSlots; // Kept to avoid reallocating when compacting
+};
+
+inline hsm_bool StateMachineStore::Open(const char* path)
+{
+	HSM_ASSERT_MSG(!IsOpen(), "Store is already open");
+	if (!mFile.Open(path))
+		return hsm_false;
+
+	if (mFile.GetSize() == 0)
+	{
+		if (!mFile.Resize(kHeaderSize))
+		{
+			mFile.Close(0);
+			return hsm_false;
+		}
+
+		Header& header = GetHeader();
+		memset(&header, 0, kHeaderSize);
+		header.mMagic = kMagic;
+		header.mVersion = kVersion;
+		header.mPayloadOffset = GetPayloadOffset(0);
+	}
+
+	// The slot table must fit in the file, followed by the heap. The capacity is bounded first so that the
+	// offsets can't overflow.
+	const uint64_t fileSize = mFile.GetSize();
+	hsm_bool valid = fileSize >= kHeaderSize && GetHeader().mMagic == kMagic && GetHeader().mVersion == kVersion;
+	if (valid)
+	{
+		const Header& header = GetHeader();
+		valid = header.mSlotCapacity <= fileSize / sizeof(uint32_t)
+			&& header.mNumSlots <= header.mSlotCapacity
+			&& header.mPayloadOffset == GetPayloadOffset(static_cast<size_t>(header.mSlotCapacity))
+			&& header.mPayloadOffset <= fileSize
+			&& header.mPayloadSize <= fileSize - header.mPayloadOffset;
+	}
+
+	if (!valid)
+	{
+		mFile.Close(mFile.GetSize());
+		return hsm_false;
+	}
+
+	return hsm_true;
+}
+
+inline void StateMachineStore::Close()
+{
+	if (IsOpen())
+	{
+		const Header& header = GetHeader();
+		const size_t usedSize = static_cast<size_t>(header.mPayloadOffset + header.mPayloadSize);
+		mFile.Flush();
+		mFile.Close(usedSize);
+	}
+}
+
+inline hsm_bool StateMachineStore::Reserve(size_t fileSize)
+{
+	if (fileSize <= mFile.GetSize())
+		return hsm_true;
+
+	return mFile.Resize(std::max(fileSize, mFile.GetSize() * 2));
+}
+
+inline size_t StateMachineStore::AddSlots(size_t numSlots)
+{
+	HSM_ASSERT(IsOpen());
+	const size_t firstSlot = GetNumSlots();
+	const size_t newNumSlots = firstSlot + numSlots;
+	const size_t slotCapacity = static_cast<size_t>(GetHeader().mSlotCapacity);
+
+	if (newNumSlots > slotCapacity)
+	{
+		// Grow the columns, moving the heap of snapshots after them
+		const size_t newSlotCapacity = std::max(std::max(newNumSlots, slotCapacity * 2), static_cast<size_t>(64));
+		const size_t payloadOffset = static_cast<size_t>(GetHeader().mPayloadOffset);
+		const size_t payloadSize = static_cast<size_t>(GetHeader().mPayloadSize);
+		const size_t newPayloadOffset = GetPayloadOffset(newSlotCapacity);
+		if (!Reserve(newPayloadOffset + payloadSize))
+			return static_cast<size_t>(-1);
+
+		unsigned char* data = mFile.GetData();
+		memmove(data + newPayloadOffset, data + payloadOffset, payloadSize);
+
+		// Each column moves further than the previous one, so move them from last to first
+		for (size_t column = kNumColumns; column-- > 0; )
+		{
+			const size_t entrySize = column == kNumColumns - 1 ? sizeof(uint64_t) : sizeof(uint32_t);
+			unsigned char* newColumn = data + GetColumnOffset(column, newSlotCapacity);
+			memmove(newColumn, data + GetColumnOffset(column, slotCapacity), entrySize * slotCapacity);
+			memset(newColumn + entrySize * slotCapacity, 0, entrySize * (newSlotCapacity - slotCapacity));
+		}
+
+		Header& header = GetHeader();
+		header.mSlotCapacity = newSlotCapacity;
+		header.mPayloadOffset = newPayloadOffset;
+	}
+
+	GetHeader().mNumSlots = newNumSlots;
+	return firstSlot;
+}
+
+inline hsm_bool StateMachineStore::Save(size_t slot, const StateMachine& stateMachine)
+{
+	CheckSlot(slot);
+
+	mSnapshot.clear();
+	SnapshotWriter writer(mSnapshot);
+	stateMachine.SaveSnapshot(writer);
+	const size_t size = mSnapshot.size();
+
+	// A slot outside of the heap (if the file is damaged) is given new space, as if it were too small
+	const hsm_bool inHeap = IsSlotInHeap(slot);
+	if (size > GetPayloadCapacities()[slot] || !inHeap)
+	{
+		// Doesn't fit in place, so append to the heap, wasting the old space
+		const size_t capacity = RoundUp(size, kPayloadAlignment);
+		const size_t offset = static_cast<size_t>(GetHeader().mPayloadSize);
+		if (!Reserve(static_cast<size_t>(GetHeader().mPayloadOffset) + offset + capacity))
+			return hsm_false;
+
+		Header& header = GetHeader();
+		header.mPayloadSize += capacity;
+		header.mNumWastedBytes += inHeap ? GetPayloadCapacities()[slot] : 0;
+		GetPayloadCapacities()[slot] = static_cast<uint32_t>(capacity);
+		GetPayloadOffsets()[slot] = offset;
+	}
+
+	memcpy(GetPayload() + GetPayloadOffsets()[slot], mSnapshot.data(), size);
+	GetPayloadSizes()[slot] = static_cast<uint32_t>(size);
+
+	const size_t depth = stateMachine.mStateStack.size();
+	GetStackDepths()[slot] = static_cast<uint32_t>(depth);
+	GetLeafStateSnapshotIds()[slot] = depth > 0 ? detail::HashStateName(stateMachine.mStateStack[depth - 1]->GetStateType().mStateName) : 0;
+	return hsm_true;
+}
+
+inline hsm_bool StateMachineStore::Load(size_t slot, StateMachine& stateMachine)
+{
+	CheckSlot(slot);
+	const size_t size = GetPayloadSizes()[slot];
+	if (size == 0 || !IsSlotInHeap(slot))
+		return hsm_false;
+
+	SnapshotReader reader(GetPayload() + GetPayloadOffsets()[slot], size);
+	return stateMachine.LoadSnapshot(reader);
+}
+
+inline void StateMachineStore::Clear(size_t slot)
+{
+	CheckSlot(slot);
+	GetHeader().mNumWastedBytes += GetPayloadCapacities()[slot];
+	GetLeafStateSnapshotIds()[slot] = 0;
+	GetStackDepths()[slot] = 0;
+	GetPayloadSizes()[slot] = 0;
+	GetPayloadCapacities()[slot] = 0;
+	GetPayloadOffsets()[slot] = 0;
+}
+
+inline void StateMachineStore::Compact()
+{
+	HSM_ASSERT(IsOpen());
+
+	// Slots with space in the heap, in heap order, so that moving each snapshot down can't overwrite the next.
+	// Slots outside of the heap (if the file is damaged) are emptied.
+	mSortedSlots.clear();
+	const uint32_t* capacities = GetPayloadCapacities();
+	const uint64_t* offsets = GetPayloadOffsets();
+	for (size_t slot = 0; slot < GetNumSlots(); ++slot)
+	{
+		if (!IsSlotInHeap(slot))
+			Clear(slot);
+		else if (capacities[slot] > 0)
+			mSortedSlots.push_back(slot);
+	}
+	std::sort(mSortedSlots.begin(), mSortedSlots.end(), [offsets](size_t lhs, size_t rhs) { return offsets[lhs] < offsets[rhs]; });
+
+	unsigned char* payload = GetPayload();
+	size_t payloadSize = 0;
+	for (size_t i = 0; i < mSortedSlots.size(); ++i)
+	{
+		const size_t slot = mSortedSlots[i];
+		const size_t size = GetPayloadSizes()[slot];
+		memmove(payload + payloadSize, payload + GetPayloadOffsets()[slot], size);
+		GetPayloadOffsets()[slot] = payloadSize;
+		GetPayloadCapacities()[slot] = static_cast<uint32_t>(RoundUp(size, kPayloadAlignment));
+		payloadSize += GetPayloadCapacities()[slot];
+	}
+
+	Header& header = GetHeader();
+	header.mPayloadSize = payloadSize;
+	header.mNumWastedBytes = 0;
+}
+
+} // namespace hsm
+
+#endif // __HSM_STORE_H__
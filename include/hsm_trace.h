@@ -0,0 +1,613 @@
+// Hierarchical State Machine (HSM)
+//
+// Copyright (c) 2015 Antonio Maiorano
+//
+// Distributed under the MIT License (MIT)
+// (See accompanying file LICENSE.txt or copy at
+// http://opensource.org/licenses/MIT)
+
+/// \file hsm_trace.h
+/// \brief TraceSinks that buffer trace records and write them to a file from a background thread
+
+#pragma once
+#ifndef __HSM_TRACE_H__
+#define __HSM_TRACE_H__
+
+#include "hsm.h"
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hsm {
+
+namespace detail
+{
+	// Ring of trace records written by a single thread, and drained by a single thread
+	class TraceRing
+	{
+	public:
+		TraceRing(size_t capacity, std::thread::id writerThreadId)
+			: mRecords(capacity)
+			, mMask(capacity - 1)
+			, mWriterThreadId(writerThreadId)
+			, mWriterExited(false)
+		{
+			HSM_ASSERT_MSG(capacity > 0 && (capacity & (capacity - 1)) == 0, "Capacity must be a power of two");
+		}
+
+		std::thread::id GetWriterThreadId() const { return mWriterThreadId; }
+
+		// Set when the writer thread exits, after which the ring only needs to be drained one last time
+		void SetWriterExited() { mWriterExited.store(true, std::memory_order_release); }
+		hsm_bool HasWriterExited() const { return mWriterExited.load(std::memory_order_acquire); }
+
+		// Returns false if the ring is full
+		hsm_bool Push(const TraceRecord& record)
+		{
+			const size_t head = mHead.mValue.load(std::memory_order_relaxed);
+			if (head - mTail.mValue.load(std::memory_order_acquire) == mRecords.size())
+				return hsm_false;
+
+			mRecords[head & mMask] = record;
+			mHead.mValue.store(head + 1, std::memory_order_release);
+			return hsm_true;
+		}
+
+		// Appends the records pushed so far to output, in order, and removes them
+		void Drain(std::vector<TraceRecord>& output)
+		{
+			const size_t tail = mTail.mValue.load(std::memory_order_relaxed);
+			const size_t head = mHead.mValue.load(std::memory_order_acquire);
+			for (size_t i = tail; i != head; ++i)
+			{
+				output.push_back(mRecords[i & mMask]);
+			}
+			mTail.mValue.store(head, std::memory_order_release);
+		}
+
+	private:
+		static const size_t kCacheLineSize = 64;
+
+		// Index preceded by a cache line of padding. Padded rather than aligned, since HSM_NEW doesn't honour
+		// over-aligned types before C++17.
+		struct PaddedIndex
+		{
+			PaddedIndex() : mValue(0) {}
+
+			char mPadding[kCacheLineSize];
+			std::atomic<size_t> mValue;
+		};
+
+		std::vector<TraceRecord> mRecords;
+		const size_t mMask;
+		const std::thread::id mWriterThreadId;
+		std::atomic<bool> mWriterExited;
+
+		// On separate cache lines, as they're written by different threads
+		PaddedIndex mHead;
+		PaddedIndex mTail;
+	};
+
+	inline std::atomic<size_t>& GetTraceSinkCounter()
+	{
+		static std::atomic<size_t> counter(0);
+		return counter;
+	}
+}
+
+// Base of TraceSinks cheap enough to leave on in shipping builds: Write copies the record into a lock-free ring
+// owned by the calling thread, and a background thread periodically drains the rings of all threads and passes
+// the records to WriteRecords, so that formatting and file writes stay off the threads processing the state
+// machines. If a thread writes records faster than they are drained, its ring fills up and further records are
+// dropped (see GetNumDroppedRecords).
+class BufferedTraceSink : public TraceSink
+{
+public:
+	virtual ~BufferedTraceSink();
+
+	virtual void Write(const TraceRecord& record);
+
+	// Writes the records written so far
+	void Flush();
+
+	size_t GetNumDroppedRecords() const { return mNumDroppedRecords.load(std::memory_order_relaxed); }
+
+protected:
+	// Each thread that writes records gets a ring of ringCapacity records, which must be a power of two. The
+	// rings are drained every drainInterval.
+	BufferedTraceSink(size_t ringCapacity, std::chrono::milliseconds drainInterval);
+
+	// Starts accepting records, and the thread that drains them; call from the derived constructor once
+	// WriteRecords may be called. Records written before are ignored.
+	void Start();
+
+	// Stops the thread, and writes the remaining records; call from the derived destructor, as WriteRecords
+	// can't be called once the derived object is destroyed. No records may be written from then on.
+	void Stop();
+
+	// Called by the drain thread, or by Flush, with the records drained since the last call, sorted by time.
+	// Calls are serialized.
+	virtual void WriteRecords(const TraceRecord* records, size_t numRecords) = 0;
+
+	// Called by Flush after WriteRecords, to flush the output
+	virtual void FlushOutput() {}
+
+private:
+	BufferedTraceSink(const BufferedTraceSink&);
+	BufferedTraceSink& operator=(const BufferedTraceSink&);
+
+	// Returns the calling thread's ring, creating it on first use
+	detail::TraceRing& GetThreadRing();
+
+	void DrainThread();
+	void Drain();
+
+	const size_t mRingCapacity;
+	const std::chrono::milliseconds mDrainInterval;
+	const size_t mId; // Identifies this sink in the threads' ring caches
+	std::atomic<size_t> mNumDroppedRecords;
+	std::atomic<bool> mStarted;
+
+	std::mutex mRingsMutex; // Guards mRings, which only changes when a thread writes its first record or exits
+	std::vector<std::shared_ptr<detail::TraceRing>> mRings;
+
+	std::mutex mDrainMutex; // Serializes draining
+	std::vector<TraceRecord> mDrainedRecords; // Kept to reuse its memory
+
+	std::mutex mThreadMutex;
+	std::condition_variable mThreadCondition;
+	hsm_bool mStopThread;
+	std::thread mThread;
+};
+
+inline BufferedTraceSink::BufferedTraceSink(size_t ringCapacity, std::chrono::milliseconds drainInterval)
+	: mRingCapacity(ringCapacity)
+	, mDrainInterval(drainInterval)
+	, mId(++detail::GetTraceSinkCounter())
+	, mNumDroppedRecords(0)
+	, mStarted(false)
+	, mStopThread(hsm_false)
+{
+}
+
+inline BufferedTraceSink::~BufferedTraceSink()
+{
+	HSM_ASSERT_MSG(!mThread.joinable(), "Derived class must call Stop in its destructor");
+}
+
+inline void BufferedTraceSink::Start()
+{
+	mStarted.store(true, std::memory_order_release);
+	mThread = std::thread(&BufferedTraceSink::DrainThread, this);
+}
+
+inline void BufferedTraceSink::Stop()
+{
+	if (!mThread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mThreadMutex);
+		mStopThread = hsm_true;
+	}
+	mThreadCondition.notify_one();
+	mThread.join();
+
+	Flush();
+	mStarted.store(false, std::memory_order_release);
+}
+
+inline detail::TraceRing& BufferedTraceSink::GetThreadRing()
+{
+	// Marks the rings of the thread as exited when it exits, so that their sinks free them once drained. Rings
+	// are shared with the sinks, which may be destroyed first.
+	struct ThreadRings
+	{
+		~ThreadRings()
+		{
+			for (size_t i = 0; i < mRings.size(); ++i)
+			{
+				if (std::shared_ptr<detail::TraceRing> ring = mRings[i].lock())
+					ring->SetWriterExited();
+			}
+		}
+
+		std::vector<std::weak_ptr<detail::TraceRing>> mRings;
+	};
+
+	// Each thread caches the last ring it wrote to, identified by the id of its sink, which is never reused, so a
+	// destroyed sink's ring is never returned. Otherwise, the ring is looked up by thread in the sink.
+	static thread_local size_t cachedSinkId = 0;
+	static thread_local detail::TraceRing* cachedRing = 0;
+	if (cachedSinkId == mId)
+		return *cachedRing;
+
+	const std::thread::id threadId = std::this_thread::get_id();
+	std::lock_guard<std::mutex> lock(mRingsMutex);
+	detail::TraceRing* ring = 0;
+	for (size_t i = 0; i < mRings.size() && !ring; ++i)
+	{
+		// A ring whose writer exited may remain until the next drain, while its thread id is reused
+		if (mRings[i]->GetWriterThreadId() == threadId && !mRings[i]->HasWriterExited())
+			ring = mRings[i].get();
+	}
+
+	if (!ring)
+	{
+		mRings.push_back(std::shared_ptr<detail::TraceRing>(HSM_NEW detail::TraceRing(mRingCapacity, threadId)));
+		ring = mRings.back().get();
+
+		static thread_local ThreadRings threadRings;
+		threadRings.mRings.erase(std::remove_if(threadRings.mRings.begin(), threadRings.mRings.end(), [](const std::weak_ptr<detail::TraceRing>& threadRing)
+		{
+			return threadRing.expired();
+		}), threadRings.mRings.end());
+		threadRings.mRings.push_back(mRings.back());
+	}
+
+	cachedSinkId = mId;
+	cachedRing = ring;
+	return *ring;
+}
+
+inline void BufferedTraceSink::Write(const TraceRecord& record)
+{
+	if (mStarted.load(std::memory_order_relaxed) && !GetThreadRing().Push(record))
+	{
+		mNumDroppedRecords.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+inline void BufferedTraceSink::Flush()
+{
+	if (mStarted.load(std::memory_order_acquire))
+	{
+		std::lock_guard<std::mutex> lock(mDrainMutex);
+		Drain();
+		FlushOutput();
+	}
+}
+
+inline void BufferedTraceSink::DrainThread()
+{
+	std::unique_lock<std::mutex> lock(mThreadMutex);
+	while (!mStopThread)
+	{
+		mThreadCondition.wait_for(lock, mDrainInterval);
+
+		std::lock_guard<std::mutex> drainLock(mDrainMutex);
+		Drain();
+	}
+}
+
+inline void BufferedTraceSink::Drain()
+{
+	{
+		std::lock_guard<std::mutex> lock(mRingsMutex);
+		for (size_t i = 0; i < mRings.size(); )
+		{
+			// Checked before draining, so that once set, the ring can't receive records after being drained
+			const hsm_bool writerExited = mRings[i]->HasWriterExited();
+			mRings[i]->Drain(mDrainedRecords);
+			if (writerExited)
+				mRings.erase(mRings.begin() + static_cast<ptrdiff_t>(i));
+			else
+				++i;
+		}
+	}
+
+	if (!mDrainedRecords.empty())
+	{
+		// Records are only in order per thread
+		std::stable_sort(mDrainedRecords.begin(), mDrainedRecords.end(), [](const TraceRecord& lhs, const TraceRecord& rhs)
+		{
+			return lhs.mTime < rhs.mTime;
+		});
+
+		WriteRecords(mDrainedRecords.data(), mDrainedRecords.size());
+		mDrainedRecords.clear();
+	}
+}
+
+// Writes trace records to a binary file, without formatting them; tools/hsmTraceDecode.py turns the file into
+// text.
+//
+// File format (native byte order): the magic "HSMT", a uint32 version and the uint32 sizeof(hsm_char), followed
+// by records that each start with a uint8 kind. A state name record (kind 0) is a uint32 id, a uint16 length in
+// characters and the name's characters, and is written before the first transition record that refers to it.
+// A transition record (kind 1) is the uint64 time and uint64 duration in nanoseconds, uint64 state machine id,
+// uint32 state name id, uint16 depth, uint8 TraceEvent and uint8 TraceLevel.
+class FileTraceSink : public BufferedTraceSink
+{
+public:
+	explicit FileTraceSink(const char* path, size_t ringCapacity = 4096, std::chrono::milliseconds drainInterval = std::chrono::milliseconds(10));
+
+	// Writes the remaining records and closes the file
+	virtual ~FileTraceSink();
+
+	hsm_bool IsOpen() const { return mFile != 0; }
+
+protected:
+	virtual void WriteRecords(const TraceRecord* records, size_t numRecords);
+	virtual void FlushOutput() { fflush(mFile); }
+
+private:
+	static const uint32_t kMagic = 0x544d5348; // "HSMT"
+	static const uint32_t kVersion = 2;
+
+	template <typename T>
+	void Append(const T& value)
+	{
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+		mBuffer.insert(mBuffer.end(), bytes, bytes + sizeof(T));
+	}
+
+	FILE* mFile;
+	HSM_STD_MAP<const hsm_char*, uint32_t> mStateNameIds;
+	std::vector<unsigned char> mBuffer;
+};
+
+inline FileTraceSink::FileTraceSink(const char* path, size_t ringCapacity, std::chrono::milliseconds drainInterval)
+	: BufferedTraceSink(ringCapacity, drainInterval)
+	, mFile(fopen(path, "wb"))
+{
+	if (mFile)
+	{
+		Append(static_cast<uint32_t>(kMagic));
+		Append(static_cast<uint32_t>(kVersion));
+		Append(static_cast<uint32_t>(sizeof(hsm_char)));
+		Start();
+	}
+}
+
+inline FileTraceSink::~FileTraceSink()
+{
+	Stop();
+	if (mFile)
+	{
+		fwrite(mBuffer.data(), 1, mBuffer.size(), mFile); // Header only, if no records were written
+		fclose(mFile);
+	}
+}
+
+inline void FileTraceSink::WriteRecords(const TraceRecord* records, size_t numRecords)
+{
+	for (size_t i = 0; i < numRecords; ++i)
+	{
+		const TraceRecord& record = records[i];
+
+		// State names are written once, the first time they're seen
+		uint32_t stateNameId = static_cast<uint32_t>(mStateNameIds.size());
+		const std::pair<HSM_STD_MAP<const hsm_char*, uint32_t>::iterator, bool> result = mStateNameIds.insert(std::make_pair(record.mStateName, stateNameId));
+		if (result.second)
+		{
+			uint16_t length = 0;
+			while (record.mStateName[length] != 0 && length < 0xFFFF)
+				++length;
+
+			const unsigned char* chars = reinterpret_cast<const unsigned char*>(record.mStateName);
+			Append(static_cast<uint8_t>(0));
+			Append(stateNameId);
+			Append(length);
+			mBuffer.insert(mBuffer.end(), chars, chars + length * sizeof(hsm_char));
+		}
+		else
+		{
+			stateNameId = result.first->second;
+		}
+
+		Append(static_cast<uint8_t>(1));
+		Append(record.mTime);
+		Append(record.mDuration);
+		Append(record.mStateMachineId);
+		Append(stateNameId);
+		Append(record.mDepth);
+		Append(record.mEvent);
+		Append(record.mLevel);
+	}
+
+	fwrite(mBuffer.data(), 1, mBuffer.size(), mFile);
+	mBuffer.clear();
+}
+
+// Writes the state stacks of the state machines as a timeline in the Chrome trace event format (JSON), which can
+// be opened in Perfetto (ui.perfetto.dev) or chrome://tracing. Each state machine, including each region, gets a
+// track, on which each state is a slice that lasts from its push to its pop, nested like the state stack. Use
+// TraceLevel::Diagnostic or higher, so that pops, events and deferred transitions (shown as instants) are
+// reported, and TraceLevel::Calls to also show GetTransition and Update calls as slices within the states (if
+// HSM_USE_TRACE_CALLS is set).
+// Times are those of std::chrono::steady_clock in microseconds, to line up with other traces that use it.
+//
+// States that are still on the stack when the sink is destroyed, or that were popped without being reported
+// (e.g. when stopping a machine without calling OnExit), end at the time of destruction, or of the next state
+// pushed at their depth or below.
+class ChromeTraceSink : public BufferedTraceSink
+{
+public:
+	explicit ChromeTraceSink(const char* path, size_t ringCapacity = 4096, std::chrono::milliseconds drainInterval = std::chrono::milliseconds(10));
+
+	// Ends the states still on the stacks, writes the remaining records and closes the file
+	virtual ~ChromeTraceSink();
+
+	hsm_bool IsOpen() const { return mFile != 0; }
+
+protected:
+	virtual void WriteRecords(const TraceRecord* records, size_t numRecords);
+	virtual void FlushOutput() { fflush(mFile); }
+
+private:
+	// State on a machine's stack, whose slice is written once it's popped
+	struct OpenState
+	{
+		const hsm_char* mStateName;
+		uint64_t mStartTime;
+	};
+
+	struct Track
+	{
+		uint32_t mTrackId;
+		std::vector<OpenState> mStateStack;
+	};
+
+	Track& GetTrack(uint64_t stateMachineId);
+
+	// Writes the slices of the states on the track at depth or deeper, ending at endTime, and pops them
+	void PopStates(Track& track, size_t depth, uint64_t endTime);
+
+	void WriteEvent(const char* phase, const hsm_char* name, const hsm_char* nameSuffix, const char* category, uint64_t time, uint64_t duration, uint32_t trackId, size_t depth);
+	void WriteString(const hsm_char* str);
+
+	FILE* mFile;
+	hsm_bool mFirstEvent;
+	HSM_STD_MAP<uint64_t, Track> mTracks; // By state machine id
+};
+
+inline ChromeTraceSink::ChromeTraceSink(const char* path, size_t ringCapacity, std::chrono::milliseconds drainInterval)
+	: BufferedTraceSink(ringCapacity, drainInterval)
+	, mFile(fopen(path, "w"))
+	, mFirstEvent(hsm_true)
+{
+	if (mFile)
+	{
+		fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", mFile);
+		Start();
+	}
+}
+
+inline ChromeTraceSink::~ChromeTraceSink()
+{
+	Stop();
+	if (mFile)
+	{
+		const uint64_t endTime = detail::GetTraceTime();
+		for (HSM_STD_MAP<uint64_t, Track>::iterator iter = mTracks.begin(); iter != mTracks.end(); ++iter)
+		{
+			PopStates(iter->second, 0, endTime);
+		}
+
+		fputs("\n]}\n", mFile);
+		fclose(mFile);
+	}
+}
+
+inline ChromeTraceSink::Track& ChromeTraceSink::GetTrack(uint64_t stateMachineId)
+{
+	HSM_STD_MAP<uint64_t, Track>::iterator iter = mTracks.find(stateMachineId);
+	if (iter != mTracks.end())
+		return iter->second;
+
+	Track& track = mTracks[stateMachineId];
+	track.mTrackId = static_cast<uint32_t>(mTracks.size());
+
+	fprintf(mFile, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"StateMachine 0x%llx\"}}",
+		mFirstEvent ? "" : ",", track.mTrackId, static_cast<unsigned long long>(stateMachineId));
+	mFirstEvent = hsm_false;
+	return track;
+}
+
+inline void ChromeTraceSink::PopStates(Track& track, size_t depth, uint64_t endTime)
+{
+	while (track.mStateStack.size() > depth)
+	{
+		const OpenState& state = track.mStateStack.back();
+		const uint64_t startTime = state.mStartTime < endTime ? state.mStartTime : endTime;
+		WriteEvent("X", state.mStateName, 0, "state", startTime, endTime - startTime, track.mTrackId, track.mStateStack.size() - 1);
+		track.mStateStack.pop_back();
+	}
+}
+
+inline void ChromeTraceSink::WriteRecords(const TraceRecord* records, size_t numRecords)
+{
+	for (size_t i = 0; i < numRecords; ++i)
+	{
+		const TraceRecord& record = records[i];
+		Track& track = GetTrack(record.mStateMachineId);
+
+		switch (record.mEvent)
+		{
+			case TraceEvent::Init:
+			case TraceEvent::Entry:
+			case TraceEvent::Inner:
+			case TraceEvent::Sibling:
+			{
+				// The pushed state replaces any state at its depth or deeper
+				PopStates(track, record.mDepth, record.mTime);
+				OpenState state = { record.mStateName, record.mTime };
+				track.mStateStack.push_back(state);
+			}
+			break;
+
+			case TraceEvent::Pop:
+				PopStates(track, record.mDepth, record.mTime);
+				break;
+
+			case TraceEvent::Deferred:
+			case TraceEvent::Event:
+			{
+				const hsm_char* suffix = record.mEvent == TraceEvent::Deferred ? HSM_TEXT(" deferred transition") : HSM_TEXT(" event");
+				WriteEvent("i", record.mStateName, suffix, "event", record.mTime, 0, track.mTrackId, record.mDepth);
+			}
+			break;
+
+			case TraceEvent::GetTransition:
+			case TraceEvent::Update:
+			{
+				const hsm_char* suffix = record.mEvent == TraceEvent::GetTransition ? HSM_TEXT("::GetTransition") : HSM_TEXT("::Update");
+				WriteEvent("X", record.mStateName, suffix, "call", record.mTime, record.mDuration, track.mTrackId, record.mDepth);
+			}
+			break;
+		}
+	}
+}
+
+inline void ChromeTraceSink::WriteEvent(const char* phase, const hsm_char* name, const hsm_char* nameSuffix, const char* category, uint64_t time, uint64_t duration, uint32_t trackId, size_t depth)
+{
+	fputs(mFirstEvent ? "\n{\"name\":\"" : ",\n{\"name\":\"", mFile);
+	mFirstEvent = hsm_false;
+
+	WriteString(name);
+	if (nameSuffix)
+	{
+		WriteString(nameSuffix);
+	}
+
+	fprintf(mFile, "\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%llu.%03u", category, phase,
+		static_cast<unsigned long long>(time / 1000), static_cast<unsigned>(time % 1000));
+	if (phase[0] == 'X')
+	{
+		fprintf(mFile, ",\"dur\":%llu.%03u", static_cast<unsigned long long>(duration / 1000), static_cast<unsigned>(duration % 1000));
+	}
+	else
+	{
+		fputs(",\"s\":\"t\"", mFile);
+	}
+	fprintf(mFile, ",\"pid\":1,\"tid\":%u,\"args\":{\"depth\":%u}}", trackId, static_cast<unsigned>(depth));
+}
+
+inline void ChromeTraceSink::WriteString(const hsm_char* str)
+{
+	for ( ; *str; ++str)
+	{
+		const uint32_t c = static_cast<uint32_t>(static_cast<std::make_unsigned<hsm_char>::type>(*str));
+		if (c == '"' || c == '\\')
+		{
+			fputc('\\', mFile);
+			fputc(static_cast<int>(c), mFile);
+		}
+		else if (c < 0x20 || (sizeof(hsm_char) > 1 && c >= 0x80))
+		{
+			fprintf(mFile, "\\u%04x", c < 0x10000 ? c : 0xFFFD);
+		}
+		else
+		{
+			fputc(static_cast<int>(c), mFile); // UTF-8 bytes are written as is
+		}
+	}
+}
+
+} // namespace hsm
+
+#endif // __HSM_TRACE_H__
@@ -0,0 +1,30 @@
+# Runs the addons_trace_sinks sample, which checks its own trace files, then checks that tools/hsmTraceDecode.py
+# decodes as many records as the sample wrote, and that the Chrome trace loads as JSON.
+#
+# Usage: cmake -DSAMPLE=<exe> -DPYTHON=<python> -DDECODER=<hsmTraceDecode.py> -P RunTraceSinksTest.cmake
+
+execute_process(COMMAND "${SAMPLE}" RESULT_VARIABLE result OUTPUT_VARIABLE output)
+message("${output}")
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "${SAMPLE} failed")
+endif()
+
+string(REGEX MATCH "trace_sinks.hsmt: ([0-9]+) records" match "${output}")
+set(numRecords "${CMAKE_MATCH_1}")
+
+execute_process(COMMAND "${PYTHON}" "${DECODER}" trace_sinks.hsmt RESULT_VARIABLE result OUTPUT_VARIABLE decoded ERROR_VARIABLE errors)
+if(NOT result EQUAL 0 OR NOT "${errors}" STREQUAL "")
+	message(FATAL_ERROR "hsmTraceDecode.py failed: ${errors}")
+endif()
+
+string(REGEX MATCHALL "\n" lines "${decoded}")
+list(LENGTH lines numDecodedRecords)
+if(NOT numDecodedRecords EQUAL numRecords)
+	message(FATAL_ERROR "hsmTraceDecode.py decoded ${numDecodedRecords} records, expected ${numRecords}")
+endif()
+message("hsmTraceDecode.py: ${numDecodedRecords} records")
+
+execute_process(COMMAND "${PYTHON}" -m json.tool trace_sinks.json RESULT_VARIABLE result OUTPUT_QUIET ERROR_VARIABLE errors)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "trace_sinks.json is not valid JSON: ${errors}")
+endif()
@@ -0,0 +1,19 @@
+// check.h
+// Checks shared by the add-on samples, which verify their own results so that they can be run as tests (see
+// CMakeLists.txt). Unlike assert, checks are made in all builds.
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+inline void Check(bool result, const char* expr, const char* file, int line)
+{
+	if (!result)
+	{
+		printf("%s(%d): check failed: %s\n", file, line, expr);
+		exit(1);
+	}
+}
+
+#define CHECK(expr) Check(!!(expr), #expr, __FILE__, __LINE__)
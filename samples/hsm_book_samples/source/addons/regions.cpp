@@ -0,0 +1,246 @@
+// regions.cpp
+// A body whose limbs are orthogonal regions (see State::AddRegion) of its state machine, running concurrently
+// with the body's own states. Two identical bodies are processed for a number of frames, one settling its
+// regions serially via StateMachine::ProcessStateTransitions, the other in parallel via
+// WorkStealingExecutor::ProcessStateTransitions (see hsm_parallel.h), and their states and frame metrics are
+// checked to match every frame. Also checks that regions are named after the state that owns them, use the
+// state overrides of the root, and are reused when that state is entered again.
+
+#include "hsm_parallel.h"
+#include "check.h"
+#include <algorithm>
+#include <vector>
+
+using namespace hsm;
+
+const size_t kNumLimbs = 8;
+const int kNumFrames = 100;
+const int kStopFrame = 50; // Frame on which the bodies are stopped and restarted, which restarts their limbs
+
+class Body
+{
+public:
+	Body() : mFrame(0) {}
+
+	int mFrame;
+	StateMachine mStateMachine;
+};
+
+struct LimbStates
+{
+	struct BaseState : StateWithOwner<Body>
+	{
+		// Returns the index of this limb's region in the body state that owns it, which only reads the body's
+		// state machine, so that limbs can be settled in parallel
+		size_t GetLimbIndex()
+		{
+			State* bodyState = GetStateMachine().GetParentState();
+			for (size_t i = 0; i < bodyState->GetNumRegions(); ++i)
+			{
+				if (&bodyState->GetRegion(i) == &GetStateMachine())
+					return i;
+			}
+			CHECK(false);
+			return 0;
+		}
+
+		// Steps of a swing last one frame
+		virtual void OnEnter() { mEnterFrame = Owner().mFrame; }
+		bool IsStepDone() const { return Owner().mFrame > mEnterFrame; }
+
+		int mEnterFrame = 0;
+	};
+
+	// Each limb swings at its own rate
+	struct Idle : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (Owner().mFrame % static_cast<int>(GetLimbIndex() + 2) == 0)
+				return SiblingTransition(GetStateOverride<Swing>());
+
+			return NoTransition();
+		}
+	};
+
+	struct Swing : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (IsInInnerState<Swing_Done>())
+				return SiblingTransition<Idle>();
+
+			return InnerEntryTransition<Swing_Forward>();
+		}
+	};
+
+	// Overrides Swing, skipping the forward step
+	struct SwingFast : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (IsInInnerState<Swing_Done>())
+				return SiblingTransition<Idle>();
+
+			return InnerEntryTransition<Swing_Back>();
+		}
+	};
+
+	struct Swing_Forward : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			return IsStepDone() ? SiblingTransition<Swing_Back>() : NoTransition();
+		}
+	};
+
+	struct Swing_Back : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			return IsStepDone() ? SiblingTransition<Swing_Done>() : NoTransition();
+		}
+	};
+
+	struct Swing_Done : BaseState
+	{
+	};
+};
+
+struct BodyStates
+{
+	struct BaseState : StateWithOwner<Body>
+	{
+	};
+
+	struct Alive : BaseState
+	{
+		virtual void OnEnter()
+		{
+			for (size_t i = 0; i < kNumLimbs; ++i)
+			{
+				AddRegion<LimbStates::Idle>();
+			}
+		}
+
+		virtual Transition GetTransition()
+		{
+			return InnerEntryTransition<Stand>();
+		}
+	};
+
+	struct Stand : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			return Owner().mFrame % 10 == 5 ? SiblingTransition<Move>() : NoTransition();
+		}
+	};
+
+	struct Move : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			return Owner().mFrame % 10 == 0 ? SiblingTransition<Stand>() : NoTransition();
+		}
+	};
+};
+
+void CheckSameStack(StateMachine& stateMachine1, StateMachine& stateMachine2)
+{
+	OuterToInnerIterator iter1 = stateMachine1.BeginOuterToInner();
+	OuterToInnerIterator iter2 = stateMachine2.BeginOuterToInner();
+	for ( ; iter1 != stateMachine1.EndOuterToInner() && iter2 != stateMachine2.EndOuterToInner(); ++iter1, ++iter2)
+	{
+		CHECK((*iter1)->GetStateType() == (*iter2)->GetStateType());
+	}
+	CHECK(iter1 == stateMachine1.EndOuterToInner() && iter2 == stateMachine2.EndOuterToInner());
+}
+
+void CheckSameStates(Body& body1, Body& body2)
+{
+	StateMachine& stateMachine1 = body1.mStateMachine;
+	StateMachine& stateMachine2 = body2.mStateMachine;
+	CheckSameStack(stateMachine1, stateMachine2);
+
+	CHECK(stateMachine1.GetNumActiveRegions() == kNumLimbs && stateMachine2.GetNumActiveRegions() == kNumLimbs);
+	for (size_t i = 0; i < kNumLimbs; ++i)
+	{
+		CheckSameStack(stateMachine1.GetActiveRegion(i), stateMachine2.GetActiveRegion(i));
+	}
+
+	const FrameMetrics& metrics1 = stateMachine1.GetFrameMetrics();
+	const FrameMetrics& metrics2 = stateMachine2.GetFrameMetrics();
+	CHECK(metrics1.mNumGetTransitionCalls == metrics2.mNumGetTransitionCalls);
+	CHECK(metrics1.mNumPushes == metrics2.mNumPushes);
+	CHECK(metrics1.mNumPops == metrics2.mNumPops);
+}
+
+int main()
+{
+	Body serialBody;
+	Body parallelBody;
+	Body* bodies[] = { &serialBody, &parallelBody };
+	for (Body* body : bodies)
+	{
+		body->mStateMachine.Initialize<BodyStates::Alive>(body);
+		body->mStateMachine.AddStateOverride<LimbStates::Swing, LimbStates::SwingFast>();
+	}
+
+	WorkStealingExecutor executor(4);
+	executor.SetChunkSize(1);
+
+	std::vector<StateMachine*> regions;
+	size_t numSwings = 0;
+	size_t numRegionGetTransitionCalls = 0;
+	for (int frame = 0; frame < kNumFrames; ++frame)
+	{
+		if (frame == kStopFrame)
+		{
+			serialBody.mStateMachine.Stop();
+			parallelBody.mStateMachine.Stop();
+		}
+
+		serialBody.mFrame = frame;
+		parallelBody.mFrame = frame;
+		serialBody.mStateMachine.ProcessStateTransitions();
+		executor.ProcessStateTransitions(parallelBody.mStateMachine);
+		serialBody.mStateMachine.UpdateStates();
+		parallelBody.mStateMachine.UpdateStates();
+
+		CheckSameStates(serialBody, parallelBody);
+
+		// Regions are reused when Alive is entered again
+		if (frame == 0 || frame == kStopFrame)
+		{
+			for (size_t i = 0; i < kNumLimbs; ++i)
+			{
+				StateMachine& region = parallelBody.mStateMachine.GetActiveRegion(i);
+				CHECK(region.GetParentState() == parallelBody.mStateMachine.GetState<BodyStates::Alive>());
+				CHECK(region.GetDebugName() == region.GetParentState()->GetStateDebugName());
+				if (frame == 0)
+					regions.push_back(&region);
+				else
+					CHECK(std::find(regions.begin(), regions.end(), &region) != regions.end());
+			}
+		}
+
+		for (size_t i = 0; i < kNumLimbs; ++i)
+		{
+			StateMachine& limb = parallelBody.mStateMachine.GetActiveRegion(i);
+			CHECK(!limb.IsInState<LimbStates::Swing>());
+			if (limb.IsInState<LimbStates::SwingFast>())
+				++numSwings;
+			numRegionGetTransitionCalls += limb.GetFrameMetrics().mNumGetTransitionCalls;
+		}
+	}
+
+	CHECK(numSwings > 0);
+	CHECK(parallelBody.mStateMachine.GetTotalMetrics().mNumGetTransitionCalls > numRegionGetTransitionCalls);
+	printf("%d frames, %d limbs: %d frames spent swinging, %d GetTransition calls in regions\n", kNumFrames,
+		static_cast<int>(kNumLimbs), static_cast<int>(numSwings), static_cast<int>(numRegionGetTransitionCalls));
+
+	serialBody.mStateMachine.Stop();
+	parallelBody.mStateMachine.Stop();
+	return 0;
+}
@@ -0,0 +1,282 @@
+// state_machine_store.cpp
+// Round-trips state machines through a StateMachineStore (see hsm_store.h) in a temporary file: saves them
+// while growing the slot table past its capacity, re-saves some in place and some appended to the heap, clears
+// one, reopens the file, compacts it, and checks the slot table columns, the wasted byte count and the loaded
+// machines along the way.
+
+#define HSM_USE_SNAPSHOTS 1
+#include "hsm_store.h"
+#include "check.h"
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+using namespace hsm;
+
+class Character
+{
+public:
+	Character() : mMove(false), mNumWaypoints(0) {}
+
+	bool mMove;
+	uint32_t mNumWaypoints; // Number of waypoints Move_Walk starts with, which sets the size of its snapshot
+	StateMachine mStateMachine;
+};
+
+struct CharacterStates
+{
+	struct BaseState : StateWithOwner<Character>
+	{
+	};
+
+	struct Alive : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (Owner().mMove)
+				return InnerEntryTransition<Move>();
+
+			return InnerEntryTransition<Stand>();
+		}
+	};
+
+	struct Stand : BaseState
+	{
+	};
+
+	struct Move : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			return InnerEntryTransition<Move_Walk>();
+		}
+	};
+
+	struct Move_Walk : BaseState
+	{
+		virtual void OnEnter()
+		{
+			for (uint32_t i = 0; i < Owner().mNumWaypoints; ++i)
+			{
+				mWaypoints.push_back(static_cast<float>(i));
+			}
+		}
+
+		virtual void SaveState(SnapshotWriter& writer) const
+		{
+			writer.Write(static_cast<uint32_t>(mWaypoints.size()));
+			for (size_t i = 0; i < mWaypoints.size(); ++i)
+			{
+				writer.Write(mWaypoints[i]);
+			}
+		}
+
+		virtual void LoadState(SnapshotReader& reader)
+		{
+			uint32_t numWaypoints = 0;
+			reader.Read(numWaypoints);
+			mWaypoints.resize(numWaypoints);
+			for (size_t i = 0; i < mWaypoints.size(); ++i)
+			{
+				reader.Read(mWaypoints[i]);
+			}
+		}
+
+		std::vector<float> mWaypoints;
+	};
+};
+
+const char* const kStorePath = "state_machine_store.hsmf";
+
+// Must match StateMachineStore::kPayloadAlignment
+const size_t kPayloadAlignment = 64;
+
+size_t RoundUp(size_t value)
+{
+	return (value + kPayloadAlignment - 1) / kPayloadAlignment * kPayloadAlignment;
+}
+
+// Restarts the character's machine with the input settings, and returns the size of its snapshot
+size_t ResetCharacter(Character& character, bool move, uint32_t numWaypoints)
+{
+	character.mMove = move;
+	character.mNumWaypoints = numWaypoints;
+	character.mStateMachine.Stop();
+	character.mStateMachine.ProcessStateTransitions();
+
+	std::vector<unsigned char> snapshot;
+	SnapshotWriter writer(snapshot);
+	character.mStateMachine.SaveSnapshot(writer);
+	return snapshot.size();
+}
+
+// Checks that the slot's columns and snapshot match the character
+void CheckSlot(StateMachineStore& store, size_t slot, const Character& character)
+{
+	CHECK(!store.IsEmpty(slot));
+
+	const StateFactory& leafStateFactory = character.mMove ? GetStateFactory<CharacterStates::Move_Walk>() : GetStateFactory<CharacterStates::Stand>();
+	CHECK(store.GetLeafStateSnapshotId(slot) == leafStateFactory.GetStateSnapshotId());
+	CHECK(store.GetStackDepth(slot) == (character.mMove ? 3u : 2u));
+
+	Character loadedCharacter;
+	loadedCharacter.mStateMachine.Initialize<CharacterStates::Alive>(&loadedCharacter);
+	CHECK(store.Load(slot, loadedCharacter.mStateMachine));
+	if (character.mMove)
+	{
+		const CharacterStates::Move_Walk* walk = loadedCharacter.mStateMachine.GetState<CharacterStates::Move_Walk>();
+		CHECK(walk && walk->mWaypoints.size() == character.mNumWaypoints);
+		CHECK(character.mNumWaypoints == 0 || walk->mWaypoints.back() == static_cast<float>(character.mNumWaypoints - 1));
+	}
+	else
+	{
+		CHECK(loadedCharacter.mStateMachine.IsInState<CharacterStates::Stand>());
+	}
+	loadedCharacter.mStateMachine.Stop();
+}
+
+long GetFileSize(const char* path)
+{
+	long size = -1;
+	if (FILE* file = fopen(path, "rb"))
+	{
+		fseek(file, 0, SEEK_END);
+		size = ftell(file);
+		fclose(file);
+	}
+	return size;
+}
+
+int main()
+{
+	// More machines than the initial slot capacity (64), so that the slot table grows twice
+	const size_t kNumMachines = 200;
+	const size_t kNumMachinesBeforeGrowing = 40;
+	const size_t kClearedSlot = 1;
+
+	std::vector<std::unique_ptr<Character>> characters;
+	std::vector<size_t> capacities; // Expected space of each slot's snapshot in the heap
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		characters.push_back(std::unique_ptr<Character>(new Character()));
+		Character& character = *characters.back();
+		character.mStateMachine.Initialize<CharacterStates::Alive>(&character);
+		capacities.push_back(RoundUp(ResetCharacter(character, i % 2 != 0, static_cast<uint32_t>(i % 7))));
+	}
+
+	remove(kStorePath);
+
+	{
+		StateMachineStore store;
+		CHECK(store.Open(kStorePath));
+		CHECK(store.GetNumSlots() == 0);
+
+		// Snapshots saved before the slot table grows must be moved along with the heap
+		CHECK(store.AddSlots(kNumMachinesBeforeGrowing) == 0);
+		for (size_t i = 0; i < kNumMachinesBeforeGrowing; ++i)
+		{
+			CHECK(store.Save(i, characters[i]->mStateMachine));
+		}
+		CHECK(store.AddSlots(kNumMachines - kNumMachinesBeforeGrowing) == kNumMachinesBeforeGrowing);
+		CHECK(store.GetNumSlots() == kNumMachines);
+		for (size_t i = kNumMachinesBeforeGrowing; i < kNumMachines; ++i)
+		{
+			CHECK(store.Save(i, characters[i]->mStateMachine));
+		}
+
+		for (size_t i = 0; i < kNumMachines; ++i)
+		{
+			CheckSlot(store, i, *characters[i]);
+		}
+		CHECK(store.GetNumWastedBytes() == 0);
+
+		// Re-save with different sizes: snapshots that fit in their slot's space are overwritten in place, the
+		// others are appended, wasting their old space
+		size_t numWastedBytes = 0;
+		size_t numSavedInPlace = 0;
+		for (size_t i = 0; i < kNumMachines; i += 3)
+		{
+			const size_t size = ResetCharacter(*characters[i], true, static_cast<uint32_t>((i * 5) % 40));
+			if (size > capacities[i])
+			{
+				numWastedBytes += capacities[i];
+				capacities[i] = RoundUp(size);
+			}
+			else
+			{
+				++numSavedInPlace;
+			}
+			CHECK(store.Save(i, characters[i]->mStateMachine));
+		}
+		CHECK(store.GetNumWastedBytes() == numWastedBytes);
+		CHECK(numWastedBytes > 0 && numSavedInPlace > 0);
+
+		store.Clear(kClearedSlot);
+		numWastedBytes += capacities[kClearedSlot];
+		CHECK(store.IsEmpty(kClearedSlot));
+		CHECK(store.GetNumWastedBytes() == numWastedBytes);
+
+		Character character;
+		character.mStateMachine.Initialize<CharacterStates::Alive>(&character);
+		CHECK(!store.Load(kClearedSlot, character.mStateMachine));
+	}
+
+	const long uncompactedFileSize = GetFileSize(kStorePath);
+
+	{
+		// Everything is still there after reopening
+		StateMachineStore store;
+		CHECK(store.Open(kStorePath));
+		CHECK(store.GetNumSlots() == kNumMachines);
+		CHECK(store.GetNumWastedBytes() > 0);
+		for (size_t i = 0; i < kNumMachines; ++i)
+		{
+			if (i != kClearedSlot)
+				CheckSlot(store, i, *characters[i]);
+		}
+
+		store.Compact();
+		CHECK(store.GetNumWastedBytes() == 0);
+		for (size_t i = 0; i < kNumMachines; ++i)
+		{
+			if (i != kClearedSlot)
+				CheckSlot(store, i, *characters[i]);
+		}
+	}
+
+	const long compactedFileSize = GetFileSize(kStorePath);
+	printf("%s: %d slots, %ld bytes, %ld bytes once compacted\n", kStorePath, static_cast<int>(kNumMachines), uncompactedFileSize, compactedFileSize);
+	CHECK(compactedFileSize > 0 && compactedFileSize < uncompactedFileSize);
+
+	{
+		StateMachineStore store;
+		CHECK(store.Open(kStorePath));
+		for (size_t i = 0; i < kNumMachines; ++i)
+		{
+			if (i != kClearedSlot)
+				CheckSlot(store, i, *characters[i]);
+		}
+	}
+
+	// A file that isn't a store is rejected, and left as is
+	if (FILE* file = fopen(kStorePath, "wb"))
+	{
+		const char kText[] = "Not a state machine store, but long enough to hold its header...................";
+		fwrite(kText, 1, sizeof(kText), file);
+		fclose(file);
+	}
+	{
+		StateMachineStore store;
+		CHECK(!store.Open(kStorePath));
+		CHECK(!store.IsOpen());
+	}
+	CHECK(GetFileSize(kStorePath) == static_cast<long>(sizeof("Not a state machine store, but long enough to hold its header...................")));
+
+	remove(kStorePath);
+
+	for (size_t i = 0; i < characters.size(); ++i)
+	{
+		characters[i]->mStateMachine.Stop();
+	}
+	return 0;
+}
@@ -0,0 +1,108 @@
+// timer_overflow.cpp
+// Expires the timers of five nested states of one state machine in the same frame, which is one more than its
+// deferred transition queue holds (HSM_DEFERRED_TRANSITION_QUEUE_SIZE), and checks that the timer that doesn't
+// fit stays pending and makes its transition on the next frame instead of being dropped.
+
+#include "hsm.h"
+#include "check.h"
+
+using namespace hsm;
+
+const int kNumLevels = 5;
+const TimerTime kMaxDelay = 10;
+
+static_assert(HSM_DEFERRED_TRANSITION_QUEUE_SIZE < kNumLevels, "All timers must not fit in the deferred transition queue");
+
+class Character
+{
+public:
+	Character() : mFiredLevels(0) {}
+
+	int mFiredLevels; // Bit per level whose timer made its transition
+	StateMachine mStateMachine;
+};
+
+struct CharacterStates
+{
+	struct BaseState : StateWithOwner<Character>
+	{
+	};
+
+	template <int Level>
+	struct Fired : BaseState
+	{
+		virtual void OnEnter()
+		{
+			Owner().mFiredLevels |= 1 << Level;
+		}
+	};
+
+	// Inner levels expire first, so that their transitions don't pop the states of the outer levels
+	template <int Level>
+	struct Wait : BaseState
+	{
+		virtual void OnEnter()
+		{
+			StartTimer(kMaxDelay - Level, SiblingTransition<Fired<Level>>());
+		}
+
+		virtual Transition GetTransition()
+		{
+			return InnerEntryTransition<Wait<Level + 1>>();
+		}
+	};
+
+	struct Alive : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			return InnerEntryTransition<Wait<0>>();
+		}
+	};
+};
+
+template <>
+Transition CharacterStates::Wait<kNumLevels - 1>::GetTransition()
+{
+	return NoTransition();
+}
+
+int main()
+{
+	ManualTimerClock clock;
+	TimerService timerService(&clock);
+
+	Character character;
+	character.mStateMachine.Initialize<CharacterStates::Alive>(&character);
+	character.mStateMachine.SetTimerService(&timerService);
+	character.mStateMachine.ProcessStateTransitions();
+	CHECK(character.mStateMachine.IsInState<CharacterStates::Wait<kNumLevels - 1>>());
+	CHECK(timerService.GetNumTimers() == kNumLevels);
+
+	// All timers expire in this frame; the outermost one expires last and finds the queue full
+	clock.Advance(kMaxDelay);
+	timerService.Update();
+	CHECK(timerService.GetNumTimers() == 1);
+	CHECK(character.mFiredLevels == 0);
+
+	character.mStateMachine.ProcessStateTransitions();
+	const int kInnerLevels = ((1 << kNumLevels) - 1) & ~1;
+	CHECK(character.mFiredLevels == kInnerLevels);
+	CHECK(character.mStateMachine.IsInState<CharacterStates::Wait<0>>());
+	CHECK(character.mStateMachine.GetState<CharacterStates::Wait<0>>()->HasPendingTimers());
+
+	// Processing again in the same frame doesn't expire it early
+	character.mStateMachine.ProcessStateTransitions();
+	CHECK(character.mFiredLevels == kInnerLevels);
+
+	clock.Advance(1);
+	timerService.Update();
+	CHECK(timerService.GetNumTimers() == 0);
+	character.mStateMachine.ProcessStateTransitions();
+	CHECK(character.mFiredLevels == (1 << kNumLevels) - 1);
+	CHECK(character.mStateMachine.IsInState<CharacterStates::Fired<0>>());
+	printf("%d timers expired in one frame, %d transitions deferred, 1 retried on the next frame\n", kNumLevels, HSM_DEFERRED_TRANSITION_QUEUE_SIZE);
+
+	character.mStateMachine.Stop();
+	return 0;
+}
@@ -0,0 +1,386 @@
+// trace_sinks.cpp
+// Writes the transitions and calls of state machines processed on several threads to a FileTraceSink and to a
+// ChromeTraceSink (see hsm_trace.h), then reads both files back to check that every record made it out: the
+// binary file is decoded and its records counted, and the JSON file is parsed and its state slices counted.
+// Prints the number of records, which the CMake test also compares with the output of tools/hsmTraceDecode.py.
+
+#define HSM_USE_TRACE_CALLS 1
+#include "hsm_trace.h"
+#include "check.h"
+#include <cctype>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace hsm;
+
+class Character
+{
+public:
+	Character() : mFrame(0) {}
+
+	int mFrame;
+	StateMachine mStateMachine;
+};
+
+struct CharacterStates
+{
+	struct BaseState : StateWithOwner<Character>
+	{
+	};
+
+	struct Alive : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			return InnerEntryTransition<Stand>();
+		}
+	};
+
+	struct Stand : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (Owner().mFrame % 3 == 0)
+				return SiblingTransition<Move>();
+
+			return NoTransition();
+		}
+	};
+
+	struct Move : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (Owner().mFrame % 3 == 1)
+				return SiblingTransition<Stand>();
+
+			return InnerEntryTransition<Move_Walk>();
+		}
+	};
+
+	struct Move_Walk : BaseState
+	{
+		virtual void Update()
+		{
+			++mNumSteps;
+		}
+
+		int mNumSteps = 0;
+	};
+};
+
+// Counts the records passed on to a sink, to compare with what the sink wrote out
+class CountingTraceSink : public TraceSink
+{
+public:
+	explicit CountingTraceSink(TraceSink& traceSink) : mTraceSink(traceSink), mNumRecords(0), mNumPushes(0) {}
+
+	virtual void Write(const TraceRecord& record)
+	{
+		++mNumRecords;
+		if (record.mEvent <= TraceEvent::Sibling)
+			++mNumPushes;
+		mTraceSink.Write(record);
+	}
+
+	TraceSink& mTraceSink;
+	std::atomic<size_t> mNumRecords;
+	std::atomic<size_t> mNumPushes;
+};
+
+const size_t kNumThreads = 4;
+const size_t kNumMachinesPerThread = 8;
+const int kNumFrames = 100;
+
+// Processes the machines on kNumThreads threads, each of which owns a range of the machines. The machines are
+// left with states on their stack, so that sinks have to end them.
+void RunMachines(std::vector<std::unique_ptr<Character>>& characters, TraceSink& traceSink, BufferedTraceSink& bufferedTraceSink)
+{
+	for (size_t i = 0; i < characters.size(); ++i)
+	{
+		characters[i]->mFrame = 0;
+		characters[i]->mStateMachine.SetTraceSink(&traceSink, TraceLevel::Calls);
+	}
+
+	std::vector<std::thread> threads;
+	for (size_t threadIndex = 0; threadIndex < kNumThreads; ++threadIndex)
+	{
+		threads.push_back(std::thread([&characters, threadIndex]()
+		{
+			for (int frame = 0; frame < kNumFrames; ++frame)
+			{
+				for (size_t i = threadIndex * kNumMachinesPerThread; i < (threadIndex + 1) * kNumMachinesPerThread; ++i)
+				{
+					Character& character = *characters[i];
+					character.mFrame = frame;
+					character.mStateMachine.ProcessStateTransitions();
+					character.mStateMachine.UpdateStates();
+				}
+			}
+		}));
+	}
+
+	// Flushing while threads are writing must not lose or duplicate records
+	bufferedTraceSink.Flush();
+
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+}
+
+void StopMachines(std::vector<std::unique_ptr<Character>>& characters)
+{
+	for (size_t i = 0; i < characters.size(); ++i)
+	{
+		characters[i]->mStateMachine.SetTraceSink(0);
+		characters[i]->mStateMachine.Stop();
+	}
+}
+
+std::vector<unsigned char> ReadFile(const char* path)
+{
+	std::vector<unsigned char> data;
+	if (FILE* file = fopen(path, "rb"))
+	{
+		unsigned char buffer[4096];
+		size_t size;
+		while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		{
+			data.insert(data.end(), buffer, buffer + size);
+		}
+		fclose(file);
+	}
+	return data;
+}
+
+// Returns the number of transition records in a FileTraceSink file, or -1 if it's malformed
+int CountFileTraceRecords(const std::vector<unsigned char>& data)
+{
+	struct Header
+	{
+		uint32_t mMagic;
+		uint32_t mVersion;
+		uint32_t mCharSize;
+	};
+
+	Header header;
+	if (data.size() < sizeof(header))
+		return -1;
+
+	memcpy(&header, data.data(), sizeof(header));
+	if (header.mMagic != 0x544d5348 || header.mVersion != 2 || header.mCharSize != sizeof(hsm_char))
+		return -1;
+
+	const size_t kTransitionRecordSize = 8 + 8 + 8 + 4 + 2 + 1 + 1;
+	int numRecords = 0;
+	size_t offset = sizeof(header);
+	while (offset < data.size())
+	{
+		const unsigned char kind = data[offset++];
+		if (kind == 0)
+		{
+			uint16_t length = 0;
+			if (offset + sizeof(uint32_t) + sizeof(length) > data.size())
+				return -1;
+			memcpy(&length, &data[offset + sizeof(uint32_t)], sizeof(length));
+			offset += sizeof(uint32_t) + sizeof(length) + length * sizeof(hsm_char);
+		}
+		else if (kind == 1)
+		{
+			offset += kTransitionRecordSize;
+			++numRecords;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	return offset == data.size() ? numRecords : -1;
+}
+
+// Minimal JSON parser, which only checks that its input is valid
+class JsonValidator
+{
+public:
+	explicit JsonValidator(const char* text) : mText(text) {}
+
+	bool IsValid()
+	{
+		return ParseValue() && (SkipSpaces(), *mText == 0);
+	}
+
+private:
+	void SkipSpaces()
+	{
+		while (*mText == ' ' || *mText == '\n' || *mText == '\r' || *mText == '\t')
+			++mText;
+	}
+
+	bool Expect(char c)
+	{
+		SkipSpaces();
+		if (*mText != c)
+			return false;
+		++mText;
+		return true;
+	}
+
+	bool ParseValue()
+	{
+		SkipSpaces();
+		switch (*mText)
+		{
+			case '{': return ParseContainer('}', true);
+			case '[': return ParseContainer(']', false);
+			case '"': return ParseString();
+			case 't': return ParseLiteral("true");
+			case 'f': return ParseLiteral("false");
+			case 'n': return ParseLiteral("null");
+			default: return ParseNumber();
+		}
+	}
+
+	bool ParseContainer(char close, bool isObject)
+	{
+		++mText;
+		if (Expect(close))
+			return true;
+
+		do
+		{
+			if (isObject && (!(SkipSpaces(), ParseString()) || !Expect(':')))
+				return false;
+			if (!ParseValue())
+				return false;
+		} while (Expect(','));
+
+		return Expect(close);
+	}
+
+	bool ParseString()
+	{
+		if (*mText != '"')
+			return false;
+
+		for (++mText; *mText != '"'; ++mText)
+		{
+			if (static_cast<unsigned char>(*mText) < 0x20)
+				return false;
+
+			if (*mText == '\\')
+			{
+				++mText;
+				if (*mText == 'u')
+				{
+					for (int i = 0; i < 4; ++i)
+					{
+						if (!isxdigit(static_cast<unsigned char>(*++mText)))
+							return false;
+					}
+				}
+				else if (!strchr("\"\\/bfnrt", *mText) || *mText == 0)
+				{
+					return false;
+				}
+			}
+		}
+		++mText;
+		return true;
+	}
+
+	bool ParseLiteral(const char* literal)
+	{
+		const size_t length = strlen(literal);
+		if (strncmp(mText, literal, length) != 0)
+			return false;
+		mText += length;
+		return true;
+	}
+
+	bool ParseNumber()
+	{
+		const char* start = mText;
+		if (*mText == '-')
+			++mText;
+		if (!isdigit(static_cast<unsigned char>(*mText)))
+			return false;
+		while (isdigit(static_cast<unsigned char>(*mText)) || *mText == '.' || *mText == 'e' || *mText == 'E' || *mText == '+' || *mText == '-')
+			++mText;
+		return mText != start;
+	}
+
+	const char* mText;
+};
+
+size_t CountOccurrences(const char* text, const char* pattern)
+{
+	size_t count = 0;
+	for (const char* match = strstr(text, pattern); match; match = strstr(match + 1, pattern))
+	{
+		++count;
+	}
+	return count;
+}
+
+int main()
+{
+	const char* const kFileTracePath = "trace_sinks.hsmt";
+	const char* const kChromeTracePath = "trace_sinks.json";
+
+	std::vector<std::unique_ptr<Character>> characters;
+	for (size_t i = 0; i < kNumThreads * kNumMachinesPerThread; ++i)
+	{
+		characters.push_back(std::unique_ptr<Character>(new Character()));
+		characters.back()->mStateMachine.Initialize<CharacterStates::Alive>(characters.back().get());
+	}
+
+	// Rings are large enough that no records are dropped, even if the drain thread doesn't get to run
+	const size_t kRingCapacity = 1 << 14;
+
+	size_t numFileRecords = 0;
+	{
+		FileTraceSink fileTraceSink(kFileTracePath, kRingCapacity);
+		CHECK(fileTraceSink.IsOpen());
+		CountingTraceSink countingTraceSink(fileTraceSink);
+		RunMachines(characters, countingTraceSink, fileTraceSink);
+		StopMachines(characters);
+		CHECK(fileTraceSink.GetNumDroppedRecords() == 0);
+		numFileRecords = countingTraceSink.mNumRecords;
+	}
+
+	const int numDecodedRecords = CountFileTraceRecords(ReadFile(kFileTracePath));
+	printf("%s: %d records\n", kFileTracePath, numDecodedRecords);
+	CHECK(numDecodedRecords >= 0 && static_cast<size_t>(numDecodedRecords) == numFileRecords);
+
+	size_t numPushes = 0;
+	{
+		// Machines are not stopped before the sink is destroyed, so that it ends the states still on the stacks
+		ChromeTraceSink chromeTraceSink(kChromeTracePath, kRingCapacity);
+		CHECK(chromeTraceSink.IsOpen());
+		CountingTraceSink countingTraceSink(chromeTraceSink);
+		RunMachines(characters, countingTraceSink, chromeTraceSink);
+		for (size_t i = 0; i < characters.size(); ++i)
+		{
+			characters[i]->mStateMachine.SetTraceSink(0);
+		}
+		CHECK(chromeTraceSink.GetNumDroppedRecords() == 0);
+		numPushes = countingTraceSink.mNumPushes;
+	}
+	StopMachines(characters);
+
+	std::vector<unsigned char> json = ReadFile(kChromeTracePath);
+	json.push_back(0);
+	const char* jsonText = reinterpret_cast<const char*>(json.data());
+	CHECK(JsonValidator(jsonText).IsValid());
+
+	// Each pushed state is a slice, whether it was popped or ended by the sink
+	const size_t numStateSlices = CountOccurrences(jsonText, "\"cat\":\"state\"");
+	printf("%s: %d state slices\n", kChromeTracePath, static_cast<int>(numStateSlices));
+	CHECK(numStateSlices == numPushes);
+	CHECK(CountOccurrences(jsonText, "\"name\":\"thread_name\"") == characters.size());
+
+	return 0;
+}
@@ -0,0 +1,36 @@
+// benchmark.h
+// Minimal timing helpers shared by the benchmarks. Build in Release (e.g. cmake -DCMAKE_BUILD_TYPE=Release .)
+// and without HSM_DEBUG for meaningful numbers.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+
+namespace benchmark
+{
+	// Returns the number of nanoseconds taken by the fastest of numRuns calls to func
+	template <typename Func>
+	double MeasureNs(size_t numRuns, Func func)
+	{
+		double bestNs = 0;
+		for (size_t run = 0; run < numRuns; ++run)
+		{
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			func();
+			const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+			const double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+			if (run == 0 || ns < bestNs)
+				bestNs = ns;
+		}
+		return bestNs;
+	}
+
+	// Folds a value into a volatile sink, so that the compiler can't optimize away the code that computes it
+	inline void Consume(size_t value)
+	{
+		static volatile size_t sink = 0;
+		sink = sink + value;
+	}
+}
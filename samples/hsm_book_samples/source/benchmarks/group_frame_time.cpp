@@ -0,0 +1,159 @@
+// group_frame_time.cpp
+// Times a frame (ProcessStateTransitions + UpdateStates) against the number of machines, when looping over the
+// machines directly, and when running them through a StateMachineGroup, with and without bucketing by leaf state
+// type. Characters are allocated individually and registered in a shuffled order, as they usually would be in a
+// game, rather than laid out contiguously in processing order. With only four small state types, bucketing has
+// little instruction cache locality to gain, and costs the locality between the processing order and the order
+// in which states were allocated, so this also shows its overhead.
+
+#include "hsm.h"
+#include "benchmark.h"
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace hsm;
+
+struct Character
+{
+	Character() : mInput(0), mNumUpdates(0) {}
+
+	// Advances a pseudo-random input every frame, which drives the transitions
+	void NextInput() { mInput = mInput * 1664525u + 1013904223u; }
+	bool WantsToMove() const { return (mInput >> 28) > 4; }
+	bool WantsToJump() const { return (mInput >> 28) == 15; }
+
+	unsigned int mInput;
+	size_t mNumUpdates;
+	StateMachine mStateMachine;
+};
+
+struct CharacterStates
+{
+	struct BaseState : StateWithOwner<Character>
+	{
+		virtual void Update()
+		{
+			++Owner().mNumUpdates;
+		}
+	};
+
+	struct Alive : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			// Inputs change every frame, so advance them here rather than in a separate loop over the characters
+			Owner().NextInput();
+			return InnerEntryTransition<Stand>();
+		}
+	};
+
+	struct Stand : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (Owner().WantsToJump())
+				return SiblingTransition<Jump>();
+
+			if (Owner().WantsToMove())
+				return SiblingTransition<Move>();
+
+			return NoTransition();
+		}
+	};
+
+	struct Move : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (Owner().WantsToJump())
+				return SiblingTransition<Jump>();
+
+			if (!Owner().WantsToMove())
+				return SiblingTransition<Stand>();
+
+			return NoTransition();
+		}
+	};
+
+	struct Jump : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (!Owner().WantsToJump())
+				return SiblingTransition<Stand>();
+
+			return NoTransition();
+		}
+	};
+};
+
+enum Mode { Loop, Group, GroupBucketed };
+
+// Returns the nanoseconds per frame taken to process and update numMachines machines
+double MeasureFrame(size_t numMachines, Mode mode)
+{
+	std::vector<std::unique_ptr<Character> > characters;
+	for (size_t i = 0; i < numMachines; ++i)
+	{
+		characters.push_back(std::unique_ptr<Character>(new Character()));
+		characters.back()->mInput = static_cast<unsigned int>(i);
+		characters.back()->mStateMachine.Initialize<CharacterStates::Alive>(characters.back().get());
+	}
+	std::shuffle(characters.begin(), characters.end(), std::mt19937(1));
+
+	StateMachineGroup group;
+	group.SetBucketByLeafStateType(mode == GroupBucketed);
+	for (size_t i = 0; i < numMachines; ++i)
+	{
+		group.AddStateMachine(&characters[i]->mStateMachine);
+	}
+
+	const size_t numFrames = std::max<size_t>(10, 1000000 / numMachines);
+	const double ns = benchmark::MeasureNs(3, [&]()
+	{
+		for (size_t frame = 0; frame < numFrames; ++frame)
+		{
+			if (mode == Loop)
+			{
+				for (size_t i = 0; i < numMachines; ++i)
+				{
+					characters[i]->mStateMachine.ProcessStateTransitions();
+					characters[i]->mStateMachine.UpdateStates();
+				}
+			}
+			else
+			{
+				group.ProcessStateTransitions();
+				group.UpdateStates();
+			}
+		}
+	});
+
+	for (size_t i = 0; i < numMachines; ++i)
+	{
+		benchmark::Consume(characters[i]->mNumUpdates);
+		group.RemoveStateMachine(&characters[i]->mStateMachine);
+		characters[i]->mStateMachine.Stop();
+	}
+
+	return ns / static_cast<double>(numFrames);
+}
+
+int main()
+{
+	printf("%10s %14s %14s %14s %16s\n", "machines", "loop (us)", "group (us)", "bucketed (us)", "bucketed ns/sm");
+
+	const size_t machineCounts[] = { 100, 1000, 10000, 100000 };
+	for (size_t i = 0; i < sizeof(machineCounts) / sizeof(machineCounts[0]); ++i)
+	{
+		const size_t numMachines = machineCounts[i];
+		const double loopNs = MeasureFrame(numMachines, Loop);
+		const double groupNs = MeasureFrame(numMachines, Group);
+		const double bucketedNs = MeasureFrame(numMachines, GroupBucketed);
+		printf("%10d %14.1f %14.1f %14.1f %16.2f\n", static_cast<int>(numMachines), loopNs / 1000, groupNs / 1000, bucketedNs / 1000,
+			bucketedNs / static_cast<double>(numMachines));
+	}
+	return 0;
+}
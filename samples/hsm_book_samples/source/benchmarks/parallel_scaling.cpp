@@ -0,0 +1,154 @@
+// parallel_scaling.cpp
+// Times a frame of a StateMachineGroup processed by a WorkStealingExecutor (see hsm_parallel.h) with 1 to N
+// threads, where N is the number of hardware threads, and reports the speedup over 1 thread. States are pooled,
+// so this also measures contention on the default StatePoolSets, which are shared by the worker threads.
+
+#define HSM_USE_STATE_POOLS 1
+#define HSM_STATE_POOLS_THREAD_SAFE 1
+#include "hsm.h"
+#include "hsm_parallel.h"
+#include "benchmark.h"
+#include <memory>
+#include <vector>
+
+using namespace hsm;
+
+struct Character
+{
+	Character() : mInput(0), mPosition(0) {}
+
+	// Advances a pseudo-random input every frame, which drives the transitions
+	void NextInput() { mInput = mInput * 1664525u + 1013904223u; }
+	bool WantsToMove() const { return (mInput >> 28) > 4; }
+	bool WantsToJump() const { return (mInput >> 28) == 15; }
+
+	// Stands in for the game code that states usually run
+	void Simulate(unsigned int speed)
+	{
+		for (unsigned int i = 0; i < 64; ++i)
+		{
+			mPosition = mPosition * 31 + speed + i;
+		}
+	}
+
+	unsigned int mInput;
+	unsigned int mPosition;
+	StateMachine mStateMachine;
+};
+
+struct CharacterStates
+{
+	struct BaseState : StateWithOwner<Character>
+	{
+	};
+
+	struct Alive : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			Owner().NextInput();
+			return InnerEntryTransition<Stand>();
+		}
+	};
+
+	struct Stand : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (Owner().WantsToJump())
+				return SiblingTransition<Jump>();
+
+			if (Owner().WantsToMove())
+				return SiblingTransition<Move>();
+
+			return NoTransition();
+		}
+
+		virtual void Update()
+		{
+			Owner().Simulate(0);
+		}
+	};
+
+	struct Move : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (Owner().WantsToJump())
+				return SiblingTransition<Jump>();
+
+			if (!Owner().WantsToMove())
+				return SiblingTransition<Stand>();
+
+			return NoTransition();
+		}
+
+		virtual void Update()
+		{
+			Owner().Simulate(1);
+		}
+	};
+
+	struct Jump : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (!Owner().WantsToJump())
+				return SiblingTransition<Stand>();
+
+			return NoTransition();
+		}
+
+		virtual void Update()
+		{
+			Owner().Simulate(2);
+		}
+	};
+};
+
+int main()
+{
+	const size_t kNumMachines = 20000;
+	const size_t kNumFrames = 50;
+
+	std::vector<std::unique_ptr<Character> > characters;
+	StateMachineGroup group;
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		characters.push_back(std::unique_ptr<Character>(new Character()));
+		characters.back()->mInput = static_cast<unsigned int>(i);
+		characters.back()->mStateMachine.Initialize<CharacterStates::Alive>(characters.back().get());
+		group.AddStateMachine(&characters.back()->mStateMachine);
+	}
+
+	const size_t maxThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+	printf("%d machines, %d hardware threads\n", static_cast<int>(kNumMachines), static_cast<int>(maxThreads));
+	printf("%8s %12s %9s\n", "threads", "frame (us)", "speedup");
+
+	double singleThreadNs = 0;
+	for (size_t numThreads = 1; numThreads <= maxThreads; ++numThreads)
+	{
+		WorkStealingExecutor executor(numThreads);
+		const double ns = benchmark::MeasureNs(5, [&]()
+		{
+			for (size_t frame = 0; frame < kNumFrames; ++frame)
+			{
+				executor.ProcessStateTransitions(group);
+				executor.UpdateStates(group);
+			}
+		}) / kNumFrames;
+
+		if (numThreads == 1)
+			singleThreadNs = ns;
+
+		printf("%8d %12.1f %8.2fx\n", static_cast<int>(numThreads), ns / 1000, singleThreadNs / ns);
+	}
+
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		benchmark::Consume(characters[i]->mPosition);
+		group.RemoveStateMachine(&characters[i]->mStateMachine);
+		characters[i]->mStateMachine.Stop();
+	}
+	return 0;
+}
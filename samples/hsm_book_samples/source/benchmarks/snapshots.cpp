@@ -0,0 +1,153 @@
+// snapshots.cpp
+// Measures how many machines per second can be saved to and loaded from snapshots (see
+// StateMachine::SaveSnapshot). Each machine has three states on its stack, one of which binds a StateValue of
+// the owner and saves its own data.
+
+#define HSM_USE_SNAPSHOTS 1
+#include "hsm.h"
+#include "benchmark.h"
+#include <memory>
+#include <vector>
+
+using namespace hsm;
+
+struct Character
+{
+	Character() : mMove(false), mSpeed(0) {}
+
+	bool mMove;
+	StateValue<float> mSpeed;
+	StateMachine mStateMachine;
+};
+
+struct CharacterStates
+{
+	struct BaseState : StateWithOwner<Character>
+	{
+	};
+
+	struct Alive : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			return InnerEntryTransition<Locomotion>();
+		}
+	};
+
+	struct Locomotion : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (Owner().mMove)
+				return InnerEntryTransition<Move>();
+
+			return InnerEntryTransition<Stand>();
+		}
+	};
+
+	struct Stand : BaseState
+	{
+	};
+
+	struct Move : BaseState
+	{
+		Move() : mDistance(0) {}
+
+		virtual void OnEnter()
+		{
+			SetStateValue(Owner().mSpeed) = 5.0f;
+		}
+
+		virtual void Update()
+		{
+			mDistance += Owner().mSpeed;
+		}
+
+		virtual void SaveState(SnapshotWriter& writer) const
+		{
+			writer.Write(mDistance);
+		}
+
+		virtual void LoadState(SnapshotReader& reader)
+		{
+			reader.Read(mDistance);
+		}
+
+		float mDistance;
+	};
+};
+
+int main()
+{
+	const size_t kNumMachines = 10000;
+
+	std::vector<std::unique_ptr<Character> > characters;
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		characters.push_back(std::unique_ptr<Character>(new Character()));
+		Character& character = *characters.back();
+		character.mMove = (i % 2) != 0;
+		character.mStateMachine.Initialize<CharacterStates::Alive>(&character);
+		character.mStateMachine.SetOwnerSize(sizeof(Character));
+		character.mStateMachine.ProcessStateTransitions();
+		character.mStateMachine.UpdateStates();
+	}
+
+	std::vector<unsigned char> buffer;
+	const double saveNs = benchmark::MeasureNs(5, [&]()
+	{
+		buffer.clear();
+		SnapshotWriter writer(buffer);
+		for (size_t i = 0; i < kNumMachines; ++i)
+		{
+			characters[i]->mStateMachine.SaveSnapshot(writer);
+		}
+	});
+
+	size_t numLoaded = 0;
+	const double loadNs = benchmark::MeasureNs(5, [&]()
+	{
+		numLoaded = 0;
+		SnapshotReader reader(buffer.data(), buffer.size());
+		for (size_t i = 0; i < kNumMachines; ++i)
+		{
+			StateMachine& stateMachine = characters[i]->mStateMachine;
+			stateMachine.Stop();
+			numLoaded += stateMachine.LoadSnapshot(reader) ? 1 : 0;
+		}
+	});
+
+	// Check that the loaded machines are back in their saved states, with their saved data
+	size_t numRestored = 0;
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		Character& character = *characters[i];
+		const CharacterStates::Move* move = character.mStateMachine.GetState<CharacterStates::Move>();
+		if (character.mMove ? (move && move->mDistance == 5.0f && character.mSpeed == 5.0f) : (!move && character.mSpeed == 0))
+			++numRestored;
+	}
+
+	// Loading includes stopping the machine, which pops its states, so time that on its own too
+	const double stopNs = benchmark::MeasureNs(5, [&]()
+	{
+		for (size_t i = 0; i < kNumMachines; ++i)
+		{
+			characters[i]->mStateMachine.Stop();
+			characters[i]->mStateMachine.ProcessStateTransitions();
+		}
+	});
+	benchmark::Consume(numLoaded + numRestored);
+
+	const double numMachines = static_cast<double>(kNumMachines);
+	printf("%d machines, %.1f bytes per snapshot, %d loaded, %d restored\n", static_cast<int>(kNumMachines),
+		static_cast<double>(buffer.size()) / numMachines, static_cast<int>(numLoaded), static_cast<int>(numRestored));
+	printf("  SaveSnapshot:                       %10.0f machines/s\n", numMachines / (saveNs * 1e-9));
+	printf("  Stop + LoadSnapshot:                %10.0f machines/s\n", numMachines / (loadNs * 1e-9));
+	printf("  Stop + ProcessStateTransitions:     %10.0f machines/s (rebuilding without a snapshot)\n", numMachines / (stopNs * 1e-9));
+
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		characters[i]->mStateMachine.Stop();
+	}
+	return 0;
+}
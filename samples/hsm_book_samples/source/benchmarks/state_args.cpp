@@ -0,0 +1,141 @@
+// state_args.cpp
+// Times creating and copying Transitions with state args, and making transitions with state args. Built twice:
+// benchmarks_state_args stores args inline only (the default), and benchmarks_state_args_heap_fallback sets
+// HSM_STATE_ARGS_HEAP_FALLBACK, which makes Transition non-trivially copyable and allows args too large to be
+// stored inline, which are then allocated on the heap.
+
+#include "hsm.h"
+#include "benchmark.h"
+#include <string>
+#include <type_traits>
+
+using namespace hsm;
+
+class Character
+{
+public:
+	Character() : mMove(false), mNumEntries(0) {}
+
+	bool mMove;
+	size_t mNumEntries;
+	StateMachine mStateMachine;
+};
+
+struct CharacterStates
+{
+	struct BaseState : StateWithOwner<Character>
+	{
+	};
+
+	struct Stand : BaseState
+	{
+		virtual void OnEnter(const char* animName, bool loop)
+		{
+			Owner().mNumEntries += static_cast<size_t>(animName[0]) + (loop ? 1 : 0);
+		}
+
+		virtual Transition GetTransition()
+		{
+			if (Owner().mMove)
+				return SiblingTransition<Move>("Anim_Move", true);
+
+			return NoTransition();
+		}
+	};
+
+	struct Move : BaseState
+	{
+		virtual void OnEnter(const char* animName, bool loop)
+		{
+			Owner().mNumEntries += static_cast<size_t>(animName[0]) + (loop ? 1 : 0);
+		}
+
+		virtual Transition GetTransition()
+		{
+			if (!Owner().mMove)
+				return SiblingTransition<Stand>("Anim_Stand", true);
+
+			return NoTransition();
+		}
+	};
+
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+	// Only compiles with the heap fallback, as a std::string doesn't fit inline in a Transition
+	struct PlayAnim : BaseState
+	{
+		virtual void OnEnter(const std::string& animName)
+		{
+			Owner().mNumEntries += animName.size();
+		}
+	};
+#endif
+};
+
+int main()
+{
+	const size_t kNumRuns = 10;
+	const size_t kNumTransitions = 1024;
+	const size_t kNumCopies = 1000;
+	const size_t kNumFrames = 100000;
+
+	printf("HSM_STATE_ARGS_HEAP_FALLBACK: %d, Transition trivially copyable: %d, sizeof(Transition): %d\n",
+		HSM_STATE_ARGS_HEAP_FALLBACK, std::is_trivially_copyable<Transition>::value ? 1 : 0, static_cast<int>(sizeof(Transition)));
+
+	// Create Transitions with inline args
+	static Transition transitions[kNumTransitions];
+	double ns = benchmark::MeasureNs(kNumRuns, [&]()
+	{
+		for (size_t i = 0; i < kNumTransitions; ++i)
+		{
+			transitions[i] = SiblingTransition<CharacterStates::Move>("Anim_Move", (i & 1) != 0);
+		}
+		benchmark::Consume(transitions[kNumTransitions - 1].HasOnEnterArgs() ? 1 : 0);
+	});
+	printf("Create transition with inline args: %.2f ns\n", ns / kNumTransitions);
+
+	// Copy them, as when storing and returning Transitions
+	static Transition copies[kNumTransitions];
+	ns = benchmark::MeasureNs(kNumRuns, [&]()
+	{
+		for (size_t copy = 0; copy < kNumCopies; ++copy)
+		{
+			for (size_t i = 0; i < kNumTransitions; ++i)
+			{
+				copies[i] = transitions[(i + copy) % kNumTransitions];
+			}
+			benchmark::Consume(copies[copy % kNumTransitions].HasOnEnterArgs() ? 1 : 0);
+		}
+	});
+	printf("Copy transition with inline args: %.2f ns\n", ns / (kNumTransitions * kNumCopies));
+
+#if HSM_STATE_ARGS_HEAP_FALLBACK
+	// Create Transitions with args that are allocated on the heap
+	ns = benchmark::MeasureNs(kNumRuns, [&]()
+	{
+		for (size_t i = 0; i < kNumTransitions; ++i)
+		{
+			transitions[i] = SiblingTransition<CharacterStates::PlayAnim>(std::string("Anim_Attack"));
+		}
+		benchmark::Consume(transitions[kNumTransitions - 1].HasOnEnterArgs() ? 1 : 0);
+	});
+	printf("Create transition with heap args: %.2f ns\n", ns / kNumTransitions);
+#endif
+
+	// Make a transition with args every frame
+	Character character;
+	character.mStateMachine.Initialize<CharacterStates::Stand>(&character);
+	character.mStateMachine.ProcessStateTransitions();
+	ns = benchmark::MeasureNs(kNumRuns, [&]()
+	{
+		for (size_t frame = 0; frame < kNumFrames; ++frame)
+		{
+			character.mMove = !character.mMove;
+			character.mStateMachine.ProcessStateTransitions();
+		}
+	});
+	benchmark::Consume(character.mNumEntries);
+	printf("Transition with args: %.2f ns\n", ns / kNumFrames);
+
+	character.mStateMachine.Stop();
+	return 0;
+}
@@ -0,0 +1,170 @@
+// static_dispatch.cpp
+// Times the same character topology (Alive, containing Stand, Move and Jump, as in the ch4 samples) run by
+// StateMachine, which calls states virtually and allocates them, and by StaticStateMachine (see hsm_static.h),
+// which dispatches through per-type tables and stores states inline.
+
+#include "hsm.h"
+#include "hsm_static.h"
+#include "benchmark.h"
+#include <vector>
+
+using namespace hsm;
+
+struct Character
+{
+	Character() : mInput(0), mNumUpdates(0) {}
+
+	// Advances a pseudo-random input every frame, which drives the transitions
+	void NextInput() { mInput = mInput * 1664525u + 1013904223u; }
+	bool WantsToMove() const { return (mInput >> 28) > 4; }
+	bool WantsToJump() const { return (mInput >> 28) == 15; }
+
+	unsigned int mInput;
+	size_t mNumUpdates;
+};
+
+// The states are written once, and instantiated with either engine's state base
+template <typename BaseState>
+struct CharacterStates
+{
+	struct Alive : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			return InnerEntryTransition<Stand>();
+		}
+
+		virtual void Update()
+		{
+			++this->Owner().mNumUpdates;
+		}
+	};
+
+	struct Stand : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (this->Owner().WantsToJump())
+				return SiblingTransition<Jump>();
+
+			if (this->Owner().WantsToMove())
+				return SiblingTransition<Move>();
+
+			return NoTransition();
+		}
+
+		virtual void Update()
+		{
+			++this->Owner().mNumUpdates;
+		}
+	};
+
+	struct Move : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (this->Owner().WantsToJump())
+				return SiblingTransition<Jump>();
+
+			if (!this->Owner().WantsToMove())
+				return SiblingTransition<Stand>();
+
+			return NoTransition();
+		}
+
+		virtual void Update()
+		{
+			++this->Owner().mNumUpdates;
+		}
+	};
+
+	struct Jump : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			if (!this->Owner().WantsToJump())
+				return SiblingTransition<Stand>();
+
+			return NoTransition();
+		}
+
+		virtual void Update()
+		{
+			++this->Owner().mNumUpdates;
+		}
+	};
+};
+
+typedef CharacterStates<StateWithOwner<Character> > DynamicStates;
+typedef CharacterStates<StaticState<Character> > StaticStates;
+typedef StaticStateMachine<Character, StaticStates::Alive, StaticStates::Stand, StaticStates::Move, StaticStates::Jump> CharacterStaticStateMachine;
+
+// Returns the nanoseconds per machine per frame taken to process and update all machines for numFrames
+template <typename StateMachineType>
+double RunFrames(std::vector<Character>& characters, std::vector<StateMachineType>& stateMachines, size_t numFrames)
+{
+	const double ns = benchmark::MeasureNs(5, [&]()
+	{
+		for (size_t frame = 0; frame < numFrames; ++frame)
+		{
+			for (size_t i = 0; i < stateMachines.size(); ++i)
+			{
+				characters[i].NextInput();
+				stateMachines[i].ProcessStateTransitions();
+				stateMachines[i].UpdateStates();
+			}
+		}
+	});
+
+	size_t numUpdates = 0;
+	for (size_t i = 0; i < characters.size(); ++i)
+	{
+		numUpdates += characters[i].mNumUpdates;
+	}
+	benchmark::Consume(numUpdates);
+
+	return ns / static_cast<double>(numFrames * stateMachines.size());
+}
+
+int main()
+{
+	const size_t kNumMachines = 1000;
+	const size_t kNumFrames = 1000;
+
+	std::vector<Character> characters(kNumMachines);
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		characters[i].mInput = static_cast<unsigned int>(i);
+	}
+
+	std::vector<StateMachine> dynamicStateMachines(kNumMachines);
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		dynamicStateMachines[i].Initialize<DynamicStates::Alive>(&characters[i]);
+	}
+	const double dynamicNs = RunFrames(characters, dynamicStateMachines, kNumFrames);
+
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		characters[i] = Character();
+		characters[i].mInput = static_cast<unsigned int>(i);
+	}
+
+	std::vector<CharacterStaticStateMachine> staticStateMachines(kNumMachines);
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		staticStateMachines[i].Initialize<StaticStates::Alive>(&characters[i]);
+	}
+	const double staticNs = RunFrames(characters, staticStateMachines, kNumFrames);
+
+	printf("%d machines, ns per machine per frame (ProcessStateTransitions + UpdateStates):\n", static_cast<int>(kNumMachines));
+	printf("  StateMachine:       %.2f\n", dynamicNs);
+	printf("  StaticStateMachine: %.2f (%.2fx)\n", staticNs, dynamicNs / staticNs);
+
+	for (size_t i = 0; i < kNumMachines; ++i)
+	{
+		dynamicStateMachines[i].Stop();
+		staticStateMachines[i].Stop();
+	}
+	return 0;
+}
@@ -1,5 +1,7 @@
 // reusable_states.cpp
 
+// Attack passes Transitions as state args, which don't fit inline in a Transition
+#define HSM_STATE_ARGS_HEAP_FALLBACK 1
 #include "hsm.h"
 
 using namespace hsm;
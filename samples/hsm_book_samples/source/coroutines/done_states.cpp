@@ -0,0 +1,220 @@
+// done_states.cpp
+// The done_states sample of chapter 4 written with coroutine states (see hsm_coroutine.h): OpenDoor awaits each
+// step of opening the door, instead of going through inner states and an OpenDoor_Done state that it polls for.
+// Checks the transitions and the frames on which they happen, that waiting states are skipped by the state
+// machine, and if HSM_USE_STATE_POOLS is set, that coroutine frames are allocated from the StatePoolSet.
+// Requires C++20, so it's built by its own targets (see CMakeLists.txt), with and without state pools.
+
+#include "hsm_coroutine.h"
+#include "../addons/check.h"
+
+using namespace hsm;
+
+const int kNumKnocks = 2;
+const size_t kOpenAnimFrames = 3;
+const int kHoldDoorMilliseconds = 5;
+
+struct KnockEvent
+{
+};
+
+class Character
+{
+public:
+	Character();
+	~Character();
+	void Update();
+
+	// Public to simplify sample
+	bool mIsInPosition;
+	int mNumKnocks;
+	int mNumDoorsOpened;
+	size_t mOpenAnimStartFrame;
+	size_t mOpenAnimEndFrame;
+
+	// Each frame is one tick, i.e. a millisecond of SteadyTimerClock
+	ManualTimerClock mClock;
+	TimerService mTimerService;
+#if HSM_USE_STATE_POOLS
+	StatePoolSet mStatePoolSet;
+#endif
+	StateMachine mStateMachine;
+};
+
+struct CharacterStates
+{
+	struct BaseState : StateWithOwner<Character>
+	{
+	};
+
+	struct CoroutineBaseState : StateWithOwner<Character, CoroutineState>
+	{
+	};
+
+	struct Alive : BaseState
+	{
+		virtual Transition GetTransition()
+		{
+			// Stand and OpenDoor make all the transitions
+			Quiesce();
+			return InnerEntryTransition<Stand>();
+		}
+	};
+
+	struct Stand : CoroutineBaseState
+	{
+		StateCoroutine Run() override
+		{
+			for (int i = 0; i < kNumKnocks; ++i)
+			{
+				co_await WaitForEvent<KnockEvent>();
+				++Owner().mNumKnocks;
+			}
+			co_return SiblingTransition<OpenDoor>();
+		}
+	};
+
+	struct OpenDoor : CoroutineBaseState
+	{
+		StateCoroutine Run() override
+		{
+			co_await WaitUntil([this] { return Owner().mIsInPosition; });
+
+			Owner().mOpenAnimStartFrame = GetStateMachine().GetFrameIndex();
+			co_await WaitFrames(kOpenAnimFrames);
+			Owner().mOpenAnimEndFrame = GetStateMachine().GetFrameIndex();
+
+			co_await WaitFor(std::chrono::milliseconds(kHoldDoorMilliseconds));
+
+			++Owner().mNumDoorsOpened;
+			co_return SiblingTransition<Stand>();
+		}
+	};
+};
+
+Character::Character()
+	: mIsInPosition(false)
+	, mNumKnocks(0)
+	, mNumDoorsOpened(0)
+	, mOpenAnimStartFrame(0)
+	, mOpenAnimEndFrame(0)
+	, mTimerService(&mClock)
+{
+#if HSM_USE_STATE_POOLS
+	mStateMachine.SetStatePoolSet(&mStatePoolSet);
+#endif
+	mStateMachine.Initialize<CharacterStates::Alive>(this);
+	mStateMachine.SetTimerService(&mTimerService);
+}
+
+Character::~Character()
+{
+	mStateMachine.Stop();
+}
+
+void Character::Update()
+{
+	mClock.Advance(1);
+	mTimerService.Update();
+	mStateMachine.ProcessStateTransitions();
+	mStateMachine.UpdateStates();
+}
+
+// Returns the number of GetTransition calls made by the last frame
+size_t GetNumGetTransitionCalls(const Character& character)
+{
+	return character.mStateMachine.GetFrameMetrics().mNumGetTransitionCalls;
+}
+
+size_t GetNumCoroutineFrames(Character& character)
+{
+#if HSM_USE_STATE_POOLS
+	return character.mStatePoolSet.GetBlockStats().mNumInUse;
+#else
+	(void)character;
+	return 1;
+#endif
+}
+
+int main()
+{
+	Character character;
+	StateMachine& stateMachine = character.mStateMachine;
+
+	// Stand waits for knocks without being polled
+	character.Update();
+	CHECK(stateMachine.IsInState<CharacterStates::Stand>());
+	CHECK(stateMachine.GetState<CharacterStates::Stand>()->IsQuiescent());
+	CHECK(GetNumCoroutineFrames(character) == 1);
+	character.Update();
+	CHECK(GetNumGetTransitionCalls(character) == 0);
+
+	// Woken before the event, Stand quiesces again
+	stateMachine.WakeStates();
+	character.Update();
+	CHECK(stateMachine.GetState<CharacterStates::Stand>()->IsQuiescent());
+	character.Update();
+	CHECK(GetNumGetTransitionCalls(character) == 0);
+
+	// The first knock resumes the coroutine from HandleEvent, which then waits for the second knock
+	stateMachine.PostEvent(KnockEvent());
+	character.Update();
+	CHECK(character.mNumKnocks == 1);
+	CHECK(stateMachine.IsInState<CharacterStates::Stand>());
+	CHECK(stateMachine.GetState<CharacterStates::Stand>()->IsQuiescent());
+
+	// The second knock makes the transition in the same frame
+	stateMachine.PostEvent(KnockEvent());
+	character.Update();
+	CHECK(character.mNumKnocks == kNumKnocks);
+	CHECK(stateMachine.IsInState<CharacterStates::OpenDoor>());
+	CHECK(GetNumCoroutineFrames(character) == 1);
+
+	// OpenDoor polls its predicate every frame until the character is in position
+	character.Update();
+	CHECK(GetNumGetTransitionCalls(character) == 1);
+	CHECK(!stateMachine.GetState<CharacterStates::OpenDoor>()->IsQuiescent());
+
+	character.mIsInPosition = true;
+	character.Update();
+	const size_t openAnimStartFrame = stateMachine.GetFrameIndex();
+	CHECK(character.mOpenAnimStartFrame == openAnimStartFrame);
+	CHECK(stateMachine.GetState<CharacterStates::OpenDoor>()->IsQuiescent());
+
+	// Waits exactly kOpenAnimFrames frames, even if woken in between
+	character.Update();
+	CHECK(GetNumGetTransitionCalls(character) == 0);
+	stateMachine.WakeStates();
+	character.Update();
+	CHECK(stateMachine.GetState<CharacterStates::OpenDoor>()->IsQuiescent());
+	CHECK(character.mOpenAnimEndFrame == 0);
+	character.Update();
+	CHECK(character.mOpenAnimEndFrame == openAnimStartFrame + kOpenAnimFrames);
+	CHECK(stateMachine.GetState<CharacterStates::OpenDoor>()->IsQuiescent());
+	CHECK(stateMachine.GetState<CharacterStates::OpenDoor>()->HasPendingTimers());
+
+	// Holds the door as measured by the TimerService's clock, woken by a timer rather than polling
+	for (int i = 1; i < kHoldDoorMilliseconds; ++i)
+	{
+		character.Update();
+		CHECK(GetNumGetTransitionCalls(character) == 0);
+		CHECK(stateMachine.IsInState<CharacterStates::OpenDoor>());
+	}
+	character.Update();
+	CHECK(character.mNumDoorsOpened == 1);
+	CHECK(stateMachine.IsInState<CharacterStates::Stand>());
+	CHECK(stateMachine.GetFrameIndex() == character.mOpenAnimEndFrame + kHoldDoorMilliseconds);
+	CHECK(character.mTimerService.GetNumTimers() == 0);
+
+#if HSM_USE_STATE_POOLS
+	// Stand's frame was returned to its pool when it was popped, and is reused now that it's pushed again
+	const StatePoolStats blockStats = character.mStatePoolSet.GetBlockStats();
+	CHECK(blockStats.mNumInUse == 1 && blockStats.mNumHits >= 1);
+	stateMachine.Stop();
+	CHECK(character.mStatePoolSet.GetBlockStats().mNumInUse == 0);
+	printf("Coroutine frames: %d allocated, %d reused\n", static_cast<int>(blockStats.mNumMisses), static_cast<int>(blockStats.mNumHits));
+#endif
+
+	printf("Door opened on frame %d\n", static_cast<int>(stateMachine.GetFrameIndex()));
+	return 0;
+}
@@ -5,12 +5,16 @@ import sys
 import re
 import pprint
 import binascii
+import math
 
 def PrintUsage():
 	print """
 Parses cpp file(s) containing an HSM and outputs dot format text that can be used to render it.
+
+If a heatmap file written by hsm::TransitionGraph::WriteFile is given, transitions are drawn thicker the more
+often they were taken at runtime, and redder the longer their target state stayed on the stack.
 	
-Usage: {} <filespec>
+Usage: {} <filespec> [--heatmap <heatmapfile>]
 	""".format(os.path.basename(sys.argv[0]))
 
 DOT_LEFT_RIGHT = False
@@ -35,6 +39,14 @@ SIBLING_TRANSITION = 3
 
 REPLACE_UNDERSCORES_WITH_DASHES = False
 
+HEATMAP_MAX_PENWIDTH = 8.0
+HEATMAP_COLD_HUE = 0.66 # Blue, for the shortest average dwell time
+HEATMAP_HOT_HUE = 0.0 # Red, for the longest average dwell time
+HEATMAP_UNTAKEN_COLOR = "gray80"
+
+# Matches hsm::Transition::Type names written by hsm::TransitionGraph::WriteFile
+HEATMAP_TRANSITION_TYPES = {"Inner": INNER_TRANSITION, "InnerEntry": INNER_ENTRY_TRANSITION, "Sibling": SIBLING_TRANSITION}
+
 def Info(message):
 	sys.stderr.write(message + "\n")
 
@@ -83,6 +95,7 @@ class State:
 		self.IsRoot = False
 		self.IsReusable = False
 		self.IsProxy = False
+		self.ProxiedName = "" # Name of the reusable state this proxy stands for
 		self.Cluster = "" #@TODO: remove this
 		self.Clusters = []
 		self.Parents = []
@@ -417,10 +430,12 @@ class Hsm:
 		for state in self._states.values():
 			for transition in state.Transitions():
 				if transition.TargetState.IsReusable:
-					proxyState = self.AddState(transition.TargetState.Name + str(GetUid()), "")
+					proxiedName = transition.TargetState.Name
+					proxyState = self.AddState(proxiedName + str(GetUid()), "")
 					transition.TargetState = proxyState
 					transition.TargetStateName = proxyState.Name
 					proxyState.IsProxy = True
+					proxyState.ProxiedName = proxiedName
 
 	def Finalize(self):
 		self._ValidateStateReferences()
@@ -517,6 +532,79 @@ def ParseHsm(filespec, hsm):
 		   
 	return hsm
 
+class HeatmapEdge:
+	def __init__(self):
+		self.NumTaken = 0
+		self.NumExits = 0
+		self.TotalDwellTime = 0 # Nanoseconds
+		self.IsMatched = False
+
+	def AverageDwellTime(self):
+		if self.NumExits == 0:
+			return 0
+		return float(self.TotalDwellTime) / self.NumExits
+
+class Heatmap:
+	def __init__(self):
+		self._edges = {} # (source name, target name, transition type) -> HeatmapEdge
+
+	def AddEdge(self, sourceName, targetName, transitionType, numTaken, numExits, totalDwellTime):
+		key = (sourceName, targetName, transitionType)
+		if not self._edges.has_key(key):
+			self._edges[key] = HeatmapEdge()
+		# Names are unqualified, so states with the same name in different namespaces are merged
+		edge = self._edges[key]
+		edge.NumTaken += numTaken
+		edge.NumExits += numExits
+		edge.TotalDwellTime += totalDwellTime
+
+	def GetEdge(self, sourceName, targetName, transitionType):
+		edge = self._edges.get((sourceName, targetName, transitionType))
+		if edge != None:
+			edge.IsMatched = True
+		return edge
+
+	def GetMaxNumTaken(self):
+		return max([x.NumTaken for x in self._edges.values()] + [1])
+
+	def GetMinMaxAverageDwellTime(self):
+		dwellTimes = [x.AverageDwellTime() for x in self._edges.values() if x.NumExits > 0]
+		if not dwellTimes:
+			return (0, 0)
+		return (min(dwellTimes), max(dwellTimes))
+
+	def WarnUnmatchedEdges(self):
+		for key, edge in self._edges.items():
+			if not edge.IsMatched:
+				Warn("Heatmap transition %s -> %s (taken %d times) not found in source" % (key[0], key[1], edge.NumTaken))
+
+heatmap = None
+
+def GetUnqualifiedStateName(name):
+	# Runtime state names may be qualified with namespaces or enclosing classes, parsed names never are
+	return name.split("::")[-1].strip()
+
+def ParseHeatmap(filespec):
+	result = Heatmap()
+	file = open(filespec)
+	for line in file.readlines():
+		line = line.strip()
+		if line == "" or line.startswith("#"):
+			continue
+		fields = line.split("\t")
+		if len(fields) != 6:
+			raise Exception("Invalid heatmap line: %s" % (line))
+		sourceName, targetName, typeName, numTaken, numExits, totalDwellTime = fields
+		# Initial state transitions have no source state in the graph
+		if sourceName == "-":
+			continue
+		if not HEATMAP_TRANSITION_TYPES.has_key(typeName):
+			raise Exception("Unknown transition type in heatmap: %s" % (typeName))
+		result.AddEdge(GetUnqualifiedStateName(sourceName), GetUnqualifiedStateName(targetName), HEATMAP_TRANSITION_TYPES[typeName],
+			int(numTaken), int(numExits), int(totalDwellTime))
+	file.close()
+	return result
+
 def GetLabelForState(hsm, state):
 	rank = state.Rank - hsm.GetMinVisibleRank() + DISPLAYED_RANK_OFFSET
 	return "%s (%d)" % (state.Name, rank)
@@ -555,10 +643,36 @@ def GetAttributesForState(hsm, state):
 	result += ',fontname=%s' % (DOT_FONT)
 	return result
 
-def GetAttributesForTransition(transition):
+def GetHeatmapAttributesForTransition(hsm, state, transition):
+	targetState = hsm.GetStateByNameOrAlias(transition.TargetStateName)
+	targetName = targetState.Name
+	if targetState.IsProxy:
+		targetName = targetState.ProxiedName
+
+	edge = heatmap.GetEdge(state.Name, targetName, transition.Type)
+	if edge == None:
+		return (None, "")
+
+	# Thickness by frequency and hue by average dwell time, both on a log scale since they vary wildly
+	takenRatio = math.log(1 + edge.NumTaken) / math.log(1 + heatmap.GetMaxNumTaken())
+	penwidth = 1.0 + takenRatio * (HEATMAP_MAX_PENWIDTH - 1.0)
+
+	minDwellTime, maxDwellTime = heatmap.GetMinMaxAverageDwellTime()
+	dwellRatio = 0.0
+	if edge.NumExits > 0 and maxDwellTime > minDwellTime:
+		dwellRatio = math.log((1 + edge.AverageDwellTime()) / (1 + minDwellTime)) / math.log((1 + maxDwellTime) / (1 + minDwellTime))
+	H = HEATMAP_COLD_HUE + dwellRatio * (HEATMAP_HOT_HUE - HEATMAP_COLD_HUE)
+	color = "%.3f 1.0 0.85" % (H)
+
+	attributes = ",penwidth=%.2f,label=\"%d\",fontname=%s" % (penwidth, edge.NumTaken, DOT_FONT)
+	attributes += ",tooltip=\"taken %d, avg dwell %.1f us\"" % (edge.NumTaken, edge.AverageDwellTime() / 1000.0)
+	return (color, attributes)
+
+def GetAttributesForTransition(hsm, state, transition):
 	weight = 1
 	color = "black"
 	style = "solid"
+	heatmapAttributes = ""
 	if transition.Type == INNER_TRANSITION or transition.Type == INNER_ENTRY_TRANSITION:
 		if len(transition.TargetState.Parents) == 1:
 			weight = 100
@@ -569,10 +683,13 @@ def GetAttributesForTransition(transition):
 	if transition.Type == SIBLING_TRANSITION:
 		weight = 50
 		style = "dotted"
+	if heatmap:
+		heatmapColor, heatmapAttributes = GetHeatmapAttributesForTransition(hsm, state, transition)
+		color = heatmapColor or HEATMAP_UNTAKEN_COLOR
 	if not transition.IsLegal:
 		color = "red"
 	
-	return ("[style=\"%s\",weight=%d,color=\"%s\"]" % (style, weight, color))
+	return ("[style=\"%s\",weight=%d,color=\"%s\"%s]" % (style, weight, color, heatmapAttributes))
 	#return ("[style=\"%s\",weight=%d,color=\"%s\",label=\"%d\"]" % (style, weight, color, weight))
 
 def GetAttributesForChildPositioningEdge(transition):
@@ -692,7 +809,7 @@ def PrintDotFile(hsm):
 	for state in hsm.States():
 		for transition in state.Transitions():
 			if ShouldPrintTransition(state, transition.TargetState):
-				attributes = GetAttributesForTransition(transition)
+				attributes = GetAttributesForTransition(hsm, state, transition)
 				print("  %s -> %s %s;" % (state.Name, hsm.GetStateByNameOrAlias(transition.TargetStateName).Name, attributes))
 		for child in state.Children:
 			if ShouldPrintTransition(state, child):
@@ -701,8 +818,12 @@ def PrintDotFile(hsm):
 
 	print ("}")
 
+	if heatmap:
+		heatmap.WarnUnmatchedEdges()
+
 
 def main(argv = None):
+	global heatmap
 	if argv is None:
 		argv = sys.argv
 	
@@ -711,9 +832,18 @@ def main(argv = None):
 		return 0
 
 	filespec = argv[1]
+
+	files = argv[1:]
+	if "--heatmap" in files:
+		index = files.index("--heatmap")
+		if index + 1 >= len(files):
+			PrintUsage()
+			return 1
+		heatmap = ParseHeatmap(files[index + 1])
+		del files[index:index + 2]
 	
 	hsm = Hsm()
-	for file in argv[1:]:
+	for file in files:
 		ParseHsm(file, hsm)
 	hsm.Finalize()
 
@@ -0,0 +1,105 @@
+import os
+import sys
+import struct
+
+def PrintUsage():
+	sys.stdout.write("""
+Decodes a binary trace file written by hsm::FileTraceSink (see hsm_trace.h) into text, one transition per line,
+sorted by time.
+
+Usage: {} <tracefile> [--machine <id>]
+""".format(os.path.basename(sys.argv[0])))
+
+MAGIC = 0x544d5348 # "HSMT"
+VERSION = 2
+
+NAME_RECORD = 0
+TRANSITION_RECORD = 1
+
+# Matches hsm::TraceEvent::Type
+EVENT_NAMES = ["Init", "Entry", "Inner", "Sibling", "Pop", "Deferred", "Event", "GetTransition", "Update"]
+
+HEADER_FORMAT = "=III"
+NAME_RECORD_FORMAT = "=IH"
+TRANSITION_RECORD_FORMAT = "=QQQIHBB"
+
+def Error(message):
+	sys.stderr.write(message + "\n")
+	sys.exit(1)
+
+def ReadTrace(data):
+	headerSize = struct.calcsize(HEADER_FORMAT)
+	if len(data) < headerSize:
+		Error("File is too small to be a trace")
+
+	magic, version, charSize = struct.unpack_from(HEADER_FORMAT, data, 0)
+	if magic != MAGIC:
+		Error("Not a trace file")
+	if version != VERSION:
+		Error("Unsupported trace version {}".format(version))
+
+	encoding = {1: "utf-8", 2: "utf-16", 4: "utf-32"}.get(charSize)
+	if encoding is None:
+		Error("Unsupported character size {}".format(charSize))
+
+	names = {}
+	transitions = []
+	nameRecordSize = struct.calcsize(NAME_RECORD_FORMAT)
+	transitionRecordSize = struct.calcsize(TRANSITION_RECORD_FORMAT)
+	offset = headerSize
+
+	while offset < len(data):
+		kind = struct.unpack_from("=B", data, offset)[0]
+		offset += 1
+
+		if kind == NAME_RECORD:
+			if offset + nameRecordSize > len(data):
+				break
+			nameId, length = struct.unpack_from(NAME_RECORD_FORMAT, data, offset)
+			offset += nameRecordSize
+			nameBytes = data[offset:offset + length * charSize]
+			offset += length * charSize
+			names[nameId] = nameBytes.decode(encoding, "replace")
+
+		elif kind == TRANSITION_RECORD:
+			if offset + transitionRecordSize > len(data):
+				break
+			transitions.append(struct.unpack_from(TRANSITION_RECORD_FORMAT, data, offset))
+			offset += transitionRecordSize
+
+		else:
+			Error("Unknown record kind {} at offset {}".format(kind, offset - 1))
+
+	if offset < len(data):
+		sys.stderr.write("Warning: trace is truncated\n")
+
+	return names, transitions
+
+def Main():
+	args = sys.argv[1:]
+	if len(args) not in (1, 3) or (len(args) == 3 and args[1] != "--machine"):
+		PrintUsage()
+		sys.exit(1)
+
+	machineFilter = int(args[2], 0) if len(args) == 3 else None
+
+	with open(args[0], "rb") as f:
+		names, transitions = ReadTrace(f.read())
+
+	# Records are only in order per thread
+	transitions.sort(key=lambda transition: transition[0])
+	startTime = transitions[0][0] if transitions else 0
+
+	for time, duration, machine, nameId, depth, event, level in transitions:
+		if machineFilter is not None and machine != machineFilter:
+			continue
+
+		eventName = EVENT_NAMES[event] if event < len(EVENT_NAMES) else str(event)
+		stateName = names.get(nameId, "<unknown {}>".format(nameId))
+		line = "{:>12.3f}us HSM_{}_{:#x}:{} {:<8}: {}".format((time - startTime) / 1000.0, level, machine, " " * (depth * 2), eventName, stateName)
+		if duration:
+			line += " ({:.3f}us)".format(duration / 1000.0)
+		sys.stdout.write(line + "\n")
+
+if __name__ == "__main__":
+	Main()
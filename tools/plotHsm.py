@@ -10,7 +10,7 @@ def PrintUsage():
 Plots an HSM defined in cpp file(s) via hsmToDot -> dot -> default image viewer
 Requires GraphViz (Windows: https://graphviz.gitlab.io/_pages/Download/Download_windows.html)
 
-Usage: {} <filespec>
+Usage: {} <filespec> [--heatmap <heatmapfile>]
 	""".format(os.path.basename(sys.argv[0]))
 	
 def GetScriptPath():
@@ -40,10 +40,18 @@ def main(argv = None):
 		return 0
 
 	filespec = argv[1]
+
+	# Passed through to hsmToDot to overlay the transitions taken at runtime (see hsm::TransitionGraph)
+	heatmapArgs = ''
+	if len(argv) == 4 and argv[2] == '--heatmap':
+		heatmapArgs = ' --heatmap ' + argv[3]
+	elif len(argv) != 2:
+		PrintUsage()
+		return 1
 		
 	# Write dot file
 	dotFile = os.path.join(tempfile.gettempdir(), os.path.basename(filespec) + '.dot')
-	ExecCommand('"{}" {}'.format(sys.executable, os.path.join(GetScriptPath(), 'hsmToDot.py') + ' ' + filespec + ' > ' + dotFile))
+	ExecCommand('"{}" {}'.format(sys.executable, os.path.join(GetScriptPath(), 'hsmToDot.py') + ' ' + filespec + heatmapArgs + ' > ' + dotFile))
 	
 	# Invoke dot to produce image
 	pngFile = dotFile + '.png'